@@ -153,7 +153,7 @@ int IO_FUNC replica_read(const io_t *io, buffer_t *buf)
         
         YASSERT(schedule_running());
 
-        DBUG("write "CHKID_FORMAT"\n", CHKID_ARG(&io->id));
+        DBUG("read "CHKID_FORMAT"\n", CHKID_ARG(&io->id));
         
         ret = __replica_getfd(&io->id, &fd, O_RDONLY);
         if (ret)
@@ -163,7 +163,6 @@ int IO_FUNC replica_read(const io_t *io, buffer_t *buf)
         mbuffer_init(buf, io->size);
         iov_count = Y_MSG_MAX / PAGE_SIZE + 1;
         ret = mbuffer_trans(iov, &iov_count, buf);
-        DINFO("ret %u %u\n", ret, buf->len);
         YASSERT(ret == (int)buf->len);
 
         io_prep_preadv(&iocb, fd, iov, iov_count, io->offset);
@@ -83,6 +83,9 @@ struct nfsconf_t
         int rsize;
         int wsize;
         int job_qos;
+        int drc_size;
+        int attr_cache_ttl;
+        int write_gather;
         struct nfsconf_export_t nfs_export[1024];
 };
 
@@ -194,6 +197,20 @@ struct gloconf_t
         int performance_analysis;
         int write_back;
         uint64_t cache_size;
+        int wbcache;                    /* client write-back cache */
+        uint64_t wbcache_size;          /* total dirty bytes */
+        int wbcache_flush_size;         /* per file dirty bytes */
+        int wbcache_flush_interval;
+        int redis_replica_read;         /* read-only metadata ops from replica, read-your-writes per process */
+        int redis_replica_lag;          /* ms, max staleness of replica reads */
+        int quota_cache;                /* client quota cache, batched usage */
+        int quota_cache_interval;
+        uint64_t quota_space_lease;     /* exact check within this of the limit */
+        int quota_inode_lease;
+        int md_atomic;                  /* namespace ops as one redis script */
+        uint64_t dir_split_threshold;   /* entries before a dir is split, 0 off */
+        int dir_split_buckets;
+        int inline_size;                /* files up to this keep data in md */
         int net_crc;
         int io_mode;
         int dir_refresh;
@@ -232,6 +249,8 @@ struct gloconf_t
 
         int main_loop_threads; //yfslib 的 schedule个数
         int schedule_physical_package_id;
+        int core_task_max;      /* coroutine limit of core schedule */
+        int main_loop_task_max; /* coroutine limit of main loop schedule */
         int max_lvm; /*最大lvm个数*/
 };
 
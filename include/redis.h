@@ -25,6 +25,14 @@ static inline int fid2key(const fileid_t *fid, char *key)
 static inline int id2key(const char *prefix, const fileid_t *fid, char *key)
 {
         YASSERT(fid->type);
+
+        /* bucket of a split directory, see dir_split.c */
+        if (fid->idx && (fid->type == ftype_dir || fid->type == ftype_vol)) {
+                sprintf(key, "%s:%llu/%llu#%u", prefix, (LLU)fid->volid,
+                        (LLU)fid->id, fid->idx);
+                return 0;
+        }
+
         sprintf(key, "%s:%llu/%llu", prefix, (LLU)fid->volid, (LLU)fid->id);
         return 0;
 }
@@ -34,9 +42,15 @@ extern int init_redis();
 extern int kdel(const fileid_t *fid);
 extern int kset(const fileid_t *fid, const void *buf, size_t size, int flag);
 extern int kget(const fileid_t *fid, void *buf, size_t *size);
+extern int kincr(const fileid_t *fid, const char *name, int64_t incr, int64_t *result);
+extern int kincr_del(const fileid_t *fid, const char *name);
+extern int keval(const fileid_t *fid, const char *script, char *sha,
+                 int argc, const char **argv, const size_t *argvlen,
+                 redisReply **reply);
 
-extern int klock(const fileid_t *fileid, int ttl, int block);
-extern int kunlock(const fileid_t *fileid);
+extern int klock(const fileid_t *fileid, int ttl, int block, uint64_t *token);
+extern int kunlock(const fileid_t *fileid, uint64_t token);
+extern void klock_key(const fileid_t *fileid, char *key);
 extern int hiter(const fileid_t *fid, const char *match, func2_t func, void *ctx);
 extern int rm_push(const nid_t *nid, int _hash, const chkid_t *chkid);
 extern int rm_pop(const nid_t *nid, int _hash, chkid_t *array, int *count);
@@ -47,6 +61,7 @@ extern int hget(const fileid_t *fid, const char *name, char *buf, size_t *len);
 extern int hdel(const fileid_t *fid, const char *name);
 extern int hlen(const fileid_t *fid, uint64_t *count);
 extern redisReply *hscan(const fileid_t *fid, const char *match, uint64_t cursor, uint64_t count);
+extern redisReply *hmget(const fileid_t *fid, int count, const char **names);
 extern redisReply *scan(int redis_id, uint32_t cursor);
 
 #endif
@@ -36,6 +36,7 @@ typedef struct {
         buffer_type_t type;
         uint32_t len;
         void *ptr;
+        void *base;     /* start of the memory, ptr moves on as the front is popped */
         int pipe[2];
 } seg_t;
 
@@ -228,6 +228,8 @@ typedef struct {
 #define ENABLE_CORENET 1
 #define ENABLE_CORERPC 0
 #define ENABLE_COREAIO 0
+#define ENABLE_SCHEDULE_STACK_GUARD 1
+#define ENABLE_SCHEDULE_STACK_ASSERT 0 /* per yield check, the guard page already faults */
 
 #define ENABLE_QUOTA 0
 #define ENABLE_MD_POSIX 0
@@ -148,6 +148,7 @@ extern int ly_create(const char *path, mode_t);
 extern int ly_pwrite(int fd, const char *buf, size_t, yfs_off_t);
 extern int ly_write(const char *path, const char *buf, size_t size, yfs_off_t offset);
 extern int ly_release(int fd);
+extern int ly_fsync(const char *path);
 
 extern int ly_truncate(const char *path, off_t length);
 extern int ly_symlink(const char *link_target, const char *link_name);
@@ -359,19 +360,56 @@ int sdfs_read_async(const fileid_t *fileid, buffer_t *buf, uint32_t size,
 int sdfs_read_sync(fileid_t *fileid, buffer_t *buf, uint32_t size, uint64_t off); //sync io
 
 int sdfs_write(const fileid_t *fileid, const buffer_t *_buf, uint32_t size, uint64_t offset);//coroutine
+int sdfs_write_wcc(const fileid_t *fileid, const buffer_t *_buf, uint32_t size,
+                   uint64_t offset, struct stat *pre, struct stat *post);
 int sdfs_write_async(const fileid_t *fileid, const buffer_t *buf, uint32_t size,
                      uint64_t off, int (*callback)(void *, int), void *obj);//async io
 int sdfs_write_sync(fileid_t *fileid, const buffer_t *buf, uint32_t size, uint64_t off);// sync io
+int sdfs_fsync(const fileid_t *fileid);
 int sdfs_truncate(const fileid_t *fileid, uint64_t length);
 int sdfs_link2node(const fileid_t *old, const fileid_t *, const char *);
 int sdfs_unlink(const fileid_t *parent, const char *name);
 int sdfs_setlock(const fileid_t *fileid, const sdfs_lock_t *lock);
 int sdfs_getlock(const fileid_t *fileid, sdfs_lock_t *lock);
 
+//async, see sdfs_async.c
+typedef enum {
+        SDFS_OP_READ = 0,
+        SDFS_OP_WRITE,
+        SDFS_OP_GETATTR,
+        SDFS_OP_LOOKUP,
+        SDFS_OP_CREATE,
+        SDFS_OP_READDIR,
+        SDFS_OP_TRUNCATE,
+        SDFS_OP_FSYNC,
+} sdfs_op_type_t;
+
+typedef struct {
+        sdfs_op_type_t type;
+        fileid_t fileid;        /* file, parent for lookup/create */
+        const char *name;       /* lookup, create */
+        uint32_t mode;          /* create */
+        uint32_t uid;
+        uint32_t gid;
+        buffer_t *buf;          /* read, write */
+        uint32_t size;          /* read, write */
+        uint64_t offset;        /* read, write, readdir, length for truncate */
+        struct stat *stbuf;     /* getattr */
+        fileid_t *out;          /* lookup, create */
+        void *de;               /* readdir, free by caller */
+        int delen;
+        int (*callback)(void *arg, int retval); /* retval < 0 is -errno */
+        void *arg;
+} sdfs_op_t;
+
+int sdfs_submit(sdfs_op_t *ops, int count);
+
 
 //node
 int sdfs_getattr(const fileid_t *fileid, struct stat *stbuf);
 int sdfs_setattr(const fileid_t *fileid, const setattr_t *setattr, int force);
+int sdfs_setattr_wcc(const fileid_t *fileid, const setattr_t *setattr, int force,
+                     struct stat *pre, struct stat *post);
 int sdfs_chmod(const fileid_t *fileid, mode_t mode);
 int sdfs_chown(const fileid_t *fileid, uid_t uid, gid_t gid);
 int sdfs_utime(const fileid_t *fileid, const struct timespec *atime,
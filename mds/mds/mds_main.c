@@ -157,6 +157,17 @@ int mds_init(const char *home, int metano)
         if (ret)
                 GOTO(err_ret, ret);
 
+        if (strcmp(mdsconf.db, "leveldb") == 0) {
+                ret = mdkv_init(mdsconf.leveldb);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
+        /* clients follow the db the master serves, not their own conf */
+        ret = etcd_set_with_ttl(ROLE_MOND, "db", mdsconf.db, -1);
+        if (ret)
+                GOTO(err_ret, ret);
+
         ret = rpc_start(); /*begin serivce*/
         if (ret)
                 GOTO(err_ret, ret);
@@ -229,12 +240,60 @@ err_ret:
 }
 
 
+/*
+ * the mdkv store is a local leveldb with no replica, a second mond taking
+ * over would serve an empty or stale copy. the first mond started with
+ * db leveldb owns it, any other mond refuses to start.
+ */
+static int __mds_mdkv_claim()
+{
+        int ret;
+        char nid[MAX_NAME_LEN], owner[MAX_BUF_LEN];
+
+        if (strcmp(mdsconf.db, "leveldb"))
+                return 0;
+
+        nid2str(nid, net_getnid());
+
+retry:
+        ret = etcd_get_text(ROLE_MOND, "mdkv", owner, NULL);
+        if (ret) {
+                if (ret == ENOKEY) {
+                        ret = etcd_create_text(ROLE_MOND, "mdkv", nid, -1);
+                        if (ret) {
+                                if (ret == EEXIST)
+                                        goto retry;
+                                else
+                                        GOTO(err_ret, ret);
+                        }
+
+                        DINFO("mdkv owned by %s\n", nid);
+                        return 0;
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+        if (strcmp(owner, nid)) {
+                ret = EPERM;
+                DERROR("db leveldb lives on mond %s, one mond only\n", owner);
+                GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
 static int __mds_loop(const char *home, int metano)
 {
         int ret;
         etcd_lock_t lock;
         char buf[MAX_BUF_LEN];
 
+        ret = __mds_mdkv_claim();
+        if (ret)
+                GOTO(err_ret, ret);
+
         nid2str(buf, net_getnid());
         ret = etcd_lock_init(&lock, ROLE_MOND, "master", gloconf.rpc_timeout / 2 , -1, -1);
         if (ret)
@@ -0,0 +1,81 @@
+#include <sys/types.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YFSMDS
+
+#include "net_global.h"
+#include "mond_rpc.h"
+#include "md.h"
+#include "md_db.h"
+#include "dbg.h"
+
+/*
+ * chunk info in the mdkv store of the master mond, keyed
+ * c/<volid>/<id>/<idx>, see dir_mdkv.c
+ */
+
+#define CHKINFO_SIZE(__repnum__) (sizeof(chkinfo_t) + sizeof(diskid_t) * __repnum__)
+#define CHUNK_MDKV_KEY 64
+
+static int __chunk_mdkv_key(char *key, const chkid_t *chkid)
+{
+        return snprintf(key, CHUNK_MDKV_KEY, "c/%016jx/%016jx/%08x",
+                        chkid->volid, chkid->id, chkid->idx);
+}
+
+static int __chunk_mdkv_put(const chkinfo_t *chkinfo, int op)
+{
+        int ret, klen;
+        char key[CHUNK_MDKV_KEY];
+        mdkv_batch_t batch;
+
+        mdkv_batch_init(&batch);
+        klen = __chunk_mdkv_key(key, &chkinfo->chkid);
+        ret = mdkv_batch_append(&batch, op, key, klen, chkinfo,
+                                CHKINFO_SIZE(chkinfo->repnum));
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = mond_rpc_mdkv_write(&batch);
+        if (ret)
+                goto err_ret;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int __chunk_mdkv_create(const chkinfo_t *chkinfo)
+{
+        return __chunk_mdkv_put(chkinfo, MDKV_PUT_EXCL);
+}
+
+static int __chunk_mdkv_update(const chkinfo_t *chkinfo)
+{
+        return __chunk_mdkv_put(chkinfo, MDKV_PUT);
+}
+
+static int __chunk_mdkv_load(const chkid_t *chkid, chkinfo_t *chkinfo)
+{
+        int ret, klen;
+        uint32_t len;
+        char key[CHUNK_MDKV_KEY];
+
+        klen = __chunk_mdkv_key(key, chkid);
+        len = CHKINFO_SIZE(YFS_CHK_REP_MAX);
+        ret = mond_rpc_mdkv_get(key, klen, chkinfo, &len);
+        if (ret)
+                goto err_ret;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+chunkop_t __chunkop_mdkv__ = {
+        .create = __chunk_mdkv_create,
+        .load = __chunk_mdkv_load,
+        .update = __chunk_mdkv_update,
+};
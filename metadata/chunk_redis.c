@@ -73,7 +73,7 @@ err_ret:
         return ret;
 }
 
-chunkop_t __chunkop__ = {
+chunkop_t __chunkop_redis__ = {
         .create = __chunk_create,
         .load = __chunk_load,
         .update = __chunk_update,
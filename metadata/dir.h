@@ -14,6 +14,29 @@ typedef struct {
         uint16_t d_type;
 } dir_entry_t;
 
+/* value of SDFS_SPLIT in the hash of a split directory */
+typedef struct {
+        uint32_t count;         /* buckets, 0 if not split */
+        uint32_t migrating;     /* the directory hash still holds entries */
+} dir_split_t;
+
 #pragma pack()
 
+/* dir_split.c */
+/* hash index in bits 55..62 (dir_split_buckets <= 255), the sign bit stays clear */
+#define DIR_COOKIE_SHIFT 55
+#define DIR_COOKIE_MASK ((1ULL << DIR_COOKIE_SHIFT) - 1)
+
+int dir_split_get(const fileid_t *dirid, dir_split_t *split, int refresh);
+void dir_split_set(const fileid_t *dirid, const dir_split_t *split);
+void dir_split_new(dir_split_t *split);
+int dir_split_bucketid(const fileid_t *dirid, uint32_t idx, fileid_t *bucket);
+int dir_split_bucket(const fileid_t *dirid, const dir_split_t *split,
+                     const char *name, fileid_t *bucket);
+int dir_split_start(const fileid_t *dirid, const dir_split_t *split);
+int dir_split_childcount(const fileid_t *dirid, uint64_t *count);
+int dir_split_childhint(const fileid_t *dirid, uint64_t *count);
+void dir_split_count(const fileid_t *dirid, int64_t delta);
+int dir_split_remove(const fileid_t *dirid);
+
 #endif
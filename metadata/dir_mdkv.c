@@ -0,0 +1,459 @@
+#include <sys/types.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stddef.h>
+
+#define DBG_SUBSYS S_YFSMDS
+
+#include "dir.h"
+#include "net_global.h"
+#include "mond_rpc.h"
+#include "md.h"
+#include "md_db.h"
+#include "dbg.h"
+
+/*
+ * directory entries in the mdkv store of the master mond (mdsconf.db
+ * "leveldb"). an entry is kept twice:
+ *
+ *   n/<volid>/<id>/<name> -> dir_mdkv_ent_t, for lookup
+ *   d/<volid>/<id>/<seq>  -> dir_entry_t + name, for readdir
+ *
+ * and c/<volid>/<id> counts them, for getattr. seq comes from md_newid,
+ * so readdir walks a directory in creation order and the cookie is just
+ * the seq of the last entry returned. the records and the count change
+ * in one batch. there is no create/remove/rename script here, the
+ * namespace runs without md_atomic on this backend.
+ */
+
+typedef struct {
+        uint64_t seq;
+        dir_entry_t ent;
+} dir_mdkv_ent_t;
+
+#define DIR_MDKV_KEY (MAX_NAME_LEN + 64)
+
+static int __dir_mdkv_name(char *key, const fileid_t *parent, const char *name)
+{
+        return snprintf(key, DIR_MDKV_KEY, "n/%016jx/%016jx/%s",
+                        parent->volid, parent->id, name);
+}
+
+static int __dir_mdkv_seq(char *key, const fileid_t *parent, uint64_t seq)
+{
+        return snprintf(key, DIR_MDKV_KEY, "d/%016jx/%016jx/%016jx",
+                        parent->volid, parent->id, seq);
+}
+
+static int __dir_mdkv_count(char *key, const fileid_t *parent)
+{
+        return snprintf(key, DIR_MDKV_KEY, "c/%016jx/%016jx",
+                        parent->volid, parent->id);
+}
+
+static int __dir_mdkv_prefix(char *key, const fileid_t *parent, char tag)
+{
+        return snprintf(key, DIR_MDKV_KEY, "%c/%016jx/%016jx/",
+                        tag, parent->volid, parent->id);
+}
+
+static int __dir_mdkv_get(const fileid_t *parent, const char *name, dir_mdkv_ent_t *ent)
+{
+        int ret, klen;
+        uint32_t len;
+        char key[DIR_MDKV_KEY];
+
+        klen = __dir_mdkv_name(key, parent, name);
+        len = sizeof(*ent);
+        ret = mond_rpc_mdkv_get(key, klen, ent, &len);
+        if (ret)
+                goto err_ret;
+
+        if (len != sizeof(*ent)) {
+                ret = EIO;
+                GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int dir_mdkv_lookup(const fileid_t *parent, const char *name,
+                           fileid_t *fid, uint32_t *type)
+{
+        int ret;
+        dir_mdkv_ent_t ent;
+
+        ret = __dir_mdkv_get(parent, name, &ent);
+        if (ret)
+                goto err_ret;
+
+        *fid = ent.ent.fileid;
+        *type = ent.ent.d_type;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int dir_mdkv_newrec(const fileid_t *parent, const char *name,
+                           const fileid_t *fileid, uint32_t type, int flag)
+{
+        int ret, klen, len;
+        int64_t delta;
+        char key[DIR_MDKV_KEY], value[sizeof(dir_entry_t) + MAX_NAME_LEN];
+        dir_mdkv_ent_t ent;
+        mdkv_batch_t batch;
+
+        ANALYSIS_BEGIN(0);
+
+        DBUG(""FID_FORMAT"/"FID_FORMAT" name %s\n", FID_ARG(parent), FID_ARG(fileid), name);
+
+        /* dirents are always created exclusive */
+        YASSERT(flag == O_EXCL);
+
+        len = strlen(name) + 1;
+        if (len > MAX_NAME_LEN) {
+                ret = ENAMETOOLONG;
+                GOTO(err_ret, ret);
+        }
+
+        ret = md_newid(idtype_dirent, &ent.seq);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        memset(&ent.ent, 0x0, sizeof(ent.ent));
+        ent.ent.fileid = *fileid;
+        ent.ent.d_type = type;
+        memcpy(value, &ent.ent, sizeof(ent.ent));
+        memcpy(value + sizeof(ent.ent), name, len);
+
+        mdkv_batch_init(&batch);
+        klen = __dir_mdkv_name(key, parent, name);
+        ret = mdkv_batch_append(&batch, MDKV_PUT_EXCL, key, klen, &ent, sizeof(ent));
+        if (ret)
+                GOTO(err_ret, ret);
+
+        klen = __dir_mdkv_seq(key, parent, ent.seq);
+        ret = mdkv_batch_append(&batch, MDKV_PUT, key, klen,
+                                value, sizeof(ent.ent) + len);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        delta = 1;
+        klen = __dir_mdkv_count(key, parent);
+        ret = mdkv_batch_append(&batch, MDKV_ADD, key, klen, &delta, sizeof(delta));
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = mond_rpc_mdkv_write(&batch);
+        if (ret)
+                goto err_ret;
+
+        ANALYSIS_QUEUE(0, IO_WARN, NULL);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int dir_mdkv_unlink(const fileid_t *parent, const char *name)
+{
+        int ret, klen, retry = 0;
+        int64_t delta;
+        char key[DIR_MDKV_KEY];
+        dir_mdkv_ent_t ent;
+        mdkv_batch_t batch;
+
+retry:
+        ret = __dir_mdkv_get(parent, name, &ent);
+        if (ret)
+                goto err_ret;
+
+        mdkv_batch_init(&batch);
+        klen = __dir_mdkv_name(key, parent, name);
+        ret = mdkv_batch_append(&batch, MDKV_DEL_EQ, key, klen, &ent, sizeof(ent));
+        if (ret)
+                GOTO(err_ret, ret);
+
+        klen = __dir_mdkv_seq(key, parent, ent.seq);
+        ret = mdkv_batch_append(&batch, MDKV_DEL, key, klen, NULL, 0);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        delta = -1;
+        klen = __dir_mdkv_count(key, parent);
+        ret = mdkv_batch_append(&batch, MDKV_ADD, key, klen, &delta, sizeof(delta));
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = mond_rpc_mdkv_write(&batch);
+        if (ret) {
+                /* replaced by someone meanwhile */
+                if (ret == ESTALE && retry < 10) {
+                        retry++;
+                        goto retry;
+                }
+
+                GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/*
+ * one page of d/ records after the seq offset, into a buffer of
+ * MDKV_SCAN_MAX from ymalloc
+ */
+static int __dir_mdkv_scan(const fileid_t *parent, uint64_t offset, uint32_t count,
+                           mdkv_scan_t **_scan, uint32_t *_buflen)
+{
+        int ret, slen, plen;
+        char start[DIR_MDKV_KEY], prefix[DIR_MDKV_KEY];
+        uint32_t buflen;
+        mdkv_scan_t *scan;
+
+        plen = __dir_mdkv_prefix(prefix, parent, 'd');
+        slen = __dir_mdkv_seq(start, parent, offset + 1);
+
+        ret = ymalloc((void **)&scan, MDKV_SCAN_MAX);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        buflen = MDKV_SCAN_MAX;
+        ret = mond_rpc_mdkv_scan(start, slen, prefix, plen, count, scan, &buflen);
+        if (ret)
+                GOTO(err_free, ret);
+
+        if (buflen < sizeof(*scan)) {
+                ret = EIO;
+                GOTO(err_free, ret);
+        }
+
+        *_scan = scan;
+        *_buflen = buflen - sizeof(*scan);
+
+        return 0;
+err_free:
+        yfree((void **)&scan);
+err_ret:
+        return ret;
+}
+
+static int __dir_mdkv_rec(const mdkv_rec_t *rec, uint64_t *seq,
+                          const dir_entry_t **ent, const char **name)
+{
+        char tmp[17];
+
+        if (rec->klen < 16 || rec->vlen <= sizeof(dir_entry_t)
+            || rec->buf[rec->klen + rec->vlen - 1] != '\0')
+                return EIO;
+
+        /* the key is not terminated, the value follows */
+        memcpy(tmp, rec->buf + rec->klen - 16, 16);
+        tmp[16] = '\0';
+        *seq = strtoull(tmp, NULL, 16);
+        *ent = (const dir_entry_t *)(rec->buf + rec->klen);
+        *name = rec->buf + rec->klen + sizeof(dir_entry_t);
+
+        return 0;
+}
+
+static int __dir_mdkv_readdir(const fileid_t *fid, void *buf, int *_buflen,
+                              uint64_t _offset, const filter_t *filter, int is_plus)
+{
+        int ret, reclen, buflen, full = 0;
+        uint32_t len, count;
+        uint64_t offset, seq, last;
+        const mdkv_rec_t *rec;
+        const dir_entry_t *ent;
+        const char *name;
+        mdkv_scan_t *scan;
+        struct dirent *curr, *de;
+        md_proto_t *md1;
+
+        offset = filter ? filter->offset : _offset;
+        count = filter ? filter->count : MAX_READDIR_ENTRIES;
+
+        ret = __dir_mdkv_scan(fid, offset, count, &scan, &len);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        buflen = *_buflen;
+        last = offset;
+        curr = buf;
+        mdkv_for_each(scan + 1, len, rec) {
+                ret = __dir_mdkv_rec(rec, &seq, &ent, &name);
+                if (ret)
+                        GOTO(err_free, ret);
+
+                reclen = sizeof(*curr) + strlen(name) + 1 - sizeof(curr->d_name);
+                if ((void *)curr + reclen + (is_plus ? sizeof(md_proto_t) : 0) - buf > buflen) {
+                        full = 1;
+                        break;
+                }
+
+                curr->d_reclen = reclen;
+                curr->d_type = ent->d_type;
+                curr->d_ino = 0;
+                strcpy(curr->d_name, name);
+
+                if (is_plus) {
+                        md1 = (void*)curr + curr->d_reclen;
+                        md1->fileid = ent->fileid;
+                        curr->d_reclen += sizeof(md_proto_t);
+                }
+
+                last = seq;
+                curr = (void *)curr + curr->d_reclen;
+        }
+
+        if (curr == buf && full) {
+                ret = ENOSPC;
+                GOTO(err_free, ret);
+        }
+
+        /* the whole page carries the cookie, as dir_redis.c does */
+        last = (full || scan->more) ? last : 0;
+        buflen = (void *)curr - buf;
+        dir_for_each(buf, buflen, de, offset) {
+                de->d_off = last;
+        }
+
+        yfree((void **)&scan);
+
+        *_buflen = buflen;
+
+        return 0;
+err_free:
+        yfree((void **)&scan);
+err_ret:
+        return ret;
+}
+
+static int dir_mdkv_readdir(const fileid_t *fid, void *buf, int *buflen,
+                            uint64_t offset)
+{
+        return __dir_mdkv_readdir(fid, buf, buflen, offset, NULL, 0);
+}
+
+static int dir_mdkv_readdirplus(const fileid_t *fid, void *buf, int *buflen,
+                                uint64_t offset)
+{
+        return __dir_mdkv_readdir(fid, buf, buflen, offset, NULL, 1);
+}
+
+static int dir_mdkv_readdirplus_filter(const fileid_t *fid, void *buf, int *buflen,
+                                       uint64_t offset, const filter_t *filter)
+{
+        return __dir_mdkv_readdir(fid, buf, buflen, offset, filter, 1);
+}
+
+static int dir_mdkv_dirlist(const dirid_t *dirid, uint32_t count, uint64_t offset,
+                            dirlist_t **dirlist)
+{
+        int ret, idx;
+        uint32_t len;
+        uint64_t seq;
+        const mdkv_rec_t *rec;
+        const dir_entry_t *ent;
+        const char *name;
+        mdkv_scan_t *scan;
+        dirlist_t *array;
+        __dirlist_t *node;
+
+        ret = __dir_mdkv_scan(dirid, offset, count, &scan, &len);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        idx = 0;
+        mdkv_for_each(scan + 1, len, rec) {
+                idx++;
+        }
+
+        ret = ymalloc((void **)&array, DIRLIST_SIZE(idx));
+        if (ret)
+                GOTO(err_free, ret);
+
+        idx = 0;
+        seq = 0;
+        mdkv_for_each(scan + 1, len, rec) {
+                ret = __dir_mdkv_rec(rec, &seq, &ent, &name);
+                if (ret) {
+                        yfree((void **)&array);
+                        GOTO(err_free, ret);
+                }
+
+                node = &array->array[idx];
+                node->fileid = ent->fileid;
+                node->d_type = ent->d_type;
+                strcpy(node->name, name);
+
+                DBUG("name %s "CHKID_FORMAT"\n", node->name, CHKID_ARG(&node->fileid));
+                idx++;
+        }
+
+        array->count = idx;
+        array->cursor = 0;
+        array->offset = scan->more ? seq : 0;
+        *dirlist = array;
+
+        yfree((void **)&scan);
+
+        return 0;
+err_free:
+        yfree((void **)&scan);
+err_ret:
+        return ret;
+}
+
+int dir_mdkv_childcount(const fileid_t *fileid, uint64_t *count)
+{
+        int ret, klen;
+        uint32_t len;
+        int64_t value;
+        char key[DIR_MDKV_KEY];
+
+        if (!S_ISDIR(stype(fileid->type))) {
+                ret = ENOTDIR;
+                GOTO(err_ret, ret);
+        }
+
+        klen = __dir_mdkv_count(key, fileid);
+        len = sizeof(value);
+        ret = mond_rpc_mdkv_get(key, klen, &value, &len);
+        if (ret) {
+                if (ret == ENOENT) {
+                        /* the count is dropped at 0 */
+                        *count = 0;
+                        return 0;
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+        if (len != sizeof(value) || value < 0) {
+                ret = EIO;
+                GOTO(err_ret, ret);
+        }
+
+        *count = value;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+dirop_t __dirop_mdkv__ = {
+        .lookup = dir_mdkv_lookup,
+        .readdir = dir_mdkv_readdir,
+        .readdirplus = dir_mdkv_readdirplus,
+        .readdirplus_filter = dir_mdkv_readdirplus_filter,
+        .newrec = dir_mdkv_newrec,
+        .unlink = dir_mdkv_unlink,
+        .dirlist = dir_mdkv_dirlist,
+};
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stddef.h>
+#include <time.h>
 
 #define DBG_SUBSYS S_YFSMDS
 
@@ -13,82 +15,839 @@
 #include "md_db.h"
 #include "dbg.h"
 
-static int dir_lookup(const fileid_t *parent, const char *name, fileid_t *fid, uint32_t *type) {
+/*
+ * script errors from the hash of a split directory (see dir_split.c), they
+ * never leave this file
+ */
+#define DIR_SPLIT_STALE ESTALE          /* split already, entries go to buckets */
+#define DIR_SPLIT_NEW EMLINK            /* this create split it */
+
+inline static int __dir_local(const fileid_t *hash, const fileid_t *fileid)
+{
+        return fileid->volid == hash->volid && fileid->sharding == hash->sharding;
+}
+
+static int __dir_entry(const char *buf, size_t buflen, fileid_t *fid, uint32_t *type)
+{
+        const dir_entry_t *ent;
+
+        if (buflen != sizeof(dir_entry_t))
+                return EIO;
+
+        ent = (const dir_entry_t *)buf;
+        *fid = ent->fileid;
+        *type = ent->d_type;
+
+        return 0;
+}
+
+static int __dir_get(const fileid_t *hash, const char *name, fileid_t *fid, uint32_t *type)
+{
         int ret;
-        dir_entry_t *ent;
         char buf[sizeof(dir_entry_t)];
         size_t buflen;
-        
-        ret = hget(parent, name, buf, &buflen);
+
+        buflen = sizeof(buf);
+        ret = hget(hash, name, buf, &buflen);
         if (ret)
+                goto err_ret;
+
+        ret = __dir_entry(buf, buflen, fid, type);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/*
+ * name and SDFS_SPLIT of a directory taken as not split, in one round
+ * trip, so a split made by another client is found here.
+ */
+static int __dir_lookup(const fileid_t *parent, const char *name,
+                        dir_split_t *split, fileid_t *fid, uint32_t *type)
+{
+        int ret;
+        const char *names[2];
+        redisReply *reply, *e0, *e1;
+
+        names[0] = name;
+        names[1] = SDFS_SPLIT;
+        reply = hmget(parent, 2, names);
+        if (reply == NULL) {
+                ret = ECONNRESET;
                 GOTO(err_ret, ret);
+        }
 
-        if (buflen != (int)sizeof(dir_entry_t)) {
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
                 ret = EIO;
+                GOTO(err_free, ret);
+        }
+
+        e0 = reply->element[0];
+        e1 = reply->element[1];
+
+        if (e1->type == REDIS_REPLY_STRING && e1->len == sizeof(*split)) {
+                memcpy(split, e1->str, sizeof(*split));
+                dir_split_set(parent, split);
+        }
+
+        if (e0->type != REDIS_REPLY_STRING) {
+                ret = ENOENT;
+                goto err_free;
+        }
+
+        ret = __dir_entry(e0->str, e0->len, fid, type);
+        if (ret)
+                GOTO(err_free, ret);
+
+        freeReplyObject(reply);
+
+        return 0;
+err_free:
+        freeReplyObject(reply);
+err_ret:
+        return ret;
+}
+
+static int dir_lookup(const fileid_t *parent, const char *name, fileid_t *fid, uint32_t *type) {
+        int ret;
+        fileid_t bucket;
+        dir_split_t split;
+
+        ret = dir_split_get(parent, &split, 0);
+        if (ret)
                 GOTO(err_ret, ret);
+
+        if (split.count == 0) {
+                ret = __dir_lookup(parent, name, &split, fid, type);
+                if (ret != ENOENT || split.count == 0)
+                        goto out;
         }
 
-        ent = (dir_entry_t *)buf;
-        *fid = ent->fileid;
-        *type = ent->d_type;
+        ret = dir_split_bucket(parent, &split, name, &bucket);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = __dir_get(&bucket, name, fid, type);
+        if (ret == ENOENT && split.migrating) {
+                ret = __dir_get(parent, name, fid, type);
+                if (ret == ENOENT) {
+                        /* moved meanwhile */
+                        ret = __dir_get(&bucket, name, fid, type);
+                }
+        }
+
+out:
+        if (ret)
+                goto err_ret;
 
         return 0;
 err_ret:
         return ret;
 }
 
+static int dir_create(const fileid_t *parent, const char *name,
+                      fileid_t *fileid, uint32_t type, md_proto_t *md);
+
 static int dir_newrec(const fileid_t *parent, const char *name,
                       const fileid_t *fileid, uint32_t type, int flag)
 {
-        dir_entry_t ent;
         int ret;
-        uint64_t count;
+        fileid_t id;
 
         ANALYSIS_BEGIN(0);
-        
+
         DBUG(""FID_FORMAT"/"FID_FORMAT" name %s\n", FID_ARG(parent), FID_ARG(fileid), name);
 
-        ret = hlen(parent, &count);
+        /* dirents are always created exclusive */
+        YASSERT(flag == O_EXCL);
+
+        id = *fileid;
+        ret = dir_create(parent, name, &id, type, NULL);
+        if (ret) {
+                DBUG(""FID_FORMAT" / "FID_FORMAT" name %s\n", FID_ARG(parent), FID_ARG(fileid), name);
+                GOTO(err_ret, ret);
+        }
+
+        ANALYSIS_QUEUE(0, IO_WARN, NULL);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int dir_unlink(const fileid_t *parent, const char *name)
+{
+        int ret;
+        fileid_t bucket;
+        const fileid_t *hash;
+        dir_split_t split;
+
+        ret = dir_split_get(parent, &split, 0);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (split.count == 0) {
+                ret = hdel(parent, name);
+                if (ret == 0)
+                        return 0;
+                else if (ret != ENOENT)
+                        GOTO(err_ret, ret);
+
+                ret = dir_split_get(parent, &split, 1);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                if (split.count == 0) {
+                        ret = ENOENT;
+                        goto err_ret;
+                }
+        }
+
+        ret = dir_split_bucket(parent, &split, name, &bucket);
         if (ret)
                 GOTO(err_ret, ret);
 
-        if (count > MAX_SUB_FILES) {
-                ret = EPERM;
-                DWARN("limt max sub files %llu", (LLU)MAX_SUB_FILES);
+        hash = &bucket;
+        ret = hdel(hash, name);
+        if (ret == ENOENT && split.migrating) {
+                hash = parent;
+                ret = hdel(hash, name);
+                if (ret == ENOENT) {
+                        hash = &bucket;
+                        ret = hdel(hash, name);
+                }
+        }
+
+        if (ret)
+                goto err_ret;
+
+        if (hash == &bucket)
+                dir_split_count(parent, -1);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/*
+ * namespace ops as one lua script on the parent's sharding. ARGV[1..4]
+ * are shared: the time stamped on the parent ('' keeps it), then the
+ * offsets of at_mtime, at_ctime and at_nlink in md_proto_t. errors come
+ * back as -errno.
+ */
+#define __LUA_ERR(__e__) __LUA_ERR1(__e__)
+#define __LUA_ERR1(__e__) "return -" #__e__ " "
+#define __LUA_MD "'" SDFS_MD "'"
+#define __LUA_SPLIT "'" SDFS_SPLIT "'"
+#define __LUA_INLINE "'" SDFS_INLINE "'"
+
+#define __LUA_COMMON__                                                  \
+        "local t, moff, coff, noff = ARGV[1], tonumber(ARGV[2]), "      \
+        "tonumber(ARGV[3]), tonumber(ARGV[4])\n"                        \
+        "local function patch(s, off, v)\n"                             \
+        "  return string.sub(s, 1, off) .. v .. string.sub(s, off + #v + 1)\n" \
+        "end\n"                                                         \
+        "local function touch(key)\n"                                   \
+        "  if t == '' then return end\n"                                \
+        "  local md = redis.call('HGET', key, " __LUA_MD ")\n"          \
+        "  if md then\n"                                                \
+        "    redis.call('HSET', key, " __LUA_MD ", patch(patch(md, moff, t), coff, t))\n" \
+        "  end\n"                                                       \
+        "end\n"
+
+/*
+ * KEYS: hash [inode], ARGV[5..11]: name, dirent, md, max, split, threshold,
+ * inline. split is '' for a bucket, else the SDFS_SPLIT value stored once
+ * the directory hash holds threshold entries. inline '1' starts the file
+ * with empty inline data (md_inline.c).
+ */
+static const char *__dir_create_lua__ =
+        __LUA_COMMON__
+        "local p, name, split = KEYS[1], ARGV[5], ARGV[9]\n"
+        "if split ~= '' then\n"
+        "  if redis.call('HEXISTS', p, " __LUA_MD ") == 0 then " __LUA_ERR(ENOENT) "end\n"
+        "  if redis.call('HEXISTS', p, " __LUA_SPLIT ") == 1 then "
+        __LUA_ERR(DIR_SPLIT_STALE) "end\n"
+        "end\n"
+        "local n = redis.call('HLEN', p)\n"
+        "if n > tonumber(ARGV[8]) then " __LUA_ERR(EPERM) "end\n"
+        "if redis.call('HEXISTS', p, name) == 1 then " __LUA_ERR(EEXIST) "end\n"
+        "if split ~= '' and n > tonumber(ARGV[10]) then\n"
+        "  redis.call('HSET', p, " __LUA_SPLIT ", split)\n"
+        "  " __LUA_ERR(DIR_SPLIT_NEW) "\n"
+        "end\n"
+        "if #KEYS > 1 then\n"
+        "  if redis.call('HSETNX', KEYS[2], " __LUA_MD ", ARGV[7]) == 0 then "
+        __LUA_ERR(EEXIST) "end\n"
+        "  if ARGV[11] == '1' then redis.call('HSET', KEYS[2], " __LUA_INLINE ", '') end\n"
+        "end\n"
+        "redis.call('HSET', p, name, ARGV[6])\n"
+        "touch(p)\n"
+        "return 0\n";
+
+/*
+ * KEYS: hash [inode [xattr] lock], ARGV[5..6]: name, fileid. with the
+ * inode a file loses one link, a dir (xattr given) must be empty and goes
+ * away, the md after the unlink is returned. klock holders rewrite the
+ * whole md, so a klocked inode is left to the caller (EXDEV).
+ */
+static const char *__dir_remove_lua__ =
+        __LUA_COMMON__
+        "local p, name = KEYS[1], ARGV[5]\n"
+        "local ent = redis.call('HGET', p, name)\n"
+        "if not ent then\n"
+        "  if redis.call('HEXISTS', p, " __LUA_SPLIT ") == 1 then "
+        __LUA_ERR(DIR_SPLIT_STALE) "end\n"
+        "  " __LUA_ERR(ENOENT) "\n"
+        "end\n"
+        "if string.sub(ent, 1, #ARGV[6]) ~= ARGV[6] then " __LUA_ERR(EAGAIN) "end\n"
+        "if #KEYS > 1 and redis.call('EXISTS', KEYS[#KEYS]) == 1 then "
+        __LUA_ERR(EXDEV) "end\n"
+        "local md = ''\n"
+        "if #KEYS > 3 then\n"
+        "  if redis.call('HLEN', KEYS[2]) > 1 then " __LUA_ERR(ENOTEMPTY) "end\n"
+        "  md = redis.call('HGET', KEYS[2], " __LUA_MD ") or ''\n"
+        "  redis.call('DEL', KEYS[2], KEYS[3])\n"
+        "elseif #KEYS > 1 then\n"
+        "  md = redis.call('HGET', KEYS[2], " __LUA_MD ") or ''\n"
+        "  if md ~= '' then\n"
+        "    local n = struct.unpack('<I4', md, noff + 1)\n"
+        "    if n > 0 then\n"
+        "      md = patch(md, noff, struct.pack('<I4', n - 1))\n"
+        "      if t ~= '' and n > 1 then md = patch(md, coff, t) end\n"
+        "      redis.call('HSET', KEYS[2], " __LUA_MD ", md)\n"
+        "    end\n"
+        "  end\n"
+        "end\n"
+        "redis.call('HDEL', p, name)\n"
+        "touch(p)\n"
+        "return md\n";
+
+/* KEYS: from, to, ARGV[5..8]: fname, tname, fileid, max */
+static const char *__dir_rename_lua__ =
+        __LUA_COMMON__
+        "local fp, tp = KEYS[1], KEYS[2]\n"
+        "if redis.call('HEXISTS', fp, " __LUA_SPLIT ") == 1 "
+        "or redis.call('HEXISTS', tp, " __LUA_SPLIT ") == 1 then "
+        __LUA_ERR(DIR_SPLIT_STALE) "end\n"
+        "local ent = redis.call('HGET', fp, ARGV[5])\n"
+        "if not ent then " __LUA_ERR(ENOENT) "end\n"
+        "if string.sub(ent, 1, #ARGV[7]) ~= ARGV[7] then " __LUA_ERR(EAGAIN) "end\n"
+        "if redis.call('HEXISTS', tp, " __LUA_MD ") == 0 then " __LUA_ERR(ENOENT) "end\n"
+        "if redis.call('HEXISTS', tp, ARGV[6]) == 1 then " __LUA_ERR(EEXIST) "end\n"
+        "if redis.call('HLEN', tp) > tonumber(ARGV[8]) then " __LUA_ERR(EPERM) "end\n"
+        "redis.call('HSET', tp, ARGV[6], ent)\n"
+        "redis.call('HDEL', fp, ARGV[5])\n"
+        "touch(fp)\n"
+        "if tp ~= fp then touch(tp) end\n"
+        "return 0\n";
+
+static char __dir_create_sha__[REDIS_SHA_LEN];
+static char __dir_remove_sha__[REDIS_SHA_LEN];
+static char __dir_rename_sha__[REDIS_SHA_LEN];
+
+#define DIR_LUA_KEY_MAX 3
+#define DIR_LUA_ARG_MAX 7
+
+/* lock, if set, is one more key after ids */
+static int __dir_eval(const char *script, char *sha, int nkeys, const fileid_t **ids,
+                      const char *lock, int nargs, const char **args,
+                      const size_t *argslen, redisReply **_reply)
+{
+        int ret, argc, i;
+        char key[DIR_LUA_KEY_MAX][MAX_PATH_LEN], numkeys[MAX_NAME_LEN];
+        char offset[3][MAX_NAME_LEN];
+        const char *argv[1 + DIR_LUA_KEY_MAX + 1 + 4 + DIR_LUA_ARG_MAX];
+        size_t argvlen[1 + DIR_LUA_KEY_MAX + 1 + 4 + DIR_LUA_ARG_MAX];
+        struct timespec now;
+        redisReply *reply;
+
+        YASSERT(nkeys <= DIR_LUA_KEY_MAX && nargs <= DIR_LUA_ARG_MAX);
+
+        argc = 0;
+        snprintf(numkeys, MAX_NAME_LEN, "%d", nkeys + (lock ? 1 : 0));
+        argv[argc] = numkeys;
+        argvlen[argc++] = strlen(numkeys);
+
+        for (i = 0; i < nkeys; i++) {
+                id2key(ftype(ids[i]), ids[i], key[i]);
+                argv[argc] = key[i];
+                argvlen[argc++] = strlen(key[i]);
+        }
+
+        if (lock) {
+                argv[argc] = lock;
+                argvlen[argc++] = strlen(lock);
+        }
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        argv[argc] = (void *)&now;
+        argvlen[argc++] = ENABLE_MD_POSIX ? sizeof(now) : 0;
+
+        snprintf(offset[0], MAX_NAME_LEN, "%zu", offsetof(md_proto_t, at_mtime));
+        snprintf(offset[1], MAX_NAME_LEN, "%zu", offsetof(md_proto_t, at_ctime));
+        snprintf(offset[2], MAX_NAME_LEN, "%zu", offsetof(md_proto_t, at_nlink));
+        for (i = 0; i < 3; i++) {
+                argv[argc] = offset[i];
+                argvlen[argc++] = strlen(offset[i]);
+        }
+
+        for (i = 0; i < nargs; i++) {
+                argv[argc] = args[i];
+                argvlen[argc++] = argslen[i];
+        }
+
+        ret = keval(ids[0], script, sha, argc, argv, argvlen, &reply);
+        if (ret)
                 GOTO(err_ret, ret);
+
+        if (reply->type == REDIS_REPLY_INTEGER && reply->integer < 0) {
+                ret = -reply->integer;
+                freeReplyObject(reply);
+                goto err_ret;
         }
 
+        *_reply = reply;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/*
+ * one create on hash, the directory hash itself when split is given. md is
+ * stored in the script when it sits on the sharding of hash, otherwise
+ * ahead of it.
+ */
+static int __dir_create(const fileid_t *hash, const char *name,
+                        const fileid_t *fileid, uint32_t type,
+                        const md_proto_t *md, const dir_split_t *split)
+{
+        int ret, nkeys, local, inl;
+        dir_entry_t ent;
+        const fileid_t *ids[2];
+        const char *args[7];
+        size_t argslen[7];
+        char max[MAX_NAME_LEN], threshold[MAX_NAME_LEN];
+        redisReply *reply;
+
+        local = md && __dir_local(hash, fileid);
+        inl = md && md->data_inline;
+        if (md && !local) {
+                ret = hset(fileid, SDFS_MD, md, md->md_size, O_EXCL);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                if (inl) {
+                        ret = hset(fileid, SDFS_INLINE, "", 0, 0);
+                        if (ret) {
+                                kdel(fileid);
+                                GOTO(err_ret, ret);
+                        }
+                }
+        }
+
+        memset(&ent, 0x0, sizeof(ent));
         ent.fileid = *fileid;
         ent.d_type = type;
+        snprintf(max, MAX_NAME_LEN, "%llu", (LLU)MAX_SUB_FILES);
+        snprintf(threshold, MAX_NAME_LEN, "%llu", gloconf.dir_split_threshold
+                 ? (LLU)gloconf.dir_split_threshold : (LLU)-1);
 
-        ret = hset(parent, name, &ent, sizeof(dir_entry_t), flag);
+        ids[0] = hash;
+        ids[1] = fileid;
+        nkeys = local ? 2 : 1;
+
+        args[0] = name;
+        argslen[0] = strlen(name);
+        args[1] = (void *)&ent;
+        argslen[1] = sizeof(ent);
+        args[2] = local ? (void *)md : "";
+        argslen[2] = local ? md->md_size : 0;
+        args[3] = max;
+        argslen[3] = strlen(max);
+        args[4] = split ? (void *)split : "";
+        argslen[4] = split ? sizeof(*split) : 0;
+        args[5] = threshold;
+        argslen[5] = strlen(threshold);
+        args[6] = (local && inl) ? "1" : "";
+        argslen[6] = strlen(args[6]);
+
+        ret = __dir_eval(__dir_create_lua__, __dir_create_sha__, nkeys, ids, NULL,
+                         7, args, argslen, &reply);
         if (ret) {
-                DBUG(""FID_FORMAT" / "FID_FORMAT" name %s\n", FID_ARG(parent), FID_ARG(fileid), name);
+                if (md && !local) {
+                        kdel(fileid);
+                }
+
+                goto err_ret;
+        }
+
+        freeReplyObject(reply);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * add the dirent and stamp the parent at once. md, if given, is stored
+ * with it, a file inode created on the parent's sharding moves to the
+ * sharding of the bucket (fileid and md->fileid are updated).
+ */
+static int dir_create(const fileid_t *parent, const char *name,
+                      fileid_t *fileid, uint32_t type, md_proto_t *md)
+{
+        int ret;
+        fileid_t bucket, tmp;
+        dir_split_t split, newsplit;
+        uint32_t tmptype;
+
+        ANALYSIS_BEGIN(0);
+
+        DBUG(""FID_FORMAT"/"FID_FORMAT" name %s\n", FID_ARG(parent), FID_ARG(fileid), name);
+
+        ret = dir_split_get(parent, &split, 0);
+        if (ret)
                 GOTO(err_ret, ret);
+
+        if (split.count == 0) {
+                dir_split_new(&newsplit);
+                ret = __dir_create(parent, name, fileid, type, md, &newsplit);
+                if (ret == 0) {
+                        goto out;
+                } else if (ret == DIR_SPLIT_NEW) {
+                        split = newsplit;
+                        ret = dir_split_start(parent, &split);
+                        if (ret) {
+                                DWARN("split "CHKID_FORMAT" ret %u\n",
+                                      CHKID_ARG(parent), ret);
+                        }
+                } else if (ret == DIR_SPLIT_STALE) {
+                        ret = dir_split_get(parent, &split, 1);
+                        if (ret)
+                                GOTO(err_ret, ret);
+
+                        if (split.count == 0) {
+                                ret = EAGAIN;
+                                GOTO(err_ret, ret);
+                        }
+                } else
+                        goto err_ret;
         }
 
+        ret = dir_split_bucket(parent, &split, name, &bucket);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (split.migrating) {
+                ret = __dir_get(parent, name, &tmp, &tmptype);
+                if (ret == 0) {
+                        ret = EEXIST;
+                        goto err_ret;
+                } else if (ret != ENOENT)
+                        GOTO(err_ret, ret);
+        }
+
+        if (md && fileid->type == ftype_file && gloconf.md_atomic
+            && __dir_local(parent, fileid)) {
+                fileid->sharding = bucket.sharding;
+                md->fileid = *fileid;
+        }
+
+        ret = __dir_create(&bucket, name, fileid, type, md, NULL);
+        if (ret)
+                goto err_ret;
+
+        dir_split_count(parent, 1);
+out:
         ANALYSIS_QUEUE(0, IO_WARN, NULL);
-        
+
         return 0;
 err_ret:
         return ret;
 }
 
-static int dir_unlink(const fileid_t *parent, const char *name)
+/*
+ * one remove on hash. with md the inode is unlinked in the script, which
+ * needs it on the sharding of hash and not klocked, EXDEV otherwise.
+ */
+static int __dir_remove(const fileid_t *hash, const char *name,
+                        const fileid_t *fileid, md_proto_t *md)
+{
+        int ret, nkeys;
+        fileid_t xattrid;
+        const fileid_t *ids[3];
+        const char *args[2], *lock = NULL;
+        size_t argslen[2];
+        char _lock[MAX_NAME_LEN];
+        redisReply *reply;
+
+        ids[0] = hash;
+        nkeys = 1;
+        if (md) {
+                if (!__dir_local(hash, fileid)) {
+                        ret = EXDEV;
+                        goto err_ret;
+                }
+
+                ids[nkeys++] = fileid;
+                if (S_ISDIR(stype(fileid->type))) {
+                        xattrid = *fileid;
+                        xattrid.type = ftype_xattr;
+                        ids[nkeys++] = &xattrid;
+                }
+
+                klock_key(fileid, _lock);
+                lock = _lock;
+        }
+
+        args[0] = name;
+        argslen[0] = strlen(name);
+        args[1] = (void *)fileid;
+        argslen[1] = sizeof(*fileid);
+
+        ret = __dir_eval(__dir_remove_lua__, __dir_remove_sha__, nkeys, ids, lock,
+                         2, args, argslen, &reply);
+        if (ret)
+                goto err_ret;
+
+        if (md) {
+                if (reply->type != REDIS_REPLY_STRING || reply->len == 0) {
+                        DWARN(CHKID_FORMAT" not found\n", CHKID_ARG(fileid));
+                        memset(md, 0x0, sizeof(*md));
+                } else {
+                        YASSERT(reply->len <= MAX_BUF_LEN);
+                        memcpy(md, reply->str, reply->len);
+                }
+        }
+
+        freeReplyObject(reply);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * drop the dirent if it still points to fileid (EAGAIN if not) and stamp
+ * the parent. with md the inode is unlinked in the same script and md
+ * returns it as after the unlink; that needs the inode on the sharding of
+ * the hash holding the dirent and not klocked, EXDEV (nothing done)
+ * otherwise.
+ */
+static int dir_remove(const fileid_t *parent, const char *name,
+                      const fileid_t *fileid, md_proto_t *md)
 {
         int ret;
+        fileid_t bucket;
+        const fileid_t *hash;
+        dir_split_t split;
 
-        ret = hdel(parent, name);
+        ret = dir_split_get(parent, &split, 0);
         if (ret)
                 GOTO(err_ret, ret);
-        
+
+        if (split.count == 0) {
+                ret = __dir_remove(parent, name, fileid, md);
+                if (ret == 0)
+                        return 0;
+                else if (ret != DIR_SPLIT_STALE)
+                        goto err_ret;
+
+                ret = dir_split_get(parent, &split, 1);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                if (split.count == 0) {
+                        ret = EAGAIN;
+                        GOTO(err_ret, ret);
+                }
+        }
+
+        ret = dir_split_bucket(parent, &split, name, &bucket);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        hash = &bucket;
+        ret = __dir_remove(hash, name, fileid, md);
+        if (ret == ENOENT && split.migrating) {
+                hash = parent;
+                ret = __dir_remove(hash, name, fileid, md);
+                if (ret == DIR_SPLIT_STALE) {
+                        /* moved meanwhile */
+                        hash = &bucket;
+                        ret = __dir_remove(hash, name, fileid, md);
+                }
+        }
+
+        if (ret)
+                goto err_ret;
+
+        if (hash == &bucket)
+                dir_split_count(parent, -1);
+
         return 0;
 err_ret:
         return ret;
 }
 
-static int __readdir(const fileid_t *fid, void *buf, int *_buflen,
-                     uint64_t _offset, const filter_t *filter, int is_plus)
+/**
+ * move the dirent between two parents of the same sharding, the target
+ * name must not exist. EXDEV if the parents are on different shardings or
+ * either is split.
+ */
+static int dir_rename(const fileid_t *fparent, const char *fname,
+                      const fileid_t *tparent, const char *tname,
+                      const fileid_t *fileid)
+{
+        int ret;
+        const fileid_t *ids[2];
+        const char *args[4];
+        size_t argslen[4];
+        char max[MAX_NAME_LEN];
+        dir_split_t fsplit, tsplit;
+        redisReply *reply;
+
+        if (fparent->volid != tparent->volid
+            || fparent->sharding != tparent->sharding) {
+                ret = EXDEV;
+                goto err_ret;
+        }
+
+        ret = dir_split_get(fparent, &fsplit, 0);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = dir_split_get(tparent, &tsplit, 0);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (fsplit.count || tsplit.count) {
+                ret = EXDEV;
+                goto err_ret;
+        }
+
+        snprintf(max, MAX_NAME_LEN, "%llu", (LLU)MAX_SUB_FILES);
+
+        ids[0] = fparent;
+        ids[1] = tparent;
+
+        args[0] = fname;
+        argslen[0] = strlen(fname);
+        args[1] = tname;
+        argslen[1] = strlen(tname);
+        args[2] = (void *)fileid;
+        argslen[2] = sizeof(*fileid);
+        args[3] = max;
+        argslen[3] = strlen(max);
+
+        ret = __dir_eval(__dir_rename_lua__, __dir_rename_sha__, 2, ids, NULL,
+                         4, args, argslen, &reply);
+        if (ret) {
+                if (ret == DIR_SPLIT_STALE) {
+                        dir_split_get(fparent, &fsplit, 1);
+                        dir_split_get(tparent, &tsplit, 1);
+                        ret = EXDEV;
+                }
+
+                goto err_ret;
+        }
+
+        freeReplyObject(reply);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/*
+ * readdir cookies of a split directory carry the hash in the high bits:
+ * 0 is the directory hash, i bucket i, the low DIR_COOKIE_SHIFT bits are
+ * the hscan cursor in it, wider than any redis hash table. cookies of
+ * other directories are plain cursors.
+ */
+static int __dir_cursor(const fileid_t *fid, uint64_t offset, dir_split_t *split,
+                        fileid_t *hash, uint32_t *idx, uint64_t *cursor)
+{
+        int ret;
+
+        ret = dir_split_get(fid, split, 0);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (split->count == 0 && offset > DIR_COOKIE_MASK) {
+                ret = dir_split_get(fid, split, 1);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
+        if (split->count == 0) {
+                *hash = *fid;
+                *idx = 0;
+                *cursor = offset;
+                return 0;
+        }
+
+        *idx = offset >> DIR_COOKIE_SHIFT;
+        *cursor = offset & DIR_COOKIE_MASK;
+        if (*idx > split->count) {
+                ret = EINVAL;
+                GOTO(err_ret, ret);
+        }
+
+        if (*idx == 0) {
+                *hash = *fid;
+        } else {
+                ret = dir_split_bucketid(fid, *idx, hash);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int __dir_cookie(const dir_split_t *split, uint32_t idx, uint64_t next,
+                        uint64_t *cookie)
+{
+        int ret;
+
+        if (split->count == 0) {
+                *cookie = next;
+                return 0;
+        }
+
+        if (next > DIR_COOKIE_MASK) {
+                ret = EOVERFLOW;
+                DERROR("hash %u cursor %ju too large\n", idx, next);
+                GOTO(err_ret, ret);
+        }
+
+        if (next) {
+                *cookie = ((uint64_t)idx << DIR_COOKIE_SHIFT) | next;
+        } else if (idx < split->count) {
+                *cookie = (uint64_t)(idx + 1) << DIR_COOKIE_SHIFT;
+        } else {
+                *cookie = 0;
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/*
+ * one hscan of hash into buf, SDFS_SPLIT seen in a directory hash is
+ * returned in split
+ */
+static int __readdir_scan(const fileid_t *fid, void *buf, int *_buflen,
+                          uint64_t offset, uint64_t count, int is_plus,
+                          uint64_t *_next, dir_split_t *split)
 {
         int ret, reclen, buflen;
         redisReply *reply, *e0, *e1, *k1, *v1;
@@ -98,10 +857,6 @@ static int __readdir(const fileid_t *fid, void *buf, int *_buflen,
         uint64_t next;
         uint32_t i;
         struct dirent *curr;
-        uint64_t offset, count;
-
-        offset = filter ? filter->offset : _offset;
-        count = filter ? filter->count : (uint64_t)-1;
 
 retry:
         buflen = *_buflen;
@@ -124,6 +879,13 @@ retry:
                 // name + value
                 k1 = e1->element[i];
                 if (strncmp(k1->str, SDFS_MD_SYSTEM, strlen(SDFS_MD_SYSTEM)) == 0) {
+                        v1 = e1->element[i+1];
+                        if (split && strcmp(k1->str, SDFS_SPLIT) == 0
+                            && v1->len == sizeof(*split)) {
+                                memcpy(split, v1->str, sizeof(*split));
+                                dir_split_set(fid, split);
+                        }
+
                         continue;
                 }
 
@@ -172,6 +934,7 @@ retry:
         freeReplyObject(reply);
 
         *_buflen = (void *)curr - buf;
+        *_next = next;
 
         return 0;
 err_ret:
@@ -179,6 +942,54 @@ err_ret:
         return ret;
 }
 
+static int __readdir(const fileid_t *fid, void *buf, int *_buflen,
+                     uint64_t _offset, const filter_t *filter, int is_plus)
+{
+        int ret, buflen;
+        uint32_t idx;
+        uint64_t offset, count, cursor, next, cookie;
+        fileid_t hash;
+        dir_split_t split;
+        struct dirent *de;
+
+        offset = filter ? filter->offset : _offset;
+        count = filter ? filter->count : (uint64_t)-1;
+
+        ret = __dir_cursor(fid, offset, &split, &hash, &idx, &cursor);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        while (1) {
+                buflen = *_buflen;
+                ret = __readdir_scan(&hash, buf, &buflen, cursor, count, is_plus,
+                                     &next, idx ? NULL : &split);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                ret = __dir_cookie(&split, idx, next, &cookie);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                /* pages of a split directory can be empty, go on */
+                if (buflen || cookie == 0)
+                        break;
+
+                ret = __dir_cursor(fid, cookie, &split, &hash, &idx, &cursor);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
+        dir_for_each(buf, buflen, de, offset) {
+                de->d_off = cookie;
+        }
+
+        *_buflen = buflen;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
 static int dir_readdir(const fileid_t *fileid, void *buf, int *buflen,
                        uint64_t offset)
 {
@@ -213,18 +1024,29 @@ static int __dir_list(const dirid_t *dirid, uint32_t count, uint64_t offset, dir
         int ret, idx;
         redisReply *reply, *e0, *e1, *k1, *v1;
         dir_entry_t *ent;
-        uint64_t next;
-        uint32_t i;
+        uint64_t next, cursor, cookie;
+        uint32_t i, hashidx;
+        fileid_t hash;
+        dir_split_t split;
         dirlist_t *array;
         __dirlist_t *node;
         
+        ret = __dir_cursor(dirid, offset, &split, &hash, &hashidx, &cursor);
+        if (ret)
+                GOTO(err_ret, ret);
 
-        reply = hscan(dirid, NULL, offset, count);
-        if (reply->type != REDIS_REPLY_ARRAY) {
+retry:
+        reply = hscan(&hash, NULL, cursor, count);
+        if (reply == NULL) {
                 ret = ENOENT;
                 GOTO(err_ret, ret);
         }
 
+        if (reply->type != REDIS_REPLY_ARRAY) {
+                ret = ENOENT;
+                GOTO(err_free, ret);
+        }
+
         e0 = reply->element[0];
         e1 = reply->element[1];
 
@@ -235,17 +1057,23 @@ static int __dir_list(const dirid_t *dirid, uint32_t count, uint64_t offset, dir
 
         ret = ymalloc((void **)&array, DIRLIST_SIZE(e1->elements / 2));
         if (ret)
-                GOTO(err_ret, ret);
+                GOTO(err_free, ret);
 
         idx = 0;
         for (i = 0; i < (uint32_t)e1->elements; i += 2) {
                 // name + value
                 k1 = e1->element[i];
+                v1 = e1->element[i+1];
                 if (strncmp(k1->str, SDFS_MD_SYSTEM, strlen(SDFS_MD_SYSTEM)) == 0) {
+                        if (hashidx == 0 && strcmp(k1->str, SDFS_SPLIT) == 0
+                            && v1->len == sizeof(split)) {
+                                memcpy(&split, v1->str, sizeof(split));
+                                dir_split_set(dirid, &split);
+                        }
+
                         continue;
                 }
 
-                v1 = e1->element[i+1];
                 ent = (dir_entry_t *)v1->str;
                 node = &array->array[idx];
                 node->fileid = ent->fileid;
@@ -258,23 +1086,44 @@ static int __dir_list(const dirid_t *dirid, uint32_t count, uint64_t offset, dir
         
         freeReplyObject(reply);
 
+        ret = __dir_cookie(&split, hashidx, next, &cookie);
+        if (ret) {
+                yfree((void **)&array);
+                GOTO(err_ret, ret);
+        }
+
+        /* pages of a split directory can be empty, go on */
+        if (idx == 0 && cookie) {
+                yfree((void **)&array);
+
+                ret = __dir_cursor(dirid, cookie, &split, &hash, &hashidx, &cursor);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                goto retry;
+        }
+
         array->count = idx;
         array->cursor = 0;
-        array->offset = next;
+        array->offset = cookie;
         *dirlist = array;
 
         return 0;
-err_ret:
+err_free:
         freeReplyObject(reply);
+err_ret:
         return ret;
 }
 
-dirop_t __dirop__ = {
+dirop_t __dirop_redis__ = {
         .lookup = dir_lookup,
         .readdir = dir_readdir,
         .readdirplus = dir_readdirplus,
         .readdirplus_filter = __readdirplus_filter,
         .newrec = dir_newrec,
         .unlink = dir_unlink,
+        .create = dir_create,
+        .remove = dir_remove,
+        .rename = dir_rename,
         .dirlist = __dir_list,
 };
@@ -0,0 +1,613 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YFSMDS
+
+#include "dir.h"
+#include "sdfs_list.h"
+#include "configure.h"
+#include "net_global.h"
+#include "redis_conn.h"
+#include "redis.h"
+#include "md.h"
+#include "md_db.h"
+#include "dbg.h"
+
+/*
+ * directory sharding
+ *
+ * once a directory hash passes dir_split_threshold entries, the create
+ * that crosses it stores SDFS_SPLIT in the hash and new entries go to
+ * dir_split_buckets bucket hashes picked by name hash. bucket i of a
+ * directory is the dirid with idx i (key "...#i"), on sharding
+ * (dirid.sharding + i) % shardings, so the entries of one directory are
+ * spread over the whole volume. the old entries are then moved out of
+ * the directory hash and migrating is cleared; until then lookup falls
+ * back to the directory hash.
+ *
+ * the move runs in a thread of whichever client holds the split lease, a
+ * key next to the directory renewed every batch. the splitting client
+ * starts it, any client that meets migrating set tries again at most once
+ * per lease period, so a move left by a dead client is picked up once its
+ * lease runs out. moves are idempotent, two movers only waste work.
+ *
+ * the entries in the buckets are counted by DIR_SPLIT_COUNTER, a kincr
+ * counter of the directory: the move bumps it in the script that drops
+ * the entry from the directory hash, bucket creates and removes after the
+ * fact. it only feeds nlink, emptiness is checked on the buckets.
+ *
+ * split state never goes back, clients cache the split directories they
+ * met. a client missing the split is corrected by the directory hash
+ * itself: the create/remove scripts fail with EXDEV there and lookup reads
+ * SDFS_SPLIT with the name.
+ */
+
+#define DIR_SPLIT_HASH 256
+#define DIR_SPLIT_CACHE_MAX 8192
+#define DIR_SPLIT_REFRESH 1             /* seconds, for migrating entries */
+#define DIR_SPLIT_BATCH 1000
+#define DIR_SPLIT_LEASE 10              /* seconds */
+#define DIR_SPLIT_COUNTER "split_count"
+#define DIR_SPLIT_OWNER "split_lease"
+
+typedef struct {
+        struct list_head hook;
+        fileid_t dirid;
+        dir_split_t split;
+        time_t update;
+        time_t kick;            /* last mover started here */
+} dir_split_ent_t;
+
+typedef struct {
+        fileid_t dirid;
+        dir_split_t split;
+        char owner[MAX_NAME_LEN];
+} dir_split_ctx_t;
+
+static pthread_mutex_t __dir_split_lock__ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t __dir_split_once__ = PTHREAD_ONCE_INIT;
+static struct list_head __dir_split_hash__[DIR_SPLIT_HASH];
+static int __dir_split_count__ = 0;
+
+/*
+ * KEYS: hash [counter], ARGV: name, value. drop name only if it still
+ * holds value, the counter gains what the hash lost
+ */
+static const char *__dir_split_cad_lua__ =
+        "if redis.call('HGET', KEYS[1], ARGV[1]) == ARGV[2] then\n"
+        "  redis.call('HDEL', KEYS[1], ARGV[1])\n"
+        "  if #KEYS > 1 then redis.call('INCRBY', KEYS[2], 1) end\n"
+        "  return 1\n"
+        "end\n"
+        "return 0\n";
+
+/* KEYS: lease, ARGV: owner, ttl. take or renew, ttl 0 lets it go */
+static const char *__dir_split_lease_lua__ =
+        "local v = redis.call('GET', KEYS[1])\n"
+        "if v and v ~= ARGV[1] then return 0 end\n"
+        "if ARGV[2] == '0' then\n"
+        "  redis.call('DEL', KEYS[1])\n"
+        "else\n"
+        "  redis.call('SET', KEYS[1], ARGV[1], 'EX', ARGV[2])\n"
+        "end\n"
+        "return 1\n";
+
+static char __dir_split_cad_sha__[REDIS_SHA_LEN];
+static char __dir_split_lease_sha__[REDIS_SHA_LEN];
+
+static int __dir_split_resume(const fileid_t *dirid, const dir_split_t *split);
+
+static void __dir_split_once()
+{
+        int i;
+
+        for (i = 0; i < DIR_SPLIT_HASH; i++) {
+                INIT_LIST_HEAD(&__dir_split_hash__[i]);
+        }
+}
+
+static struct list_head *__dir_split_head(const fileid_t *dirid)
+{
+        pthread_once(&__dir_split_once__, __dir_split_once);
+
+        return &__dir_split_hash__[(dirid->id + dirid->volid) % DIR_SPLIT_HASH];
+}
+
+static dir_split_ent_t *__dir_split_find(struct list_head *head, const fileid_t *dirid)
+{
+        struct list_head *pos;
+        dir_split_ent_t *ent;
+
+        list_for_each(pos, head) {
+                ent = (void *)pos;
+                if (ent->dirid.id == dirid->id && ent->dirid.volid == dirid->volid)
+                        return ent;
+        }
+
+        return NULL;
+}
+
+/**
+ * cache the split state of dirid. a split still migrating gets a mover
+ * here unless one was started here within the lease period.
+ */
+void dir_split_set(const fileid_t *dirid, const dir_split_t *split)
+{
+        int ret, kick = 0;
+        time_t now;
+        struct list_head *head;
+        dir_split_ent_t *ent;
+
+        if (split->count == 0)
+                return;
+
+        head = __dir_split_head(dirid);
+
+        pthread_mutex_lock(&__dir_split_lock__);
+
+        ent = __dir_split_find(head, dirid);
+        if (ent == NULL) {
+                if (__dir_split_count__ >= DIR_SPLIT_CACHE_MAX && !list_empty(head)) {
+                        ent = (void *)head->prev;
+                        list_del(&ent->hook);
+                } else {
+                        ret = ymalloc((void **)&ent, sizeof(*ent));
+                        if (ret) {
+                                pthread_mutex_unlock(&__dir_split_lock__);
+                                return;
+                        }
+
+                        __dir_split_count__++;
+                }
+
+                ent->dirid = *dirid;
+                ent->kick = 0;
+                list_add(&ent->hook, head);
+        }
+
+        now = gettime();
+        ent->split = *split;
+        ent->update = now;
+        if (split->migrating && now - ent->kick >= DIR_SPLIT_LEASE) {
+                ent->kick = now;
+                kick = 1;
+        }
+
+        pthread_mutex_unlock(&__dir_split_lock__);
+
+        if (kick) {
+                ret = __dir_split_resume(dirid, split);
+                if (ret) {
+                        DWARN("split "CHKID_FORMAT" ret %u\n", CHKID_ARG(dirid), ret);
+                }
+        }
+}
+
+/**
+ * split state of dirid, from the cache unless refresh. a directory not in
+ * the cache is taken as not split.
+ */
+int dir_split_get(const fileid_t *dirid, dir_split_t *split, int refresh)
+{
+        int ret;
+        size_t len;
+        struct list_head *head;
+        dir_split_ent_t *ent;
+
+        head = __dir_split_head(dirid);
+
+        pthread_mutex_lock(&__dir_split_lock__);
+
+        ent = __dir_split_find(head, dirid);
+        if (ent) {
+                *split = ent->split;
+                if (ent->split.migrating
+                    && gettime() - ent->update >= DIR_SPLIT_REFRESH) {
+                        refresh = 1;
+                }
+        } else {
+                memset(split, 0x0, sizeof(*split));
+        }
+
+        pthread_mutex_unlock(&__dir_split_lock__);
+
+        if (!refresh)
+                return 0;
+
+        len = sizeof(*split);
+        ret = hget(dirid, SDFS_SPLIT, (void *)split, &len);
+        if (ret) {
+                if (ret == ENOENT) {
+                        memset(split, 0x0, sizeof(*split));
+                        return 0;
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+        if (len != sizeof(*split)) {
+                ret = EIO;
+                GOTO(err_ret, ret);
+        }
+
+        dir_split_set(dirid, split);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+void dir_split_new(dir_split_t *split)
+{
+        split->count = gloconf.dir_split_buckets;
+        split->migrating = 1;
+}
+
+int dir_split_bucketid(const fileid_t *dirid, uint32_t idx, fileid_t *bucket)
+{
+        int ret, count;
+
+        YASSERT(idx);
+
+        ret = redis_conn_sharding(dirid->volid, &count);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        *bucket = *dirid;
+        bucket->idx = idx;
+        bucket->sharding = (dirid->sharding + idx) % count;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+int dir_split_bucket(const fileid_t *dirid, const dir_split_t *split,
+                     const char *name, fileid_t *bucket)
+{
+        YASSERT(split->count);
+
+        return dir_split_bucketid(dirid, 1 + hash_str(name) % split->count, bucket);
+}
+
+/* key of the kincr counter name of fileid, see kincr */
+static void __dir_split_key(const fileid_t *fileid, const char *name, char *key)
+{
+        char tmp[MAX_PATH_LEN];
+
+        id2key(ftype(fileid), fileid, tmp);
+        snprintf(key, MAX_PATH_LEN, "%s:%s", tmp, name);
+}
+
+static int __dir_split_cad(const fileid_t *fileid, const char *name,
+                           const char *value, size_t len, int count)
+{
+        int ret, argc;
+        char key[MAX_PATH_LEN], counter[MAX_PATH_LEN], numkeys[MAX_NAME_LEN];
+        const char *argv[5];
+        size_t argvlen[5];
+        redisReply *reply;
+
+        snprintf(numkeys, MAX_NAME_LEN, "%d", count ? 2 : 1);
+        id2key(ftype(fileid), fileid, key);
+
+        argc = 0;
+        argv[argc] = numkeys;
+        argvlen[argc++] = strlen(numkeys);
+        argv[argc] = key;
+        argvlen[argc++] = strlen(key);
+        if (count) {
+                __dir_split_key(fileid, DIR_SPLIT_COUNTER, counter);
+                argv[argc] = counter;
+                argvlen[argc++] = strlen(counter);
+        }
+        argv[argc] = name;
+        argvlen[argc++] = strlen(name);
+        argv[argc] = value;
+        argvlen[argc++] = len;
+
+        ret = keval(fileid, __dir_split_cad_lua__, __dir_split_cad_sha__,
+                    argc, argv, argvlen, &reply);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = (reply->type == REDIS_REPLY_INTEGER && reply->integer) ? 0 : ENOENT;
+        freeReplyObject(reply);
+
+        return ret;
+err_ret:
+        return ret;
+}
+
+/*
+ * copy to the bucket, then drop from the directory hash if unchanged. an
+ * entry removed meanwhile loses its copy again.
+ */
+static int __dir_split_move(const fileid_t *dirid, const dir_split_t *split,
+                            const char *name, const char *value, size_t len)
+{
+        int ret;
+        fileid_t bucket;
+
+        ret = dir_split_bucket(dirid, split, name, &bucket);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = hset(&bucket, name, value, len, O_EXCL);
+        if (ret) {
+                if (ret == EEXIST) {
+                        /* moved before the last restart */
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+        ret = __dir_split_cad(dirid, name, value, len, 1);
+        if (ret) {
+                if (ret == ENOENT) {
+                        __dir_split_cad(&bucket, name, value, len, 0);
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/* take or renew the lease of ctx, ttl 0 gives it back. EBUSY if held */
+static int __dir_split_lease(const dir_split_ctx_t *ctx, int ttl)
+{
+        int ret;
+        char key[MAX_PATH_LEN], numkeys[MAX_NAME_LEN], _ttl[MAX_NAME_LEN];
+        const char *argv[4];
+        size_t argvlen[4];
+        redisReply *reply;
+
+        snprintf(numkeys, MAX_NAME_LEN, "%d", 1);
+        snprintf(_ttl, MAX_NAME_LEN, "%d", ttl);
+        __dir_split_key(&ctx->dirid, DIR_SPLIT_OWNER, key);
+
+        argv[0] = numkeys;
+        argvlen[0] = strlen(numkeys);
+        argv[1] = key;
+        argvlen[1] = strlen(key);
+        argv[2] = ctx->owner;
+        argvlen[2] = strlen(ctx->owner);
+        argv[3] = _ttl;
+        argvlen[3] = strlen(_ttl);
+
+        ret = keval(&ctx->dirid, __dir_split_lease_lua__, __dir_split_lease_sha__,
+                    4, argv, argvlen, &reply);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = (reply->type == REDIS_REPLY_INTEGER && reply->integer) ? 0 : EBUSY;
+        freeReplyObject(reply);
+
+        return ret;
+err_ret:
+        return ret;
+}
+
+static void *__dir_split_migrate(void *arg)
+{
+        int ret, moved = 0;
+        uint32_t i;
+        uint64_t cursor = 0;
+        dir_split_ctx_t *ctx = arg;
+        redisReply *reply, *e1, *k1, *v1;
+
+        ret = __dir_split_lease(ctx, DIR_SPLIT_LEASE);
+        if (ret) {
+                if (ret == EBUSY) {
+                        DBUG("split "CHKID_FORMAT" moving elsewhere\n",
+                             CHKID_ARG(&ctx->dirid));
+                        yfree((void **)&ctx);
+                        return NULL;
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+        DINFO("split "CHKID_FORMAT" into %u buckets, %s\n",
+              CHKID_ARG(&ctx->dirid), ctx->split.count, ctx->owner);
+
+        do {
+                reply = hscan(&ctx->dirid, NULL, cursor, DIR_SPLIT_BATCH);
+                if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+                        ret = ECONNRESET;
+                        GOTO(err_lease, ret);
+                }
+
+                cursor = atol(reply->element[0]->str);
+                e1 = reply->element[1];
+                for (i = 0; i < (uint32_t)e1->elements; i += 2) {
+                        k1 = e1->element[i];
+                        v1 = e1->element[i + 1];
+                        if (strncmp(k1->str, SDFS_MD_SYSTEM, strlen(SDFS_MD_SYSTEM)) == 0)
+                                continue;
+
+                        ret = __dir_split_move(&ctx->dirid, &ctx->split,
+                                               k1->str, v1->str, v1->len);
+                        if (ret) {
+                                freeReplyObject(reply);
+                                GOTO(err_lease, ret);
+                        }
+
+                        moved++;
+                }
+
+                freeReplyObject(reply);
+
+                /* lost to a mover that took over after a stall, let it go on */
+                ret = __dir_split_lease(ctx, DIR_SPLIT_LEASE);
+                if (ret)
+                        GOTO(err_ret, ret);
+        } while (cursor);
+
+        ctx->split.migrating = 0;
+        ret = hset(&ctx->dirid, SDFS_SPLIT, &ctx->split, sizeof(ctx->split), 0);
+        if (ret)
+                GOTO(err_lease, ret);
+
+        dir_split_set(&ctx->dirid, &ctx->split);
+        __dir_split_lease(ctx, 0);
+
+        DINFO("split "CHKID_FORMAT" done, moved %u\n",
+              CHKID_ARG(&ctx->dirid), moved);
+
+        yfree((void **)&ctx);
+        return NULL;
+err_lease:
+        __dir_split_lease(ctx, 0);
+err_ret:
+        DWARN("split "CHKID_FORMAT" stopped, moved %u, ret %u\n",
+              CHKID_ARG(&ctx->dirid), moved, ret);
+        yfree((void **)&ctx);
+        return NULL;
+}
+
+static int __dir_split_resume(const fileid_t *dirid, const dir_split_t *split)
+{
+        int ret;
+        dir_split_ctx_t *ctx;
+
+        ret = ymalloc((void **)&ctx, sizeof(*ctx));
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ctx->dirid = *dirid;
+        ctx->split = *split;
+        snprintf(ctx->owner, MAX_NAME_LEN, "%u/%d/%p",
+                 net_getnid()->id, getpid(), ctx);
+
+        ret = sy_thread_create2(__dir_split_migrate, ctx, "dir_split");
+        if (ret)
+                GOTO(err_free, ret);
+
+        return 0;
+err_free:
+        yfree((void **)&ctx);
+err_ret:
+        return ret;
+}
+
+/**
+ * move the entries older than the split to their buckets, in background
+ */
+int dir_split_start(const fileid_t *dirid, const dir_split_t *split)
+{
+        YASSERT(split->migrating);
+
+        dir_split_set(dirid, split);
+
+        return 0;
+}
+
+/**
+ * bucket entries of dirid changed by delta, after the bucket op
+ */
+void dir_split_count(const fileid_t *dirid, int64_t delta)
+{
+        int ret;
+
+        ret = kincr(dirid, DIR_SPLIT_COUNTER, delta, NULL);
+        if (ret) {
+                DWARN("split "CHKID_FORMAT" count %jd ret %u\n",
+                      CHKID_ARG(dirid), (intmax_t)delta, ret);
+        }
+}
+
+/**
+ * entries in the buckets of dirid from the counter, one round trip. it can
+ * be off after a client died between a bucket op and its count, use
+ * dir_split_childcount where it must be exact.
+ */
+int dir_split_childhint(const fileid_t *dirid, uint64_t *_count)
+{
+        int ret;
+        int64_t count;
+
+        ret = kincr(dirid, DIR_SPLIT_COUNTER, 0, &count);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        *_count = count > 0 ? count : 0;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * entries in the buckets of dirid, 0 if it is not split. one hlen per
+ * bucket, for emptiness checks
+ */
+int dir_split_childcount(const fileid_t *dirid, uint64_t *_count)
+{
+        int ret;
+        uint32_t i;
+        uint64_t count, total = 0;
+        fileid_t bucket;
+        dir_split_t split;
+
+        ret = dir_split_get(dirid, &split, 0);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        for (i = 1; i <= split.count; i++) {
+                ret = dir_split_bucketid(dirid, i, &bucket);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                ret = hlen(&bucket, &count);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                total += count;
+        }
+
+        *_count = total;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+int dir_split_remove(const fileid_t *dirid)
+{
+        int ret;
+        uint32_t i;
+        fileid_t bucket;
+        dir_split_t split;
+
+        ret = dir_split_get(dirid, &split, 0);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        for (i = 1; i <= split.count; i++) {
+                ret = dir_split_bucketid(dirid, i, &bucket);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                ret = kdel(&bucket);
+                if (ret) {
+                        if (ret == ENOENT) {
+                                //pass
+                        } else
+                                GOTO(err_ret, ret);
+                }
+        }
+
+        if (split.count) {
+                ret = kincr_del(dirid, DIR_SPLIT_COUNTER);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
@@ -77,16 +77,17 @@ static void __inode_getxattrid(const fileid_t *fileid, fileid_t *xattrid, int fl
         xattrid->type = ftype_xattr;
 }
 
-static int __inode_create(const fileid_t *parent, const setattr_t *setattr,
-                          int type, fileid_t *_fileid)
+/**
+ * build the md of a new inode under parent without storing it
+ */
+static int __inode_prepare(const fileid_t *parent, const setattr_t *setattr,
+                           int type, md_proto_t *md)
 {
         int ret;
-        char buf[MAX_BUF_LEN], buf1[MAX_BUF_LEN];
+        char buf[MAX_BUF_LEN];
         fileid_t fileid;
-        md_proto_t *md_parent, *md;
+        md_proto_t *md_parent;
 
-        ANALYSIS_BEGIN(0);
-        
         md_parent = (md_proto_t *)buf;
         ret = md_getattr(md_parent, parent);
         if (ret)
@@ -96,17 +97,41 @@ static int __inode_create(const fileid_t *parent, const setattr_t *setattr,
         if (ret)
                 GOTO(err_ret, ret);
 
-        md = (void *)buf1;
         ret = md_attr_init((void *)md, setattr, type, md_parent, &fileid);
         if (ret)
                 GOTO(err_ret, ret);
 
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int __inode_create(const fileid_t *parent, const setattr_t *setattr,
+                          int type, fileid_t *_fileid)
+{
+        int ret;
+        char buf[MAX_BUF_LEN];
+        md_proto_t *md;
+
+        ANALYSIS_BEGIN(0);
+        
+        md = (void *)buf;
+        ret = __inode_prepare(parent, setattr, type, md);
+        if (ret)
+                GOTO(err_ret, ret);
+
         ret = __md_set(md, O_EXCL);
         if (ret)
                 GOTO(err_ret, ret);
 
+        if (md->data_inline) {
+                ret = hset(&md->fileid, SDFS_INLINE, "", 0, 0);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
         if (_fileid) {
-                *_fileid = fileid;
+                *_fileid = md->fileid;
         }
 
         ANALYSIS_QUEUE(0, IO_WARN, NULL);
@@ -134,7 +159,8 @@ static int __inode_getattr(const fileid_t *fileid, md_proto_t *md)
         YASSERT(md->md_size == len);
 
         if (S_ISDIR(stype(fileid->type))) {
-                ret = __inode_childcount(fileid, &count);
+                /* dirents may live on another backend, see md_init */
+                ret = __inodeop__.childhint(fileid, &count);
                 if (ret)
                         GOTO(err_ret, ret);
 
@@ -146,15 +172,19 @@ err_ret:
         return ret;
 }
 
-static int __inode_setattr(const fileid_t *fileid, const setattr_t *setattr, int force)
+/* pre and post, if set, get the md before and after the update */
+static int __inode_setattr(const fileid_t *fileid, const setattr_t *setattr,
+                           int force, md_proto_t *pre, md_proto_t *post)
 {
         int ret;
+        uint64_t token;
         char buf[MAX_BUF_LEN] = {0};
         md_proto_t *md;
 
         DBUG("setattr "CHKID_FORMAT", force %u\n", CHKID_ARG(fileid), force);
         
-        ret = klock(fileid, 10, force ? 1 : 0);
+        md = (void *)buf;
+        ret = klock(fileid, 10, force ? 1 : 0, &token);
         if (ret) {
                 if (ret == EAGAIN && force == 0) {
                         goto out;
@@ -162,11 +192,14 @@ static int __inode_setattr(const fileid_t *fileid, const setattr_t *setattr, int
                         GOTO(err_ret, ret);
         }
         
-        md = (void *)buf;
         ret = __inode_getattr(fileid, md);
         if (ret)
                 GOTO(err_lock, ret);
 
+        if (pre) {
+                memcpy(pre, md, md->md_size);
+        }
+
         md_attr_update(md, setattr);
         YASSERT(md->at_mode);
         
@@ -174,14 +207,31 @@ static int __inode_setattr(const fileid_t *fileid, const setattr_t *setattr, int
         if (ret)
                 GOTO(err_lock, ret);
 
-        ret = kunlock(fileid);
+        ret = kunlock(fileid, token);
         if (ret)
                 GOTO(err_ret, ret);
 
+        if (post) {
+                memcpy(post, md, md->md_size);
+        }
+
+        return 0;
 out:
+        if (pre || post) {
+                /* skipped, report the md as it is */
+                ret = __inode_getattr(fileid, md);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                if (pre)
+                        memcpy(pre, md, md->md_size);
+                if (post)
+                        memcpy(post, md, md->md_size);
+        }
+
         return 0;
 err_lock:
-        kunlock(fileid);
+        kunlock(fileid, token);
 err_ret:
         return ret;
 }
@@ -189,6 +239,7 @@ err_ret:
 static int __inode_extend(const fileid_t *fileid, size_t size)
 {
         int ret, retry = 0;
+        uint64_t token;
         char buf[MAX_BUF_LEN] = {0};
         md_proto_t *md;
 
@@ -204,7 +255,7 @@ retry:
 
         (void) retry;
         
-        ret = klock(fileid, 10, 0);
+        ret = klock(fileid, 10, 0, &token);
         if (ret) {
 #if 1
                 if (retry > 500 && retry % 100 == 0 ) {
@@ -235,13 +286,13 @@ retry:
                         GOTO(err_lock, ret);
         }
 
-        ret = kunlock(fileid);
+        ret = kunlock(fileid, token);
         if (ret)
                 GOTO(err_ret, ret);
         
         return 0;
 err_lock:
-        kunlock(fileid);
+        kunlock(fileid, token);
 err_ret:
         return ret;
 }
@@ -255,6 +306,18 @@ static int __inode_del(const fileid_t *fileid)
         DBUG("del "CHKID_FORMAT" \n", CHKID_ARG(fileid));
         
         __inode_getxattrid(fileid, &xattrid, 0);
+
+        if (S_ISDIR(stype(fileid->type))) {
+                ret = dir_split_remove(fileid);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
+        if (fileid->type == ftype_file) {
+                ret = md_lock_remove(fileid);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
         
         ret = kdel(fileid);
         if (ret)
@@ -368,10 +431,12 @@ err_ret:
         return ret;
 }
 
-static int __inode_childcount(const fileid_t *fileid, uint64_t *_count)
+/* exact counts every bucket of a split directory, else its counter */
+static int __inode_children(const fileid_t *fileid, uint64_t *_count, int exact)
 {
         int ret;
-        uint64_t count;
+        uint64_t count, bucket;
+        dir_split_t split;
 
         if (!S_ISDIR(stype(fileid->type))) {
                 ret = ENOTDIR;
@@ -382,20 +447,50 @@ static int __inode_childcount(const fileid_t *fileid, uint64_t *_count)
         if (ret)
                 GOTO(err_ret, ret);
 
-        *_count = count - 1;
+        count--;        /* SDFS_MD */
+
+        /* a hash that big may have been split by another client */
+        ret = dir_split_get(fileid, &split, gloconf.dir_split_threshold
+                            && count >= gloconf.dir_split_threshold);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (split.count) {
+                if (exact)
+                        ret = dir_split_childcount(fileid, &bucket);
+                else
+                        ret = dir_split_childhint(fileid, &bucket);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                count += bucket - 1;    /* SDFS_SPLIT */
+        }
+
+        *_count = count;
 
         return 0;
 err_ret:
         return ret;
 }
 
+static int __inode_childcount(const fileid_t *fileid, uint64_t *count)
+{
+        return __inode_children(fileid, count, 1);
+}
+
+static int __inode_childhint(const fileid_t *fileid, uint64_t *count)
+{
+        return __inode_children(fileid, count, 0);
+}
+
 static int __inode_link(const fileid_t *fileid)
 {
         int ret;
+        uint64_t token;
         md_proto_t *md;
         char buf[MAX_BUF_LEN];
 
-        ret = klock(fileid, 10, 1);
+        ret = klock(fileid, 10, 1, &token);
         if (ret)
                 GOTO(err_ret, ret);
 
@@ -410,13 +505,13 @@ static int __inode_link(const fileid_t *fileid)
         if (ret)
                 GOTO(err_lock, ret);
         
-        ret = kunlock(fileid);
+        ret = kunlock(fileid, token);
         if (ret)
                 GOTO(err_ret, ret);
 
         return 0;
 err_lock:
-        kunlock(fileid);
+        kunlock(fileid, token);
 err_ret:
         return ret;
 }
@@ -424,6 +519,7 @@ err_ret:
 static int __inode_unlink(const fileid_t *fileid, md_proto_t *_md)
 {
         int ret;
+        uint64_t token;
         md_proto_t *md;
         char buf[MAX_BUF_LEN];
 
@@ -431,7 +527,7 @@ static int __inode_unlink(const fileid_t *fileid, md_proto_t *_md)
                 return __inode_remove(fileid, _md);
         }
         
-        ret = klock(fileid, 10, 1);
+        ret = klock(fileid, 10, 1, &token);
         if (ret)
                 GOTO(err_ret, ret);
 
@@ -464,13 +560,13 @@ static int __inode_unlink(const fileid_t *fileid, md_proto_t *_md)
         }
 #endif
         
-        ret = kunlock(fileid);
+        ret = kunlock(fileid, token);
         if (ret)
                 GOTO(err_ret, ret);
 
         return 0;
 err_lock:
-        kunlock(fileid);
+        kunlock(fileid, token);
 err_ret:
         return ret;
 }
@@ -568,8 +664,9 @@ err_ret:
         return ret;
 }
 
-inodeop_t __inodeop__ = {
+inodeop_t __inodeop_redis__ = {
         .create = __inode_create,
+        .prepare = __inode_prepare,
         .getattr = __inode_getattr,
         .setattr = __inode_setattr,
         .extend = __inode_extend,
@@ -578,6 +675,7 @@ inodeop_t __inodeop__ = {
         .listxattr = __inode_listxattr,
         .removexattr = __inode_removexattr,
         .childcount = __inode_childcount,
+        .childhint = __inode_childhint,
         //.init = __inode_init,
         .link = __inode_link,
         .unlink = __inode_unlink,
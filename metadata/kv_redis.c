@@ -104,14 +104,14 @@ err_ret:
         return ret;
 }
 
-static int __kv_lock(root_type_t type)
+static int __kv_lock(root_type_t type, uint64_t *token)
 {
         int ret;
         fileid_t fileid;
 
         fileid = *md_root_getid(type);
 
-        ret = klock(&fileid, 10, 1);
+        ret = klock(&fileid, 10, 1, token);
         if (ret)
                 GOTO(err_ret, ret);
 
@@ -120,14 +120,14 @@ err_ret:
         return ret;
 }
 
-static int __kv_unlock(root_type_t type)
+static int __kv_unlock(root_type_t type, uint64_t token)
 {
         int ret;
         fileid_t fileid;
 
         fileid = *md_root_getid(type);
 
-        ret = kunlock(&fileid);
+        ret = kunlock(&fileid, token);
         if (ret)
                 GOTO(err_ret, ret);
 
@@ -12,28 +12,75 @@
 #include "etcd.h"
 #include "md_proto.h"
 #include "md_lib.h"
+#include "md_db.h"
 #include "dbg.h"
 
+/*
+ * id leases
+ *
+ * ids of a type are leased from the etcd counter SYSTEMID/<type> in
+ * ranges, one compare and swap per range. the range size follows the
+ * allocation rate of this process: it doubles when a range lasted less
+ * than MDID_FAST seconds or the swap met other allocators, and halves
+ * when it lasted more than MDID_SLOW seconds. daemons never go below
+ * MDID_STEP. md_destroy gives the unused rest back when nobody leased
+ * after us.
+ */
+
 typedef struct {
         sy_rwlock_t lock;
         uint64_t begin;
         uint64_t cur;
         uint64_t end;
+        uint64_t step;
+        time_t leased;
+        uint64_t lease;         /* leases taken */
+        uint64_t conflict;      /* swaps lost to other allocators */
 } mdid_t;
 
 static mdid_t *__mdid__ = NULL;
 
+dirop_t __dirop__;
+inodeop_t __inodeop__;
+chunkop_t __chunkop__;
+
 #define MDID_STEP 100000
+#define MDID_STEP_MIN 16
+#define MDID_STEP_MAX (MDID_STEP * 10)
+#define MDID_FAST 1
+#define MDID_SLOW 60
 #define SYSTEMID "systemid"
 
+static uint64_t __md_newid_step(mdid_t *mdid, int conflict)
+{
+        uint64_t step, min;
+        time_t now;
+
+        min = ng.daemon ? MDID_STEP : MDID_STEP_MIN;
+        step = mdid->step ? mdid->step : min;
+        now = gettime();
+
+        if (mdid->leased) {
+                if (conflict || now - mdid->leased < MDID_FAST) {
+                        step = step * 2;
+                } else if (now - mdid->leased > MDID_SLOW) {
+                        step = step / 2;
+                }
+        }
+
+        step = step < min ? min : step;
+        step = step > MDID_STEP_MAX ? MDID_STEP_MAX : step;
+
+        return step;
+}
+
 static int __md_newid(mdid_t *mdid, fidtype_t type)
 {
-        int ret, idx;
+        int ret, idx, conflict = 0;
         char key[MAX_PATH_LEN], value[MAX_BUF_LEN];
-        uint64_t begin, end;
-        int step = (ng.daemon ? MDID_STEP : 1);
+        uint64_t begin, end, step;
 
-        (void) mdid;
+        step = __md_newid_step(mdid, 0);
 
 retry:
         snprintf(key, MAX_NAME_LEN, "%d", type);
@@ -49,6 +96,7 @@ retry:
                         if (ret) {
                                 if (ret == EEXIST) {
                                         DWARN("%s created by other\n", key);
+                                        conflict++;
                                         goto retry;
                                 } else {
                                         GOTO(err_ret, ret);
@@ -66,11 +114,12 @@ retry:
         end = begin + step;
         snprintf(value, MAX_NAME_LEN, "%ju", end);
 
-        DINFO("try to set %s %s\n", key, value);
+        DBUG("try to set %s %s\n", key, value);
         ret = etcd_update_text(SYSTEMID, key, value, &idx, 0);
         if(ret) {
                 if (ret == EEXIST) {
-                        DWARN("%s update by other\n", key);
+                        DBUG("%s update by other\n", key);
+                        conflict++;
                         goto retry;
                 } else {
                         GOTO(err_ret, ret);
@@ -78,6 +127,15 @@ retry:
         }
         
 out:
+        if (conflict) {
+                mdid->conflict += conflict;
+                DWARN("id type %d lease %ju-%ju after %d conflicts, total lease %ju conflict %ju\n",
+                      type, begin, end, conflict, mdid->lease + 1, mdid->conflict);
+        }
+
+        mdid->step = __md_newid_step(mdid, conflict);
+        mdid->leased = gettime();
+        mdid->lease++;
         mdid->begin = begin;
         mdid->end = end;
         mdid->cur = begin;
@@ -120,6 +178,126 @@ err_ret:
         return ret;
 }
 
+/*
+ * move the counter back to cur if it still ends at our range
+ */
+static int __md_newid_release(mdid_t *mdid, fidtype_t type)
+{
+        int ret, idx;
+        char key[MAX_PATH_LEN], value[MAX_BUF_LEN];
+
+        if (mdid->cur >= mdid->end)
+                return 0;
+
+        snprintf(key, MAX_NAME_LEN, "%d", type);
+        ret = etcd_get_text(SYSTEMID, key, value, &idx);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        if ((uint64_t)atoll(value) != mdid->end) {
+                DBUG("%s leased by other, keep %ju-%ju\n", key, mdid->cur, mdid->end);
+                return 0;
+        }
+
+        snprintf(value, MAX_NAME_LEN, "%ju", mdid->cur);
+        ret = etcd_update_text(SYSTEMID, key, value, &idx, 0);
+        if(ret) {
+                if (ret == EEXIST) {
+                        return 0;
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+        DINFO("%s release %ju-%ju\n", key, mdid->cur, mdid->end);
+        mdid->end = mdid->cur;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * give back the unused part of the id leases, on clean exit
+ */
+int md_destroy()
+{
+        int ret, i;
+        mdid_t *mdid;
+
+        if (__mdid__ == NULL)
+                return 0;
+
+        for (i = 0; i < idtype_max; i++) {
+                mdid = &__mdid__[i];
+
+                ret = sy_rwlock_wrlock(&mdid->lock);
+                if(ret)
+                        GOTO(err_ret, ret);
+
+                ret = __md_newid_release(mdid, i);
+                if (ret) {
+                        DWARN("id type %d release fail %u\n", i, ret);
+                }
+
+                sy_rwlock_unlock(&mdid->lock);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/*
+ * mdsconf.db picks where dirents and chunk info live. "leveldb" puts them
+ * in the mdkv store of the master mond (mond/mdkv.c), inodes, xattrs and
+ * kv stay on redis. that store has no namespace scripts, so md_atomic is
+ * turned off with it. the master publishes the db it serves, every client
+ * follows that one, the local conf only counts before a mond ever ran.
+ */
+static int __md_backend_init()
+{
+        int ret;
+        char db[MAX_BUF_LEN];
+
+        __dirop__ = __dirop_redis__;
+        __inodeop__ = __inodeop_redis__;
+        __chunkop__ = __chunkop_redis__;
+
+        ret = etcd_get_text(ROLE_MOND, "db", db, NULL);
+        if (ret) {
+                if (ret == ENOKEY) {
+                        strcpy(db, mdsconf.db);
+                } else
+                        GOTO(err_ret, ret);
+        } else if (strcmp(db, mdsconf.db)) {
+                DWARN("db %s from mond, local conf %s ignored\n", db, mdsconf.db);
+        }
+
+        if (strcmp(db, "redis") == 0) {
+                return 0;
+        } else if (strcmp(db, "leveldb")) {
+                ret = EINVAL;
+                DERROR("unknown db %s\n", db);
+                GOTO(err_ret, ret);
+        }
+
+        __dirop__ = __dirop_mdkv__;
+        __chunkop__ = __chunkop_mdkv__;
+        __inodeop__.childcount = dir_mdkv_childcount;
+        __inodeop__.childhint = dir_mdkv_childcount;
+
+        if (gloconf.md_atomic) {
+                DWARN("md_atomic not supported by db %s, off\n", db);
+                gloconf.md_atomic = 0;
+        }
+
+        DINFO("metadata db %s\n", db);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
 int md_init()
 {
         int ret, i;
@@ -141,10 +319,16 @@ int md_init()
                 mdid->begin = 0;
                 mdid->end = 0;
                 mdid->cur = 0;
+                mdid->step = 0;
+                mdid->leased = 0;
         }
 
         __mdid__ = array;
 
+        ret = __md_backend_init();
+        if (ret)
+                GOTO(err_ret, ret);
+
 #if 1
         ret = init_redis();
         if(ret)
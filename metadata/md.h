@@ -7,6 +7,7 @@
 
 int md_newid(fidtype_t type, uint64_t *id);
 int md_init();
+int md_destroy();
 
 
 #endif
@@ -298,6 +298,7 @@ int md_attr_init(md_proto_t *md, const setattr_t *setattr, uint32_t type,
         md->fileid = *fileid;
         md->md_version = 0;
         md->chknum = 0;
+        md->data_inline = S_ISREG(mode) && gloconf.inline_size;
         memset(&md->quotaid, 0x0, sizeof(md->quotaid));
         md_attr_inherit(md, parent, NULL, mode);
         md_attr_update(md, setattr);
@@ -337,9 +338,18 @@ int md_attr_getid(fileid_t *fileid, const fileid_t *parent, ftype_t type, const
                         fileid->volid = parent->volid;
                         fileid->idx = 0;
                         fileid->id = id;
-                        ret = redis_conn_new(parent->volid, &fileid->sharding);
-                        if (ret)
-                                GOTO(err_ret, ret);
+
+                        /*
+                         * files follow the dirent, so create/unlink touch a
+                         * single sharding and run as one script
+                         */
+                        if (gloconf.md_atomic && type == ftype_file) {
+                                fileid->sharding = parent->sharding;
+                        } else {
+                                ret = redis_conn_new(parent->volid, &fileid->sharding);
+                                if (ret)
+                                        GOTO(err_ret, ret);
+                        }
                 } else {
                         uint64_t systemvol;
                         ret = md_system_volid(&systemvol);
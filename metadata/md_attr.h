@@ -14,6 +14,7 @@
 typedef enum {
         idtype_nid = 0,
         idtype_fileid = 1,
+        idtype_dirent = 2,
         idtype_max = 3,
 } fidtype_t;
 
@@ -355,11 +355,12 @@ err_ret:
 int md_newrep(chkinfo_t *chkinfo, const chkid_t *chkid, int lock, int flag)
 {
         int ret;
+        uint64_t token = 0;
 
         UNIMPLEMENTED(__DUMP__);//disabled
         
         if (lock) {
-                ret = klock(chkid, 10, 1);
+                ret = klock(chkid, 10, 1, &token);
                 if (ret)
                         GOTO(err_ret, ret);
         }
@@ -377,7 +378,7 @@ int md_newrep(chkinfo_t *chkinfo, const chkid_t *chkid, int lock, int flag)
                 GOTO(err_lock, ret);
 
         if (lock) {
-                ret = kunlock(chkid);
+                ret = kunlock(chkid, token);
                 if (ret)
                         GOTO(err_ret, ret);
         }
@@ -385,7 +386,7 @@ int md_newrep(chkinfo_t *chkinfo, const chkid_t *chkid, int lock, int flag)
         return 0;
 err_lock:
         if (lock) {
-                kunlock(chkid);
+                kunlock(chkid, token);
         }
 err_ret:
         return ret;
@@ -476,12 +477,13 @@ int md_chunk_set(const chkid_t *chkid, const diskid_t *diskid,
                  int available, chkinfo_t *chkinfo)
 {
         int ret;
+        uint64_t token;
 
         //req->op = MDP_CHKAVAILABLE;
 
         UNIMPLEMENTED(__DUMP__);//disabled
 
-        ret = klock(chkid, 10, 1);
+        ret = klock(chkid, 10, 1, &token);
         if (ret)
                 GOTO(err_ret, ret);
         
@@ -497,13 +499,13 @@ int md_chunk_set(const chkid_t *chkid, const diskid_t *diskid,
         if (ret)
                 GOTO(err_lock, ret);
 
-        ret = kunlock(chkid);
+        ret = kunlock(chkid, token);
         if (ret)
                 GOTO(err_ret, ret);
 
         return 0;
 err_lock:
-        kunlock(chkid);
+        kunlock(chkid, token);
 err_ret:
         return ret;
 }
@@ -599,10 +601,11 @@ err_ret:
 int md_chknewmaster(chkinfo_t *chkinfo, const chkid_t *chkid, int type)
 {
         int ret;
+        uint64_t token;
 
         (void) type;
 
-        ret = klock(chkid, 10, 1);
+        ret = klock(chkid, 10, 1, &token);
         if (ret)
                 GOTO(err_ret, ret);
         
@@ -628,13 +631,13 @@ int md_chknewmaster(chkinfo_t *chkinfo, const chkid_t *chkid, int type)
         if (ret)
                 GOTO(err_lock, ret);
 
-        ret = kunlock(chkid);
+        ret = kunlock(chkid, token);
         if (ret)
                 GOTO(err_ret, ret);
         
         return 0;
 err_lock:
-        kunlock(chkid);
+        kunlock(chkid, token);
 err_ret:
         return ret;
 }
@@ -780,8 +783,9 @@ err_ret:
 static int __md_chunk_load_slow(const chkid_t *chkid, chkinfo_t *chkinfo, int repmin)
 {
         int ret;
+        uint64_t token;
 
-        ret = klock(chkid, 10, 1);
+        ret = klock(chkid, 10, 1, &token);
         if (unlikely(ret))
                 GOTO(err_ret, ret);
         
@@ -807,13 +811,13 @@ static int __md_chunk_load_slow(const chkid_t *chkid, chkinfo_t *chkinfo, int re
         if (ret)
                 GOTO(err_lock, ret);
 
-        ret = kunlock(chkid);
+        ret = kunlock(chkid, token);
         if (unlikely(ret))
                 GOTO(err_ret, ret);
 
         return 0;
 err_lock:
-        kunlock(chkid);
+        kunlock(chkid, token);
 err_ret:
         return ret;
 }
@@ -8,6 +8,8 @@
 
 #define SDFS_MD "__system_md__"
 #define SDFS_LOCK "__system_lock__"
+#define SDFS_SPLIT "__system_split__"
+#define SDFS_INLINE "__system_inline__"
 #define SDFS_MD_SYSTEM "__system"
 
 
@@ -17,6 +19,15 @@ typedef struct {
                       const fileid_t *fileid, uint32_t type, int flag);
         
         int (*unlink)(const fileid_t *parent, const char *name);
+
+        // 单次原子操作, 见 dir_redis.c
+        int (*create)(const fileid_t *parent, const char *name,
+                      fileid_t *fileid, uint32_t type, md_proto_t *md);
+        int (*remove)(const fileid_t *parent, const char *name,
+                      const fileid_t *fileid, md_proto_t *md);
+        int (*rename)(const fileid_t *fparent, const char *fname,
+                      const fileid_t *tparent, const char *tname,
+                      const fileid_t *fileid);
         
         int (*lookup)(const fileid_t *parent, const char *name, fileid_t *fileid,
                       uint32_t *type);
@@ -39,15 +50,20 @@ typedef struct {
         int (*init)();
         int (*create)(const fileid_t *parent, const setattr_t *setattr, int mode,
                       fileid_t *_fileid);
+        int (*prepare)(const fileid_t *parent, const setattr_t *setattr, int mode,
+                       md_proto_t *md);
         //int (*del)(const fileid_t *fileid);
         int (*getattr)(const fileid_t *fileid, md_proto_t *md);
-        int (*setattr)(const fileid_t *fileid, const setattr_t *setattr, int force);
+        int (*setattr)(const fileid_t *fileid, const setattr_t *setattr, int force,
+                       md_proto_t *pre, md_proto_t *post);
         int (*extend)(const fileid_t *fileid, size_t size);
         int (*setxattr)(const fileid_t *id, const char *key, const char *value, size_t size, int flag);
         int (*getxattr)(const fileid_t *id, const char *key, char *value, size_t *value_len);
         int (*listxattr)(const fileid_t *id, char *list, size_t *size);
         int (*removexattr)(const fileid_t *id, const char *key);
         int (*childcount)(const fileid_t *parent, uint64_t *count);
+        // 同上, 可能略有偏差, 只用于 nlink
+        int (*childhint)(const fileid_t *parent, uint64_t *count);
         int (*unlink)(const fileid_t *fileid, md_proto_t *md);
         int (*remove)(const fileid_t *fileid, md_proto_t *md);
         int (*link)(const fileid_t *fileid);
@@ -71,14 +87,25 @@ typedef struct {
         int (*remove)(root_type_t type, const char *key);
         redisReply* (*scan)(root_type_t type, const char *match, uint64_t offset);
         int (*iter)(root_type_t type, const char *match, func2_t func, void *ctx);
-        int (*lock)(root_type_t type);
-        int (*unlock)(root_type_t type);
+        int (*lock)(root_type_t type, uint64_t *token);
+        int (*unlock)(root_type_t type, uint64_t token);
 } kvop_t;
 
 
+/* the tables in use, filled by md_init from a backend below */
 extern dirop_t __dirop__;
 extern inodeop_t __inodeop__;
 extern chunkop_t __chunkop__;
 extern kvop_t __kvop__;
 
+/* redis, *_redis.c */
+extern dirop_t __dirop_redis__;
+extern inodeop_t __inodeop_redis__;
+extern chunkop_t __chunkop_redis__;
+
+/* mdkv of the master mond, *_mdkv.c. inodes stay on redis */
+extern dirop_t __dirop_mdkv__;
+extern chunkop_t __chunkop_mdkv__;
+int dir_mdkv_childcount(const fileid_t *fileid, uint64_t *count);
+
 #endif
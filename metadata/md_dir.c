@@ -35,7 +35,7 @@ inline static int __md_update_time(const fileid_t *fileid, int at, int mt, int c
                             mt ? __SET_TO_SERVER_TIME : __DONT_CHANGE, NULL,
                             ct ? __SET_TO_SERVER_TIME : __DONT_CHANGE, NULL);
 
-        ret = inodeop->setattr(fileid, &setattr, 0);
+        ret = inodeop->setattr(fileid, &setattr, 0, NULL, NULL);
         if (ret)
                 GOTO(err_ret, ret);
 
@@ -44,11 +44,103 @@ err_ret:
         return ret;
 }
 
+/*
+ * with md_atomic the dirent and a co-located inode change in one script,
+ * an inode on another sharding is dropped after its name.
+ */
+static int __md_remove_atomic(const fileid_t *parent, const char *name,
+                              uint32_t type, md_proto_t *md)
+{
+        int ret, retry = 0;
+        uint64_t count;
+        fileid_t fileid;
+        dir_split_t split;
+
+retry:
+        ret = md_lookup(&fileid, parent, name);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (S_ISDIR(stype(type)) && !S_ISDIR(stype(fileid.type))) {
+                ret = ENOTDIR;
+                GOTO(err_ret, ret);
+        }
+
+        ret = dirop->remove(parent, name, &fileid, md);
+        if (ret) {
+                if (ret == EAGAIN) {
+                        USLEEP_RETRY(err_ret, ret, retry, retry, 10, (10 * 1000));
+                } else if (ret == EXDEV) {
+                        /* inode not with the dirent */
+                        goto remote;
+                } else if (ret == ENOTEMPTY) {
+                        /* SDFS_SPLIT counts as an entry there */
+                        ret = dir_split_get(&fileid, &split, 1);
+                        if (ret)
+                                GOTO(err_ret, ret);
+
+                        if (split.count)
+                                goto remote;
+
+                        ret = ENOTEMPTY;
+                }
+
+                GOTO(err_ret, ret);
+        }
+
+        goto out;
+remote:
+        if (S_ISDIR(stype(fileid.type))) {
+                ret = dir_split_get(&fileid, &split, 1);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                ret = inodeop->childcount(&fileid, &count);
+                if (ret == 0 && count > 0) {
+                        ret = ENOTEMPTY;
+                        GOTO(err_ret, ret);
+                }
+        }
+
+        ret = dirop->remove(parent, name, &fileid, NULL);
+        if (ret) {
+                if (ret == EAGAIN) {
+                        USLEEP_RETRY(err_ret, ret, retry, retry, 10, (10 * 1000));
+                }
+
+                GOTO(err_ret, ret);
+        }
+
+        memset(md, 0x0, sizeof(*md));
+        if (S_ISDIR(stype(fileid.type))) {
+                ret = inodeop->remove(&fileid, md);
+        } else {
+                ret = inodeop->unlink(&fileid, md);
+        }
+
+        if (ret) {
+                if (ret == ENOENT) {
+                        DWARN(CHKID_FORMAT" not found\n", CHKID_ARG(&fileid));
+                        memset(md, 0x0, sizeof(*md));
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+out:
+        quota_unlink_dec(md);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
 static int __md_create(const fileid_t *parent, const char *name,
                        const setattr_t *setattr, int mode, fileid_t *_fileid)
 {
         int ret;
         fileid_t fileid;
+        md_proto_t *md;
+        char buf[MAX_BUF_LEN];
 
         if (strncmp(name, SDFS_MD_SYSTEM, strlen(SDFS_MD_SYSTEM)) == 0) {
                 ret = EPERM;
@@ -61,6 +153,20 @@ static int __md_create(const fileid_t *parent, const char *name,
                 GOTO(err_ret, ret);
 #endif
 
+        if (gloconf.md_atomic) {
+                md = (void *)buf;
+                ret = inodeop->prepare(parent, setattr, mode, md);
+                if (ret)
+                        GOTO(err_dec, ret);
+
+                ret = dirop->create(parent, name, &md->fileid, mode, md);
+                if (ret)
+                        GOTO(err_dec, ret);
+
+                fileid = md->fileid;
+                goto out;
+        }
+
         ret = inodeop->create(parent, setattr, mode, &fileid);
         if (ret)
                 GOTO(err_dec, ret);
@@ -80,6 +186,7 @@ static int __md_create(const fileid_t *parent, const char *name,
                 GOTO(err_dec, ret);
         }
 
+out:
         if (_fileid) {
                 *_fileid = fileid;
         }
@@ -317,11 +424,25 @@ int md_rmdir(const fileid_t *parent, const char *name)
         uint32_t type;
         uint64_t count;
         fileid_t fileid;
+        dir_split_t split;
+        char buf[MAX_BUF_LEN];
+
+        if (gloconf.md_atomic) {
+                ret = __md_remove_atomic(parent, name, ftype_dir, (void *)buf);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                return 0;
+        }
 
         ret = dirop->lookup(parent, name, &fileid, &type);
         if (ret)
                 GOTO(err_ret, ret);
 
+        ret = dir_split_get(&fileid, &split, 1);
+        if (ret)
+                GOTO(err_ret, ret);
+
         ret = inodeop->childcount(&fileid, &count);
         if (ret) {
                 if (ret == ENOENT) {
@@ -371,6 +492,16 @@ int md_unlink(const fileid_t *parent, const char *name, md_proto_t *_md)
         md_proto_t *md;
         char buf[MAX_BUF_LEN];
 
+        if (gloconf.md_atomic) {
+                md = (void *)buf;
+                ret = __md_remove_atomic(parent, name, ftype_file, md);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                memcpy(_md, md, md->md_size ? md->md_size : sizeof(*md));
+                return 0;
+        }
+
         ret = md_lookup(&fileid, parent, name);
         if (ret)
                 GOTO(err_ret, ret);
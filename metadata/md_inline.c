@@ -0,0 +1,429 @@
+#include <sys/types.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YFSMDS
+
+#include "sdfs_buffer.h"
+#include "net_global.h"
+#include "redis.h"
+#include "quota.h"
+#include "md_lib.h"
+#include "md_db.h"
+#include "dbg.h"
+
+/*
+ * inline file data
+ *
+ * a regular file created with inline_size set keeps its data in the
+ * SDFS_INLINE field of its inode hash, next to SDFS_MD, until it grows
+ * past inline_size. the field holds the first bytes of the file, bytes
+ * after it up to at_size read as zero. a truncate moves at_size and cuts
+ * the field to it (md_inline_truncate), so old bytes never come back when
+ * the file grows again.
+ *
+ * the field is the truth, md->data_inline only a hint that it may exist:
+ * it is set with the field and cleared with it, once the data moved to
+ * chunks (md_inline_drop) the file never goes back.
+ */
+
+#define __LUA_ERR(__e__) __LUA_ERR1(__e__)
+#define __LUA_ERR1(__e__) "return -" #__e__ " "
+#define __LUA_MD "'" SDFS_MD "'"
+#define __LUA_INLINE "'" SDFS_INLINE "'"
+
+#define __LUA_PATCH__                                                   \
+        "local function patch(s, off, v)\n"                             \
+        "  return string.sub(s, 1, off) .. v .. string.sub(s, off + #v + 1)\n" \
+        "end\n"
+
+/*
+ * KEYS: inode, ARGV: offset, data, max, offset of at_size. returns the
+ * size before the write.
+ */
+static const char *__md_inline_write_lua__ =
+        __LUA_PATCH__
+        "local k, off, buf, max = KEYS[1], tonumber(ARGV[1]), ARGV[2], tonumber(ARGV[3])\n"
+        "local soff = tonumber(ARGV[4])\n"
+        "local data = redis.call('HGET', k, " __LUA_INLINE ")\n"
+        "if not data then " __LUA_ERR(ENODATA) "end\n"
+        "local md = redis.call('HGET', k, " __LUA_MD ")\n"
+        "if not md then " __LUA_ERR(ENOENT) "end\n"
+        "local e = off + #buf\n"
+        "if e > max then " __LUA_ERR(EFBIG) "end\n"
+        "local size = struct.unpack('<I8', md, soff + 1)\n"
+        "data = string.sub(data, 1, size)\n"
+        "if #data < off then data = data .. string.rep('\\0', off - #data) end\n"
+        "redis.call('HSET', k, " __LUA_INLINE ", string.sub(data, 1, off) .. buf .. string.sub(data, e + 1))\n"
+        "if e > size then\n"
+        "  redis.call('HSET', k, " __LUA_MD ", patch(md, soff, struct.pack('<I8', e)))\n"
+        "end\n"
+        "return size\n";
+
+/*
+ * KEYS: inode, ARGV: data, size, offset of at_size, offset of chknum,
+ * chknum, offset of data_inline. drops the data if unchanged since
+ * md_inline_get, EAGAIN otherwise.
+ */
+static const char *__md_inline_drop_lua__ =
+        __LUA_PATCH__
+        "local k = KEYS[1]\n"
+        "local data = redis.call('HGET', k, " __LUA_INLINE ")\n"
+        "if not data then return 0 end\n"
+        "local md = redis.call('HGET', k, " __LUA_MD ")\n"
+        "if not md then " __LUA_ERR(ENOENT) "end\n"
+        "local size = struct.unpack('<I8', md, tonumber(ARGV[3]) + 1)\n"
+        "if size ~= tonumber(ARGV[2]) or string.sub(data, 1, size) ~= ARGV[1] then "
+        __LUA_ERR(EAGAIN) "end\n"
+        "md = patch(md, tonumber(ARGV[4]), struct.pack('<I4', tonumber(ARGV[5])))\n"
+        "md = patch(md, tonumber(ARGV[6]), string.char(0))\n"
+        "redis.call('HSET', k, " __LUA_MD ", md)\n"
+        "redis.call('HDEL', k, " __LUA_INLINE ")\n"
+        "return 0\n";
+
+/*
+ * KEYS: inode, ARGV: offset of at_size. cuts the data to at_size.
+ */
+static const char *__md_inline_truncate_lua__ =
+        "local k = KEYS[1]\n"
+        "local data = redis.call('HGET', k, " __LUA_INLINE ")\n"
+        "if not data then return 0 end\n"
+        "local md = redis.call('HGET', k, " __LUA_MD ")\n"
+        "if not md then " __LUA_ERR(ENOENT) "end\n"
+        "local size = struct.unpack('<I8', md, tonumber(ARGV[1]) + 1)\n"
+        "if #data > size then\n"
+        "  redis.call('HSET', k, " __LUA_INLINE ", string.sub(data, 1, size))\n"
+        "end\n"
+        "return 0\n";
+
+static char __md_inline_write_sha__[REDIS_SHA_LEN];
+static char __md_inline_drop_sha__[REDIS_SHA_LEN];
+static char __md_inline_truncate_sha__[REDIS_SHA_LEN];
+
+/*
+ * md and inline data in one round trip, ENODATA (md still loaded) if the
+ * file keeps its data in chunks
+ */
+static int __md_inline_load(const fileid_t *fileid, md_proto_t *md,
+                            const char **data, uint32_t *len, redisReply **_reply)
+{
+        int ret;
+        const char *names[2];
+        redisReply *reply, *e0, *e1;
+
+        names[0] = SDFS_MD;
+        names[1] = SDFS_INLINE;
+        reply = hmget(fileid, 2, names);
+        if (reply == NULL) {
+                ret = ECONNRESET;
+                GOTO(err_ret, ret);
+        }
+
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+                ret = EIO;
+                GOTO(err_free, ret);
+        }
+
+        e0 = reply->element[0];
+        e1 = reply->element[1];
+
+        if (e0->type != REDIS_REPLY_STRING) {
+                ret = ENOENT;
+                goto err_free;
+        }
+
+        YASSERT(e0->len <= MAX_BUF_LEN);
+        memcpy(md, e0->str, e0->len);
+        YASSERT(md->md_size == e0->len);
+
+        if (e1->type != REDIS_REPLY_STRING) {
+                ret = ENODATA;
+                goto err_free;
+        }
+
+        *data = e1->str;
+        *len = e1->len < md->at_size ? e1->len : md->at_size;
+        *_reply = reply;
+
+        return 0;
+err_free:
+        freeReplyObject(reply);
+err_ret:
+        return ret;
+}
+
+/**
+ * read size bytes at offset of an inline file into buf, clipped to
+ * md->at_size as from md_getattr. ENODATA if the data is in chunks.
+ */
+int md_inline_read(const md_proto_t *md, buffer_t *buf, uint32_t size,
+                   uint64_t offset)
+{
+        int ret;
+        const char *names[1];
+        uint32_t len, cp;
+        redisReply *reply, *e0;
+
+        names[0] = SDFS_INLINE;
+        reply = hmget(&md->fileid, 1, names);
+        if (reply == NULL) {
+                ret = ECONNRESET;
+                GOTO(err_ret, ret);
+        }
+
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 1) {
+                ret = EIO;
+                GOTO(err_free, ret);
+        }
+
+        e0 = reply->element[0];
+        if (e0->type != REDIS_REPLY_STRING) {
+                ret = ENODATA;
+                goto err_free;
+        }
+
+        len = e0->len < md->at_size ? e0->len : md->at_size;
+
+        if (offset >= md->at_size) {
+                size = 0;
+        } else if (size + offset > md->at_size) {
+                size = md->at_size - offset;
+        }
+
+        if (size && offset < len) {
+                cp = len - offset < size ? len - offset : size;
+                ret = mbuffer_appendmem(buf, e0->str + offset, cp);
+                if (ret)
+                        GOTO(err_free, ret);
+
+                size -= cp;
+        }
+
+        if (size) {
+                ret = mbuffer_appendzero(buf, size);
+                if (ret)
+                        GOTO(err_free, ret);
+        }
+
+        freeReplyObject(reply);
+
+        return 0;
+err_free:
+        freeReplyObject(reply);
+err_ret:
+        return ret;
+}
+
+/**
+ * the stored inline data, without the zeros up to md->at_size
+ */
+int md_inline_get(const fileid_t *fileid, md_proto_t *md, buffer_t *buf)
+{
+        int ret;
+        const char *data;
+        uint32_t len;
+        redisReply *reply;
+
+        ret = __md_inline_load(fileid, md, &data, &len, &reply);
+        if (ret)
+                goto err_ret;
+
+        ret = mbuffer_appendmem(buf, data, len);
+        if (ret)
+                GOTO(err_free, ret);
+
+        freeReplyObject(reply);
+
+        return 0;
+err_free:
+        freeReplyObject(reply);
+err_ret:
+        return ret;
+}
+
+static int __md_inline_eval(const fileid_t *fileid, const char *script, char *sha,
+                            int argc, const char **args, const size_t *argslen,
+                            long long *result)
+{
+        int ret, i;
+        char key[MAX_PATH_LEN], numkeys[MAX_NAME_LEN];
+        const char *argv[REDIS_EVAL_ARG_MAX];
+        size_t argvlen[REDIS_EVAL_ARG_MAX];
+        redisReply *reply;
+
+        YASSERT(argc + 2 <= REDIS_EVAL_ARG_MAX);
+
+        snprintf(numkeys, MAX_NAME_LEN, "%d", 1);
+        id2key(ftype(fileid), fileid, key);
+
+        argv[0] = numkeys;
+        argvlen[0] = strlen(numkeys);
+        argv[1] = key;
+        argvlen[1] = strlen(key);
+        for (i = 0; i < argc; i++) {
+                argv[i + 2] = args[i];
+                argvlen[i + 2] = argslen[i];
+        }
+
+        ret = keval(fileid, script, sha, argc + 2, argv, argvlen, &reply);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (reply->type != REDIS_REPLY_INTEGER) {
+                ret = EIO;
+                freeReplyObject(reply);
+                GOTO(err_ret, ret);
+        }
+
+        if (reply->integer < 0) {
+                ret = -reply->integer;
+                freeReplyObject(reply);
+                goto err_ret;
+        }
+
+        *result = reply->integer;
+        freeReplyObject(reply);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * write to an inline file and extend it, ENODATA if the data is in chunks,
+ * EFBIG if the file would pass inline_size (move it with md_inline_drop
+ * first).
+ */
+int md_inline_write(const md_proto_t *md, const buffer_t *buf, uint32_t size,
+                    uint64_t offset)
+{
+        int ret;
+        char *data, off[MAX_NAME_LEN], max[MAX_NAME_LEN], soff[MAX_NAME_LEN];
+        const char *args[4];
+        size_t argslen[4];
+        long long prev;
+
+        YASSERT(buf->len == size);
+
+        if (offset + size > (uint64_t)gloconf.inline_size) {
+                ret = EFBIG;
+                goto err_ret;
+        }
+
+        ret = ymalloc((void **)&data, size + 1);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        mbuffer_get(buf, data, size);
+
+        snprintf(off, MAX_NAME_LEN, "%llu", (LLU)offset);
+        snprintf(max, MAX_NAME_LEN, "%d", gloconf.inline_size);
+        snprintf(soff, MAX_NAME_LEN, "%zu", offsetof(md_proto_t, at_size));
+
+        args[0] = off;
+        argslen[0] = strlen(off);
+        args[1] = data;
+        argslen[1] = size;
+        args[2] = max;
+        argslen[2] = strlen(max);
+        args[3] = soff;
+        argslen[3] = strlen(soff);
+
+        ret = __md_inline_eval(&md->fileid, __md_inline_write_lua__,
+                               __md_inline_write_sha__, 4, args, argslen, &prev);
+        yfree((void **)&data);
+        if (ret)
+                goto err_ret;
+
+#if ENABLE_QUOTA
+        if (offset + size > (uint64_t)prev) {
+                ret = quota_space_increase(&md->parent, md->at_uid, md->at_gid,
+                                           offset + size - prev);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+#else
+        (void) prev;
+#endif
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * forget the inline data once buf, as from md_inline_get with md, is in
+ * the chunks. EAGAIN if the data changed meanwhile.
+ */
+int md_inline_drop(const md_proto_t *md, const buffer_t *buf)
+{
+        int ret;
+        char *data, size[MAX_NAME_LEN], soff[MAX_NAME_LEN];
+        char noff[MAX_NAME_LEN], chknum[MAX_NAME_LEN], ioff[MAX_NAME_LEN];
+        const char *args[6];
+        size_t argslen[6];
+        long long res;
+
+        ret = ymalloc((void **)&data, buf->len + 1);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        mbuffer_get(buf, data, buf->len);
+
+        snprintf(size, MAX_NAME_LEN, "%llu", (LLU)md->at_size);
+        snprintf(soff, MAX_NAME_LEN, "%zu", offsetof(md_proto_t, at_size));
+        snprintf(noff, MAX_NAME_LEN, "%zu", offsetof(md_proto_t, chknum));
+        snprintf(chknum, MAX_NAME_LEN, "%u", _get_chknum(md->at_size, md->split));
+        snprintf(ioff, MAX_NAME_LEN, "%zu", offsetof(md_proto_t, data_inline));
+
+        args[0] = data;
+        argslen[0] = buf->len;
+        args[1] = size;
+        argslen[1] = strlen(size);
+        args[2] = soff;
+        argslen[2] = strlen(soff);
+        args[3] = noff;
+        argslen[3] = strlen(noff);
+        args[4] = chknum;
+        argslen[4] = strlen(chknum);
+        args[5] = ioff;
+        argslen[5] = strlen(ioff);
+
+        ret = __md_inline_eval(&md->fileid, __md_inline_drop_lua__,
+                               __md_inline_drop_sha__, 6, args, argslen, &res);
+        yfree((void **)&data);
+        if (ret)
+                goto err_ret;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * cut the inline data of a file to its at_size, after a truncate
+ */
+int md_inline_truncate(const fileid_t *fileid)
+{
+        int ret;
+        char soff[MAX_NAME_LEN];
+        const char *args[1];
+        size_t argslen[1];
+        long long res;
+
+        snprintf(soff, MAX_NAME_LEN, "%zu", offsetof(md_proto_t, at_size));
+
+        args[0] = soff;
+        argslen[0] = strlen(soff);
+
+        ret = __md_inline_eval(fileid, __md_inline_truncate_lua__,
+                               __md_inline_truncate_sha__, 1, args, argslen, &res);
+        if (ret)
+                goto err_ret;
+
+        return 0;
+err_ret:
+        return ret;
+}
@@ -29,6 +29,8 @@ int md_utime(const fileid_t *fileid, const struct timespec *atime,
              const struct timespec *mtime, const struct timespec *ctime);
 int md_chmod(const fileid_t *fileid, mode_t mode);
 int md_setattr(const fileid_t *fileid, const setattr_t *setattr, int force);
+int md_setattr_wcc(const fileid_t *fileid, const setattr_t *setattr, int force,
+                   md_proto_t *pre, md_proto_t *post);
 int md_set_wormid(const fileid_t *fileid, uint64_t fid);
 int md_list_worm(worm_t *wormlist, uint32_t max_size, int *count, const nid_t *_peer);
 int md_chown(const fileid_t *fileid, uid_t uid, gid_t gid);
@@ -99,8 +101,20 @@ int md_dirlist(const dirid_t *dirid, uint32_t count, uint64_t offset, dirlist_t
 int md_lookupvol(const char *name, fileid_t *fileid);
 int md_initroot();
 int md_system_volid(uint64_t *id);
+
+/* lock.c */
 int md_getlock(const fileid_t *fileid, sdfs_lock_t *lock);
 int md_setlock(const fileid_t *fileid, const sdfs_lock_t *lock);
+int md_lock_remove(const fileid_t *fileid);
+
+/* inline.c */
+int md_inline_read(const md_proto_t *md, buffer_t *buf, uint32_t size,
+                   uint64_t offset);
+int md_inline_get(const fileid_t *fileid, md_proto_t *md, buffer_t *buf);
+int md_inline_write(const md_proto_t *md, const buffer_t *buf, uint32_t size,
+                    uint64_t offset);
+int md_inline_drop(const md_proto_t *md, const buffer_t *buf);
+int md_inline_truncate(const fileid_t *fileid);
 
 /*quota.c*/
 extern int md_create_quota(quota_t *quota);
@@ -108,6 +122,7 @@ extern int md_get_quota(const fileid_t *quotaid, quota_t *quota, quota_type_t qu
 extern int md_modify_quota(const fileid_t *quotaid, INOUT quota_t *quota, const uint32_t modify_mask);
 extern int md_remove_quota(const fileid_t *quotaid, const quota_t *quota);
 extern int md_update_quota(const quota_t *quota);
+extern int md_quota_add(const quota_t *quota, int64_t space, int64_t inode);
 extern int quota_remove_lvm(const fileid_t *dirid, int quota_type);
 extern int quota_should_be_remove(const fileid_t *quotaid,
                                   const fileid_t *fileid, quota_t *_quota);
@@ -130,8 +145,8 @@ int md_share_get_byname(const char *name, share_user_type_t type, shareinfo_t *s
 int md_share_get(const char *key, shareinfo_t *shareinfo);
 int md_share_set(const char *key, const shareinfo_t *shareinfo);
 /*redis.c*/
-//extern int kunlock(const fileid_t *fileid);
-//extern int klock(const fileid_t *fileid, int ttl);
+//extern int kunlock(const fileid_t *fileid, uint64_t token);
+//extern int klock(const fileid_t *fileid, int ttl, int block, uint64_t *token);
 
 /* file lock operation */
 extern int md_flock_op(const fileid_t *fileid,
@@ -0,0 +1,312 @@
+#include <sys/types.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YFSMDC
+
+#include "net_global.h"
+#include "redis.h"
+#include "md_lib.h"
+#include "md_db.h"
+#include "dbg.h"
+
+/*
+ * byte range locks
+ *
+ * the locks of a file live in their own hash "flock:<volid>/<id>" on the
+ * sharding of the file, one field per lock. the redis instance owning the
+ * file keeps the table in memory and checks and applies a lock or unlock
+ * in one script, so there is no klock around it and no rewrite of the
+ * whole table, nor a size limit on it.
+ *
+ * field: start, end (all f for "to the end"), sid and owner as 16 hex
+ * digits each, so ranges compare as strings in lua. the same owner locking
+ * the same range again replaces its lock. value: '1' for a write lock,
+ * '0' otherwise, then the sdfs_lock_t.
+ *
+ * a lock in conflict fails with EWOULDBLOCK, blocked nfs locks are queued
+ * and retried by nlm_async.c.
+ */
+
+#define MD_LOCK_PREFIX "flock"
+
+#define __LUA_ERR(__e__) __LUA_ERR1(__e__)
+#define __LUA_ERR1(__e__) "return -" #__e__ " "
+
+#define __LUA_CONFLICT__                                                \
+        "local function conflict(f, e, wr, k, v)\n"                     \
+        "  return string.sub(k, 1, 16) < e and string.sub(f, 1, 16) < string.sub(k, 18, 33)\n" \
+        "    and (wr or string.sub(v, 1, 1) == '1')\n"                  \
+        "end\n"
+
+/*
+ * KEYS: hash. ARGV: field, value.
+ */
+static const char *__md_lock_lua__ =
+        __LUA_CONFLICT__
+        "local f, v = ARGV[1], ARGV[2]\n"
+        "local e, wr = string.sub(f, 18, 33), string.sub(v, 1, 1) == '1'\n"
+        "local all = redis.call('HGETALL', KEYS[1])\n"
+        "for i = 1, #all, 2 do\n"
+        "  if all[i] ~= f and conflict(f, e, wr, all[i], all[i + 1]) then\n"
+        "    " __LUA_ERR(EWOULDBLOCK) "\n"
+        "  end\n"
+        "end\n"
+        "redis.call('HSET', KEYS[1], f, v)\n"
+        "return 0\n";
+
+/*
+ * KEYS: hash. ARGV: field.
+ */
+static const char *__md_unlock_lua__ =
+        "if redis.call('HDEL', KEYS[1], ARGV[1]) == 0 then " __LUA_ERR(ENOENT) "end\n"
+        "return 0\n";
+
+/*
+ * KEYS: hash. ARGV: field, value. the first lock in conflict, itself
+ * included.
+ */
+static const char *__md_getlock_lua__ =
+        __LUA_CONFLICT__
+        "local f, v = ARGV[1], ARGV[2]\n"
+        "local e, wr = string.sub(f, 18, 33), string.sub(v, 1, 1) == '1'\n"
+        "local all = redis.call('HGETALL', KEYS[1])\n"
+        "for i = 1, #all, 2 do\n"
+        "  if conflict(f, e, wr, all[i], all[i + 1]) then return all[i + 1] end\n"
+        "end\n"
+        __LUA_ERR(ENOENT);
+
+static const char *__md_lock_remove_lua__ =
+        "return redis.call('DEL', KEYS[1])\n";
+
+static char __md_lock_sha__[REDIS_SHA_LEN];
+static char __md_unlock_sha__[REDIS_SHA_LEN];
+static char __md_getlock_sha__[REDIS_SHA_LEN];
+static char __md_lock_remove_sha__[REDIS_SHA_LEN];
+
+typedef struct {
+        char hash[MAX_PATH_LEN];
+} md_lock_key_t;
+
+static void __md_lock_key(const fileid_t *fileid, md_lock_key_t *key)
+{
+        id2key(MD_LOCK_PREFIX, fileid, key->hash);
+}
+
+static void __md_lock_field(const sdfs_lock_t *lock, char *field)
+{
+        uint64_t end;
+
+        if (lock->length == 0 || lock->start + lock->length < lock->start)
+                end = UINT64_MAX;
+        else
+                end = lock->start + lock->length;
+
+        snprintf(field, MAX_NAME_LEN, "%016llx:%016llx:%016llx:%016llx",
+                 (LLU)lock->start, (LLU)end, (LLU)lock->sid, (LLU)lock->owner);
+}
+
+static void __md_lock_value(const sdfs_lock_t *lock, char *value)
+{
+        value[0] = lock->type == SDFS_WRLOCK ? '1' : '0';
+        memcpy(value + 1, lock, SDFS_LOCK_SIZE(lock));
+}
+
+static int __md_lock_eval(const fileid_t *fileid, const char *script, char *sha,
+                          int nkeys, const md_lock_key_t *key, int argc,
+                          const char **args, const size_t *argslen,
+                          redisReply **_reply)
+{
+        int ret, i;
+        char numkeys[MAX_NAME_LEN];
+        const char *argv[REDIS_EVAL_ARG_MAX];
+        size_t argvlen[REDIS_EVAL_ARG_MAX];
+        redisReply *reply;
+
+        YASSERT(nkeys == 1 && nkeys + argc + 1 <= REDIS_EVAL_ARG_MAX);
+
+        snprintf(numkeys, MAX_NAME_LEN, "%d", nkeys);
+
+        argv[0] = numkeys;
+        argv[1] = key->hash;
+        for (i = 0; i <= nkeys; i++) {
+                argvlen[i] = strlen(argv[i]);
+        }
+
+        for (i = 0; i < argc; i++) {
+                argv[nkeys + 1 + i] = args[i];
+                argvlen[nkeys + 1 + i] = argslen[i];
+        }
+
+        ret = keval(fileid, script, sha, nkeys + 1 + argc, argv, argvlen, &reply);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (reply->type == REDIS_REPLY_INTEGER && reply->integer < 0) {
+                ret = -reply->integer;
+                freeReplyObject(reply);
+                goto err_ret;
+        }
+
+        *_reply = reply;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int __md_lock(const fileid_t *fileid, const sdfs_lock_t *lock)
+{
+        int ret;
+        md_lock_key_t key;
+        char field[MAX_NAME_LEN], value[MAX_BUF_LEN];
+        const char *args[2];
+        size_t argslen[2];
+        redisReply *reply;
+
+        if (fileid->type != ftype_file) {
+                ret = EPERM;
+                GOTO(err_ret, ret);
+        }
+
+        if (SDFS_LOCK_SIZE(lock) >= MAX_BUF_LEN) {
+                ret = EINVAL;
+                GOTO(err_ret, ret);
+        }
+
+        __md_lock_key(fileid, &key);
+        __md_lock_field(lock, field);
+        __md_lock_value(lock, value);
+
+        args[0] = field;
+        argslen[0] = strlen(field);
+        args[1] = value;
+        argslen[1] = SDFS_LOCK_SIZE(lock) + 1;
+
+        ret = __md_lock_eval(fileid, __md_lock_lua__, __md_lock_sha__,
+                             1, &key, 2, args, argslen, &reply);
+        if (ret)
+                goto err_ret;
+
+        freeReplyObject(reply);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int __md_unlock(const fileid_t *fileid, const sdfs_lock_t *lock)
+{
+        int ret;
+        md_lock_key_t key;
+        char field[MAX_NAME_LEN];
+        const char *args[1];
+        size_t argslen[1];
+        redisReply *reply;
+
+        if (fileid->type != ftype_file) {
+                ret = EPERM;
+                GOTO(err_ret, ret);
+        }
+
+        __md_lock_key(fileid, &key);
+        __md_lock_field(lock, field);
+
+        args[0] = field;
+        argslen[0] = strlen(field);
+
+        ret = __md_lock_eval(fileid, __md_unlock_lua__, __md_unlock_sha__,
+                             1, &key, 1, args, argslen, &reply);
+        if (ret)
+                goto err_ret;
+
+        freeReplyObject(reply);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+int md_setlock(const fileid_t *fileid, const sdfs_lock_t *lock)
+{
+        if (lock->type == SDFS_UNLOCK) {
+                return __md_unlock(fileid, lock);
+        } else {
+                return __md_lock(fileid, lock);
+        }
+}
+
+int md_getlock(const fileid_t *fileid, sdfs_lock_t *lock)
+{
+        int ret;
+        md_lock_key_t key;
+        char field[MAX_NAME_LEN], value[MAX_BUF_LEN];
+        const char *args[2];
+        size_t argslen[2];
+        redisReply *reply;
+
+        if (fileid->type != ftype_file) {
+                ret = EPERM;
+                GOTO(err_ret, ret);
+        }
+
+        if (SDFS_LOCK_SIZE(lock) >= MAX_BUF_LEN) {
+                ret = EINVAL;
+                GOTO(err_ret, ret);
+        }
+
+        __md_lock_key(fileid, &key);
+        __md_lock_field(lock, field);
+        __md_lock_value(lock, value);
+
+        args[0] = field;
+        argslen[0] = strlen(field);
+        args[1] = value;
+        argslen[1] = SDFS_LOCK_SIZE(lock) + 1;
+
+        ret = __md_lock_eval(fileid, __md_getlock_lua__, __md_getlock_sha__,
+                             1, &key, 2, args, argslen, &reply);
+        if (ret)
+                goto err_ret;
+
+        if (reply->type != REDIS_REPLY_STRING || reply->len < 1 + (int)sizeof(*lock)
+            || reply->len > MAX_BUF_LEN) {
+                ret = EIO;
+                GOTO(err_free, ret);
+        }
+
+        memcpy(lock, reply->str + 1, reply->len - 1);
+        YASSERT(SDFS_LOCK_SIZE(lock) == (size_t)reply->len - 1);
+
+        freeReplyObject(reply);
+
+        return 0;
+err_free:
+        freeReplyObject(reply);
+err_ret:
+        return ret;
+}
+
+/**
+ * drop every lock of a removed file
+ */
+int md_lock_remove(const fileid_t *fileid)
+{
+        int ret;
+        md_lock_key_t key;
+        redisReply *reply;
+
+        __md_lock_key(fileid, &key);
+
+        ret = __md_lock_eval(fileid, __md_lock_remove_lua__, __md_lock_remove_sha__,
+                             1, &key, 0, NULL, NULL, &reply);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        freeReplyObject(reply);
+
+        return 0;
+err_ret:
+        return ret;
+}
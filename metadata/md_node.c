@@ -101,7 +101,7 @@ int md_chmod(const fileid_t *fileid, mode_t mode)
         setattr_t setattr;
 
         setattr_init(&setattr, mode & MODE_MAX, -1, NULL, -1, -1, -1);
-        ret = inodeop->setattr(fileid, &setattr, 1);
+        ret = inodeop->setattr(fileid, &setattr, 1, NULL, NULL);
         if (ret)
                 GOTO(err_ret, ret);
         
@@ -111,12 +111,32 @@ err_ret:
 }
 
 int md_setattr(const fileid_t *fileid, const setattr_t *setattr, int force)
+{
+        return md_setattr_wcc(fileid, setattr, force, NULL, NULL);
+}
+
+/* pre and post get the md before and after, MAX_BUF_LEN each */
+int md_setattr_wcc(const fileid_t *fileid, const setattr_t *setattr, int force,
+                   md_proto_t *pre, md_proto_t *post)
 {
         int ret;
 
-        ret = inodeop->setattr(fileid, setattr, force);
+        /* a size change cuts inline data to at_size, see md_inline.c */
+        if (setattr->size.set_it) {
+                ret = md_inline_truncate(fileid);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
+        ret = inodeop->setattr(fileid, setattr, force, pre, post);
         if (ret)
                 GOTO(err_ret, ret);
+
+        if (setattr->size.set_it) {
+                ret = md_inline_truncate(fileid);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
         
         return 0;
 err_ret:
@@ -135,7 +155,7 @@ int md_utime(const fileid_t *fileid, const struct timespec *atime,
                             __SET_TO_CLIENT_TIME, mtime,
                             __SET_TO_CLIENT_TIME, ctime);
 
-        ret = inodeop->setattr(fileid, &setattr, 1);
+        ret = inodeop->setattr(fileid, &setattr, 1, NULL, NULL);
         if (ret)
                 GOTO(err_ret, ret);
 
@@ -153,7 +173,7 @@ int md_set_wormid(const fileid_t *fileid, uint64_t wormid)
         setattr.wormid.set_it = 1;
         setattr.wormid.val = wormid;
 
-        ret = inodeop->setattr(fileid, &setattr, 1);
+        ret = inodeop->setattr(fileid, &setattr, 1, NULL, NULL);
         if (ret)
                 GOTO(err_ret, ret);
                 
@@ -169,7 +189,7 @@ int md_chown(const fileid_t *fileid, uid_t uid, gid_t gid)
 
         setattr_init(&setattr, -1, -1, NULL, uid, gid, -1);
 
-        ret = inodeop->setattr(fileid, &setattr, 1);
+        ret = inodeop->setattr(fileid, &setattr, 1, NULL, NULL);
         if (ret)
                 GOTO(err_ret, ret);
 
@@ -189,7 +209,7 @@ int md_set_quotaid(const fileid_t *fileid, const fileid_t *quotaid)
 
         //DINFO("set quotaid:\n", (LLU)quotaid);
 
-        ret = inodeop->setattr(fileid, &setattr, 1);
+        ret = inodeop->setattr(fileid, &setattr, 1, NULL, NULL);
         if (ret)
                 GOTO(err_ret, ret);
                 
@@ -201,10 +221,11 @@ err_ret:
 int md_rename(const fileid_t *fparent,
               const char *fname, const fileid_t *tparent, const char *tname)
 {
-        int ret;
+        int ret, retry = 0;
         fileid_t fileid;
         uint32_t type;
 
+retry:
         ret = dirop->lookup(fparent, fname, &fileid, &type);
         if (ret)
                 GOTO(err_ret, ret);
@@ -213,6 +234,20 @@ int md_rename(const fileid_t *fparent,
                 ret = EPERM;
                 GOTO(err_ret, ret);
         }
+
+        if (gloconf.md_atomic) {
+                ret = dirop->rename(fparent, fname, tparent, tname, &fileid);
+                if (ret == 0)
+                        return 0;
+
+                if (ret == EAGAIN) {
+                        USLEEP_RETRY(err_ret, ret, retry, retry, 10, (10 * 1000));
+                }
+
+                /* EXDEV: across shardings or split directories, two steps */
+                if (ret != EXDEV)
+                        GOTO(err_ret, ret);
+        }
         
         ret = dirop->newrec(tparent, tname, &fileid, type, O_EXCL);
         if (ret)
@@ -15,6 +15,13 @@ static kvop_t *kvop = &__kvop__;
 
 #if QUOTA_NEW
 
+/*
+ * usage is kept apart from the quota record as two redis counters, so
+ * clients add their deltas with INCRBY and never rewrite the record.
+ * space_used/inode_used in the record is only a base.
+ */
+#define QUOTA_SPACE_COUNTER "space"
+#define QUOTA_INODE_COUNTER "inode"
 
 static int __md_quota_key(const fileid_t *quotaid, const quota_t *quota, fileid_t *_key, int flag)
 {
@@ -74,6 +81,48 @@ err_ret:
         return ret;
 }
 
+static uint64_t __md_quota_used(uint64_t base, int64_t counter)
+{
+        if (counter < 0 && (uint64_t)-counter > base)
+                return 0;
+
+        return base + counter;
+}
+
+static int __md_quota_counter(const fileid_t *fileid, int64_t *space, int64_t *inode)
+{
+        int ret;
+
+        ret = kincr(fileid, QUOTA_SPACE_COUNTER, 0, space);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        ret = kincr(fileid, QUOTA_INODE_COUNTER, 0, inode);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int __md_quota_load(const fileid_t *fileid, quota_t *quota)
+{
+        int ret;
+        int64_t space, inode;
+
+        ret = __md_quota_counter(fileid, &space, &inode);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        quota->space_used = __md_quota_used(quota->space_used, space);
+        quota->inode_used = __md_quota_used(quota->inode_used, inode);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
 #else
 
 static void __build_quota_key(const fileid_t *quotaid, const quota_t *quota,
@@ -193,6 +242,10 @@ static int __get_quota(const fileid_t *quotaid,
         ret = kget(&fileid, quota, &size);
         if (ret)
                 GOTO(err_ret, ret);
+
+        ret = __md_quota_load(&fileid, quota);
+        if (ret)
+                GOTO(err_ret, ret);
 #else        
         
         uint32_t keylen = 0;
@@ -261,6 +314,9 @@ int md_modify_quota(const fileid_t *quotaid,
         if (unlikely(ret))
                 GOTO(err_ret, ret);
 
+        ret = __md_quota_load(&fileid, &tmp_quota);
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
         
         memcpy(quota, &tmp_quota, sizeof(quota_t));
 #else
@@ -297,22 +353,34 @@ int md_update_quota(const quota_t *quota)
         int ret;
 #if QUOTA_NEW
         fileid_t fileid;
+        quota_t tmp;
+        int64_t space, inode;
         
         ret = __md_quota_key(&quota->quotaid, quota, &fileid, 0);
         if(ret)
                 GOTO(err_ret, ret);
+
+        /* store the base so that base + counter is the used given */
+        ret = __md_quota_counter(&fileid, &space, &inode);
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
+        tmp = *quota;
+        tmp.space_used = __md_quota_used(quota->space_used, -space);
+        tmp.inode_used = __md_quota_used(quota->inode_used, -inode);
         
-        ret = kset(&fileid, quota, sizeof(*quota), 0);
+        ret = kset(&fileid, &tmp, sizeof(tmp), 0);
         if (unlikely(ret))
                 GOTO(err_ret, ret);
 #else
         uint32_t keylen = 0;
+        uint64_t token;
         char key[MAX_NAME_LEN] = {0};
 
 
         __build_quota_key(&quota->quotaid, quota, key, &keylen);
 
-        ret = klock(&quota->dirid, 10, 1);
+        ret = klock(&quota->dirid, 10, 1, &token);
         if (ret)
                 GOTO(err_ret, ret);
         
@@ -321,7 +389,7 @@ int md_update_quota(const quota_t *quota)
         if (ret)
                 GOTO(err_lock, ret);
 
-        ret = kunlock(&quota->dirid);
+        ret = kunlock(&quota->dirid, token);
         if (ret)
                 GOTO(err_ret, ret);
 #endif
@@ -329,12 +397,43 @@ int md_update_quota(const quota_t *quota)
         return 0;
 #if !QUOTA_NEW
 err_lock:
-        kunlock(&quota->dirid);
+        kunlock(&quota->dirid, token);
 #endif
 err_ret:
         return ret;
 }
 
+#if QUOTA_NEW
+/**
+ * add usage deltas to a quota without read-modify-write of the record
+ */
+int md_quota_add(const quota_t *quota, int64_t space, int64_t inode)
+{
+        int ret;
+        fileid_t fileid;
+
+        ret = __md_quota_key(&quota->quotaid, quota, &fileid, 0);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        if (space) {
+                ret = kincr(&fileid, QUOTA_SPACE_COUNTER, space, NULL);
+                if (unlikely(ret))
+                        GOTO(err_ret, ret);
+        }
+
+        if (inode) {
+                ret = kincr(&fileid, QUOTA_INODE_COUNTER, inode, NULL);
+                if (unlikely(ret))
+                        GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+#endif
+
 int quota_should_be_remove(const fileid_t *quotaid,
                 const fileid_t *fileid, quota_t *_quota)
 {
@@ -377,7 +476,9 @@ static int __quota_remove(const fileid_t *quotaid, const quota_t *quota)
         ret = kdel(&fileid);
         if(ret)
                 GOTO(err_ret, ret);
-        
+
+        kincr_del(&fileid, QUOTA_SPACE_COUNTER);
+        kincr_del(&fileid, QUOTA_INODE_COUNTER);
 #else
         uint32_t keylen = 0;
         char key[MAX_NAME_LEN];
@@ -81,8 +81,9 @@ err_ret:
 int md_share_set(const char *key, const shareinfo_t *shareinfo)
 {
         int ret;
+        uint64_t token;
 
-        ret = kvop->lock(roottype_share);
+        ret = kvop->lock(roottype_share, &token);
         if (ret)
                 GOTO(err_ret, ret);
         
@@ -90,13 +91,13 @@ int md_share_set(const char *key, const shareinfo_t *shareinfo)
         if (ret)
                 GOTO(err_lock, ret);
 
-        ret = kvop->unlock(roottype_share);
+        ret = kvop->unlock(roottype_share, token);
         if (ret)
                 GOTO(err_ret, ret);
         
         return 0;
 err_lock:
-        kvop->unlock(roottype_share);
+        kvop->unlock(roottype_share, token);
 err_ret:
         return ret;
 }
@@ -132,8 +133,9 @@ err_ret:
 int md_share_remove(const char *key, share_protocol_t prot, share_user_type_t type)
 {
         int ret;
+        uint64_t token;
 
-        ret = kvop->lock(roottype_share);
+        ret = kvop->lock(roottype_share, &token);
         if (ret)
                 GOTO(err_ret, ret);
         
@@ -141,13 +143,13 @@ int md_share_remove(const char *key, share_protocol_t prot, share_user_type_t ty
         if (ret)
                 GOTO(err_lock, ret);
 
-        ret = kvop->unlock(roottype_share);
+        ret = kvop->unlock(roottype_share, token);
         if (ret)
                 GOTO(err_ret, ret);
         
         return 0;
 err_lock:
-        kvop->unlock(roottype_share);
+        kvop->unlock(roottype_share, token);
 err_ret:
         return ret;
 }
@@ -15,11 +15,19 @@ extern int quota_chown(const fileid_t *fileid, uid_t new_uid, gid_t new_gid);
 extern void quota_removeall(const fileid_t *dirid, const fileid_t *quotaid);
 #endif
 
+extern void volid2lvmid(uint64_t volid, fileid_t *dirid);
 extern int quota_check_dec(const fileid_t *fileid);
+extern int quota_unlink_dec(const md_proto_t *md);
 extern int quota_inode_increase(const fileid_t *fileid, const setattr_t *setattr);
 extern int quota_inode_decrease(const fileid_t *fileid, const setattr_t *setattr);
 extern int quota_space_increase(const fileid_t *fileid, uid_t uid, gid_t gid, uint64_t space);
 extern int quota_space_decrease(const fileid_t *fileid, uid_t uid, gid_t gid, uint64_t space);
 
+/* quota_cache.c */
+extern int quota_cache_init();
+extern int quota_cache_flush();
+extern int quota_cache_space(const fileid_t *dirid, uid_t uid, gid_t gid, int64_t space);
+extern int quota_cache_inode(const fileid_t *dirid, uid_t uid, gid_t gid, int64_t inode);
+
 
 #endif
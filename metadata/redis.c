@@ -11,6 +11,7 @@
 #include "net_global.h"
 #include "dbg.h"
 #include "adt.h"
+#include "sdfs_list.h"
 #include "cJSON.h"
 #include "network.h"
 #include "sdfs_lib.h"
@@ -46,7 +47,7 @@ static int __hget__(const fileid_t *fileid, const char *name, char *value, size_
         id2key(ftype(fileid), fileid, key);
 
 retry:
-        ret = redis_conn_get(fileid->volid, fileid->sharding, &handler);
+        ret = redis_conn_get_ro(fileid->volid, fileid->sharding, &handler);
         if(ret)
                 GOTO(err_ret, ret);
         
@@ -176,7 +177,7 @@ static int __hlen__(const fileid_t *fileid, uint64_t *count)
         id2key(ftype(fileid), fileid, key);
 
 retry:
-        ret = redis_conn_get(fileid->volid, fileid->sharding, &handler);
+        ret = redis_conn_get_ro(fileid->volid, fileid->sharding, &handler);
         if(ret)
                 GOTO(err_ret, ret);
         
@@ -232,7 +233,8 @@ redisReply *__hscan__(const fileid_t *fileid, const char *match, uint64_t cursor
         id2key(ftype(fileid), fileid, key);
 
 retry:
-        ret = redis_conn_get(fileid->volid, fileid->sharding, &handler);
+        /* a cursor is only valid on the instance that issued it, stay on the primary */
+        ret = redis_conn_get_master(fileid->volid, fileid->sharding, &handler);
         if(ret)
                 GOTO(err_ret, ret);
         
@@ -279,6 +281,61 @@ redisReply *hscan(const fileid_t *fileid, const char *match, uint64_t cursor, ui
         }
 }
 
+static redisReply *__hmget__(const fileid_t *fileid, int count, const char **names)
+{
+        int ret, retry = 0;
+        char key[MAX_PATH_LEN];
+        redis_handler_t handler;
+        redisReply *reply;
+
+        id2key(ftype(fileid), fileid, key);
+
+retry:
+        ret = redis_conn_get_ro(fileid->volid, fileid->sharding, &handler);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        reply = redis_hmget(handler.conn, key, count, names);
+        if (reply == NULL) {
+                redis_conn_close(&handler);
+                redis_conn_release(&handler);
+                USLEEP_RETRY(err_ret, ret, retry, retry, 100, (100 * 1000));
+        }
+
+        redis_conn_release(&handler);
+
+        return reply;
+err_ret:
+        return NULL;
+}
+
+static int __hmget(va_list ap)
+{
+        const fileid_t *fileid = va_arg(ap, const fileid_t *);
+        int count = va_arg(ap, int);
+        const char **names = va_arg(ap, const char **);
+        redisReply **_redisReply = va_arg(ap, redisReply **);
+
+        va_end(ap);
+
+        *_redisReply = __hmget__(fileid, count, names);
+        return 0;
+}
+
+redisReply *hmget(const fileid_t *fileid, int count, const char **names)
+{
+        if (likely(schedule_running() && ASYNC)) {
+                redisReply *reply;
+                schedule_newthread(SCHE_THREAD_REDIS, ++__seq__, FALSE,
+                                   "hmget", -1, __hmget,
+                                   fileid, count, names, &reply);
+
+                return reply;
+        } else {
+                return __hmget__(fileid, count, names);
+        }
+}
+
 
 static int __hdel__(const fileid_t *fileid, const char *name)
 {
@@ -504,20 +561,27 @@ int kdel(const fileid_t *fileid)
         }
 }
 
-static int __klock1(const fileid_t *fileid, int ttl)
+static int __kincr__(const fileid_t *fileid, const char *name, int64_t incr, int64_t *result)
 {
         int ret, retry = 0;
+        char key[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
         redis_handler_t handler;
-        char key[MAX_PATH_LEN], value[MAX_BUF_LEN];
+
+        id2key(ftype(fileid), fileid, tmp);
+        snprintf(key, MAX_PATH_LEN, "%s:%s", tmp, name);
 
 retry:
         ret = redis_conn_get(fileid->volid, fileid->sharding, &handler);
         if(ret)
                 GOTO(err_ret, ret);
 
-        snprintf(key, MAX_NAME_LEN, "lock:"CHKID_FORMAT, CHKID_ARG(fileid));
-        snprintf(value, MAX_NAME_LEN, "%u", ng.local_nid.id);
-        ret = redis_kset(handler.conn, key, value, strlen(value) + 1, O_EXCL, ttl);
+        if (incr == INT64_MIN) {
+                ret = redis_kdel(handler.conn, key);
+                if (ret == ENOENT)
+                        ret = 0;
+        } else {
+                ret = redis_incrby(handler.conn, key, incr, result);
+        }
         if(ret) {
                 if (ret == ECONNRESET) {
                         redis_conn_close(&handler);
@@ -529,7 +593,7 @@ retry:
         }
 
         redis_conn_release(&handler);
-        
+
         return 0;
 err_release:
         redis_conn_release(&handler);
@@ -537,87 +601,422 @@ err_ret:
         return ret;
 }
 
-static int __klock__(const fileid_t *fileid, int ttl, int block)
+static int __kincr(va_list ap)
+{
+        const fileid_t *fileid = va_arg(ap, const fileid_t *);
+        const char *name = va_arg(ap, const char *);
+        int64_t incr = va_arg(ap, int64_t);
+        int64_t *result = va_arg(ap, int64_t *);
+
+        va_end(ap);
+
+        return __kincr__(fileid, name, incr, result);
+}
+
+/**
+ * atomic counter @name attached to fileid, incr 0 reads it
+ */
+int kincr(const fileid_t *fileid, const char *name, int64_t incr, int64_t *result)
+{
+        YASSERT(incr != INT64_MIN);
+
+        if (likely(schedule_running() && ASYNC)) {
+                return schedule_newthread(SCHE_THREAD_REDIS, ++__seq__, FALSE,
+                                          "kincr", -1, __kincr,
+                                          fileid, name, incr, result);
+        } else {
+                return __kincr__(fileid, name, incr, result);
+        }
+}
+
+int kincr_del(const fileid_t *fileid, const char *name)
+{
+        if (likely(schedule_running() && ASYNC)) {
+                return schedule_newthread(SCHE_THREAD_REDIS, ++__seq__, FALSE,
+                                          "kincr_del", -1, __kincr,
+                                          fileid, name, INT64_MIN, NULL);
+        } else {
+                return __kincr__(fileid, name, INT64_MIN, NULL);
+        }
+}
+
+static int __keval__(const fileid_t *fileid, const char *script, char *sha,
+                     int argc, const char **argv, const size_t *argvlen,
+                     redisReply **reply)
 {
         int ret, retry = 0;
+        redis_handler_t handler;
 
 retry:
-        ret = __klock1(fileid, ttl);
+        ret = redis_conn_get(fileid->volid, fileid->sharding, &handler);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        ret = redis_eval(handler.conn, script, sha, argc, argv, argvlen, reply);
         if(ret) {
-                if (ret == EEXIST && block) {
-                        if (retry > 500 && retry % 100 == 0 ) {
-                                DWARN("lock "CHKID_FORMAT", retry %u\n", CHKID_ARG(fileid), retry);
-                        }
-                        USLEEP_RETRY(err_ret, ret, retry, retry, 1000, (1 * 1000));
-                } else {
-                        GOTO(err_ret, ret);
+                if (ret == ECONNRESET) {
+                        redis_conn_close(&handler);
+                        redis_conn_release(&handler);
+                        USLEEP_RETRY(err_ret, ret, retry, retry, 100, (100 * 1000));
                 }
+
+                GOTO(err_release, ret);
         }
 
+        redis_conn_release(&handler);
+
         return 0;
+err_release:
+        redis_conn_release(&handler);
 err_ret:
-        ret = ret == EEXIST ? EAGAIN : ret;
         return ret;
 }
 
-inline static int __klock(va_list ap)
+static int __keval(va_list ap)
 {
         const fileid_t *fileid = va_arg(ap, const fileid_t *);
-        int ttl = va_arg(ap, int);
-        int block = va_arg(ap, int);
+        const char *script = va_arg(ap, const char *);
+        char *sha = va_arg(ap, char *);
+        int argc = va_arg(ap, int);
+        const char **argv = va_arg(ap, const char **);
+        const size_t *argvlen = va_arg(ap, const size_t *);
+        redisReply **reply = va_arg(ap, redisReply **);
 
         va_end(ap);
 
-        return __klock__(fileid, ttl, block);
+        return __keval__(fileid, script, sha, argc, argv, argvlen, reply);
 }
 
-int klock(const fileid_t *fileid, int ttl, int block)
+/**
+ * run a lua script on the sharding of fileid, every key in argv must live
+ * there. the caller frees the reply.
+ */
+int keval(const fileid_t *fileid, const char *script, char *sha,
+          int argc, const char **argv, const size_t *argvlen, redisReply **reply)
 {
-#if ENABLE_KLOCK
         if (likely(schedule_running() && ASYNC)) {
                 return schedule_newthread(SCHE_THREAD_REDIS, ++__seq__, FALSE,
-                                          "klock", -1, __klock,
-                                          fileid, ttl, block);
+                                          "keval", -1, __keval,
+                                          fileid, script, sha, argc, argv,
+                                          argvlen, reply);
         } else {
-                return __klock__(fileid, ttl, block);
+                return __keval__(fileid, script, sha, argc, argv, argvlen, reply);
         }
-#else
-        (void) fileid;
-        (void) ttl;
-        (void) block;
+}
+
+/*
+ * klock
+ *
+ * "lock:<id>" holds the fencing token of the holder, drawn from the
+ * counter "lock:<id>:seq", so a holder that outlived its ttl can not
+ * release the lock of the next one. a blocked caller counts itself in
+ * "lock:<id>:w" and sleeps on the list "lock:<id>:q" with BLPOP, kunlock
+ * pushes one wake up there when somebody waits. redis serves BLPOP
+ * callers in arrival order, and while a wake up is pending only woken
+ * callers may take the lock, so waiters are granted roughly FIFO. a dead
+ * holder is noticed when its ttl runs out, waiters re-check every
+ * KLOCK_WAIT seconds.
+ *
+ * klock hands the token to the caller, who passes it back to kunlock, so
+ * holders of the same lock in one process can not release each other.
+ */
+
+#define __LUA_ERR(__e__) __LUA_ERR1(__e__)
+#define __LUA_ERR1(__e__) "return -" #__e__ " "
+
+#define KLOCK_WAIT 1            /* seconds per BLPOP, below the socket timeout */
+
+/*
+ * KEYS: lock, seq, waiters, wake list. ARGV: ttl, waited, block. returns
+ * the token, 0 if busy, the caller then counts as waiter if block.
+ */
+static const char *__klock_lua__ =
+        "local ttl, waited = tonumber(ARGV[1]), ARGV[2] == '1'\n"
+        "if waited and tonumber(redis.call('GET', KEYS[3]) or '0') > 0 then\n"
+        "  redis.call('DECR', KEYS[3])\n"
+        "end\n"
+        "if redis.call('EXISTS', KEYS[1]) == 0\n"
+        "   and (waited or redis.call('LLEN', KEYS[4]) == 0) then\n"
+        "  local t = redis.call('INCR', KEYS[2])\n"
+        "  redis.call('SET', KEYS[1], t, 'EX', ttl)\n"
+        "  return t\n"
+        "end\n"
+        "if ARGV[3] == '1' then\n"
+        "  redis.call('INCR', KEYS[3])\n"
+        "  redis.call('EXPIRE', KEYS[3], ttl * 2)\n"
+        "end\n"
+        "return 0\n";
+
+/*
+ * KEYS: lock, waiters, wake list. ARGV: token. ENOENT if the lock expired
+ * or went to another holder. the wake up lives as long as the waiters.
+ */
+static const char *__kunlock_lua__ =
+        "if redis.call('GET', KEYS[1]) ~= ARGV[1] then " __LUA_ERR(ENOENT) "end\n"
+        "redis.call('DEL', KEYS[1])\n"
+        "if tonumber(redis.call('GET', KEYS[2]) or '0') > 0 then\n"
+        "  local e = redis.call('TTL', KEYS[2])\n"
+        "  redis.call('RPUSH', KEYS[3], '1')\n"
+        "  redis.call('EXPIRE', KEYS[3], e > 0 and e or 1)\n"
+        "end\n"
+        "return 0\n";
+
+/*
+ * KEYS: waiters. a blocked caller that gives up stops counting itself
+ */
+static const char *__kunwait_lua__ =
+        "if tonumber(redis.call('GET', KEYS[1]) or '0') > 0 then\n"
+        "  redis.call('DECR', KEYS[1])\n"
+        "end\n"
+        "return 0\n";
+
+static char __klock_sha__[REDIS_SHA_LEN];
+static char __kunlock_sha__[REDIS_SHA_LEN];
+static char __kunwait_sha__[REDIS_SHA_LEN];
+
+static void __klock_key(const fileid_t *fileid, const char *suffix, char *key)
+{
+        snprintf(key, MAX_NAME_LEN, "lock:"CHKID_FORMAT"%s", CHKID_ARG(fileid), suffix);
+}
+
+/* the key a klock of fileid is held in, for scripts that must respect it */
+void klock_key(const fileid_t *fileid, char *key)
+{
+        __klock_key(fileid, "", key);
+}
+
+static int __klock_eval(const fileid_t *fileid, const char *script, char *sha,
+                        int argc, const char **argv, long long *result)
+{
+        int ret, i;
+        const char *_argv[REDIS_EVAL_ARG_MAX];
+        size_t argvlen[REDIS_EVAL_ARG_MAX];
+        redisReply *reply;
+
+        for (i = 0; i < argc; i++) {
+                _argv[i] = argv[i];
+                argvlen[i] = strlen(argv[i]);
+        }
+
+        ret = __keval__(fileid, script, sha, argc, _argv, argvlen, &reply);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (reply->type != REDIS_REPLY_INTEGER) {
+                ret = EIO;
+                freeReplyObject(reply);
+                GOTO(err_ret, ret);
+        }
+
+        if (reply->integer < 0) {
+                ret = -reply->integer;
+                freeReplyObject(reply);
+                goto err_ret;
+        }
+
+        *result = reply->integer;
+        freeReplyObject(reply);
+
         return 0;
-#endif
+err_ret:
+        return ret;
+}
+
+static int __klock1(const fileid_t *fileid, int ttl, int waited, int block,
+                    uint64_t *token)
+{
+        int ret;
+        long long res;
+        char lock[MAX_NAME_LEN], seq[MAX_NAME_LEN], w[MAX_NAME_LEN], q[MAX_NAME_LEN];
+        char _ttl[MAX_NAME_LEN];
+        const char *argv[8];
+
+        __klock_key(fileid, "", lock);
+        __klock_key(fileid, ":seq", seq);
+        __klock_key(fileid, ":w", w);
+        __klock_key(fileid, ":q", q);
+        snprintf(_ttl, MAX_NAME_LEN, "%d", ttl);
+
+        argv[0] = "4";
+        argv[1] = lock;
+        argv[2] = seq;
+        argv[3] = w;
+        argv[4] = q;
+        argv[5] = _ttl;
+        argv[6] = waited ? "1" : "0";
+        argv[7] = block ? "1" : "0";
+
+        ret = __klock_eval(fileid, __klock_lua__, __klock_sha__, 8, argv, &res);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (res == 0) {
+                ret = EEXIST;
+                goto err_ret;
+        }
+
+        *token = res;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static void __kunwait(const fileid_t *fileid)
+{
+        int ret;
+        long long res;
+        char w[MAX_NAME_LEN];
+        const char *argv[2];
+
+        __klock_key(fileid, ":w", w);
+
+        argv[0] = "1";
+        argv[1] = w;
+
+        ret = __klock_eval(fileid, __kunwait_lua__, __kunwait_sha__, 2, argv, &res);
+        if (ret) {
+                /* the counter expires with the ttl */
+                DWARN("lock "CHKID_FORMAT" unwait fail, ret %d\n",
+                      CHKID_ARG(fileid), ret);
+        }
 }
 
-static int __kunlock__(const fileid_t *fileid)
+static int __kwait__(const fileid_t *fileid, const char *key, int timeout)
 {
         int ret, retry = 0;
         redis_handler_t handler;
-        char key[MAX_PATH_LEN];
 
 retry:
-        ret = redis_conn_get(fileid->volid, fileid->sharding, &handler);
+        /* BLPOP holds the connection, take one outside the pool */
+        ret = redis_conn_get_block(fileid->volid, fileid->sharding, &handler);
         if(ret)
                 GOTO(err_ret, ret);
 
-        snprintf(key, MAX_NAME_LEN, "lock:"CHKID_FORMAT, CHKID_ARG(fileid));
-        ret = redis_del(handler.conn, key);
+        ret = redis_blpop(handler.conn, key, timeout);
         if(ret) {
                 if (ret == ECONNRESET) {
-                        redis_conn_close(&handler);
-                        redis_conn_release(&handler);
+                        redis_conn_release_block(&handler, 1);
                         USLEEP_RETRY(err_ret, ret, retry, retry, 100, (100 * 1000));
+                } else if (ret == ETIMEDOUT) {
+                        redis_conn_release_block(&handler, 0);
+                        return 0;
                 }
-                
+
                 GOTO(err_release, ret);
         }
 
-        redis_conn_release(&handler);
-        
+        redis_conn_release_block(&handler, 0);
+
         return 0;
 err_release:
-        redis_conn_release(&handler);
-err_ret: 
+        redis_conn_release_block(&handler, 1);
+err_ret:
+        return ret;
+}
+
+static int __klock__(const fileid_t *fileid, int ttl, int block, uint64_t *token)
+{
+        int ret, waited = 0;
+        char key[MAX_NAME_LEN];
+
+        while (1) {
+                ret = __klock1(fileid, ttl, waited, block, token);
+                if (ret == 0)
+                        break;
+
+                if (ret != EEXIST || !block)
+                        GOTO(err_ret, ret);
+
+                /* a full queue of holders may take longer than one ttl */
+                if (waited > ttl * 2) {
+                        DWARN("lock "CHKID_FORMAT", waited %u\n",
+                              CHKID_ARG(fileid), waited);
+                        ret = __klock1(fileid, ttl, 1, 0, token);
+                        if (ret)
+                                GOTO(err_ret, ret);
+
+                        break;
+                }
+
+                __klock_key(fileid, ":q", key);
+                ret = __kwait__(fileid, key, KLOCK_WAIT);
+                if (ret) {
+                        __kunwait(fileid);
+                        GOTO(err_ret, ret);
+                }
+
+                waited++;
+        }
+
+        return 0;
+err_ret:
+        ret = ret == EEXIST ? EAGAIN : ret;
+        return ret;
+}
+
+inline static int __klock(va_list ap)
+{
+        const fileid_t *fileid = va_arg(ap, const fileid_t *);
+        int ttl = va_arg(ap, int);
+        int block = va_arg(ap, int);
+        uint64_t *token = va_arg(ap, uint64_t *);
+
+        va_end(ap);
+
+        return __klock__(fileid, ttl, block, token);
+}
+
+int klock(const fileid_t *fileid, int ttl, int block, uint64_t *token)
+{
+#if ENABLE_KLOCK
+        if (likely(schedule_running() && ASYNC)) {
+                return schedule_newthread(SCHE_THREAD_REDIS, ++__seq__, FALSE,
+                                          "klock", -1, __klock,
+                                          fileid, ttl, block, token);
+        } else {
+                return __klock__(fileid, ttl, block, token);
+        }
+#else
+        (void) fileid;
+        (void) ttl;
+        (void) block;
+        *token = 0;
+        return 0;
+#endif
+}
+
+static int __kunlock__(const fileid_t *fileid, uint64_t token)
+{
+        int ret;
+        long long res;
+        char lock[MAX_NAME_LEN], w[MAX_NAME_LEN], q[MAX_NAME_LEN];
+        char _token[MAX_NAME_LEN];
+        const char *argv[5];
+
+        __klock_key(fileid, "", lock);
+        __klock_key(fileid, ":w", w);
+        __klock_key(fileid, ":q", q);
+        snprintf(_token, MAX_NAME_LEN, "%llu", (LLU)token);
+
+        argv[0] = "3";
+        argv[1] = lock;
+        argv[2] = w;
+        argv[3] = q;
+        argv[4] = _token;
+
+        ret = __klock_eval(fileid, __kunlock_lua__, __kunlock_sha__, 5, argv, &res);
+        if (ret) {
+                if (ret == ENOENT) {
+                        DWARN("lock "CHKID_FORMAT" token %llu lost\n",
+                              CHKID_ARG(fileid), (LLU)token);
+                }
+
+                goto err_ret;
+        }
+
+        return 0;
+err_ret:
         ret = ret == ENOENT ? EAGAIN : ret;
         return ret;
 }
@@ -625,25 +1024,27 @@ err_ret:
 inline static int __kunlock(va_list ap)
 {
         const fileid_t *fileid = va_arg(ap, const fileid_t *);
+        uint64_t token = va_arg(ap, uint64_t);
 
         va_end(ap);
 
-        return __kunlock__(fileid);
+        return __kunlock__(fileid, token);
 }
 
 
-int kunlock(const fileid_t *fileid)
+int kunlock(const fileid_t *fileid, uint64_t token)
 {
 #if ENABLE_KLOCK
         if (likely(schedule_running() && ASYNC)) {
                 return schedule_newthread(SCHE_THREAD_REDIS, ++__seq__, FALSE,
                                           "kunlock", -1, __kunlock,
-                                          fileid);
+                                          fileid, token);
         } else {
-                return __kunlock__(fileid);
+                return __kunlock__(fileid, token);
         }
 #else
         (void) fileid;
+        (void) token;
         return 0;
 #endif
 }
@@ -657,7 +1058,7 @@ static int __hiter__(const fileid_t *fileid, const char *match, func2_t func, vo
         id2key(ftype(fileid), fileid, key);
 
 retry:
-        ret = redis_conn_get(fileid->volid, fileid->sharding, &handler);
+        ret = redis_conn_get_ro(fileid->volid, fileid->sharding, &handler);
         if(ret)
                 GOTO(err_ret, ret);
 
@@ -21,18 +21,75 @@ typedef struct{
         redis_conn_t *conn;
 } __conn_t;
 
+/*
+ * every redis call runs in a SCHE_THREAD_REDIS pthread, so idle
+ * connections are kept in a stack and a waiter sleeps on cond until
+ * release hands it one, no timed polling.
+ */
 typedef struct{
-        sy_rwlock_t lock;
-        int sequence;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
         int count;
+        int waiting;
+        int idle;
+        int *stack;
         __conn_t *conn;
+        char replica[MAX_NAME_LEN];     /* "host port" if this pool is a replica */
+
+        /* checkout stat */
+        uint64_t get;
+        uint64_t wait;
+        uint64_t wait_used;
+        uint64_t wait_max;
+        time_t last_stat;
 } __conn_sharding_t;
 
+#define REDIS_CONN_STAT_INTERVAL 60
+
+/*
+ * read-only ops may be served by a replica of the shard. times are in ms:
+ * every write finished on the primary before synced is known to be on the
+ * replica (its offset passed the primary offset sampled at synced). reads
+ * go to the replica only if this process has not written the shard since
+ * synced (read-your-writes, klock is a write on the same shard so locked
+ * read-modify-write sees the previous holder), and synced is not older
+ * than redis_replica_lag (bounded staleness). read-your-writes holds per
+ * process, not per handle: any write of the process holds back the reads
+ * of all its callers, writes of other processes are only bounded by the
+ * lag. the offsets are sampled by
+ * a thread per volume every redis_replica_lag/2, readers only look at
+ * what it left.
+ */
+typedef struct {
+        pthread_mutex_t lock;
+        int ready;
+        uint64_t last_write;
+        uint64_t synced;
+        uint64_t offset;        /* primary offset sampled at offset_time */
+        uint64_t offset_time;
+        __conn_sharding_t pool;
+} __conn_replica_t;
+
+/*
+ * a blocking call (BLPOP) holds its connection up to its timeout, so it
+ * gets a connection of its own outside the pool and never keeps others
+ * from the sharding. up to REDIS_CONN_BLOCK_IDLE idle ones are kept.
+ */
+#define REDIS_CONN_BLOCK_IDLE 8
+
+typedef struct {
+        pthread_mutex_t lock;
+        int idle;
+        redis_conn_t *stack[REDIS_CONN_BLOCK_IDLE];
+} __conn_block_t;
+
 typedef struct {
         sy_rwlock_t lock;
         int sequence;
         int sharding;
         __conn_sharding_t *shardings;
+        __conn_replica_t *replicas;
+        __conn_block_t *blocks;
         uint64_t volid;
         char volume[MAX_NAME_LEN];
 } redis_vol_t;
@@ -41,18 +98,26 @@ typedef struct {
 static int __conn_magic__ = 0;
 
 static int __redis_vol_get(uint64_t volid, redis_vol_t **_vol, int flag);
+static int __redis_conn_release__(const char *volume, __conn_sharding_t *sharding,
+                                  const redis_handler_t *handler);
+static int __redis_conn_close__(__conn_sharding_t *sharding, const redis_handler_t *handler);
 
 
-static int __redis_connect(const char *volume, int sharding, int magic, __conn_t *conn)
+static int __redis_connect(const char *volume, const __conn_sharding_t *_sharding,
+                           int sharding, int magic, __conn_t *conn)
 {
         int ret, count;
         char addr[MAX_BUF_LEN], key[MAX_BUF_LEN];
         char *list[2];
 
-        snprintf(key, MAX_NAME_LEN, "%s/slot/%d/master", volume, sharding);
-        ret = etcd_get_text(ETCD_VOLUME, key, addr, NULL);
-        if(ret)
-                GOTO(err_ret, ret);
+        if (_sharding->replica[0]) {
+                strcpy(addr, _sharding->replica);
+        } else {
+                snprintf(key, MAX_NAME_LEN, "%s/slot/%d/master", volume, sharding);
+                ret = etcd_get_text(ETCD_VOLUME, key, addr, NULL);
+                if(ret)
+                        GOTO(err_ret, ret);
+        }
 
         count = 2;
         _str_split(addr, ' ', list, &count);
@@ -61,7 +126,8 @@ static int __redis_connect(const char *volume, int sharding, int magic, __conn_t
                 GOTO(err_ret, ret);
         }
 
-        DINFO("get volume %s sharding[%d] master @ %s:%s\n", volume, sharding, list[0], list[1]);
+        DINFO("get volume %s sharding[%d] %s @ %s:%s\n", volume, sharding,
+              _sharding->replica[0] ? "replica" : "master", list[0], list[1]);
 
         int port = atoi(list[1]);
         ret = redis_connect(&conn->conn, list[0], &port);
@@ -79,7 +145,8 @@ err_ret:
         return ret;
 }
 
-static int __redis_reconnect(const char *volume, int sharding, int magic, __conn_t *conn)
+static int __redis_reconnect(const char *volume, const __conn_sharding_t *_sharding,
+                             int sharding, int magic, __conn_t *conn)
 {
         int ret;
 
@@ -87,7 +154,7 @@ static int __redis_reconnect(const char *volume, int sharding, int magic, __conn
         conn->conn = NULL;
 
         YASSERT(conn->used == 0);
-        ret = __redis_connect(volume, sharding, magic, conn);
+        ret = __redis_connect(volume, _sharding, sharding, magic, conn);
         if(ret)
                 GOTO(err_ret, ret);
 
@@ -111,18 +178,31 @@ inline static int __redis_connect_sharding(const char *volume, __conn_sharding_t
         if(ret)
                 GOTO(err_ret, ret);
 
+        ret = ymalloc((void **)&sharding->stack, sizeof(*sharding->stack) * count);
+        if(ret)
+                GOTO(err_free, ret);
+
         for (i = 0; i < count; i++) {
-                ret = __redis_connect(volume, idx, __conn_magic__++, &conn[i]);
+                ret = __redis_connect(volume, sharding, idx, __conn_magic__++, &conn[i]);
                 if(ret)
-                        GOTO(err_free, ret);
+                        GOTO(err_close, ret);
+
+                sharding->stack[i] = i;
         }
 
         sharding->count = count;
+        sharding->idle = count;
+        sharding->waiting = 0;
         sharding->conn = conn;
 
         DINFO("redis sharding[%u] conn %u connected\n", idx, count);
 
         return 0;
+err_close:
+        while (--i >= 0) {
+                redis_disconnect(conn[i].conn);
+        }
+        yfree((void **)&sharding->stack);
 err_free:
         yfree((void **)&conn);
 err_ret:
@@ -150,15 +230,47 @@ static int __redis_vol_connect(uint64_t volid, const char *volume, int sharding,
         if(ret)
                 UNIMPLEMENTED(__DUMP__);
 
+        ret = ymalloc((void **)&vol->blocks, sizeof(*vol->blocks) * vol->sharding);
+        if(ret)
+                UNIMPLEMENTED(__DUMP__);
+
+        if (gloconf.redis_replica_read) {
+                ret = ymalloc((void **)&vol->replicas, sizeof(*vol->replicas) * vol->sharding);
+                if(ret)
+                        UNIMPLEMENTED(__DUMP__);
+        }
+
         ret = sy_rwlock_init(&vol->lock, NULL);
         if(ret)
                 UNIMPLEMENTED(__DUMP__);
         
         for (i = 0; i < vol->sharding; i++) {
-                ret = sy_rwlock_init(&vol->shardings[i].lock, NULL);
+                ret = pthread_mutex_init(&vol->shardings[i].lock, NULL);
+                if(ret)
+                        UNIMPLEMENTED(__DUMP__);
+
+                ret = pthread_cond_init(&vol->shardings[i].cond, NULL);
+                if(ret)
+                        UNIMPLEMENTED(__DUMP__);
+
+                ret = pthread_mutex_init(&vol->blocks[i].lock, NULL);
                 if(ret)
                         UNIMPLEMENTED(__DUMP__);
 
+                if (vol->replicas) {
+                        ret = pthread_mutex_init(&vol->replicas[i].lock, NULL);
+                        if(ret)
+                                UNIMPLEMENTED(__DUMP__);
+
+                        ret = pthread_mutex_init(&vol->replicas[i].pool.lock, NULL);
+                        if(ret)
+                                UNIMPLEMENTED(__DUMP__);
+
+                        ret = pthread_cond_init(&vol->replicas[i].pool.cond, NULL);
+                        if(ret)
+                                UNIMPLEMENTED(__DUMP__);
+                }
+
         retry:
                 ret = __redis_connect_sharding(volume, &vol->shardings[i], i);
                 if(ret) {
@@ -174,100 +286,418 @@ static int __redis_vol_connect(uint64_t volid, const char *volume, int sharding,
         
         return 0;
 err_free:
+        if (vol->replicas)
+                yfree((void **)&vol->replicas);
+        yfree((void **)&vol->blocks);
         yfree((void **)&vol->shardings);
         yfree((void **)&vol);
 err_ret:
         return ret;
 }
 
-static int __redis_conn_get__(__conn_t *conn, redis_handler_t *handler)
+static void __redis_conn_stat(__conn_sharding_t *sharding, int idx, uint64_t used)
 {
-        int ret;
+        time_t now;
+
+        sharding->get++;
+        if (used) {
+                sharding->wait++;
+                sharding->wait_used += used;
+                if (used > sharding->wait_max)
+                        sharding->wait_max = used;
+        }
 
-        if (conn->conn == NULL) {
-                ret = ENOENT;
-                GOTO(err_ret, ret);
+        now = gettime();
+        if (now - sharding->last_stat < REDIS_CONN_STAT_INTERVAL)
+                return;
+
+        if (sharding->wait) {
+                DINFO("redis sharding[%u] get %ju wait %ju avg %ju max %ju us, waiting %u\n",
+                      idx, sharding->get, sharding->wait,
+                      sharding->wait_used / sharding->wait,
+                      sharding->wait_max, sharding->waiting);
         }
 
-        if (conn->erased) {
-                ret = ESTALE;
-                GOTO(err_ret, ret);
+        sharding->get = 0;
+        sharding->wait = 0;
+        sharding->wait_used = 0;
+        sharding->wait_max = 0;
+        sharding->last_stat = now;
+}
+
+static void __redis_conn_put(__conn_sharding_t *sharding, int idx)
+{
+        YASSERT(sharding->idle < sharding->count);
+        sharding->stack[sharding->idle++] = idx;
+
+        if (sharding->waiting)
+                pthread_cond_signal(&sharding->cond);
+}
+
+/* sleep until a connection is idle, the caller must not hold the vol lock */
+static void __redis_conn_wait(__conn_sharding_t *sharding)
+{
+        pthread_mutex_lock(&sharding->lock);
+
+        sharding->waiting++;
+        while (sharding->idle == 0) {
+                pthread_cond_wait(&sharding->cond, &sharding->lock);
         }
+        sharding->waiting--;
 
-        if (conn->used) {
-                ret = EBUSY;
+        pthread_mutex_unlock(&sharding->lock);
+}
+
+/* EAGAIN if no connection is idle, used is the time waited for it so far */
+static int __redis_conn_get_sharding(const char *volume, __conn_sharding_t *sharding,
+                                     redis_handler_t *handler, uint64_t used)
+{
+        int ret, idx;
+        __conn_t *conn;
+
+        ret = pthread_mutex_lock(&sharding->lock);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        if (unlikely(sharding->idle == 0)) {
+                pthread_mutex_unlock(&sharding->lock);
+                ret = EAGAIN;
                 goto err_ret;
         }
 
+        /* lifo, the most recently used connection is the warmest */
+        idx = sharding->stack[--sharding->idle];
+        conn = &sharding->conn[idx];
+        YASSERT(conn->used == 0);
         conn->used = 1;
+
+        __redis_conn_stat(sharding, handler->sharding, used);
+
+        pthread_mutex_unlock(&sharding->lock);
+
+        if (unlikely(conn->conn == NULL)) {
+                /* reconnect failed at last release, retry here, the slot is ours */
+                ret = __redis_connect(volume, sharding, handler->sharding,
+                                      __conn_magic__++, conn);
+                if(ret) {
+                        conn->used = 0;
+                        pthread_mutex_lock(&sharding->lock);
+                        __redis_conn_put(sharding, idx);
+                        pthread_mutex_unlock(&sharding->lock);
+                        GOTO(err_ret, ret);
+                }
+
+                conn->used = 1;
+                DINFO("redis (%d, %d) reconnected\n", handler->sharding, idx);
+        }
+
         handler->conn = conn->conn;
         handler->magic = conn->magic;
+        handler->idx = idx;
 
         return 0;
 err_ret:
         return ret;
 }
 
-static int __redis_conn_get_sharding(__conn_sharding_t *sharding, redis_handler_t *handler)
+static uint64_t __redis_msec()
 {
-        int ret, i, idx, retry = 0;
+        struct timeval tv;
 
-retry:
-        ret = sy_rwlock_wrlock(&sharding->lock);
+        _gettimeofday(&tv, NULL);
+
+        return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int __redis_replica_addr(const char *volume, int idx, char *replica)
+{
+        int ret, i, count, found, num;
+        char key[MAX_NAME_LEN], master[MAX_BUF_LEN], value[MAX_BUF_LEN];
+        char *list[3];
+
+        snprintf(key, MAX_NAME_LEN, "%s/slot/%d/master", volume, idx);
+        ret = etcd_get_text(ETCD_VOLUME, key, master, NULL);
         if(ret)
                 GOTO(err_ret, ret);
 
-        sharding->sequence++;
-        for (i = 0; i < sharding->count; i++) {
-                idx = (i + sharding->sequence) % sharding->count;
-                
-                ret = __redis_conn_get__(&sharding->conn[idx], handler);
+        snprintf(key, MAX_NAME_LEN, "%s/replica", volume);
+        ret = etcd_get_text(ETCD_VOLUME, key, value, NULL);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        num = atoi(value);
+        found = 0;
+        for (i = 0; i < num; i++) {
+                snprintf(key, MAX_NAME_LEN, "%s/slot/%d/redis/%d", volume, idx, i);
+                ret = etcd_get_text(ETCD_VOLUME, key, value, NULL);
                 if(ret)
                         continue;
 
-                handler->idx = idx;
-                break;
+                /* "host port diskid" */
+                count = 3;
+                _str_split(value, ' ', list, &count);
+                if (count < 2)
+                        continue;
+
+                snprintf(key, MAX_NAME_LEN, "%s %s", list[0], list[1]);
+                if (strcmp(key, master) == 0)
+                        continue;
+
+                /* spread clients over the replicas */
+                found++;
+                if (_random() % found == 0)
+                        strcpy(replica, key);
         }
 
-        sy_rwlock_unlock(&sharding->lock);
-        
-        if (i == sharding->count) {
-                ret = ENONET;
-                USLEEP_RETRY(err_ret, ret, retry, retry, 1000, (1000));
+        if (found == 0) {
+                ret = ENOENT;
+                goto err_ret;
         }
-        
+
         return 0;
-//err_lock:
-//        sy_rwlock_unlock(&sharding->lock);
 err_ret:
         return ret;
 }
 
-int redis_conn_get(uint64_t volid, int sharding, redis_handler_t *handler)
+static int __redis_replica_offset(const char *volume, __conn_sharding_t *sharding,
+                                  int idx, uint64_t *offset, int *master)
 {
-        int ret, idx;
+        int ret;
+        redis_handler_t handler;
+
+        handler.sharding = idx;
+        ret = __redis_conn_get_sharding(volume, sharding, &handler, 0);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        ret = redis_repl_offset(handler.conn, offset, master);
+        if(ret) {
+                if (ret == ECONNRESET)
+                        __redis_conn_close__(sharding, &handler);
+
+                __redis_conn_release__(volume, sharding, &handler);
+                goto err_ret;
+        }
+
+        __redis_conn_release__(volume, sharding, &handler);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static void __redis_replica_refresh(redis_vol_t *vol, int idx)
+{
+        int ret, master;
+        uint64_t now, moffset, roffset;
+        __conn_replica_t *rep = &vol->replicas[idx];
+
+        if (!rep->ready) {
+                ret = __redis_replica_addr(vol->volume, idx, rep->pool.replica);
+                if(ret)
+                        goto err_ret;
+
+                ret = __redis_connect_sharding(vol->volume, &rep->pool, idx);
+                if(ret)
+                        goto err_ret;
+
+                rep->ready = 1;
+        }
+
+        /* writes finished before now are covered by moffset */
+        now = __redis_msec();
+        ret = __redis_replica_offset(vol->volume, &vol->shardings[idx], idx,
+                                     &moffset, &master);
+        if (ret == EAGAIN)
+                return;         /* pool busy, sample next round */
+        if(ret || !master)
+                goto err_ret;
+
+        ret = __redis_replica_offset(vol->volume, &rep->pool, idx,
+                                     &roffset, &master);
+        if (ret == EAGAIN)
+                return;
+        if(ret || master)
+                goto err_ret;
+
+        pthread_mutex_lock(&rep->lock);
+        if (roffset >= moffset) {
+                rep->synced = now;
+        } else if (roffset >= rep->offset && rep->offset_time > rep->synced) {
+                rep->synced = rep->offset_time;
+        }
+
+        rep->offset = moffset;
+        rep->offset_time = now;
+        pthread_mutex_unlock(&rep->lock);
+
+        return;
+err_ret:
+        DBUG("redis sharding[%u] replica not usable\n", idx);
+        pthread_mutex_lock(&rep->lock);
+        rep->synced = 0;
+        pthread_mutex_unlock(&rep->lock);
+}
+
+static void *__redis_replica_worker(void *arg)
+{
+        int ret, i;
+        uint64_t volid = *(uint64_t *)arg;
+        redis_vol_t *vol;
+
+        yfree((void **)&arg);
+
+        while (1) {
+                ret = __redis_vol_get(volid, &vol, 0);
+                if(ret)
+                        GOTO(err_ret, ret);
+
+                ret = sy_rwlock_rdlock(&vol->lock);
+                if(ret) {
+                        redis_vol_release(volid);
+                        GOTO(err_ret, ret);
+                }
+
+                for (i = 0; i < vol->sharding; i++) {
+                        __redis_replica_refresh(vol, i);
+                }
+
+                sy_rwlock_unlock(&vol->lock);
+                redis_vol_release(volid);
+
+                usleep(_max(gloconf.redis_replica_lag / 2, 1) * 1000);
+        }
+
+        return NULL;
+err_ret:
+        DWARN("vol %ju replica worker exit, ret %d\n", volid, ret);
+        return NULL;
+}
+
+static int __redis_replica_start(uint64_t volid)
+{
+        int ret;
+        uint64_t *arg;
+
+        ret = ymalloc((void **)&arg, sizeof(*arg));
+        if(ret)
+                GOTO(err_ret, ret);
+
+        *arg = volid;
+        ret = sy_thread_create2(__redis_replica_worker, arg, "redis_replica");
+        if(ret)
+                GOTO(err_free, ret);
+
+        return 0;
+err_free:
+        yfree((void **)&arg);
+err_ret:
+        return ret;
+}
+
+static int __redis_replica_readable(const __conn_replica_t *rep)
+{
+        uint64_t synced = rep->synced;
+
+        return rep->ready && rep->last_write < synced
+                && __redis_msec() - synced <= (uint64_t)gloconf.redis_replica_lag;
+}
+
+static void __redis_replica_write(redis_vol_t *vol, int idx)
+{
+        uint64_t now;
+        __conn_replica_t *rep = &vol->replicas[idx];
+
+        now = __redis_msec();
+
+        pthread_mutex_lock(&rep->lock);
+        if (now > rep->last_write)
+                rep->last_write = now;
+        pthread_mutex_unlock(&rep->lock);
+}
+
+static void __redis_replica_stale(redis_vol_t *vol, int idx)
+{
+        __conn_replica_t *rep = &vol->replicas[idx];
+
+        pthread_mutex_lock(&rep->lock);
+        rep->synced = 0;
+        pthread_mutex_unlock(&rep->lock);
+}
+
+static int __redis_conn_get(uint64_t volid, int sharding, redis_handler_t *handler,
+                            int readonly, int replica)
+{
+        int ret, idx, waited = 0;
         redis_vol_t *vol;
+        __conn_sharding_t *pool;
+        struct timeval t1, t2;
+        uint64_t used = 0;
 
         ret = __redis_vol_get(volid, &vol, O_CREAT);
         if(ret)
                 GOTO(err_ret, ret);
-        
+
+retry:
         ret = sy_rwlock_rdlock(&vol->lock);
         if(ret)
                 GOTO(err_release, ret);
 
+        if (waited) {
+                _gettimeofday(&t2, NULL);
+                used = _time_used(&t1, &t2);
+        }
+
         idx = sharding % vol->sharding;
         handler->sharding = idx;
-        ret = __redis_conn_get_sharding(&vol->shardings[handler->sharding], handler);
+        handler->readonly = readonly;
+        handler->replica = 0;
+
+        pool = NULL;
+        if (replica && vol->replicas) {
+                if (__redis_replica_readable(&vol->replicas[idx])) {
+                        pool = &vol->replicas[idx].pool;
+                        ret = __redis_conn_get_sharding(vol->volume, pool,
+                                                        handler, used);
+                        if (ret == 0) {
+                                handler->replica = 1;
+                                goto out;
+                        }
+
+                        if (ret != EAGAIN)
+                                __redis_replica_stale(vol, idx);
+                }
+        }
+
+        if (pool == NULL || ret != EAGAIN) {
+                pool = &vol->shardings[idx];
+                ret = __redis_conn_get_sharding(vol->volume, pool, handler, used);
+        }
+
+        if (unlikely(ret == EAGAIN)) {
+                /* the release that wakes us takes the vol lock, wait without it */
+                sy_rwlock_unlock(&vol->lock);
+
+                if (!waited) {
+                        _gettimeofday(&t1, NULL);
+                        waited = 1;
+                }
+
+                __redis_conn_wait(pool);
+                goto retry;
+        }
+
         if(ret)
                 GOTO(err_lock, ret);
 
+out:
         handler->volid = volid;
         
         sy_rwlock_unlock(&vol->lock);
         redis_vol_release(volid);
         
-        DBUG("use vol (%d,%d)\n", handler->sharding, handler->idx);
+        DBUG("use vol (%d,%d) replica %d\n", handler->sharding, handler->idx,
+             handler->replica);
 
         return 0;
 err_lock:
@@ -278,37 +708,148 @@ err_ret:
         return ret;
 }
 
-static int __redis_conn_release__(const char *volume, __conn_sharding_t *sharding,
-                                  const redis_handler_t *handler)
+int redis_conn_get(uint64_t volid, int sharding, redis_handler_t *handler)
+{
+        return __redis_conn_get(volid, sharding, handler, 0, 0);
+}
+
+/*
+ * read-only ops, may be served by a replica if redis_replica_read is on,
+ * they see every write of this process but may miss others' recent ones
+ */
+int redis_conn_get_ro(uint64_t volid, int sharding, redis_handler_t *handler)
+{
+        return __redis_conn_get(volid, sharding, handler, 1, 1);
+}
+
+/* read-only ops that must stay on the primary, they do not count as writes */
+int redis_conn_get_master(uint64_t volid, int sharding, redis_handler_t *handler)
+{
+        return __redis_conn_get(volid, sharding, handler, 1, 0);
+}
+
+/* for blocking calls, release with redis_conn_release_block */
+int redis_conn_get_block(uint64_t volid, int sharding, redis_handler_t *handler)
+{
+        int ret, idx;
+        redis_vol_t *vol;
+        __conn_block_t *block;
+        __conn_t conn;
+
+        ret = __redis_vol_get(volid, &vol, O_CREAT);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        ret = sy_rwlock_rdlock(&vol->lock);
+        if(ret)
+                GOTO(err_release, ret);
+
+        idx = sharding % vol->sharding;
+        block = &vol->blocks[idx];
+
+        conn.conn = NULL;
+        pthread_mutex_lock(&block->lock);
+        if (block->idle)
+                conn.conn = block->stack[--block->idle];
+        pthread_mutex_unlock(&block->lock);
+
+        if (conn.conn == NULL) {
+                ret = __redis_connect(vol->volume, &vol->shardings[idx], idx,
+                                      __conn_magic__++, &conn);
+                if(ret)
+                        GOTO(err_lock, ret);
+        }
+
+        handler->sharding = idx;
+        handler->readonly = 0;
+        handler->replica = 0;
+        handler->idx = -1;
+        handler->magic = 0;
+        handler->conn = conn.conn;
+        handler->volid = volid;
+
+        sy_rwlock_unlock(&vol->lock);
+        redis_vol_release(volid);
+
+        return 0;
+err_lock:
+        sy_rwlock_unlock(&vol->lock);
+err_release:
+        redis_vol_release(volid);
+err_ret:
+        return ret;
+}
+
+/* close if the connection is broken */
+int redis_conn_release_block(const redis_handler_t *handler, int close)
 {
         int ret;
-        __conn_t *conn;
+        redis_vol_t *vol;
+        __conn_block_t *block;
 
-        ret = sy_rwlock_wrlock(&sharding->lock);
+        ret = __redis_vol_get(handler->volid, &vol, 0);
         if(ret)
                 GOTO(err_ret, ret);
 
+        block = &vol->blocks[handler->sharding];
+
+        pthread_mutex_lock(&block->lock);
+        if (!close && block->idle < REDIS_CONN_BLOCK_IDLE) {
+                block->stack[block->idle++] = handler->conn;
+                pthread_mutex_unlock(&block->lock);
+        } else {
+                pthread_mutex_unlock(&block->lock);
+                redis_disconnect(handler->conn);
+        }
+
+        redis_vol_release(handler->volid);
+
+        return 0;
+err_ret:
+        redis_disconnect(handler->conn);
+        return ret;
+}
+
+static int __redis_conn_release__(const char *volume, __conn_sharding_t *sharding,
+                                  const redis_handler_t *handler)
+{
+        int ret;
+        __conn_t *conn;
+
         conn = &sharding->conn[handler->idx];
-        
-        if (handler->magic == conn->magic) {
-                YASSERT(conn->used);
-                conn->used = 0;
-                if (conn->erased) {
-                        ret = __redis_reconnect(volume, handler->sharding,
-                                                __conn_magic__++, conn);
-                        if(ret)
-                                GOTO(err_lock, ret);
+        if (unlikely(handler->magic != conn->magic)) {
+                /* the slot was reconnected under us, it is not ours to put */
+                DWARN("redis (%d, %d) stale handler\n",
+                      handler->sharding, handler->idx);
+                ret = ESTALE;
+                GOTO(err_ret, ret);
+        }
 
+        YASSERT(conn->used);
+        conn->used = 0;
+        if (conn->erased) {
+                /* the slot is still off the stack, reconnect without the lock */
+                ret = __redis_reconnect(volume, sharding, handler->sharding,
+                                        __conn_magic__++, conn);
+                if(ret) {
+                        DWARN("redis (%d, %d) reconnect fail, ret (%u) %s\n",
+                              handler->sharding, handler->idx, ret, strerror(ret));
+                        conn->conn = NULL;
+                } else {
                         DINFO("redis (%d, %d) reconnected\n",
                               handler->sharding, handler->idx);
                 }
         }
 
-        sy_rwlock_unlock(&sharding->lock);
+        ret = pthread_mutex_lock(&sharding->lock);
+        if(ret)
+                GOTO(err_ret, ret);
+
+        __redis_conn_put(sharding, handler->idx);
+
+        pthread_mutex_unlock(&sharding->lock);
 
         return 0;
-err_lock:
-        sy_rwlock_unlock(&sharding->lock);
 err_ret:
         return ret;
 }
@@ -326,9 +867,22 @@ int redis_conn_release(const redis_handler_t *handler)
         if(ret)
                 GOTO(err_release, ret);
 
-        ret = __redis_conn_release__(vol->volume, &vol->shardings[handler->sharding], handler);
-        if(ret)
-                GOTO(err_lock, ret);
+        if (handler->replica) {
+                ret = __redis_conn_release__(vol->volume,
+                                             &vol->replicas[handler->sharding].pool,
+                                             handler);
+                if(ret)
+                        GOTO(err_lock, ret);
+        } else {
+                ret = __redis_conn_release__(vol->volume,
+                                             &vol->shardings[handler->sharding],
+                                             handler);
+                if(ret)
+                        GOTO(err_lock, ret);
+
+                if (!handler->readonly && vol->replicas)
+                        __redis_replica_write(vol, handler->sharding);
+        }
 
         sy_rwlock_unlock(&vol->lock);
         redis_vol_release(handler->volid);
@@ -376,28 +930,41 @@ err_ret:
         return ret;
 }
 
-static int __redis_conn_close__(__conn_sharding_t *sharding, const redis_handler_t *handler)
+/**
+ * number of shardings the volume is spread over
+ */
+int redis_conn_sharding(uint64_t volid, int *count)
 {
         int ret;
-        __conn_t *conn;
+        redis_vol_t *vol;
 
-        ret = sy_rwlock_wrlock(&sharding->lock);
+        ret = __redis_vol_get(volid, &vol, O_CREAT);
         if(ret)
                 GOTO(err_ret, ret);
 
+        *count = vol->sharding;
+
+        redis_vol_release(volid);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int __redis_conn_close__(__conn_sharding_t *sharding, const redis_handler_t *handler)
+{
+        __conn_t *conn;
+
         conn = &sharding->conn[handler->idx];
 
+        /* the connection is owned by the caller until released */
         YASSERT(conn->used);
         if (handler->magic == conn->magic) {
                 DINFO("redis (%d, %d) close\n", handler->sharding, handler->idx);
                 conn->erased = 1;
         }
 
-        sy_rwlock_unlock(&sharding->lock);
-        
         return 0;
-err_ret:
-        return ret;
 }
 
 int redis_conn_close(const redis_handler_t *handler)
@@ -413,9 +980,19 @@ int redis_conn_close(const redis_handler_t *handler)
         if(ret)
                 GOTO(err_release, ret);
 
-        ret = __redis_conn_close__(&vol->shardings[handler->sharding], handler);
-        if(ret)
-                GOTO(err_lock, ret);
+        if (handler->replica) {
+                ret = __redis_conn_close__(&vol->replicas[handler->sharding].pool,
+                                           handler);
+                if(ret)
+                        GOTO(err_lock, ret);
+
+                __redis_replica_stale(vol, handler->sharding);
+        } else {
+                ret = __redis_conn_close__(&vol->shardings[handler->sharding],
+                                           handler);
+                if(ret)
+                        GOTO(err_lock, ret);
+        }
         
         sy_rwlock_unlock(&vol->lock);
         redis_vol_release(handler->volid);
@@ -499,21 +1076,35 @@ static void __redis_close_sharding(__conn_sharding_t *sharding)
 
         for (i = 0; i < sharding->count; i++) {
                 conn = &sharding->conn[i];
-                redis_disconnect(conn->conn);
+                if (conn->conn)
+                        redis_disconnect(conn->conn);
                 conn->conn = NULL;
         }
 
+        yfree((void **)&sharding->stack);
         yfree((void **)&sharding->conn);
 }
 
 static void __redis_vol_close(redis_vol_t *vol)
 {
         int i;
+        __conn_block_t *block;
 
         for (i = 0; i < vol->sharding; i++) {
                 __redis_close_sharding(&vol->shardings[i]);
+
+                block = &vol->blocks[i];
+                while (block->idle) {
+                        redis_disconnect(block->stack[--block->idle]);
+                }
+
+                if (vol->replicas && vol->replicas[i].ready)
+                        __redis_close_sharding(&vol->replicas[i].pool);
         }
 
+        if (vol->replicas)
+                yfree((void **)&vol->replicas);
+        yfree((void **)&vol->blocks);
         yfree((void **)&vol->shardings);
         yfree((void **)&vol);
 }
@@ -537,6 +1128,14 @@ int redis_conn_vol(uint64_t volid)
                 GOTO(err_close, ret);
         }
 
+        if (vol->replicas) {
+                ret = __redis_replica_start(volid);
+                if(ret) {
+                        /* reads stay on the primary */
+                        DWARN("vol %ju replica worker fail, ret %d\n", volid, ret);
+                }
+        }
+
         return 0;
 err_close:
         __redis_vol_close(vol);
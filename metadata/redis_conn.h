@@ -12,6 +12,8 @@ typedef struct {
         int magic;
         int sharding;
         int idx;
+        int replica;    /* served by a replica of the sharding */
+        int readonly;
         uint64_t volid;
         redis_conn_t *conn;
 } redis_handler_t;
@@ -19,7 +21,12 @@ typedef struct {
 int redis_conn_init();
 int redis_conn_release(const redis_handler_t *handler);
 int redis_conn_get(uint64_t volid, int sharding, redis_handler_t *handler);
+int redis_conn_get_ro(uint64_t volid, int sharding, redis_handler_t *handler);
+int redis_conn_get_master(uint64_t volid, int sharding, redis_handler_t *handler);
+int redis_conn_get_block(uint64_t volid, int sharding, redis_handler_t *handler);
+int redis_conn_release_block(const redis_handler_t *handler, int close);
 int redis_conn_new(uint64_t volid, uint8_t *idx);
+int redis_conn_sharding(uint64_t volid, int *count);
 int redis_conn_close(const redis_handler_t *handler);
 int redis_conn_vol(uint64_t volid);
 
@@ -0,0 +1,554 @@
+#include <sys/types.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YFSMDS
+
+#include "sdfs_conf.h"
+#include "ylib.h"
+#include "schedule.h"
+#include "mdkv.h"
+#include "dbg.h"
+
+#if USE_LEVELDB
+#include <leveldb/c.h>
+
+/*
+ * mdkv
+ *
+ * a leveldb instance in the master mond, so metadata that needs ordered
+ * scans can skip the redis hop (mdsconf.db "leveldb", see md.c). writes
+ * come as batches that are applied all or none. callers queue their batch
+ * and sleep, one writer thread checks the conditions of every queued
+ * batch, packs the ones that pass into a single writebatch and syncs it
+ * once for the whole group, so rpc handlers never block on the disk. a
+ * batch whose conditions look at a key written earlier in the group waits
+ * for the next group, its check must see that write. the store is local
+ * to the master and not replicated, it is for single mond setups, see
+ * mds_main.c.
+ */
+
+#define MDKV_GROUP_MAX 64
+#define MDKV_ADD_MAX (MDKV_BATCH_MAX / (sizeof(mdkv_rec_t) + sizeof(int64_t)))
+
+typedef struct {
+        struct list_head hook;
+        const mdkv_batch_t *batch;
+        int retval;
+        int running;            /* caller is a schedule task */
+        task_t task;
+        sem_t sem;
+} mdkv_req_t;
+
+typedef struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        struct list_head list;
+} mdkv_queue_t;
+
+static leveldb_t *__mdkv_db__ = NULL;
+static leveldb_readoptions_t *__mdkv_ropt__;
+static leveldb_writeoptions_t *__mdkv_wopt__;
+static mdkv_queue_t __mdkv_queue__ = {
+        PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+        LIST_HEAD_INIT(__mdkv_queue__.list),
+};
+
+static void *__mdkv_writer(void *arg);
+
+int mdkv_init(const char *path)
+{
+        int ret;
+        char *err = NULL;
+        leveldb_options_t *opt;
+
+        if (__mdkv_db__) {
+                return 0;
+        }
+
+        ret = path_validate(path, YLIB_ISDIR, YLIB_DIRCREATE);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        opt = leveldb_options_create();
+        leveldb_options_set_create_if_missing(opt, 1);
+
+        __mdkv_db__ = leveldb_open(opt, path, &err);
+        leveldb_options_destroy(opt);
+        if (err) {
+                DERROR("open %s fail, %s\n", path, err);
+                leveldb_free(err);
+                ret = EIO;
+                GOTO(err_ret, ret);
+        }
+
+        __mdkv_ropt__ = leveldb_readoptions_create();
+        __mdkv_wopt__ = leveldb_writeoptions_create();
+        /* a batch is acked to the client, it must survive a crash */
+        leveldb_writeoptions_set_sync(__mdkv_wopt__, 1);
+
+        ret = sy_thread_create2(__mdkv_writer, NULL, "mdkv_writer");
+        if (ret)
+                GOTO(err_ret, ret);
+
+        DINFO("mdkv %s opened\n", path);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int __mdkv_get(const char *key, uint32_t klen, char **value, size_t *vlen)
+{
+        int ret;
+        char *err = NULL;
+
+        if (__mdkv_db__ == NULL) {
+                ret = ENOSYS;
+                GOTO(err_ret, ret);
+        }
+
+        *value = leveldb_get(__mdkv_db__, __mdkv_ropt__, key, klen, vlen, &err);
+        if (err) {
+                DERROR("get fail, %s\n", err);
+                leveldb_free(err);
+                ret = EIO;
+                GOTO(err_ret, ret);
+        }
+
+        if (*value == NULL) {
+                ret = ENOENT;
+                goto err_ret;
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+int mdkv_get(const char *key, uint32_t klen, void *value, uint32_t *vlen)
+{
+        int ret;
+        char *v;
+        size_t len;
+
+        ret = __mdkv_get(key, klen, &v, &len);
+        if (ret)
+                goto err_ret;
+
+        if (len > *vlen) {
+                ret = EOVERFLOW;
+                GOTO(err_free, ret);
+        }
+
+        memcpy(value, v, len);
+        *vlen = len;
+        leveldb_free(v);
+
+        return 0;
+err_free:
+        leveldb_free(v);
+err_ret:
+        return ret;
+}
+
+static int __mdkv_check(const mdkv_rec_t *rec)
+{
+        int ret;
+        char *v;
+        size_t len;
+
+        if (rec->op != MDKV_PUT_EXCL && rec->op != MDKV_DEL_EQ)
+                return 0;
+
+        ret = __mdkv_get(rec->buf, rec->klen, &v, &len);
+        if (ret) {
+                if (ret == ENOENT) {
+                        return rec->op == MDKV_PUT_EXCL ? 0 : ESTALE;
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+        if (rec->op == MDKV_PUT_EXCL) {
+                ret = EEXIST;
+        } else if (len != rec->vlen || memcmp(v, rec->buf + rec->klen, len)) {
+                ret = ESTALE;
+        } else {
+                ret = 0;
+        }
+
+        leveldb_free(v);
+
+        return ret;
+err_ret:
+        return ret;
+}
+
+static int __mdkv_sum(const mdkv_rec_t *rec, int64_t *_value)
+{
+        int ret;
+        char *v;
+        size_t len;
+        int64_t value, delta;
+
+        if (rec->vlen != sizeof(delta)) {
+                ret = EINVAL;
+                GOTO(err_ret, ret);
+        }
+
+        ret = __mdkv_get(rec->buf, rec->klen, &v, &len);
+        if (ret) {
+                if (ret == ENOENT) {
+                        value = 0;
+                } else
+                        GOTO(err_ret, ret);
+        } else {
+                if (len != sizeof(value)) {
+                        leveldb_free(v);
+                        ret = EIO;
+                        GOTO(err_ret, ret);
+                }
+
+                memcpy(&value, v, sizeof(value));
+                leveldb_free(v);
+        }
+
+        memcpy(&delta, rec->buf + rec->klen, sizeof(delta));
+        *_value = value + delta;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/* check every record and work out the adds, nothing is written yet */
+static int __mdkv_prep(const mdkv_batch_t *batch, int64_t *adds)
+{
+        int ret, i = 0;
+        const mdkv_rec_t *rec;
+
+        mdkv_for_each(batch->buf, batch->len, rec) {
+                ret = __mdkv_check(rec);
+                if (ret)
+                        goto err_ret;
+
+                if (rec->op == MDKV_ADD) {
+                        /* one add per key in a batch, the read sees the db */
+                        ret = __mdkv_sum(rec, &adds[i]);
+                        if (ret)
+                                goto err_ret;
+
+                        i++;
+                }
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static void __mdkv_append(leveldb_writebatch_t *wb, const mdkv_batch_t *batch,
+                          const int64_t *adds)
+{
+        int i = 0;
+        const mdkv_rec_t *rec;
+
+        mdkv_for_each(batch->buf, batch->len, rec) {
+                if (rec->op == MDKV_PUT || rec->op == MDKV_PUT_EXCL) {
+                        leveldb_writebatch_put(wb, rec->buf, rec->klen,
+                                               rec->buf + rec->klen, rec->vlen);
+                } else if (rec->op == MDKV_ADD) {
+                        if (adds[i]) {
+                                leveldb_writebatch_put(wb, rec->buf, rec->klen,
+                                                       (void *)&adds[i], sizeof(adds[i]));
+                        } else {
+                                leveldb_writebatch_delete(wb, rec->buf, rec->klen);
+                        }
+
+                        i++;
+                } else {
+                        leveldb_writebatch_delete(wb, rec->buf, rec->klen);
+                }
+        }
+}
+
+static int __mdkv_touched(const struct list_head *group, const char *key, uint32_t klen)
+{
+        const mdkv_req_t *req;
+        const mdkv_rec_t *rec;
+
+        list_for_each_entry(req, group, hook) {
+                mdkv_for_each(req->batch->buf, req->batch->len, rec) {
+                        if (rec->klen == klen && memcmp(rec->buf, key, klen) == 0)
+                                return 1;
+                }
+        }
+
+        return 0;
+}
+
+/* batch reads a key that the pending group writes */
+static int __mdkv_conflict(const struct list_head *group, const mdkv_batch_t *batch)
+{
+        const mdkv_rec_t *rec;
+
+        if (list_empty(group))
+                return 0;
+
+        mdkv_for_each(batch->buf, batch->len, rec) {
+                if (rec->op != MDKV_PUT_EXCL && rec->op != MDKV_DEL_EQ
+                    && rec->op != MDKV_ADD)
+                        continue;
+
+                if (__mdkv_touched(group, rec->buf, rec->klen))
+                        return 1;
+        }
+
+        return 0;
+}
+
+static void __mdkv_done(mdkv_req_t *req, int retval)
+{
+        list_del(&req->hook);
+
+        /* req lives on the caller's stack, not touched after the wakeup */
+        if (req->running) {
+                schedule_resume(&req->task, retval, NULL);
+        } else {
+                req->retval = retval;
+                sem_post(&req->sem);
+        }
+}
+
+static void __mdkv_flush(leveldb_writebatch_t *wb, struct list_head *group)
+{
+        int ret;
+        char *err = NULL;
+        mdkv_req_t *req;
+
+        if (list_empty(group))
+                return;
+
+        leveldb_write(__mdkv_db__, __mdkv_wopt__, wb, &err);
+        if (err) {
+                DERROR("write fail, %s\n", err);
+                leveldb_free(err);
+                ret = EIO;
+        } else {
+                ret = 0;
+        }
+
+        leveldb_writebatch_clear(wb);
+
+        while (!list_empty(group)) {
+                req = list_entry(group->next, mdkv_req_t, hook);
+                __mdkv_done(req, ret);
+        }
+}
+
+static void __mdkv_commit(struct list_head *list, leveldb_writebatch_t *wb)
+{
+        int ret, count = 0;
+        int64_t adds[MDKV_ADD_MAX];
+        struct list_head group;
+        mdkv_req_t *req;
+
+        INIT_LIST_HEAD(&group);
+
+        while (!list_empty(list)) {
+                req = list_entry(list->next, mdkv_req_t, hook);
+
+                if (count == MDKV_GROUP_MAX || __mdkv_conflict(&group, req->batch)) {
+                        __mdkv_flush(wb, &group);
+                        count = 0;
+                }
+
+                ret = __mdkv_prep(req->batch, adds);
+                if (ret) {
+                        __mdkv_done(req, ret);
+                        continue;
+                }
+
+                __mdkv_append(wb, req->batch, adds);
+                list_move_tail(&req->hook, &group);
+                count++;
+        }
+
+        __mdkv_flush(wb, &group);
+}
+
+static void *__mdkv_writer(void *arg)
+{
+        struct list_head list;
+        mdkv_queue_t *queue = &__mdkv_queue__;
+        leveldb_writebatch_t *wb;
+
+        (void) arg;
+
+        wb = leveldb_writebatch_create();
+        INIT_LIST_HEAD(&list);
+
+        while (1) {
+                pthread_mutex_lock(&queue->lock);
+
+                while (list_empty(&queue->list))
+                        pthread_cond_wait(&queue->cond, &queue->lock);
+
+                list_splice_init(&queue->list, &list);
+
+                pthread_mutex_unlock(&queue->lock);
+
+                __mdkv_commit(&list, wb);
+        }
+
+        leveldb_writebatch_destroy(wb);
+
+        return NULL;
+}
+
+int mdkv_write(const mdkv_batch_t *batch)
+{
+        int ret;
+        mdkv_req_t req;
+        mdkv_queue_t *queue = &__mdkv_queue__;
+
+        if (__mdkv_db__ == NULL) {
+                ret = ENOSYS;
+                GOTO(err_ret, ret);
+        }
+
+        req.batch = batch;
+        req.running = schedule_running();
+        if (req.running) {
+                req.task = schedule_task_get();
+        } else {
+                ret = sem_init(&req.sem, 0, 0);
+                if (ret) {
+                        ret = errno;
+                        GOTO(err_ret, ret);
+                }
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        list_add_tail(&req.hook, &queue->list);
+        pthread_cond_signal(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+
+        if (req.running) {
+                ret = schedule_yield("mdkv_write", NULL, NULL);
+        } else {
+                ret = _sem_wait(&req.sem);
+                if (ret == 0)
+                        ret = req.retval;
+
+                sem_destroy(&req.sem);
+        }
+
+        if (ret)
+                goto err_ret;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * up to count records from start on, while keys begin with prefix. more
+ * is set if the range goes on.
+ */
+int mdkv_scan(const char *start, uint32_t slen, const char *prefix, uint32_t plen,
+              uint32_t count, void *buf, uint32_t *buflen, int *more)
+{
+        int ret;
+        uint32_t left, i;
+        size_t klen, vlen;
+        const char *k, *v;
+        mdkv_rec_t *rec;
+        leveldb_iterator_t *it;
+
+        if (__mdkv_db__ == NULL) {
+                ret = ENOSYS;
+                GOTO(err_ret, ret);
+        }
+
+        it = leveldb_create_iterator(__mdkv_db__, __mdkv_ropt__);
+        leveldb_iter_seek(it, start, slen);
+
+        *more = 0;
+        left = *buflen;
+        rec = buf;
+        for (i = 0; leveldb_iter_valid(it); i++, leveldb_iter_next(it)) {
+                k = leveldb_iter_key(it, &klen);
+                if (klen < plen || memcmp(k, prefix, plen))
+                        break;
+
+                v = leveldb_iter_value(it, &vlen);
+                if (i == count || sizeof(*rec) + klen + vlen > left) {
+                        *more = 1;
+                        break;
+                }
+
+                rec->op = MDKV_PUT;
+                rec->klen = klen;
+                rec->vlen = vlen;
+                memcpy(rec->buf, k, klen);
+                memcpy(rec->buf + klen, v, vlen);
+                left -= MDKV_REC_SIZE(rec);
+                rec = (void *)rec + MDKV_REC_SIZE(rec);
+        }
+
+        leveldb_iter_destroy(it);
+
+        *buflen -= left;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+#else
+
+/* built without leveldb, mdsconf.db "leveldb" is refused at mond start */
+
+int mdkv_init(const char *path)
+{
+        DERROR("mdkv %s: built without leveldb\n", path);
+        return ENOSYS;
+}
+
+int mdkv_get(const char *key, uint32_t klen, void *value, uint32_t *vlen)
+{
+        (void) key;
+        (void) klen;
+        (void) value;
+        (void) vlen;
+
+        return ENOSYS;
+}
+
+int mdkv_write(const mdkv_batch_t *batch)
+{
+        (void) batch;
+
+        return ENOSYS;
+}
+
+int mdkv_scan(const char *start, uint32_t slen, const char *prefix, uint32_t plen,
+              uint32_t count, void *buf, uint32_t *buflen, int *more)
+{
+        (void) start;
+        (void) slen;
+        (void) prefix;
+        (void) plen;
+        (void) count;
+        (void) buf;
+        (void) buflen;
+        (void) more;
+
+        return ENOSYS;
+}
+
+#endif
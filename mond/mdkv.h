@@ -0,0 +1,86 @@
+#ifndef __MDKV_H__
+#define __MDKV_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * ordered key value store of the master mond, see mdkv.c
+ */
+
+#define MDKV_BATCH_MAX 3072
+#define MDKV_SCAN_MAX (1024 * 32)
+
+typedef enum {
+        MDKV_PUT = 0,
+        MDKV_PUT_EXCL,          /* EEXIST if the key exists */
+        MDKV_DEL,
+        MDKV_DEL_EQ,            /* ESTALE unless the key holds value */
+        MDKV_ADD,               /* add the int64 value to the int64 at key, dropped at 0 */
+} mdkv_op_t;
+
+typedef struct {
+        uint8_t op;
+        uint16_t klen;
+        uint32_t vlen;
+        char buf[0];            /* key, then value */
+} mdkv_rec_t;
+
+#define MDKV_REC_SIZE(__rec__) (sizeof(mdkv_rec_t) + (__rec__)->klen + (__rec__)->vlen)
+
+/* records applied all or none */
+typedef struct {
+        uint32_t len;
+        uint32_t count;
+        char buf[MDKV_BATCH_MAX];
+} mdkv_batch_t;
+
+/* scan reply: header, then count records */
+typedef struct {
+        uint32_t count;
+        uint32_t more;
+} mdkv_scan_t;
+
+#define mdkv_for_each(__buf__, __len__, __rec__)                        \
+        for (__rec__ = (void *)(__buf__);                               \
+             (void *)__rec__ < (void *)(__buf__) + (__len__);           \
+             __rec__ = (void *)__rec__ + MDKV_REC_SIZE(__rec__))
+
+static inline void mdkv_batch_init(mdkv_batch_t *batch)
+{
+        batch->len = 0;
+        batch->count = 0;
+}
+
+static inline int mdkv_batch_append(mdkv_batch_t *batch, int op, const char *key,
+                                    uint32_t klen, const void *value, uint32_t vlen)
+{
+        mdkv_rec_t *rec;
+
+        if (batch->len + sizeof(*rec) + klen + vlen > MDKV_BATCH_MAX)
+                return ENOSPC;
+
+        rec = (void *)batch->buf + batch->len;
+        rec->op = op;
+        rec->klen = klen;
+        rec->vlen = vlen;
+        memcpy(rec->buf, key, klen);
+        if (vlen)
+                memcpy(rec->buf + klen, value, vlen);
+
+        batch->len += MDKV_REC_SIZE(rec);
+        batch->count++;
+
+        return 0;
+}
+
+/* server, master mond only */
+int mdkv_init(const char *path);
+int mdkv_get(const char *key, uint32_t klen, void *value, uint32_t *vlen);
+int mdkv_write(const mdkv_batch_t *batch);
+int mdkv_scan(const char *start, uint32_t slen, const char *prefix, uint32_t plen,
+              uint32_t count, void *buf, uint32_t *buflen, int *more);
+
+#endif
@@ -19,6 +19,7 @@
 #include "ynet_rpc.h"
 #include "rpc_proto.h"
 #include "mond_rpc.h"
+#include "mdkv.h"
 #include "md_lib.h"
 #include "network.h"
 #include "diskpool.h"
@@ -36,6 +37,9 @@ typedef enum {
         MOND_NEWDISK,
         MOND_DISKJOIN,
         MOND_STATVFS,
+        MOND_MDKV_GET,
+        MOND_MDKV_WRITE,
+        MOND_MDKV_SCAN,
         MOND_MAX,
 } mond_op_t;
 
@@ -570,6 +574,266 @@ err_ret:
         return ret;
 }
 
+static int __mond_srv_mdkv_get(const sockid_t *sockid, const msgid_t *msgid, buffer_t *_buf)
+{
+        int ret;
+        msg_t *req;
+        char *buf = mem_cache_calloc1(MEM_CACHE_4K, PAGE_SIZE);
+        char value[MAX_BUF_LEN];
+        uint32_t buflen, klen, vlen;
+        const char *key;
+
+        req = (void *)buf;
+        mbuffer_get(_buf, req, sizeof(*req));
+        buflen = req->buflen;
+        ret = mbuffer_popmsg(_buf, req, buflen + sizeof(*req));
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
+        _opaque_decode(req->buf, buflen,
+                       &key, &klen,
+                       NULL);
+
+        vlen = sizeof(value);
+        ret = mdkv_get(key, klen, value, &vlen);
+        if (ret)
+                goto err_ret;
+
+        rpc_reply(sockid, msgid, value, vlen);
+
+        mem_cache_free(MEM_CACHE_4K, buf);
+
+        return 0;
+err_ret:
+        mem_cache_free(MEM_CACHE_4K, buf);
+        return ret;
+}
+
+int mond_rpc_mdkv_get(const char *key, uint32_t klen, void *value, uint32_t *vlen)
+{
+        int ret, replen;
+        char *buf = mem_cache_calloc1(MEM_CACHE_4K, PAGE_SIZE);
+        uint32_t count;
+        msg_t *req;
+
+        ret = network_connect_master();
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
+        ANALYSIS_BEGIN(0);
+
+        req = (void *)buf;
+        req->op = MOND_MDKV_GET;
+        _opaque_encode(&req->buf, &count,
+                       key, klen,
+                       NULL);
+
+        req->buflen = count;
+
+        replen = *vlen;
+        ret = rpc_request_wait("mond_rpc_mdkv_get", net_getadmin(),
+                               req, sizeof(*req) + count, value, &replen,
+                               MSG_MOND, 0, _get_timeout());
+        if (unlikely(ret))
+                goto err_ret;
+
+        *vlen = replen;
+
+        ANALYSIS_QUEUE(0, IO_WARN, NULL);
+
+        mem_cache_free(MEM_CACHE_4K, buf);
+
+        return 0;
+err_ret:
+        mem_cache_free(MEM_CACHE_4K, buf);
+        return ret;
+}
+
+static int __mond_srv_mdkv_write(const sockid_t *sockid, const msgid_t *msgid, buffer_t *_buf)
+{
+        int ret;
+        msg_t *req;
+        char *buf = mem_cache_calloc1(MEM_CACHE_4K, PAGE_SIZE);
+        uint32_t buflen, len;
+        const mdkv_batch_t *batch;
+
+        req = (void *)buf;
+        mbuffer_get(_buf, req, sizeof(*req));
+        buflen = req->buflen;
+        ret = mbuffer_popmsg(_buf, req, buflen + sizeof(*req));
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
+        _opaque_decode(req->buf, buflen,
+                       &batch, &len,
+                       NULL);
+
+        if (batch == NULL || len < offsetof(mdkv_batch_t, buf) + batch->len) {
+                ret = EINVAL;
+                GOTO(err_ret, ret);
+        }
+
+        ret = mdkv_write(batch);
+        if (ret)
+                goto err_ret;
+
+        rpc_reply(sockid, msgid, NULL, 0);
+
+        mem_cache_free(MEM_CACHE_4K, buf);
+
+        return 0;
+err_ret:
+        mem_cache_free(MEM_CACHE_4K, buf);
+        return ret;
+}
+
+/**
+ * apply the records of batch all or none on the master
+ */
+int mond_rpc_mdkv_write(const mdkv_batch_t *batch)
+{
+        int ret;
+        char *buf = mem_cache_calloc1(MEM_CACHE_4K, PAGE_SIZE);
+        uint32_t count;
+        msg_t *req;
+
+        ret = network_connect_master();
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
+        ANALYSIS_BEGIN(0);
+
+        req = (void *)buf;
+        req->op = MOND_MDKV_WRITE;
+        _opaque_encode(&req->buf, &count,
+                       batch, offsetof(mdkv_batch_t, buf) + batch->len,
+                       NULL);
+
+        req->buflen = count;
+
+        ret = rpc_request_wait("mond_rpc_mdkv_write", net_getadmin(),
+                               req, sizeof(*req) + count, NULL, NULL,
+                               MSG_MOND, 0, _get_timeout());
+        if (unlikely(ret))
+                goto err_ret;
+
+        ANALYSIS_QUEUE(0, IO_WARN, NULL);
+
+        mem_cache_free(MEM_CACHE_4K, buf);
+
+        return 0;
+err_ret:
+        mem_cache_free(MEM_CACHE_4K, buf);
+        return ret;
+}
+
+static int __mond_srv_mdkv_scan(const sockid_t *sockid, const msgid_t *msgid, buffer_t *_buf)
+{
+        int ret, more;
+        msg_t *req;
+        char *buf = mem_cache_calloc1(MEM_CACHE_4K, PAGE_SIZE);
+        uint32_t buflen, slen, plen, replen;
+        const char *start, *prefix;
+        const uint32_t *count, *max;
+        const mdkv_rec_t *rec;
+        mdkv_scan_t *scan;
+
+        req = (void *)buf;
+        mbuffer_get(_buf, req, sizeof(*req));
+        buflen = req->buflen;
+        ret = mbuffer_popmsg(_buf, req, buflen + sizeof(*req));
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
+        _opaque_decode(req->buf, buflen,
+                       &start, &slen,
+                       &prefix, &plen,
+                       &count, NULL,
+                       &max, NULL,
+                       NULL);
+
+        replen = *max < MDKV_SCAN_MAX ? *max : MDKV_SCAN_MAX;
+        if (replen < sizeof(*scan)) {
+                ret = EINVAL;
+                GOTO(err_ret, ret);
+        }
+
+        ret = ymalloc((void **)&scan, replen);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        replen -= sizeof(*scan);
+        ret = mdkv_scan(start, slen, prefix, plen, *count, scan + 1, &replen, &more);
+        if (ret)
+                GOTO(err_free, ret);
+
+        scan->more = more;
+        scan->count = 0;
+        mdkv_for_each(scan + 1, replen, rec) {
+                scan->count++;
+        }
+
+        rpc_reply(sockid, msgid, scan, sizeof(*scan) + replen);
+
+        yfree((void **)&scan);
+        mem_cache_free(MEM_CACHE_4K, buf);
+
+        return 0;
+err_free:
+        yfree((void **)&scan);
+err_ret:
+        mem_cache_free(MEM_CACHE_4K, buf);
+        return ret;
+}
+
+/**
+ * up to count records in key order from start on, while the keys begin
+ * with prefix. buf gets an mdkv_scan_t, then the records.
+ */
+int mond_rpc_mdkv_scan(const char *start, uint32_t slen, const char *prefix,
+                       uint32_t plen, uint32_t count, void *_buf, uint32_t *buflen)
+{
+        int ret, replen;
+        char *buf = mem_cache_calloc1(MEM_CACHE_4K, PAGE_SIZE);
+        uint32_t len;
+        msg_t *req;
+
+        ret = network_connect_master();
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
+        ANALYSIS_BEGIN(0);
+
+        req = (void *)buf;
+        req->op = MOND_MDKV_SCAN;
+        _opaque_encode(&req->buf, &len,
+                       start, slen,
+                       prefix, plen,
+                       &count, sizeof(count),
+                       buflen, sizeof(*buflen),
+                       NULL);
+
+        req->buflen = len;
+
+        replen = *buflen;
+        ret = rpc_request_wait("mond_rpc_mdkv_scan", net_getadmin(),
+                               req, sizeof(*req) + len, _buf, &replen,
+                               MSG_MOND, 0, _get_timeout());
+        if (unlikely(ret))
+                goto err_ret;
+
+        *buflen = replen;
+
+        ANALYSIS_QUEUE(0, IO_WARN, NULL);
+
+        mem_cache_free(MEM_CACHE_4K, buf);
+
+        return 0;
+err_ret:
+        mem_cache_free(MEM_CACHE_4K, buf);
+        return ret;
+}
+
 int mond_rpc_init()
 {
         DINFO("mond rpc init\n");
@@ -580,6 +844,9 @@ int mond_rpc_init()
         __request_set_handler(MOND_NEWDISK, __mond_srv_newdisk, "mond_srv_newdisk");
         __request_set_handler(MOND_DISKJOIN, __mond_srv_diskjoin, "mond_srv_diskjoin");
         __request_set_handler(MOND_STATVFS, __mond_srv_statvfs, "mond_srv_statvfs");
+        __request_set_handler(MOND_MDKV_GET, __mond_srv_mdkv_get, "mond_srv_mdkv_get");
+        __request_set_handler(MOND_MDKV_WRITE, __mond_srv_mdkv_write, "mond_srv_mdkv_write");
+        __request_set_handler(MOND_MDKV_SCAN, __mond_srv_mdkv_scan, "mond_srv_mdkv_scan");
         
         if (ng.daemon) {
                 rpc_request_register(MSG_MOND, __request_handler, NULL);
@@ -5,6 +5,7 @@
 
 #include "disk_proto.h"
 #include "md_proto.h"
+#include "mdkv.h"
 
 typedef struct {
         nid_t nid;
@@ -21,5 +22,9 @@ int mond_rpc_diskjoin(const nid_t *nid, uint32_t tier, const uuid_t *uuid,
                       const diskinfo_stat_t *stat);
 int mond_rpc_newdisk(const nid_t *nid, uint32_t tier, uint32_t repnum,
                      uint32_t hardend, diskid_t *disks);
+int mond_rpc_mdkv_get(const char *key, uint32_t klen, void *value, uint32_t *vlen);
+int mond_rpc_mdkv_write(const mdkv_batch_t *batch);
+int mond_rpc_mdkv_scan(const char *start, uint32_t slen, const char *prefix,
+                       uint32_t plen, uint32_t count, void *buf, uint32_t *buflen);
 
 #endif
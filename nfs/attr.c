@@ -11,6 +11,7 @@
 #include "md_attr.h"
 #include "network.h"
 #include "yfscli_conf.h"
+#include "nfs_attrcache.h"
 #include "dbg.h"
 
 /*
@@ -39,8 +40,16 @@ err_ret:
 }
 
 int sattr_set(const fileid_t *fileid, const sattr *attr, const nfs3_time *ctime)
+{
+        return sattr_set_wcc(fileid, attr, ctime, NULL);
+}
+
+/* wcc, if set, is filled from the setattr itself */
+int sattr_set_wcc(const fileid_t *fileid, const sattr *attr, const nfs3_time *ctime,
+                  wcc_data *wcc)
 {
         int ret, update = 0;
+        struct stat pre, post;
         setattr_t setattr;
         struct timespec t;
 
@@ -132,9 +141,21 @@ int sattr_set(const fileid_t *fileid, const sattr *attr, const nfs3_time *ctime)
         }
 
         if (update) {
-                ret = sdfs_setattr(fileid, &setattr, 1);
+                ret = sdfs_setattr_wcc(fileid, &setattr, 1,
+                                       wcc ? &pre : NULL, wcc ? &post : NULL);
+                if (ret)
+                        GOTO(err_ret, ret);
+        } else if (wcc) {
+                ret = sdfs_getattr(fileid, &pre);
                 if (ret)
                         GOTO(err_ret, ret);
+
+                post = pre;
+        }
+
+        if (wcc) {
+                get_preopattr_stat(&wcc->before, &pre);
+                get_postopattr_stat(&wcc->after, &post);
         }
 
         return 0;
@@ -228,6 +249,30 @@ err_ret:
         return;
 }
 
+/* from the attr cache if readdirplus left it there */
+void get_postopattr_cache(const fileid_t *fileid, post_op_attr *attr)
+{
+        struct stat stbuf;
+
+        if (nfs_attrcache_get(fileid, &stbuf) == 0) {
+                get_postopattr_stat(attr, &stbuf);
+                return;
+        }
+
+        get_postopattr1(fileid, attr);
+}
+
+void get_preopattr_stat(preop_attr *attr, const struct stat *stbuf)
+{
+        attr->attr_follow = TRUE;
+
+        attr->attr.size = stbuf->st_size;
+        attr->attr.mtime.seconds = stbuf->st_mtime;
+        attr->attr.mtime.nseconds = 0;
+        attr->attr.ctime.seconds = stbuf->st_ctime;
+        attr->attr.ctime.nseconds = 0;
+}
+
 void get_preopattr1(const fileid_t *fileid, preop_attr *attr)
 {
         int ret, retry;
@@ -247,16 +292,62 @@ retry:
                 }
         }
 
-        attr->attr_follow = TRUE;
-
-        attr->attr.size = stbuf.st_size;
-        attr->attr.mtime.seconds = stbuf.st_mtime;
-        attr->attr.mtime.nseconds = 0;
-        attr->attr.ctime.seconds = stbuf.st_ctime;
-        attr->attr.ctime.nseconds = 0;
+        get_preopattr_stat(attr, &stbuf);
 
         return;
 err_ret:
         DWARN(""FID_FORMAT"\n", FID_ARG(fileid));
         return;
 }
+
+/* for ops that leave the attr as it is, one getattr fills both sides */
+void get_wccattr1(const fileid_t *fileid, wcc_data *wcc)
+{
+        int ret, retry;
+        struct stat stbuf;
+
+        wcc->before.attr_follow = FALSE;
+        wcc->after.attr_follow = FALSE;
+        retry = 0;
+retry:
+        ret = sdfs_getattr(fileid, &stbuf);
+        if (ret) {
+                if (NEED_EAGAIN(ret)) {
+                        SLEEP_RETRY3(err_ret, ret, retry, retry, 100);
+                } else {
+                        GOTO(err_ret, ret);
+                }
+        }
+
+        get_preopattr_stat(&wcc->before, &stbuf);
+        get_postopattr_stat(&wcc->after, &stbuf);
+
+        return;
+err_ret:
+        DBUG(""FID_FORMAT"\n", FID_ARG(fileid));
+        return;
+}
+
+/*
+ * namespace ops move the parent times only with ENABLE_MD_POSIX, else its
+ * size, mtime and ctime before the op are those after, so the getattr
+ * after the op fills the before side too.
+ */
+void get_dir_preopattr(const fileid_t *parent, preop_attr *attr)
+{
+#if ENABLE_MD_POSIX
+        get_preopattr1(parent, attr);
+#else
+        (void) parent;
+        attr->attr_follow = FALSE;
+#endif
+}
+
+void get_dir_wccattr(const fileid_t *parent, wcc_data *wcc)
+{
+#if ENABLE_MD_POSIX
+        get_postopattr1(parent, &wcc->after);
+#else
+        get_wccattr1(parent, wcc);
+#endif
+}
@@ -18,7 +18,14 @@ extern int get_postopattr_stat(post_op_attr *, struct stat *);
 
 int sattr_utime(const fileid_t *fileid, int at, int mt, int ct);
 int sattr_set(const fileid_t *fileid, const sattr *attr, const nfs3_time *ctime);
+int sattr_set_wcc(const fileid_t *fileid, const sattr *attr, const nfs3_time *ctime,
+                  wcc_data *wcc);
+void get_preopattr_stat(preop_attr *attr, const struct stat *stbuf);
 void get_preopattr1(const fileid_t *fileid, preop_attr *attr);
 void get_postopattr1(const fileid_t *fileid, post_op_attr *attr);
+void get_postopattr_cache(const fileid_t *fileid, post_op_attr *attr);
+void get_wccattr1(const fileid_t *fileid, wcc_data *wcc);
+void get_dir_preopattr(const fileid_t *parent, preop_attr *attr);
+void get_dir_wccattr(const fileid_t *parent, wcc_data *wcc);
 
 #endif
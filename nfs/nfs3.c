@@ -40,6 +40,10 @@
 #include "core.h"
 #include "yfs_limit.h"
 #include "nfs_proc.h"
+#include "nfs_drc.h"
+#include "nfs_attrcache.h"
+#include "nfs_wgather.h"
+#include "sdfs_wbcache.h"
 #include "dbg.h"
 
 #define __FREE_ARGS(__func__, __request__)              \
@@ -54,17 +58,44 @@
 
 /* write verifier */
 static char wverf[NFS3_WRITEVERFSIZE];
-static uint32_t nfs_read_max_size = NFS_TCPDATA_MAX;
+static uint32_t __wverf_errgen__ = 0;
 extern nfs_analysis_t nfs_analysis;
 
 int nfs_remove(const fileid_t *parent, const char *name);
 
-/* generate write verifier based on PID and current time */
+/* rsize/wsize as a multiple of 4k, at most NFS_TCPDATA_MAX */
+static uint32_t __nfs_xfer_size(int size)
+{
+        if (size <= 0 || size > NFS_TCPDATA_MAX)
+                return NFS_TCPDATA_MAX;
+
+        return _max(size / 4096 * 4096, 4096);
+}
+
+/* generate write verifier based on PID, current time and wbcache errors */
 void regenerate_write_verifier(void)
 {
-        *(wverf + 0) = (uint32_t) getpid();
-        *(wverf + 0) ^= rand();
-        *(wverf + 4) = (uint32_t) time(NULL);
+        uint32_t verf[2];
+
+        verf[0] = (uint32_t)getpid() ^ (uint32_t)rand();
+        verf[1] = (uint32_t)time(NULL) ^ (__wverf_errgen__ << 16);
+        _memcpy(wverf, verf, NFS3_WRITEVERFSIZE);
+}
+
+/*
+ * a failed wbcache flush dropped data acked as UNSTABLE, its error may
+ * expire before a COMMIT sees it, a new verifier makes clients resend
+ */
+static void __nfs_wverf(char *verf)
+{
+        uint32_t errgen = wbcache_errgen();
+
+        if (unlikely(errgen != __wverf_errgen__)) {
+                __wverf_errgen__ = errgen;
+                regenerate_write_verifier();
+        }
+
+        _memcpy(verf, wverf, NFS3_WRITEVERFSIZE);
 }
 
 static void* __nfs_analysis_dump(void *arg)
@@ -237,6 +268,7 @@ static int __nfs3_getattr_svc(const sockid_t *sockid, const sunrpc_request_t *re
 
         DBUG("----NFS3---- fileid "FID_FORMAT" len %u\n", FID_ARG(fileid), args->obj.len);
 
+        /* not from the attr cache, clients check close-to-open with it */
         ret = sdfs_getattr(fileid, &stbuf);
         if (ret) {
                 GOTO(err_rep, ret);
@@ -278,8 +310,7 @@ static int __nfs3_setattr_svc(const sockid_t *sockid, const sunrpc_request_t *re
         setattr3_args *args = &_arg->setattr3_arg;
         fileid_t *fileid = (fileid_t *)args->obj.val;
         setattr3_res res;
-        preop_attr pre;
-        post_op_attr attr;
+        wcc_data *wcc;
         sattr *attr1;
         const nfs3_time *ctime = NULL;
 
@@ -288,8 +319,6 @@ static int __nfs3_setattr_svc(const sockid_t *sockid, const sunrpc_request_t *re
         (void) gid;
         (void) buf;
 
-        get_preopattr1(fileid, &pre);
-        res.setattr3_res_u.resok.obj_wcc.before = pre;
         res.status = NFS3_OK;
         attr1 = &args->new_attributes;
 
@@ -319,15 +348,14 @@ static int __nfs3_setattr_svc(const sockid_t *sockid, const sunrpc_request_t *re
               attr1->atime.time.seconds, attr1->atime.set_it,
               ctime ? ctime->seconds : 0, ctime);
 
-        ret = sattr_set(fileid, attr1, ctime);
+        wcc = &res.setattr3_res_u.resok.obj_wcc;
+        ret = sattr_set_wcc(fileid, attr1, ctime, wcc);
         if (ret)
                 GOTO(err_rep, ret);
 
-        get_postopattr1(fileid, &attr);
+        nfs_attrcache_drop(fileid);
 
-        DBUG("increase %d\n", (int)(attr.attr.size - pre.attr.size));
-
-        res.setattr3_res_u.resok.obj_wcc.after = attr;
+        DBUG("increase %d\n", (int)(wcc->after.attr.size - wcc->before.attr.size));
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                            &res, (xdr_ret_t)xdr_setattrret);
@@ -381,10 +409,12 @@ static int __nfs3_lookup_svc(const sockid_t *sockid, const sunrpc_request_t *req
                         DWARN("lookup parent\n");
                 }
 
-                ret = sdfs_lookup(parent, args->name, &fileid);
-                if (ret) {
-                        DBUG("lookup %s\n", args->name);
-                        GOTO(err_rep, ret);
+                if (nfs_attrcache_lookup(parent, args->name, &fileid)) {
+                        ret = sdfs_lookup(parent, args->name, &fileid);
+                        if (ret) {
+                                DBUG("lookup %s\n", args->name);
+                                GOTO(err_rep, ret);
+                        }
                 }
 
                 if (fileid.volid == 0 || fileid.volid != parent->volid) {
@@ -397,8 +427,8 @@ static int __nfs3_lookup_svc(const sockid_t *sockid, const sunrpc_request_t *req
 
         res.u.ok.obj.len = sizeof(fileid_t);
         res.u.ok.obj.val = (char *)&fileid;
-        get_postopattr1(&fileid, &res.u.ok.obj_attr);
-        get_postopattr1(parent, &res.u.ok.dir_attr);
+        get_postopattr_cache(&fileid, &res.u.ok.obj_attr);
+        get_postopattr_cache(parent, &res.u.ok.dir_attr);
 
         DBUG("parent "FID_FORMAT" name %s ok\n", FID_ARG(parent), args->name);
 
@@ -478,7 +508,7 @@ static int __nfs3_access_svc(const sockid_t *sockid, const sunrpc_request_t *req
 
         DBUG("----NFS3---- fileid "FID_FORMAT" len %u\n", FID_ARG(fileid), args->obj.len);
 
-        get_postopattr1(fileid, &post);
+        get_postopattr_cache(fileid, &post);
 
 #if ENABLE_MD_POSIX
         access = __nfs3_access(&post.attr, uid, gid);
@@ -609,11 +639,11 @@ static int __nfs3_fsinfo_svc(const sockid_t *sockid, const sunrpc_request_t *req
         get_postopattr1(fileid, &res.u.ok.obj_attr);
 
         res.status = NFS3_OK;
-        res.u.ok.rtmax = nfsconf.rsize;
-        res.u.ok.rtpref = nfsconf.rsize;
+        res.u.ok.rtmax = __nfs_xfer_size(nfsconf.rsize);
+        res.u.ok.rtpref = res.u.ok.rtmax;
         res.u.ok.rtmult = 4096;
-        res.u.ok.wtmax = nfsconf.wsize;
-        res.u.ok.wtpref = nfsconf.wsize;
+        res.u.ok.wtmax = __nfs_xfer_size(nfsconf.wsize);
+        res.u.ok.wtpref = res.u.ok.wtmax;
         res.u.ok.wtmult = 4096;
         res.u.ok.dtpref = 4096;
         res.u.ok.maxfilesize = ((LLU)1024 * 1024 * 1024 * 1024 * 10);
@@ -759,7 +789,7 @@ static int __nfs3_create_svc(const sockid_t *sockid, const sunrpc_request_t *req
 
         res.status = NFS3_OK;
 
-        get_preopattr1(parent, &res.u.ok.dir_wcc.before);
+        get_dir_preopattr(parent, &res.u.ok.dir_wcc.before);
 
         if (args->how.mode == EXCLUSIVE) {
                 uint64_t verf;
@@ -823,6 +853,9 @@ static int __nfs3_create_svc(const sockid_t *sockid, const sunrpc_request_t *req
                             mtime, atime, &fileid);
         if (ret)
                 GOTO(err_rep, ret);
+
+        nfs_attrcache_drop(parent);
+        nfs_attrcache_drop(&fileid);
         
         DBUG("fileid "FID_FORMAT"\n", FID_ARG(&fileid));
 
@@ -834,7 +867,7 @@ static int __nfs3_create_svc(const sockid_t *sockid, const sunrpc_request_t *req
         pfh->handle_follows = TRUE;
 
         get_postopattr1(&fileid, &res.u.ok.obj_attr);
-        get_postopattr1(parent, &res.u.ok.dir_wcc.after);
+        get_dir_wccattr(parent, &res.u.ok.dir_wcc);
 
         DBUG("status %d fhlen %u\n", res.status, pfh->handle.len);
         DBUG("parent "FID_FORMAT" %s exist\n", FID_ARG(parent), args->where.name);
@@ -947,7 +980,6 @@ static int __nfs3_mkdir_svc(const sockid_t *sockid, const sunrpc_request_t *req,
         fileid_t *parent = (fileid_t *)args->where.dir.val;
         fileid_t fileid;
         preop_attr pre;
-        post_op_attr post;
         mode_t mode;
         postop_fh *pfh;
         mkdir_ret res;
@@ -956,13 +988,15 @@ static int __nfs3_mkdir_svc(const sockid_t *sockid, const sunrpc_request_t *req,
 
         DBUG("----NFS3---- parent "FID_FORMAT" %s exist\n", FID_ARG(parent), args->where.name);
 
-        get_preopattr1(parent, &pre);
+        get_dir_preopattr(parent, &pre);
         (void) sattr_tomode(&mode, &args->attr);
 
         ret = __nfs3_mkdir(parent, args->where.name, uid, gid, mode, -1, -1, &fileid);
         if (ret)
                 GOTO(err_rep, ret);
 
+        nfs_attrcache_drop(parent);
+
 #if 0
         ret = sattr_set(&fileid, &args->attr, NULL);
         if (ret)
@@ -977,11 +1011,10 @@ static int __nfs3_mkdir_svc(const sockid_t *sockid, const sunrpc_request_t *req,
         res.status = NFS3_OK;
 
         get_postopattr1(&fileid, &res.u.ok.obj_attr);
-        get_postopattr1(parent, &post);
 
         /* overlaps with resfail */
         res.u.ok.dir_wcc.before = pre;
-        res.u.ok.dir_wcc.after = post;
+        get_dir_wccattr(parent, &res.u.ok.dir_wcc);
 
         DBUG("parent "FID_FORMAT" name: %s ok\n", FID_ARG(parent), args->where.name);
 
@@ -1074,6 +1107,7 @@ static int __nfs3_readdirplus_svc(const sockid_t *sockid, const sunrpc_request_t
         entryplus *entrys;
         char *patharray;
         fileid_t *fharray;
+        struct stat stbuf;
         void *ptr;
 
         (void) req;
@@ -1104,7 +1138,13 @@ static int __nfs3_readdirplus_svc(const sockid_t *sockid, const sunrpc_request_t
 
         res.status = NFS3_OK;
 
-        get_postopattr1(fileid, &res.u.ok.dir_attr);
+        /* lookups of the entries return the dir attr too */
+        res.u.ok.dir_attr.attr_follow = FALSE;
+        ret = sdfs_getattr(fileid, &stbuf);
+        if (ret == 0) {
+                nfs_attrcache_put(fileid, &stbuf);
+                get_postopattr_stat(&res.u.ok.dir_attr, &stbuf);
+        }
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                            &res, (xdr_ret_t)xdr_readdirplusret);
@@ -1145,6 +1185,8 @@ static int __nfs3_rmdir_svc(const sockid_t *sockid, const sunrpc_request_t *req,
 
         DBUG("----NFS3---- parent "FID_FORMAT" name %s\n", FID_ARG(parent), args->obj.name);
 
+        get_dir_preopattr(parent, &res.dir_wcc.before);
+
         ret = sdfs_lookup(parent, args->obj.name, &fileid);
         if (ret) {
                 if (ret == ENOENT) {
@@ -1156,8 +1198,6 @@ static int __nfs3_rmdir_svc(const sockid_t *sockid, const sunrpc_request_t *req,
                 }
         }
 
-        get_preopattr1(&fileid, &res.dir_wcc.before);
-
         ret = sdfs_rmdir(parent, args->obj.name);
         if (ret) {
                 if (ret == ENOENT) {
@@ -1171,10 +1211,11 @@ static int __nfs3_rmdir_svc(const sockid_t *sockid, const sunrpc_request_t *req,
 
 rmdir_ok:
         DBUG("rmdir ok parent "FID_FORMAT" name %s\n", FID_ARG(parent), args->obj.name);
+        nfs_attrcache_unlink(parent, args->obj.name);
         res.status = NFS3_OK;
 
         /* overlaps with resfail */
-        get_postopattr1(parent, &res.dir_wcc.after);
+        get_dir_wccattr(parent, &res.dir_wcc);
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                            &res, (xdr_ret_t)xdr_rmdirret);
@@ -1286,6 +1327,8 @@ static int __nfs3_symlink_svc(const sockid_t *sockid, const sunrpc_request_t *re
                 }
         }
 
+        nfs_attrcache_drop(parent);
+
         ret = sdfs_lookup(parent, args->where.name, &fileid);
         if (ret) {
                 DWARN("lookup %s form "FID_FORMAT"\n", args->where.name, FID_ARG(parent));
@@ -1301,7 +1344,7 @@ static int __nfs3_symlink_svc(const sockid_t *sockid, const sunrpc_request_t *re
 
         res.u.ok.dir_wcc.before.attr_follow = FALSE;
         get_postopattr1(&fileid, &res.u.ok.obj_attributes);
-        get_postopattr1(parent, &res.u.ok.dir_wcc.after);
+        get_dir_wccattr(parent, &res.u.ok.dir_wcc);
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                            &res, (xdr_ret_t)xdr_symlinkret);
@@ -1367,6 +1410,8 @@ static int __nfs3_remove_svc(const sockid_t *sockid, const sunrpc_request_t *req
         DBUG("----NFS3---- parent "FID_FORMAT" name %s\n", FID_ARG(parent),
                         args->obj.name);
 
+        get_dir_preopattr(parent, &res.dir_wcc.before);
+
         ret = sdfs_lookup(parent, args->obj.name, &fileid);
         if (ret) {
                 if (ret == ENOENT) {
@@ -1376,8 +1421,6 @@ static int __nfs3_remove_svc(const sockid_t *sockid, const sunrpc_request_t *req
                 }
         }
 
-        get_preopattr1(&fileid, &res.dir_wcc.before);
-
 #if 1
         ret = nfs_remove(parent, args->obj.name);
         if (ret) {
@@ -1397,9 +1440,10 @@ static int __nfs3_remove_svc(const sockid_t *sockid, const sunrpc_request_t *req
 remove_ok:
         DBUG("rmove ok parent "FID_FORMAT" name %s\n",
              FID_ARG(parent), args->obj.name);
+        nfs_attrcache_unlink(parent, args->obj.name);
 
         res.status = NFS3_OK;
-        get_postopattr1(parent, &res.dir_wcc.after);
+        get_dir_wccattr(parent, &res.dir_wcc);
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                            &res, (xdr_ret_t)xdr_removeret);
@@ -1501,17 +1545,20 @@ static int __nfs3_rename_svc(const sockid_t *sockid, const sunrpc_request_t *req
         DBUG("----NFS3---- from "FID_FORMAT" %s to "FID_FORMAT" %s\n", FID_ARG(fromdir),
              from, FID_ARG(todir), to);
 
-        get_preopattr1(fromdir, &res.u.ok.from.before);
-        get_preopattr1(todir, &res.u.ok.to.before);
+        get_dir_preopattr(fromdir, &res.u.ok.from.before);
+        get_dir_preopattr(todir, &res.u.ok.to.before);
 
         ret = __rename_proc(fromdir, from, todir, to);
         if (ret)
                 GOTO(err_rep, ret);
 
+        nfs_attrcache_unlink(fromdir, from);
+        nfs_attrcache_unlink(todir, to);
+
         res.status = NFS3_OK;
 
-        get_postopattr1(fromdir, &res.u.ok.from.after);
-        get_postopattr1(todir, &res.u.ok.to.after);
+        get_dir_wccattr(fromdir, &res.u.ok.from);
+        get_dir_wccattr(todir, &res.u.ok.to);
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                            &res, (xdr_ret_t)xdr_renameret);
@@ -1548,7 +1595,7 @@ static int __nfs3_link_svc(const sockid_t *sockid, const sunrpc_request_t *req,
         (void) uid;
         (void) gid;
 
-        get_preopattr1(parent, &res.u.ok.linkdir_wcc.before);
+        get_dir_preopattr(parent, &res.u.ok.linkdir_wcc.before);
 
         DBUG("----NFS3---- parent "FID_FORMAT" name %s\n", FID_ARG(parent), args->link.name);
 
@@ -1557,9 +1604,12 @@ static int __nfs3_link_svc(const sockid_t *sockid, const sunrpc_request_t *req,
         if (ret)
                 GOTO(err_rep, ret);
 
+        nfs_attrcache_drop(parent);
+        nfs_attrcache_drop(fileid);
+
         res.status = NFS3_OK;
 
-        get_postopattr1(parent, &res.u.ok.linkdir_wcc.after);
+        get_dir_wccattr(parent, &res.u.ok.linkdir_wcc);
         get_postopattr1(fileid, &res.u.ok.file_attributes);
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
@@ -1597,12 +1647,16 @@ static int __nfs3_commit_svc(const sockid_t *sockid, const sunrpc_request_t *req
 
         DBUG("----NFS3---- commit "FID_FORMAT" size %u offset %ju\n",
               FID_ARG(fileid), args->count, args->offset);
+
+        ret = sdfs_fsync(fileid);
+        if (ret)
+                GOTO(err_rep, ret);
         
         res.status = NFS3_OK;
-        _memcpy(res.u.ok.verf, wverf, NFS3_WRITEVERFSIZE);
+        __nfs_wverf(res.u.ok.verf);
 
-        get_preopattr1(fileid, &res.u.ok.file_wcc.before);
-        get_postopattr1(fileid, &res.u.ok.file_wcc.after);
+        /* the flush leaves the attr as getattr saw it */
+        get_wccattr1(fileid, &res.u.ok.file_wcc);
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                            &res, (xdr_ret_t)xdr_commitret);
@@ -1613,11 +1667,12 @@ static int __nfs3_commit_svc(const sockid_t *sockid, const sunrpc_request_t *req
         __FREE_ARGS(commit, buf);
 
         return 0;
-#if 0
 err_rep:
+        res.status = write_err(ret);
+        res.u.fail.file_wcc.before.attr_follow = FALSE;
+        res.u.fail.file_wcc.after.attr_follow = FALSE;
         sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                      &res, (xdr_ret_t)xdr_commitret);
-#endif
 err_ret:
         __FREE_ARGS(commit, buf);
         return ret;
@@ -1658,6 +1713,12 @@ static int __nfs3_read_svc(const sockid_t *sockid, const sunrpc_request_t *req,
                 goto read_zero;
         }
 
+        /* cap before eof is decided, a capped read stops short of the end */
+        if (unlikely(args->count > __nfs_xfer_size(nfsconf.rsize))) {
+                DWARN("request too big %u\n", args->count);
+                args->count = __nfs_xfer_size(nfsconf.rsize);
+        }
+
         if (args->count + args->offset >= (LLU)stbuf.st_size) {
                 DBUG("read offset %llu count %u, file len %llu\n", (LLU)args->offset,
                      args->count, (LLU)stbuf.st_size);
@@ -1666,11 +1727,6 @@ static int __nfs3_read_svc(const sockid_t *sockid, const sunrpc_request_t *req,
         } else
                 eof = 0;
 
-        if (unlikely(args->count > nfs_read_max_size)) {
-                DWARN("request too big %u\n", args->count);
-                args->count = nfs_read_max_size;
-        }
-
         ret = sdfs_read(fileid, &rbuf, args->count, args->offset);
         if (unlikely(ret))
                 GOTO(err_rep, ret);
@@ -1685,10 +1741,13 @@ read_zero:
 
 #if ENABLE_MD_POSIX
         sattr_utime(fileid, 1, 0, 0);
-#endif
-        
+
         /* overlaps with resfail */
         get_postopattr1(fileid, &res.u.ok.attr);
+#else
+        /* a read leaves the attr as the getattr above saw it */
+        get_postopattr_stat(&res.u.ok.attr, &stbuf);
+#endif
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                            &res, (xdr_ret_t)xdr_readret);
@@ -1714,46 +1773,77 @@ err_ret:
 static int __nfs3_write_svc(const sockid_t *sockid, const sunrpc_request_t *req,
                            uid_t uid, gid_t gid, nfsarg_t *_arg, buffer_t *buf)
 {
-        int ret;
+        int ret, stable, synced = 0;
         write_args *args = &_arg->write_arg;
         write_ret res;
         fileid_t *fileid = (fileid_t *)args->file.val;
         const buffer_t *wbuf = (buffer_t *)args->data.val;
-        preop_attr attr;
+        struct stat pre, post;
 
         (void) uid;
         (void) gid;
 
         ANALYSIS_BEGIN(0);
         
-        get_preopattr1(fileid, &attr);
-
         DBUG("----NFS3---- write "FID_FORMAT" size %u offset %ju\n",
               FID_ARG(fileid), args->count, args->offset);
+
+        /* data absorbed by wbcache is stable only after COMMIT */
+        stable = !(args->stable == UNSTABLE && gloconf.wbcache);
         
         if (args->data.len == 0) {
                 DWARN("write "FID_FORMAT" off %llu size %u\n",
                       FID_ARG(fileid), (LLU)args->offset, args->data.len);
+
+                ret = sdfs_getattr(fileid, &pre);
+                if (ret)
+                        GOTO(err_rep, ret);
+
+                post = pre;
+        } else if (stable && nfs_wgather_enabled()) {
+                /* written and synced with the writes gathered to it */
+                ret = nfs_write_gather(fileid, (buffer_t *)wbuf, args->data.len,
+                                       args->offset, &pre, &post);
+                if (ret)
+                        GOTO(err_rep, ret);
+
+                synced = 1;
+                nfs_attrcache_drop(fileid);
         } else {
-                ret = sdfs_write(fileid, wbuf, args->data.len, args->offset);
+                ret = sdfs_write_wcc(fileid, wbuf, args->data.len, args->offset,
+                                     &pre, &post);
                 if (ret)
                         GOTO(err_rep, ret);
+
+                nfs_attrcache_drop(fileid);
+        }
+
+        if (!stable) {
+                res.u.ok.committed = UNSTABLE;
+        } else {
+                if (!synced) {
+                        ret = sdfs_fsync(fileid);
+                        if (ret)
+                                GOTO(err_rep, ret);
+                }
+
+                res.u.ok.committed = FILE_SYNC;
         }
 
         res.status = NFS3_OK;
         res.u.ok.count = args->data.len;
-        //res.u.ok.committed = args->stable;
-        res.u.ok.committed = FILE_SYNC;
-        _memcpy(res.u.ok.verf, wverf, NFS3_WRITEVERFSIZE);
+        __nfs_wverf(res.u.ok.verf);
 
         DBUG("write %u\n", res.u.ok.count);
 
+        get_preopattr_stat(&res.u.ok.file_wcc.before, &pre);
+
 #if ENABLE_MD_POSIX
         sattr_utime(fileid, 0, 1, 1);
-#endif
-        
-        res.u.ok.file_wcc.before = attr;
         get_postopattr1(fileid, &res.u.ok.file_wcc.after);
+#else
+        get_postopattr_stat(&res.u.ok.file_wcc.after, &post);
+#endif
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                            &res, (xdr_ret_t)xdr_writeret);
@@ -1955,13 +2045,21 @@ int nfs_ver3(const sockid_t *sockid, const sunrpc_request_t *req,
                 GOTO(err_ret, ret);
         }
 
+        ret = nfs_drc_check(sockid, req, buf);
+        if (ret) {
+                if (ret == EINPROGRESS || ret == EEXIST)
+                        return 0;
+
+                GOTO(err_ret, ret);
+        }
+
         xdr.op = __XDR_DECODE;
         xdr.buf = buf;
 
         if (xdr_arg) {
                 if (xdr_arg(&xdr, &nfsarg)) {
                         ret = EINVAL;
-                        GOTO(err_ret, ret);
+                        GOTO(err_drc, ret);
                 }
         }
 
@@ -1974,14 +2072,18 @@ int nfs_ver3(const sockid_t *sockid, const sunrpc_request_t *req,
                 ret = core_request(hash, -1, name, __core_handler, handler,
                                    sockid, req, uid, gid, &nfsarg, buf);
                 if (ret)
-                        GOTO(err_ret, ret);
+                        GOTO(err_drc, ret);
         } else {
                 ret = handler(sockid, req, uid, gid, &nfsarg, buf);
                 if (ret)
-                        GOTO(err_ret, ret);
+                        GOTO(err_drc, ret);
         }
 
+        nfs_drc_end(sockid, req);
+
         return 0;
+err_drc:
+        nfs_drc_end(sockid, req);
 err_ret:
         return ret;
 }
@@ -0,0 +1,400 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YNFS
+
+#include "ylib.h"
+#include "ytime.h"
+#include "sdfs_list.h"
+#include "configure.h"
+#include "nfs_attrcache.h"
+#include "dbg.h"
+
+/*
+ * attribute and dentry cache
+ *
+ * READDIRPLUS puts the attr of every entry it returns and the name to
+ * fileid of each, clients follow up with LOOKUP and ACCESS on the same
+ * entries, which are then answered from here. GETATTR always reads the
+ * metadata, a client checks close-to-open consistency with it and a
+ * change made through another gateway must show at once. entries live
+ * nfsconf.attr_cache_ttl ms (off by default), procedures that change an
+ * attr or a name drop the entries they touch, the ttl bounds what other
+ * gateways do behind our back. two tables, split in NFS_ATTRCACHE_SHARD
+ * shards with a lock and an lru each.
+ */
+
+#define NFS_ATTRCACHE_SHARD 16
+#define NFS_ATTRCACHE_HASH 1024
+#define NFS_ATTRCACHE_MAX (64 * 1024)
+
+typedef struct {
+        struct list_head lru;
+        struct list_head hook;
+        ytime_t time;
+        fileid_t fileid;
+        struct stat stbuf;
+} nfs_attr_ent_t;
+
+typedef struct {
+        struct list_head lru;
+        struct list_head hook;
+        ytime_t time;
+        fileid_t parent;
+        fileid_t fileid;
+        char name[0];
+} nfs_dentry_ent_t;
+
+typedef struct {
+        sy_spinlock_t lock;
+        int count;
+        struct list_head lru;   /* oldest first */
+        struct list_head hash[NFS_ATTRCACHE_HASH];
+} nfs_attrcache_t;
+
+static nfs_attrcache_t *__attr__ = NULL;
+static nfs_attrcache_t *__dentry__ = NULL;
+static ytime_t __ttl__;
+
+static uint32_t __nfs_attr_hash(const fileid_t *fileid)
+{
+        return hash_mem(fileid, sizeof(*fileid));
+}
+
+static uint32_t __nfs_dentry_hash(const fileid_t *parent, const char *name)
+{
+        return hash_mem(parent, sizeof(*parent)) ^ hash_str(name);
+}
+
+static nfs_attrcache_t *__nfs_attrcache_shard(nfs_attrcache_t *array, uint32_t hash)
+{
+        return &array[hash % NFS_ATTRCACHE_SHARD];
+}
+
+static struct list_head *__nfs_attrcache_head(nfs_attrcache_t *cache, uint32_t hash)
+{
+        return &cache->hash[(hash / NFS_ATTRCACHE_SHARD) % NFS_ATTRCACHE_HASH];
+}
+
+static int __nfs_attrcache_expired(ytime_t time)
+{
+        return ytime_gettime() - time > __ttl__;
+}
+
+static void __nfs_attrcache_del(nfs_attrcache_t *cache, struct list_head *lru,
+                                struct list_head *hook)
+{
+        list_del(lru);
+        list_del(hook);
+        cache->count--;
+}
+
+static nfs_attr_ent_t *__nfs_attr_find(nfs_attrcache_t *cache, uint32_t hash,
+                                       const fileid_t *fileid)
+{
+        struct list_head *pos;
+        nfs_attr_ent_t *ent;
+
+        list_for_each(pos, __nfs_attrcache_head(cache, hash)) {
+                ent = list_entry(pos, nfs_attr_ent_t, hook);
+                if (fileid_cmp(&ent->fileid, fileid) == 0)
+                        return ent;
+        }
+
+        return NULL;
+}
+
+static void __nfs_attr_free(nfs_attrcache_t *cache, nfs_attr_ent_t *ent)
+{
+        __nfs_attrcache_del(cache, &ent->lru, &ent->hook);
+        yfree((void **)&ent);
+}
+
+void nfs_attrcache_put(const fileid_t *fileid, const struct stat *stbuf)
+{
+        int ret;
+        uint32_t hash;
+        nfs_attrcache_t *cache;
+        nfs_attr_ent_t *ent;
+
+        if (__attr__ == NULL)
+                return;
+
+        hash = __nfs_attr_hash(fileid);
+        cache = __nfs_attrcache_shard(__attr__, hash);
+
+        sy_spin_lock(&cache->lock);
+
+        ent = __nfs_attr_find(cache, hash, fileid);
+        if (ent) {
+                __nfs_attr_free(cache, ent);
+        }
+
+        while (cache->count >= NFS_ATTRCACHE_MAX / NFS_ATTRCACHE_SHARD) {
+                ent = list_entry(cache->lru.next, nfs_attr_ent_t, lru);
+                __nfs_attr_free(cache, ent);
+        }
+
+        ret = ymalloc((void **)&ent, sizeof(*ent));
+        if (ret) {
+                sy_spin_unlock(&cache->lock);
+                return;
+        }
+
+        ent->fileid = *fileid;
+        ent->stbuf = *stbuf;
+        ent->time = ytime_gettime();
+
+        list_add_tail(&ent->lru, &cache->lru);
+        list_add(&ent->hook, __nfs_attrcache_head(cache, hash));
+        cache->count++;
+
+        sy_spin_unlock(&cache->lock);
+}
+
+/* 0 on hit, ENOENT if not cached or expired */
+int nfs_attrcache_get(const fileid_t *fileid, struct stat *stbuf)
+{
+        int ret;
+        uint32_t hash;
+        nfs_attrcache_t *cache;
+        nfs_attr_ent_t *ent;
+
+        if (__attr__ == NULL)
+                return ENOENT;
+
+        hash = __nfs_attr_hash(fileid);
+        cache = __nfs_attrcache_shard(__attr__, hash);
+
+        sy_spin_lock(&cache->lock);
+
+        ent = __nfs_attr_find(cache, hash, fileid);
+        if (ent == NULL) {
+                ret = ENOENT;
+        } else if (__nfs_attrcache_expired(ent->time)) {
+                __nfs_attr_free(cache, ent);
+                ret = ENOENT;
+        } else {
+                *stbuf = ent->stbuf;
+                ret = 0;
+        }
+
+        sy_spin_unlock(&cache->lock);
+
+        return ret;
+}
+
+void nfs_attrcache_drop(const fileid_t *fileid)
+{
+        uint32_t hash;
+        nfs_attrcache_t *cache;
+        nfs_attr_ent_t *ent;
+
+        if (__attr__ == NULL)
+                return;
+
+        hash = __nfs_attr_hash(fileid);
+        cache = __nfs_attrcache_shard(__attr__, hash);
+
+        sy_spin_lock(&cache->lock);
+
+        ent = __nfs_attr_find(cache, hash, fileid);
+        if (ent) {
+                __nfs_attr_free(cache, ent);
+        }
+
+        sy_spin_unlock(&cache->lock);
+}
+
+static nfs_dentry_ent_t *__nfs_dentry_find(nfs_attrcache_t *cache, uint32_t hash,
+                                           const fileid_t *parent, const char *name)
+{
+        struct list_head *pos;
+        nfs_dentry_ent_t *ent;
+
+        list_for_each(pos, __nfs_attrcache_head(cache, hash)) {
+                ent = list_entry(pos, nfs_dentry_ent_t, hook);
+                if (fileid_cmp(&ent->parent, parent) == 0
+                    && strcmp(ent->name, name) == 0)
+                        return ent;
+        }
+
+        return NULL;
+}
+
+static void __nfs_dentry_free(nfs_attrcache_t *cache, nfs_dentry_ent_t *ent)
+{
+        __nfs_attrcache_del(cache, &ent->lru, &ent->hook);
+        yfree((void **)&ent);
+}
+
+void nfs_attrcache_link(const fileid_t *parent, const char *name,
+                        const fileid_t *fileid)
+{
+        int ret;
+        uint32_t hash;
+        nfs_attrcache_t *cache;
+        nfs_dentry_ent_t *ent;
+
+        if (__dentry__ == NULL)
+                return;
+
+        hash = __nfs_dentry_hash(parent, name);
+        cache = __nfs_attrcache_shard(__dentry__, hash);
+
+        sy_spin_lock(&cache->lock);
+
+        ent = __nfs_dentry_find(cache, hash, parent, name);
+        if (ent) {
+                __nfs_dentry_free(cache, ent);
+        }
+
+        while (cache->count >= NFS_ATTRCACHE_MAX / NFS_ATTRCACHE_SHARD) {
+                ent = list_entry(cache->lru.next, nfs_dentry_ent_t, lru);
+                __nfs_dentry_free(cache, ent);
+        }
+
+        ret = ymalloc((void **)&ent, sizeof(*ent) + strlen(name) + 1);
+        if (ret) {
+                sy_spin_unlock(&cache->lock);
+                return;
+        }
+
+        ent->parent = *parent;
+        ent->fileid = *fileid;
+        strcpy(ent->name, name);
+        ent->time = ytime_gettime();
+
+        list_add_tail(&ent->lru, &cache->lru);
+        list_add(&ent->hook, __nfs_attrcache_head(cache, hash));
+        cache->count++;
+
+        sy_spin_unlock(&cache->lock);
+}
+
+/* 0 on hit, ENOENT if not cached or expired */
+int nfs_attrcache_lookup(const fileid_t *parent, const char *name, fileid_t *fileid)
+{
+        int ret;
+        uint32_t hash;
+        nfs_attrcache_t *cache;
+        nfs_dentry_ent_t *ent;
+
+        if (__dentry__ == NULL)
+                return ENOENT;
+
+        hash = __nfs_dentry_hash(parent, name);
+        cache = __nfs_attrcache_shard(__dentry__, hash);
+
+        sy_spin_lock(&cache->lock);
+
+        ent = __nfs_dentry_find(cache, hash, parent, name);
+        if (ent == NULL) {
+                ret = ENOENT;
+        } else if (__nfs_attrcache_expired(ent->time)) {
+                __nfs_dentry_free(cache, ent);
+                ret = ENOENT;
+        } else {
+                *fileid = ent->fileid;
+                ret = 0;
+        }
+
+        sy_spin_unlock(&cache->lock);
+
+        return ret;
+}
+
+/* drop the name, the attr of what it pointed to and of the parent */
+void nfs_attrcache_unlink(const fileid_t *parent, const char *name)
+{
+        int found = 0;
+        uint32_t hash;
+        fileid_t fileid;
+        nfs_attrcache_t *cache;
+        nfs_dentry_ent_t *ent;
+
+        nfs_attrcache_drop(parent);
+
+        if (__dentry__ == NULL)
+                return;
+
+        hash = __nfs_dentry_hash(parent, name);
+        cache = __nfs_attrcache_shard(__dentry__, hash);
+
+        sy_spin_lock(&cache->lock);
+
+        ent = __nfs_dentry_find(cache, hash, parent, name);
+        if (ent) {
+                fileid = ent->fileid;
+                found = 1;
+                __nfs_dentry_free(cache, ent);
+        }
+
+        sy_spin_unlock(&cache->lock);
+
+        if (found) {
+                nfs_attrcache_drop(&fileid);
+        }
+}
+
+static int __nfs_attrcache_create(nfs_attrcache_t **_array)
+{
+        int ret, i, j;
+        nfs_attrcache_t *array, *cache;
+
+        ret = ymalloc((void **)&array, sizeof(*array) * NFS_ATTRCACHE_SHARD);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        for (i = 0; i < NFS_ATTRCACHE_SHARD; i++) {
+                cache = &array[i];
+
+                ret = sy_spin_init(&cache->lock);
+                if (ret)
+                        GOTO(err_free, ret);
+
+                cache->count = 0;
+                INIT_LIST_HEAD(&cache->lru);
+                for (j = 0; j < NFS_ATTRCACHE_HASH; j++) {
+                        INIT_LIST_HEAD(&cache->hash[j]);
+                }
+        }
+
+        *_array = array;
+
+        return 0;
+err_free:
+        yfree((void **)&array);
+err_ret:
+        return ret;
+}
+
+int nfs_attrcache_init()
+{
+        int ret;
+        nfs_attrcache_t *attr, *dentry;
+
+        if (nfsconf.attr_cache_ttl <= 0) {
+                DINFO("attr cache disabled\n");
+                return 0;
+        }
+
+        ret = __nfs_attrcache_create(&attr);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = __nfs_attrcache_create(&dentry);
+        if (ret)
+                GOTO(err_free, ret);
+
+        __ttl__ = (ytime_t)nfsconf.attr_cache_ttl * 1000;
+        __dentry__ = dentry;
+        __attr__ = attr;
+
+        return 0;
+err_free:
+        yfree((void **)&attr);
+err_ret:
+        return ret;
+}
@@ -0,0 +1,17 @@
+#ifndef __NFS_ATTRCACHE_H__
+#define __NFS_ATTRCACHE_H__
+
+#include <sys/stat.h>
+
+#include "sdfs_id.h"
+
+int nfs_attrcache_init();
+void nfs_attrcache_put(const fileid_t *fileid, const struct stat *stbuf);
+int nfs_attrcache_get(const fileid_t *fileid, struct stat *stbuf);
+void nfs_attrcache_drop(const fileid_t *fileid);
+void nfs_attrcache_link(const fileid_t *parent, const char *name,
+                        const fileid_t *fileid);
+int nfs_attrcache_lookup(const fileid_t *parent, const char *name, fileid_t *fileid);
+void nfs_attrcache_unlink(const fileid_t *parent, const char *name);
+
+#endif
@@ -0,0 +1,307 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YNFS
+
+#include "ylib.h"
+#include "sdfs_list.h"
+#include "configure.h"
+#include "nfs_state_machine.h"
+#include "sunrpc_proto.h"
+#include "sunrpc_reply.h"
+#include "nfs_drc.h"
+#include "dbg.h"
+
+/*
+ * duplicate request cache
+ *
+ * procedures that must not run twice are remembered by client address,
+ * xid and procedure, the crc of the first NFS_DRC_CSUM bytes of the args
+ * and their length tell a reused xid from a retransmission. a duplicate
+ * of a request still running is dropped, one of a finished request gets
+ * the saved reply again. the cache is split in NFS_DRC_SHARD shards with
+ * a lock and an lru each, nfsconf.drc_size entries in all. a retransmit
+ * may come on a new connection, which the main loop can give to another
+ * worker, so shards go by address and xid, not by worker.
+ */
+
+#define NFS_DRC_SHARD 16
+#define NFS_DRC_HASH 256
+#define NFS_DRC_CSUM 256
+
+typedef enum {
+        NFS_DRC_INPROG,
+        NFS_DRC_DONE,
+} nfs_drc_state_t;
+
+typedef struct {
+        struct list_head lru;
+        struct list_head hook;
+        uint32_t addr;
+        uint32_t xid;
+        uint32_t proc;
+        uint32_t csum;
+        uint32_t len;
+        int state;
+        buffer_t reply;
+} nfs_drc_ent_t;
+
+typedef struct {
+        sy_spinlock_t lock;
+        int count;
+        int max;
+        struct list_head lru;   /* oldest first */
+        struct list_head hash[NFS_DRC_HASH];
+} nfs_drc_t;
+
+static nfs_drc_t *__nfs_drc__ = NULL;
+
+static int __nfs_drc_cached(uint32_t proc)
+{
+        switch (proc) {
+        case NFS3_SETATTR:
+        case NFS3_WRITE:
+        case NFS3_CREATE:
+        case NFS3_MKDIR:
+        case NFS3_SYMLINK:
+        case NFS3_MKNOD:
+        case NFS3_REMOVE:
+        case NFS3_RMDIR:
+        case NFS3_RENAME:
+        case NFS3_LINK:
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+static uint32_t __nfs_drc_hash(uint32_t addr, uint32_t xid)
+{
+        return (addr ^ xid) * 2654435761U;
+}
+
+static nfs_drc_t *__nfs_drc_shard(uint32_t hash)
+{
+        return &__nfs_drc__[hash % NFS_DRC_SHARD];
+}
+
+static nfs_drc_ent_t *__nfs_drc_find(nfs_drc_t *drc, uint32_t hash,
+                                     const sockid_t *sockid,
+                                     const sunrpc_request_t *req)
+{
+        struct list_head *pos;
+        nfs_drc_ent_t *ent;
+
+        list_for_each(pos, &drc->hash[(hash / NFS_DRC_SHARD) % NFS_DRC_HASH]) {
+                ent = list_entry(pos, nfs_drc_ent_t, hook);
+                if (ent->addr == sockid->addr && ent->xid == req->xid
+                    && ent->proc == req->procedure)
+                        return ent;
+        }
+
+        return NULL;
+}
+
+static void __nfs_drc_free(nfs_drc_t *drc, nfs_drc_ent_t *ent)
+{
+        list_del(&ent->lru);
+        list_del(&ent->hook);
+        drc->count--;
+
+        mbuffer_free(&ent->reply);
+        yfree((void **)&ent);
+}
+
+static int __nfs_drc_new(nfs_drc_t *drc, uint32_t hash, const sockid_t *sockid,
+                         const sunrpc_request_t *req, uint32_t csum, uint32_t len)
+{
+        int ret;
+        nfs_drc_ent_t *ent;
+
+        while (drc->count >= drc->max) {
+                ent = list_entry(drc->lru.next, nfs_drc_ent_t, lru);
+                __nfs_drc_free(drc, ent);
+        }
+
+        ret = ymalloc((void **)&ent, sizeof(*ent));
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ent->addr = sockid->addr;
+        ent->xid = req->xid;
+        ent->proc = req->procedure;
+        ent->csum = csum;
+        ent->len = len;
+        ent->state = NFS_DRC_INPROG;
+        mbuffer_init(&ent->reply, 0);
+
+        list_add_tail(&ent->lru, &drc->lru);
+        list_add(&ent->hook, &drc->hash[(hash / NFS_DRC_SHARD) % NFS_DRC_HASH]);
+        drc->count++;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * 0 if the request is to run, EINPROGRESS for a duplicate of one running,
+ * EEXIST when the saved reply was sent again.
+ */
+int nfs_drc_check(const sockid_t *sockid, const sunrpc_request_t *req,
+                  const buffer_t *args)
+{
+        int ret;
+        uint32_t hash, csum, len;
+        nfs_drc_t *drc;
+        nfs_drc_ent_t *ent;
+        buffer_t reply;
+
+        if (__nfs_drc__ == NULL || !__nfs_drc_cached(req->procedure))
+                return 0;
+
+        len = args->len;
+        csum = mbuffer_crc(args, 0, _min(len, NFS_DRC_CSUM));
+        hash = __nfs_drc_hash(sockid->addr, req->xid);
+        drc = __nfs_drc_shard(hash);
+
+        sy_spin_lock(&drc->lock);
+
+        ent = __nfs_drc_find(drc, hash, sockid, req);
+        if (ent && (ent->csum != csum || ent->len != len)) {
+                /* xid reused by the client */
+                __nfs_drc_free(drc, ent);
+                ent = NULL;
+        }
+
+        if (ent == NULL) {
+                ret = __nfs_drc_new(drc, hash, sockid, req, csum, len);
+                sy_spin_unlock(&drc->lock);
+                if (ret) {
+                        /* run it uncached */
+                        DWARN("drc new fail, ret %d\n", ret);
+                }
+
+                return 0;
+        }
+
+        list_del(&ent->lru);
+        list_add_tail(&ent->lru, &drc->lru);
+
+        if (ent->state == NFS_DRC_INPROG) {
+                sy_spin_unlock(&drc->lock);
+                DBUG("xid %u proc %u in progress, drop\n", req->xid, req->procedure);
+                return EINPROGRESS;
+        }
+
+        mbuffer_init(&reply, 0);
+        ret = mbuffer_clone(&reply, &ent->reply);
+        sy_spin_unlock(&drc->lock);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        DINFO("xid %u proc %u from %s replayed\n", req->xid, req->procedure,
+              _inet_ntoa(sockid->addr));
+
+        ret = sunrpc_reply_buf(sockid, &reply);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        return EEXIST;
+err_ret:
+        return ret;
+}
+
+/* keep the reply of a request nfs_drc_check let run */
+void nfs_drc_save(const sockid_t *sockid, const sunrpc_request_t *req,
+                  const buffer_t *reply)
+{
+        int ret;
+        uint32_t hash;
+        nfs_drc_t *drc;
+        nfs_drc_ent_t *ent;
+
+        if (__nfs_drc__ == NULL || req->program != NFS3_PROGRAM
+            || !__nfs_drc_cached(req->procedure))
+                return;
+
+        hash = __nfs_drc_hash(sockid->addr, req->xid);
+        drc = __nfs_drc_shard(hash);
+
+        sy_spin_lock(&drc->lock);
+
+        ent = __nfs_drc_find(drc, hash, sockid, req);
+        if (ent && ent->state == NFS_DRC_INPROG) {
+                ret = mbuffer_clone(&ent->reply, (buffer_t *)reply);
+                if (ret) {
+                        __nfs_drc_free(drc, ent);
+                } else {
+                        ent->state = NFS_DRC_DONE;
+                }
+        }
+
+        sy_spin_unlock(&drc->lock);
+}
+
+/* the request is over, forget it if no reply was saved */
+void nfs_drc_end(const sockid_t *sockid, const sunrpc_request_t *req)
+{
+        uint32_t hash;
+        nfs_drc_t *drc;
+        nfs_drc_ent_t *ent;
+
+        if (__nfs_drc__ == NULL || !__nfs_drc_cached(req->procedure))
+                return;
+
+        hash = __nfs_drc_hash(sockid->addr, req->xid);
+        drc = __nfs_drc_shard(hash);
+
+        sy_spin_lock(&drc->lock);
+
+        ent = __nfs_drc_find(drc, hash, sockid, req);
+        if (ent && ent->state == NFS_DRC_INPROG) {
+                __nfs_drc_free(drc, ent);
+        }
+
+        sy_spin_unlock(&drc->lock);
+}
+
+int nfs_drc_init()
+{
+        int ret, i, j;
+        nfs_drc_t *array, *drc;
+
+        if (nfsconf.drc_size <= 0) {
+                DINFO("drc disabled\n");
+                return 0;
+        }
+
+        ret = ymalloc((void **)&array, sizeof(*array) * NFS_DRC_SHARD);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        for (i = 0; i < NFS_DRC_SHARD; i++) {
+                drc = &array[i];
+
+                ret = sy_spin_init(&drc->lock);
+                if (ret)
+                        GOTO(err_free, ret);
+
+                drc->count = 0;
+                drc->max = _max(nfsconf.drc_size / NFS_DRC_SHARD, 1);
+                INIT_LIST_HEAD(&drc->lru);
+                for (j = 0; j < NFS_DRC_HASH; j++) {
+                        INIT_LIST_HEAD(&drc->hash[j]);
+                }
+        }
+
+        __nfs_drc__ = array;
+
+        return 0;
+err_free:
+        yfree((void **)&array);
+err_ret:
+        return ret;
+}
@@ -0,0 +1,16 @@
+#ifndef __NFS_DRC_H__
+#define __NFS_DRC_H__
+
+#include <stdint.h>
+
+#include "sunrpc_proto.h"
+#include "sdfs_buffer.h"
+
+int nfs_drc_init();
+int nfs_drc_check(const sockid_t *sockid, const sunrpc_request_t *req,
+                  const buffer_t *args);
+void nfs_drc_save(const sockid_t *sockid, const sunrpc_request_t *req,
+                  const buffer_t *reply);
+void nfs_drc_end(const sockid_t *sockid, const sunrpc_request_t *req);
+
+#endif
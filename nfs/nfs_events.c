@@ -24,9 +24,11 @@
 #include "ynfs_conf.h"
 #include "nfs_conf.h"
 #include "ynet_rpc.h"
+#include "main_loop.h"
 #include "dbg.h"
 
 typedef struct {
+        struct list_head hook;
         sockid_t sockid;
         sunrpc_request_t req;
         uid_t uid;
@@ -34,6 +36,27 @@ typedef struct {
         buffer_t buf;
 } sunrpc_req_t;
 
+/*
+ * requests of a connection in flight. a socket is read, decoded and
+ * served by the main loop worker it belongs to (main_loop_event), so
+ * this needs no lock. past nfsconf.job_qos new requests wait in pending
+ * and EPOLLIN is dropped, the client then sees a full tcp window instead
+ * of the whole server stalling. reading goes on once pending is drained
+ * and half of the limit is left.
+ */
+typedef struct {
+        uint32_t seq;           /* sockid seq, a new connection resets */
+        int running;
+        int paused;
+        struct list_head pending;
+} nfs_conn_t;
+
+extern uint64_t nofile_max;
+
+static nfs_conn_t *__nfs_conn__ = NULL;
+
+#define NFS_CONN_PAUSE (Y_EPOLL_EVENTS & ~EPOLLIN)
+
 int acl_null_svc(const sockid_t *sockid, const sunrpc_request_t *req,
                  uid_t uid, gid_t gid, nfsarg_t *arg, buffer_t *buf)
 {
@@ -102,6 +125,65 @@ err_ret:
         return ret;
 }
 
+static void __nfs_exec(void *ctx);
+
+static nfs_conn_t *__nfs_conn(const sockid_t *sockid)
+{
+        nfs_conn_t *conn;
+        sunrpc_req_t *rpc_request;
+
+        YASSERT(sockid->sd >= 0 && (uint64_t)sockid->sd < nofile_max);
+
+        conn = &__nfs_conn__[sockid->sd];
+        if (conn->seq != sockid->seq) {
+                while (!list_empty(&conn->pending)) {
+                        rpc_request = (void *)conn->pending.next;
+                        list_del(&rpc_request->hook);
+                        mbuffer_free(&rpc_request->buf);
+                        mem_cache_free(MEM_CACHE_128, rpc_request);
+                }
+
+                conn->seq = sockid->seq;
+                conn->running = 0;
+                conn->paused = 0;
+        }
+
+        return conn;
+}
+
+static void __nfs_conn_event(const sockid_t *sockid, int event)
+{
+        int ret;
+
+        ret = main_loop_event(sockid->sd, event, EPOLL_CTL_MOD);
+        if (unlikely(ret)) {
+                DWARN("sd %d event %x ret %d\n", sockid->sd, event, ret);
+        }
+}
+
+/* one request of the connection is done, start what waits */
+static void __nfs_conn_done(const sockid_t *sockid)
+{
+        nfs_conn_t *conn;
+        sunrpc_req_t *rpc_request;
+
+        conn = &__nfs_conn__[sockid->sd];
+        if (conn->seq != sockid->seq)
+                return;
+
+        conn->running--;
+        if (!list_empty(&conn->pending)) {
+                rpc_request = (void *)conn->pending.next;
+                list_del(&rpc_request->hook);
+                conn->running++;
+                schedule_task_new("sunrpc", __nfs_exec, rpc_request, 0);
+        } else if (conn->paused && conn->running <= nfsconf.job_qos / 2) {
+                DBUG("sd %d resume, running %d\n", sockid->sd, conn->running);
+                conn->paused = 0;
+                __nfs_conn_event(sockid, Y_EPOLL_EVENTS);
+        }
+}
+
 static void __nfs_exec(void *ctx)
 {
         sunrpc_req_t *rpc_request = ctx;
@@ -129,6 +211,8 @@ static void __nfs_exec(void *ctx)
                        req->progversion);  //XXX: handle this --gray
         }
 
+        __nfs_conn_done(&rpc_request->sockid);
+
         mbuffer_free(&rpc_request->buf);
         mem_cache_free(MEM_CACHE_128, ctx);
 }
@@ -137,7 +221,7 @@ void nfs_newtask(const sockid_t *sockid, const sunrpc_request_t *req,
                  uid_t uid, gid_t gid, buffer_t *buf)
 {
         sunrpc_req_t *rpc_request;
-        
+        nfs_conn_t *conn;
 
 #ifdef HAVE_STATIC_ASSERT
         static_assert(sizeof(*rpc_request)  < sizeof(mem_cache128_t), "rpc_request_t");
@@ -155,6 +239,46 @@ void nfs_newtask(const sockid_t *sockid, const sunrpc_request_t *req,
         mbuffer_init(&rpc_request->buf, 0);
         mbuffer_merge(&rpc_request->buf, buf);
 
+        conn = __nfs_conn(sockid);
+        if (conn->running >= nfsconf.job_qos) {
+                list_add_tail(&rpc_request->hook, &conn->pending);
+                if (!conn->paused) {
+                        DBUG("sd %d pause, running %d\n", sockid->sd, conn->running);
+                        conn->paused = 1;
+                        __nfs_conn_event(sockid, NFS_CONN_PAUSE);
+                }
+
+                return;
+        }
+
+        conn->running++;
         schedule_task_new("sunrpc", __nfs_exec, rpc_request, 0);
 }
 
+int nfs_events_init()
+{
+        int ret;
+        uint64_t i;
+        nfs_conn_t *conn;
+
+        YASSERT(__nfs_conn__ == NULL);
+
+        if (nfsconf.job_qos < 1) {
+                nfsconf.job_qos = 1;
+        }
+
+        ret = ymalloc((void **)&__nfs_conn__, sizeof(*conn) * nofile_max);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        for (i = 0; i < nofile_max; i++) {
+                conn = &__nfs_conn__[i];
+                conn->seq = 0;
+                INIT_LIST_HEAD(&conn->pending);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
@@ -28,5 +28,6 @@ extern int nfs_nlm4(const sockid_t *sockid, const sunrpc_request_t *req,
 
 void nfs_newtask(const sockid_t *sockid, const sunrpc_request_t *req,
                   uid_t uid, gid_t gid, buffer_t *buf);
+int nfs_events_init();
 
 #endif
@@ -12,6 +12,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
 
 
 #define DBG_SUBSYS S_YNFS
@@ -37,62 +38,332 @@
 #include "sdfs_lib.h"
 #include "yfs_limit.h"
 #include "nfs_proc.h"
+#include "sdfs_list.h"
 #include "dbg.h"
 
-static int __sdfs_dir_itor1(const dirid_t *dirid, func1_t func, void *ctx)
+/*
+ * REMOVE renames the file into NFS_REMOVED/<hour> of its volume, the
+ * reaper unlinks buckets older than an hour. volume, trash and bucket ids
+ * are cached per volume, so a remove is one rename as long as the hour
+ * holds. the volume comes from fileid->volid, the map from volid to the
+ * volume directory is read from etcd.
+ */
+
+#define NFS_REAP_INTERVAL 60
+#define NFS_REAP_THREADS 8
+#define NFS_REAP_AGE 3600
+
+typedef struct {
+        struct list_head hook;
+        uint64_t volid;
+        fileid_t vol;
+        int removed_ok;
+        dirid_t removed;
+        time_t hour;
+        dirid_t bucket;
+} nfs_trash_t;
+
+static LIST_HEAD(__nfs_trash__);
+static pthread_mutex_t __nfs_trash_lock__ = PTHREAD_MUTEX_INITIALIZER;
+
+static nfs_trash_t *__nfs_trash_find(uint64_t volid)
+{
+        struct list_head *pos;
+        nfs_trash_t *trash;
+
+        list_for_each(pos, &__nfs_trash__) {
+                trash = list_entry(pos, nfs_trash_t, hook);
+                if (trash->volid == volid)
+                        return trash;
+        }
+
+        return NULL;
+}
+
+static int __nfs_trash_add(const fileid_t *vol)
 {
         int ret;
+        nfs_trash_t *trash;
+
+        pthread_mutex_lock(&__nfs_trash_lock__);
+
+        if (__nfs_trash_find(vol->volid)) {
+                pthread_mutex_unlock(&__nfs_trash_lock__);
+                return 0;
+        }
+
+        ret = ymalloc((void **)&trash, sizeof(*trash));
+        if (ret)
+                GOTO(err_lock, ret);
+
+        trash->volid = vol->volid;
+        trash->vol = *vol;
+        trash->removed_ok = 0;
+        trash->hour = 0;
+        list_add(&trash->hook, &__nfs_trash__);
+
+        pthread_mutex_unlock(&__nfs_trash_lock__);
+
+        return 0;
+err_lock:
+        pthread_mutex_unlock(&__nfs_trash_lock__);
+        return ret;
+}
+
+/* learn the volume directories of all volumes */
+static int __nfs_trash_load()
+{
+        int ret, i;
+        etcd_node_t *array, *node;
+        fileid_t vol;
+
+        ret = etcd_list(ETCD_VOLUME, &array);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        for (i = 0; i < array->num_node; i++) {
+                node = array->nodes[i];
+
+                ret = sdfs_lookupvol(node->key, &vol);
+                if (ret) {
+                        DWARN("lookup volume %s fail\n", node->key);
+                        continue;
+                }
+
+                ret = __nfs_trash_add(&vol);
+                if (ret)
+                        GOTO(err_free, ret);
+        }
+
+        free_etcd_node(array);
+
+        return 0;
+err_free:
+        free_etcd_node(array);
+err_ret:
+        return ret;
+}
+
+static int __nfs_trash_get(uint64_t volid, nfs_trash_t *_trash)
+{
+        int ret, retry = 0;
+        nfs_trash_t *trash;
+
+retry:
+        pthread_mutex_lock(&__nfs_trash_lock__);
+        trash = __nfs_trash_find(volid);
+        if (trash) {
+                *_trash = *trash;
+        }
+        pthread_mutex_unlock(&__nfs_trash_lock__);
+
+        if (trash == NULL) {
+                if (retry) {
+                        ret = ENOENT;
+                        GOTO(err_ret, ret);
+                }
+
+                ret = __nfs_trash_load();
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                retry++;
+                goto retry;
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static void __nfs_trash_set(const nfs_trash_t *_trash)
+{
+        nfs_trash_t *trash;
+
+        pthread_mutex_lock(&__nfs_trash_lock__);
+        trash = __nfs_trash_find(_trash->volid);
+        if (trash) {
+                trash->removed_ok = _trash->removed_ok;
+                trash->removed = _trash->removed;
+                trash->hour = _trash->hour;
+                trash->bucket = _trash->bucket;
+        }
+        pthread_mutex_unlock(&__nfs_trash_lock__);
+}
+
+static int __nfs_mkdir(const dirid_t *parent, const char *name, dirid_t *dirid)
+{
+        int ret;
+
+        ret = sdfs_mkdir(parent, name, NULL, dirid, 0, 0, 0);
+        if (ret) {
+                if (ret == EEXIST) {
+                        ret = sdfs_lookup(parent, name, dirid);
+                        if (ret)
+                                GOTO(err_ret, ret);
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/* the bucket of this hour in the trash of volid */
+static int __nfs_trash_bucket(uint64_t volid, int reload, dirid_t *bucket)
+{
+        int ret;
+        time_t hour;
+        nfs_trash_t trash;
+        char tname[MAX_NAME_LEN];
+
+        ret = __nfs_trash_get(volid, &trash);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        hour = (time(NULL) / 3600) * 3600;
+        if (trash.hour == hour && !reload) {
+                *bucket = trash.bucket;
+                return 0;
+        }
+
+        if (!trash.removed_ok || reload) {
+                ret = __nfs_mkdir(&trash.vol, NFS_REMOVED, &trash.removed);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                trash.removed_ok = 1;
+        }
+
+        snprintf(tname, MAX_NAME_LEN, "%d", (int)hour);
+        ret = __nfs_mkdir(&trash.removed, tname, &trash.bucket);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        trash.hour = hour;
+        __nfs_trash_set(&trash);
+
+        *bucket = trash.bucket;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+typedef struct {
+        const dirid_t *parent;
+        char (*names)[MAX_NAME_LEN];
+        int count;
+        int idx;
+} nfs_reap_t;
+
+static void *__nfs_reap_thread(void *arg)
+{
+        int ret, i;
+        nfs_reap_t *reap = arg;
+
+        for (i = reap->idx; i < reap->count; i += NFS_REAP_THREADS) {
+                DBUG("remove %s @ "CHKID_FORMAT"\n", reap->names[i], CHKID_ARG(reap->parent));
+
+                ret = sdfs_unlink(reap->parent, reap->names[i]);
+                if (ret) {
+                        DWARN("remove %s @ "CHKID_FORMAT" fail\n", reap->names[i],
+                              CHKID_ARG(reap->parent));
+                }
+        }
+
+        return NULL;
+}
+
+/* unlink a page of names with up to NFS_REAP_THREADS threads */
+static void __nfs_reap_batch(const dirid_t *parent, char (*names)[MAX_NAME_LEN], int count)
+{
+        int ret, i, n;
+        nfs_reap_t reap[NFS_REAP_THREADS];
+        pthread_t th[NFS_REAP_THREADS];
+
+        n = _min(count, NFS_REAP_THREADS);
+        for (i = 0; i < n; i++) {
+                reap[i].parent = parent;
+                reap[i].names = names;
+                reap[i].count = count;
+                reap[i].idx = i;
+        }
+
+        for (i = 1; i < n; i++) {
+                ret = pthread_create(&th[i], NULL, __nfs_reap_thread, &reap[i]);
+                if (ret) {
+                        DWARN("thread create fail, ret %d\n", ret);
+                        __nfs_reap_thread(&reap[i]);
+                        th[i] = 0;
+                }
+        }
+
+        if (n)
+                __nfs_reap_thread(&reap[0]);
+
+        for (i = 1; i < n; i++) {
+                if (th[i])
+                        pthread_join(th[i], NULL);
+        }
+}
+
+static int __nfs_reap_bucket(const dirid_t *dirid)
+{
+        int ret, delen, count;
         off_t offset = 0;
         void *de0 = NULL;
-        int delen = 0;
         struct dirent *de;
-        uint64_t count;
-        
+        char (*names)[MAX_NAME_LEN];
+
+        ret = ymalloc((void **)&names, sizeof(*names) * MAX_READDIR_ENTRIES * 2);
+        if (ret)
+                GOTO(err_ret, ret);
+
         while (srv_running) {
                 ret = sdfs_readdir1(dirid, offset, &de0, &delen);
                 if (ret) {
-                        GOTO(err_ret, ret);
+                        GOTO(err_free, ret);
                 }
 
                 if (delen == 0) {
                         break;
                 }
-                
+
+                count = 0;
                 dir_for_each(de0, delen, de, offset) {
-                        func(de, ctx);
                         offset = de->d_off;
-                        count ++;
+                        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                                continue;
 
-                        DBUG("%s offset %ju %p\n", de->d_name, offset, de);
+                        if (count == MAX_READDIR_ENTRIES * 2) {
+                                __nfs_reap_batch(dirid, names, count);
+                                count = 0;
+                        }
+
+                        strcpy(names[count++], de->d_name);
                 }
 
                 yfree((void **)&de0);
-                
+
+                __nfs_reap_batch(dirid, names, count);
+
                 if (offset == 0) {
                         break;
                 }
         }
 
+        yfree((void **)&names);
+
         return 0;
+err_free:
+        yfree((void **)&names);
 err_ret:
         return ret;
 }
 
-static void __nfs_remove_file(void *_de, void *_arg)
-{
-        int ret;
-        struct dirent *de = _de;
-        const dirid_t *parent = _arg;
-
-        DINFO("remove %s @ "CHKID_FORMAT"\n", de->d_name, CHKID_ARG(parent));
-        
-        ret = sdfs_unlink(parent, de->d_name);
-        if (ret) {
-                DWARN("remove %s @ "CHKID_FORMAT" fail\n", de->d_name, CHKID_ARG(parent));
-        }
-}
-
-static void __nfs_remove_bytime(void *_de, void *_arg)
+static void __nfs_reap_bytime(void *_de, void *_arg)
 {
         int ret;
         struct dirent *de = _de;
@@ -102,8 +373,8 @@ static void __nfs_remove_bytime(void *_de, void *_arg)
 
         now = time(NULL);
         t = atoi(de->d_name);
-        if (now - t < 3600) {
-                DINFO("name %s diff %u, skip it\n", de->d_name, now - t);
+        if (now - t < NFS_REAP_AGE) {
+                DBUG("name %s diff %u, skip it\n", de->d_name, now - t);
                 return;
         }
 
@@ -115,7 +386,7 @@ static void __nfs_remove_bytime(void *_de, void *_arg)
                 return;
         }
 
-        ret = __sdfs_dir_itor1(&dirid, __nfs_remove_file, &dirid);
+        ret = __nfs_reap_bucket(&dirid);
         if (ret) {
                 DWARN("cleanup %s @ "CHKID_FORMAT" fail\n", de->d_name, CHKID_ARG(parent));
                 return;
@@ -128,51 +399,102 @@ static void __nfs_remove_bytime(void *_de, void *_arg)
         }
 }
 
-static int __nfs_remove_volume(const char *vol)
+static int __sdfs_dir_itor1(const dirid_t *dirid, func1_t func, void *ctx)
 {
         int ret;
-        dirid_t dirid;
-        char path[MAX_PATH_LEN];
+        off_t offset = 0;
+        void *de0 = NULL;
+        int delen = 0;
+        struct dirent *de;
 
-        snprintf(path, MAX_PATH_LEN, "/%s/%s", vol, NFS_REMOVED);
-        ret = sdfs_lookup_recurive(path, &dirid);
-        if (ret)
-                GOTO(err_ret, ret);
+        while (srv_running) {
+                ret = sdfs_readdir1(dirid, offset, &de0, &delen);
+                if (ret) {
+                        GOTO(err_ret, ret);
+                }
+
+                if (delen == 0) {
+                        break;
+                }
+
+                dir_for_each(de0, delen, de, offset) {
+                        func(de, ctx);
+                        offset = de->d_off;
+
+                        DBUG("%s offset %ju %p\n", de->d_name, offset, de);
+                }
+
+                yfree((void **)&de0);
+
+                if (offset == 0) {
+                        break;
+                }
+        }
 
-        ret = __sdfs_dir_itor1(&dirid, __nfs_remove_bytime, &dirid);
-        if (ret)
-                GOTO(err_ret, ret);
-        
         return 0;
 err_ret:
         return ret;
 }
 
+static void __nfs_reap_volume(const nfs_trash_t *trash)
+{
+        int ret;
+        dirid_t removed;
+
+        ret = sdfs_lookup(&trash->vol, NFS_REMOVED, &removed);
+        if (ret) {
+                if (ret != ENOENT)
+                        DWARN("lookup trash of "CHKID_FORMAT" fail\n", CHKID_ARG(&trash->vol));
+                return;
+        }
+
+        ret = __sdfs_dir_itor1(&removed, __nfs_reap_bytime, &removed);
+        if (ret) {
+                DWARN("reap trash of "CHKID_FORMAT" fail\n", CHKID_ARG(&trash->vol));
+        }
+}
+
 static void *__nfs_remove_worker(void *arg)
 {
-        int ret, i;
-        etcd_node_t *array, *node;
+        int ret, i, count;
+        nfs_trash_t *array;
+        struct list_head *pos;
 
         (void) arg;
 
         while (1) {
-                //sleep(60 * 10);
-                sleep(60 * 10);
+                sleep(NFS_REAP_INTERVAL);
 
-                ret = etcd_list(ETCD_VOLUME, &array);
+                ret = __nfs_trash_load();
                 if (ret) {
                         DWARN("list volume fail\n");
                         continue;
                 }
 
-                for (i = 0; i < array->num_node; i++) {
-                        node = array->nodes[i];
-                        DINFO("volume %s\n", node->key);
+                pthread_mutex_lock(&__nfs_trash_lock__);
+                count = 0;
+                list_for_each(pos, &__nfs_trash__) {
+                        count++;
+                }
+
+                ret = ymalloc((void **)&array, sizeof(*array) * (count + 1));
+                if (ret) {
+                        pthread_mutex_unlock(&__nfs_trash_lock__);
+                        continue;
+                }
+
+                i = 0;
+                list_for_each(pos, &__nfs_trash__) {
+                        array[i++] = *list_entry(pos, nfs_trash_t, hook);
+                }
+                pthread_mutex_unlock(&__nfs_trash_lock__);
 
-                        __nfs_remove_volume(node->key);
+                for (i = 0; i < count; i++) {
+                        DBUG("volume "CHKID_FORMAT"\n", CHKID_ARG(&array[i].vol));
+                        __nfs_reap_volume(&array[i]);
                 }
 
-                free_etcd_node(array);
+                yfree((void **)&array);
         }
 
         return NULL;
@@ -182,7 +504,7 @@ int nfs_remove_init()
 {
         int ret;
 
-        ret = sy_thread_create2(__nfs_remove_worker, NULL, "__conn_worker");
+        ret = sy_thread_create2(__nfs_remove_worker, NULL, "__nfs_remove_worker");
         if (ret)
                 GOTO(err_ret, ret);
 
@@ -191,77 +513,30 @@ err_ret:
         return ret;
 }
 
-static  int __nfs_remove_getvolid(const dirid_t *_dirid, volid_t *volid)
-{
-        int ret;
-        dirid_t dirid, parent;
-
-        YASSERT(_dirid->type);
-        
-        dirid = *_dirid;
-        while (1) {
-                ret = sdfs_lookup(&dirid, "..", &parent);
-                if (ret)
-                        GOTO(err_ret, ret);
-
-                DBUG("parent "CHKID_FORMAT" \n", CHKID_ARG(&parent));
-                YASSERT(parent.type);
-                
-                if (parent.type == ftype_vol) {
-                        *volid = parent;
-                        break;
-                } else {
-                        dirid = parent;
-                }
-        }
-
-        return 0;
-err_ret:
-        return ret;
-}
-
 int nfs_remove(const fileid_t *parent, const char *name)
 {
-        int ret;
-        volid_t volid;
-        dirid_t removed, workdir;
-        time_t now;
-        char tname[MAX_NAME_LEN], _uuid[MAX_NAME_LEN];
+        int ret, retry = 0;
+        dirid_t bucket;
+        char _uuid[MAX_NAME_LEN];
         uuid_t uuid;
 
-        ret = __nfs_remove_getvolid(parent, &volid);
-        if (ret)
-                GOTO(err_ret, ret);
-
-        ret = sdfs_mkdir(&volid, NFS_REMOVED, NULL, &removed, 0, 0, 0);
-        if (ret) {
-                if (ret == EEXIST) {
-                        ret = sdfs_lookup(&volid, NFS_REMOVED, &removed);
-                        if (ret)
-                                GOTO(err_ret, ret);
-                } else
-                        GOTO(err_ret, ret);
-        }
-
-        now = time(NULL);
-        snprintf(tname, MAX_NAME_LEN, "%d", ((int)now / 3600) * 3600);
-
-        ret = sdfs_mkdir(&removed, tname, NULL, &workdir, 0, 0, 0);
-        if (ret) {
-                if (ret == EEXIST) {
-                        ret = sdfs_lookup(&removed, tname, &workdir);
-                        if (ret)
-                                GOTO(err_ret, ret);
-                } else
-                        GOTO(err_ret, ret);
-        }
-
         uuid_generate(uuid);
         uuid_unparse(uuid, _uuid);
 
+retry:
+        ret = __nfs_trash_bucket(parent->volid, retry, &bucket);
+        if (ret)
+                GOTO(err_ret, ret);
+
         DBUG("rename to %s\n", _uuid);
-        ret = sdfs_rename(parent, name, &workdir, _uuid);
+        ret = sdfs_rename(parent, name, &bucket, _uuid);
         if (ret) {
+                /* the cached bucket may be reaped or removed by hand */
+                if (ret == ENOENT && retry == 0) {
+                        retry++;
+                        goto retry;
+                }
+
                 GOTO(err_ret, ret);
         }
 
@@ -0,0 +1,341 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YNFS
+
+#include "ylib.h"
+#include "sdfs_list.h"
+#include "sdfs_lib.h"
+#include "configure.h"
+#include "schedule.h"
+#include "nfs_wgather.h"
+#include "dbg.h"
+
+/*
+ * write gathering
+ *
+ * a stable write to a file that has no write running goes out at once.
+ * writes that come while one runs wait on the file, when it is done the
+ * next nfsconf.write_gather of them are taken as a batch, adjacent ranges
+ * are merged into one sdfs_write, the file is synced once, and all of the
+ * batch get their reply. the first of the batch runs it, so a reply waits
+ * for its own batch only. hash_write sends all writes of a file to one
+ * core, so the waiters of a file share a schedule.
+ */
+
+#define NFS_WGATHER_HASH 256
+
+typedef struct {
+        struct list_head hook;
+        struct list_head batch;         /* set for the one to run it */
+        uint64_t offset;
+        uint32_t size;
+        buffer_t *buf;
+        task_t task;
+        int lead;
+        int retval;
+        struct stat pre;
+        struct stat post;
+} nfs_wgather_req_t;
+
+typedef struct {
+        struct list_head hook;
+        fileid_t fileid;
+        struct list_head wait;
+} nfs_wgather_t;
+
+typedef struct {
+        sy_spinlock_t lock;
+        struct list_head list;
+} nfs_wgather_head_t;
+
+static nfs_wgather_head_t *__nfs_wgather__ = NULL;
+
+static nfs_wgather_head_t *__nfs_wgather_head(const fileid_t *fileid)
+{
+        return &__nfs_wgather__[hash_mem(fileid, sizeof(*fileid)) % NFS_WGATHER_HASH];
+}
+
+static nfs_wgather_t *__nfs_wgather_find(nfs_wgather_head_t *head, const fileid_t *fileid)
+{
+        struct list_head *pos;
+        nfs_wgather_t *gather;
+
+        list_for_each(pos, &head->list) {
+                gather = list_entry(pos, nfs_wgather_t, hook);
+                if (fileid_cmp(&gather->fileid, fileid) == 0)
+                        return gather;
+        }
+
+        return NULL;
+}
+
+static int __nfs_wgather_overlap(struct list_head *batch)
+{
+        struct list_head *pos, *pos1;
+        nfs_wgather_req_t *req, *req1;
+
+        list_for_each(pos, batch) {
+                req = list_entry(pos, nfs_wgather_req_t, hook);
+                for (pos1 = pos->next; pos1 != batch; pos1 = pos1->next) {
+                        req1 = list_entry(pos1, nfs_wgather_req_t, hook);
+                        if (req->offset < req1->offset + req1->size
+                            && req1->offset < req->offset + req->size)
+                                return 1;
+                }
+        }
+
+        return 0;
+}
+
+static void __nfs_wgather_sort(struct list_head *batch)
+{
+        struct list_head list, *pos;
+        nfs_wgather_req_t *req, *tmp;
+
+        INIT_LIST_HEAD(&list);
+        list_splice_init(batch, &list);
+
+        while (!list_empty(&list)) {
+                req = list_entry(list.next, nfs_wgather_req_t, hook);
+                list_del(&req->hook);
+
+                list_for_each(pos, batch) {
+                        tmp = list_entry(pos, nfs_wgather_req_t, hook);
+                        if (tmp->offset > req->offset)
+                                break;
+                }
+
+                list_add_tail(&req->hook, pos);
+        }
+}
+
+/* one sdfs_write for the run from first to last */
+static void __nfs_wgather_write(const fileid_t *fileid, nfs_wgather_req_t *first,
+                                nfs_wgather_req_t *last, struct list_head *batch)
+{
+        int ret, count = 0;
+        uint32_t size = 0;
+        buffer_t buf;
+        struct stat pre, post;
+        struct list_head *pos;
+        nfs_wgather_req_t *req;
+
+        mbuffer_init(&buf, 0);
+        for (pos = &first->hook; pos != batch; pos = pos->next) {
+                req = list_entry(pos, nfs_wgather_req_t, hook);
+                size += req->size;
+                count++;
+                mbuffer_merge(&buf, req->buf);
+                if (req == last)
+                        break;
+        }
+
+        DBUG("write "FID_FORMAT" off %ju size %u, %u gathered\n",
+             FID_ARG(fileid), first->offset, size, count);
+
+        ret = sdfs_write_wcc(fileid, &buf, size, first->offset, &pre, &post);
+        if (ret) {
+                DWARN("write "FID_FORMAT" off %ju size %u, ret %d\n",
+                      FID_ARG(fileid), first->offset, size, ret);
+        }
+
+        mbuffer_free(&buf);
+
+        for (pos = &first->hook; pos != batch; pos = pos->next) {
+                req = list_entry(pos, nfs_wgather_req_t, hook);
+                req->retval = ret;
+                if (ret == 0) {
+                        req->pre = pre;
+                        req->post = post;
+                }
+
+                if (req == last)
+                        break;
+        }
+}
+
+static void __nfs_wgather_exec(const fileid_t *fileid, struct list_head *batch)
+{
+        int ret, merge;
+        struct list_head *pos;
+        nfs_wgather_req_t *req, *first, *last;
+
+        /* overlapping writes keep their order and go one by one */
+        merge = !__nfs_wgather_overlap(batch);
+        if (merge)
+                __nfs_wgather_sort(batch);
+
+        first = NULL;
+        last = NULL;
+        list_for_each(pos, batch) {
+                req = list_entry(pos, nfs_wgather_req_t, hook);
+                if (first && merge && req->offset == last->offset + last->size) {
+                        last = req;
+                        continue;
+                }
+
+                if (first)
+                        __nfs_wgather_write(fileid, first, last, batch);
+
+                first = req;
+                last = req;
+        }
+
+        if (first)
+                __nfs_wgather_write(fileid, first, last, batch);
+
+        ret = sdfs_fsync(fileid);
+        if (ret) {
+                list_for_each(pos, batch) {
+                        req = list_entry(pos, nfs_wgather_req_t, hook);
+                        if (req->retval == 0)
+                                req->retval = ret;
+                }
+        }
+}
+
+static void __nfs_wgather_lead(nfs_wgather_t *gather, nfs_wgather_req_t *self)
+{
+        int count;
+        nfs_wgather_head_t *head;
+        nfs_wgather_req_t *req, *next;
+        struct list_head *pos, *n;
+
+        __nfs_wgather_exec(&gather->fileid, &self->batch);
+
+        head = __nfs_wgather_head(&gather->fileid);
+
+        sy_spin_lock(&head->lock);
+
+        if (list_empty(&gather->wait)) {
+                list_del(&gather->hook);
+                next = NULL;
+        } else {
+                next = list_entry(gather->wait.next, nfs_wgather_req_t, hook);
+                INIT_LIST_HEAD(&next->batch);
+                count = 0;
+                list_for_each_safe(pos, n, &gather->wait) {
+                        if (count == nfsconf.write_gather)
+                                break;
+
+                        list_del(pos);
+                        list_add_tail(pos, &next->batch);
+                        count++;
+                }
+
+                next->lead = 1;
+        }
+
+        sy_spin_unlock(&head->lock);
+
+        /* a req is gone once its task is resumed */
+        list_for_each_safe(pos, n, &self->batch) {
+                req = list_entry(pos, nfs_wgather_req_t, hook);
+                if (req != self)
+                        schedule_resume(&req->task, 0, NULL);
+        }
+
+        if (next) {
+                schedule_resume(&next->task, 0, NULL);
+        } else {
+                yfree((void **)&gather);
+        }
+}
+
+int nfs_write_gather(const fileid_t *fileid, buffer_t *buf, uint32_t size,
+                     uint64_t offset, struct stat *pre, struct stat *post)
+{
+        int ret;
+        nfs_wgather_head_t *head;
+        nfs_wgather_t *gather;
+        nfs_wgather_req_t req;
+
+        YASSERT(__nfs_wgather__);
+
+        req.offset = offset;
+        req.size = size;
+        req.buf = buf;
+        req.lead = 0;
+        req.retval = 0;
+        INIT_LIST_HEAD(&req.batch);
+
+        head = __nfs_wgather_head(fileid);
+
+        sy_spin_lock(&head->lock);
+
+        gather = __nfs_wgather_find(head, fileid);
+        if (gather) {
+                req.task = schedule_task_get();
+                list_add_tail(&req.hook, &gather->wait);
+                sy_spin_unlock(&head->lock);
+
+                schedule_yield("nfs_wgather", NULL, NULL);
+
+                if (req.lead) {
+                        __nfs_wgather_lead(gather, &req);
+                }
+        } else {
+                ret = ymalloc((void **)&gather, sizeof(*gather));
+                if (ret) {
+                        sy_spin_unlock(&head->lock);
+                        GOTO(err_ret, ret);
+                }
+
+                gather->fileid = *fileid;
+                INIT_LIST_HEAD(&gather->wait);
+                list_add(&gather->hook, &head->list);
+                sy_spin_unlock(&head->lock);
+
+                list_add_tail(&req.hook, &req.batch);
+                __nfs_wgather_lead(gather, &req);
+        }
+
+        ret = req.retval;
+        if (ret)
+                goto err_ret;
+
+        *pre = req.pre;
+        *post = req.post;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+int nfs_wgather_init()
+{
+        int ret, i;
+        nfs_wgather_head_t *array;
+
+        if (nfsconf.write_gather <= 0) {
+                DINFO("write gather disabled\n");
+                return 0;
+        }
+
+        ret = ymalloc((void **)&array, sizeof(*array) * NFS_WGATHER_HASH);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        for (i = 0; i < NFS_WGATHER_HASH; i++) {
+                ret = sy_spin_init(&array[i].lock);
+                if (ret)
+                        GOTO(err_free, ret);
+
+                INIT_LIST_HEAD(&array[i].list);
+        }
+
+        __nfs_wgather__ = array;
+
+        return 0;
+err_free:
+        yfree((void **)&array);
+err_ret:
+        return ret;
+}
+
+int nfs_wgather_enabled()
+{
+        return __nfs_wgather__ != NULL;
+}
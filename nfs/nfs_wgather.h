@@ -0,0 +1,14 @@
+#ifndef __NFS_WGATHER_H__
+#define __NFS_WGATHER_H__
+
+#include <sys/stat.h>
+
+#include "sdfs_id.h"
+#include "sdfs_buffer.h"
+
+int nfs_wgather_init();
+int nfs_wgather_enabled();
+int nfs_write_gather(const fileid_t *fileid, buffer_t *buf, uint32_t size,
+                     uint64_t offset, struct stat *pre, struct stat *post);
+
+#endif
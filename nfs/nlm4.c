@@ -231,44 +231,6 @@ err_ret:
         return ret;
 }
 
-static int __nlm4_lock_wait(const fileid_t *fileid, const sdfs_lock_t *lock)
-{
-        int ret, cancel;
-        
-        cancel = 0;
-        ret = nlm4_async_reg(fileid, lock, &cancel);
-        if (ret)
-                GOTO(err_ret, ret);
-
-        while (1) {
-                if (cancel) {
-                        ret = EAGAIN;
-                        DINFO("lock "FID_FORMAT" canceled\n", FID_ARG(fileid));
-                        GOTO(err_reg, ret);
-                }
-
-                ret = sdfs_setlock(fileid, lock);
-                if (ret) {
-                        schedule_sleep("nlm", 100 * 1000);
-                        continue;
-                } else {
-                        DINFO("lock "FID_FORMAT" granted\n", FID_ARG(fileid));
-                        break;
-                }
-        }
-
-        ret = nlm4_async_unreg(fileid, lock, &cancel);
-        if (ret)
-                GOTO(err_ret, ret);
-        
-        return 0;
-err_reg:
-        nlm4_async_unreg(fileid, lock, &cancel);
-err_ret:
-        return ret;
-}
-        
-
 static int __nlm4_lock_svc(const sockid_t *sockid, const sunrpc_request_t *req,
                            uid_t uid, gid_t gid, nfsarg_t *_arg, buffer_t *buf)
 {
@@ -307,24 +269,31 @@ static int __nlm4_lock_svc(const sockid_t *sockid, const sunrpc_request_t *req,
                         GOTO(err_rep, ret);
                 }
         } else {
-                ret = sdfs_setlock(fileid, lock);
+                /* queue behind earlier waiters in conflict */
+                if (nlm4_async_busy(fileid, lock)) {
+                        ret = EWOULDBLOCK;
+                } else {
+                        ret = sdfs_setlock(fileid, lock);
+                }
+
                 if (ret) {
                         if (ret == EWOULDBLOCK) {
-                                res.stat = NLM4_BLOCKED;
-                                ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
-                                                   &res, (xdr_ret_t)xdr_nlm_res);
-                                if (ret)
-                                        GOTO(err_ret, ret);
-
-                                ret = __nlm4_lock_wait(fileid, lock);
-                                if (ret)
-                                        GOTO(err_ret, ret);
+                                if (args->block) {
+                                        ret = nlm4_async_reg(sockid, fileid, lock, args);
+                                        if (ret) {
+                                                res.stat = NLM4_DENIED_NOLOCKS;
+                                                GOTO(err_cookie, ret);
+                                        }
+
+                                        res.stat = NLM4_BLOCKED;
+                                } else {
+                                        res.stat = NLM4_DENIED;
+                                }
                         } else
                                 GOTO(err_ret, ret);
-
+                } else {
+                        res.stat = NLM4_GRANTED;
                 }
-                
-                res.stat = NLM4_GRANTED;
         }
         
         /*cookies
@@ -341,6 +310,10 @@ static int __nlm4_lock_svc(const sockid_t *sockid, const sunrpc_request_t *req,
         __FREE_ARGS(nlm_lock, buf);
 
         return 0;
+err_cookie:
+        res.cookies.len = args->cookies.len;
+        res.cookies.data = (void *)cookie;
+        memcpy(res.cookies.data, args->cookies.data, args->cookies.len);
 err_rep:
         sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
                            &res, (xdr_ret_t)xdr_nlm_res);
@@ -377,6 +350,8 @@ static int __nlm4_unlock_svc(const sockid_t *sockid, const sunrpc_request_t *req
                 GOTO(err_rep, ret);
         }
 
+        nlm4_async_wakeup(fileid);
+
         res.stat = NLM4_GRANTED;
         
         //cookies
@@ -410,6 +385,9 @@ static int __nlm4_cancel_svc(const sockid_t *sockid, const sunrpc_request_t *req
         fileid_t *fileid;
         sdfs_lock_t *lock;
         char _lock[MAX_LOCK_LEN];
+        char cookie[MAX_BUF_LEN];
+
+        YASSERT(args->cookies.len < MAX_BUF_LEN);
 
         (void) gid;
         (void) uid;
@@ -430,6 +408,7 @@ static int __nlm4_cancel_svc(const sockid_t *sockid, const sunrpc_request_t *req
 
         //cookies
         res.cookies.len = args->cookies.len;
+        res.cookies.data = (void *)cookie;
         memcpy(res.cookies.data, args->cookies.data, args->cookies.len);
 
         ret = sunrpc_reply(sockid, req, ACCEPT_STATE_OK,
@@ -2,6 +2,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <rpc/rpc.h>
+#include <rpc/pmap_prot.h>
 #include <unistd.h>
 #include <time.h>
 #include <stdlib.h>
@@ -10,6 +11,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #include <errno.h>
 
 
@@ -19,133 +21,641 @@
 #include "yfs_conf.h"
 #include "ylib.h"
 #include "nlm_async.h"
-#include "attr.h"
-#include "error.h"
-#include "nlm_job_context.h"
-#include "net_global.h"
-#include "nfs_conf.h"
-#include "nlm_events.h"
+#include "sdfs_list.h"
 #include "nlm_state_machine.h"
-#include "nlm_nsm.h"
-#include "../sock/sock_tcp.h"
 #include "sunrpc_proto.h"
-#include "sunrpc_reply.h"
+#include "../sock/sock_tcp.h"
 #include "sdfs_lib.h"
-#include "xdr_nlm.h"
-#include "configure.h"
-#include "sdfs_conf.h"
-#include "nlm_nsm.h"
-#include "core.h"
-#include "nfs_events.h"
-#include "yfs_limit.h"
-#include "sdfs_id.h"
 #include "dbg.h"
 
-#define NLM4_ASYNC_HASH  10;
+/*
+ * blocked nlm locks
+ *
+ * a LOCK in conflict with block set is answered NLM4_BLOCKED and queued
+ * on its file here. the worker tries the queue of a file when a lock of
+ * it is released through this server, and every NLM4_ASYNC_RETRY seconds
+ * for unlocks elsewhere. a waiter is tried only if no waiter before it
+ * conflicts, so grants follow arrival order. a granted waiter gets an
+ * NLM4_GRANTED call on its client from a thread of its own, so a client
+ * gone away holds up nobody else; the portmap lookup, connect and call
+ * take NLM4_ASYNC_TIMEOUT seconds at most each. the lock is released
+ * again if the call fails, the client asks again then.
+ */
+
+#define NLM4_ASYNC_RETRY 1
+#define NLM4_ASYNC_TIMEOUT 2
+#define NLM4_ASYNC_FH 64
 
 typedef struct {
         struct list_head hook;
-        const fileid_t *fileid;
-        const sdfs_lock_t *lock;
-        int *cancel;
+        fileid_t fileid;
+        uint32_t addr;
+        int busy;
+        int cancel;
+        int round;
+        /* for the GRANTED call */
+        ynetobj cookies;
+        bool_t exclusive;
+        char *caller;
+        ynetobj oh;
+        uint32_t fhlen;
+        char fh[NLM4_ASYNC_FH];
+        uint32_t svid;
+        uint64_t l_offset;
+        uint64_t l_len;
+        sdfs_lock_t lock;
 } nlm4_async_entry_t;
 
 typedef struct {
-        sy_spinlock_t lock;
+        struct list_head hook;
+        fileid_t fileid;
+        int kick;
+        struct list_head list;          /* waiters, oldest first */
+} nlm4_async_file_t;
+
+typedef struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int kick;
+        int round;
         struct list_head list;
 } nlm4_async_t;
 
 static nlm4_async_t *__nlm4_async__;
 
+static uint64_t __nlm4_lock_end(const sdfs_lock_t *lock)
+{
+        return lock->length ? lock->start + lock->length : (uint64_t)-1;
+}
 
-int nlm4_async_cancel(const fileid_t *fileid, const sdfs_lock_t *lock)
+static int __nlm4_lock_conflict(const sdfs_lock_t *lock1, const sdfs_lock_t *lock2)
+{
+        if (lock1->type != SDFS_WRLOCK && lock2->type != SDFS_WRLOCK)
+                return 0;
+
+        return lock1->start < __nlm4_lock_end(lock2)
+                && lock2->start < __nlm4_lock_end(lock1);
+}
+
+/* same owner and range, any type */
+static int __nlm4_lock_same(const sdfs_lock_t *lock1, const sdfs_lock_t *lock2)
+{
+        return lock1->sid == lock2->sid && lock1->owner == lock2->owner
+                && lock1->start == lock2->start && lock1->length == lock2->length;
+}
+
+static nlm4_async_file_t *__nlm4_async_file(nlm4_async_t *nlm4_async,
+                                            const fileid_t *fileid)
 {
-        int ret;
-        nlm4_async_t *nlm4_async = __nlm4_async__;
         struct list_head *pos;
-        nlm4_async_entry_t *ent;
-        
-        ret = sy_spin_lock(&nlm4_async->lock);
-        if (ret)
-                GOTO(err_ret, ret);
+        nlm4_async_file_t *file;
 
         list_for_each(pos, &nlm4_async->list) {
-                ent = (void *)pos;
-
-                if (sdfs_lock_equal(fileid, lock, ent->fileid, ent->lock)) {
-                        *ent->cancel = 1;
-                }
+                file = list_entry(pos, nlm4_async_file_t, hook);
+                if (!chkid_cmp(&file->fileid, fileid))
+                        return file;
         }
-        
-        sy_spin_lock(&nlm4_async->lock);
+
+        return NULL;
+}
+
+/* ent as built by __nlm4_async_new, every buffer set */
+static void __nlm4_async_free(nlm4_async_entry_t *ent)
+{
+        yfree((void **)&ent->caller);
+        yfree((void **)&ent->oh.data);
+        yfree((void **)&ent->cookies.data);
+        yfree((void **)&ent);
+}
+
+static int __nlm4_async_dup(ynetobj *dst, const void *data, uint32_t len)
+{
+        int ret;
+
+        ret = ymalloc((void **)&dst->data, len + 1);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        memcpy(dst->data, data, len);
+        dst->len = len;
 
         return 0;
 err_ret:
         return ret;
 }
 
-int nlm4_async_reg(const fileid_t *fileid, const sdfs_lock_t *lock, int *cancel)
+static int __nlm4_async_new(const sockid_t *sockid, const fileid_t *fileid,
+                            const sdfs_lock_t *lock, const nlm_lockargs *args,
+                            nlm4_async_entry_t **_ent)
 {
         int ret;
-        nlm4_async_t *nlm4_async = __nlm4_async__;
+        ynetobj caller;
         nlm4_async_entry_t *ent;
 
-        YASSERT(*cancel == 0);
+        if (args->alock.fh.len > NLM4_ASYNC_FH) {
+                ret = EINVAL;
+                GOTO(err_ret, ret);
+        }
 
-        ret = ymalloc((void**)&ent, sizeof(ent));
+        ret = ymalloc((void **)&ent, sizeof(*ent) + lock->len);
         if (ret)
                 GOTO(err_ret, ret);
 
-        ent->cancel = cancel;
-        ent->fileid = fileid;
-        ent->lock = lock;
+        ret = __nlm4_async_dup(&ent->cookies, args->cookies.data, args->cookies.len);
+        if (ret)
+                GOTO(err_free, ret);
 
-        ret = sy_spin_lock(&nlm4_async->lock);
+        ret = __nlm4_async_dup(&ent->oh, args->alock.oh.data, args->alock.oh.len);
         if (ret)
-                GOTO(err_ret, ret);
+                GOTO(err_cookies, ret);
 
-        list_add_tail(&ent->hook, &nlm4_async->list);
+        ret = __nlm4_async_dup(&caller, args->alock.caller, args->alock.len);
+        if (ret)
+                GOTO(err_oh, ret);
+
+        ent->caller = (void *)caller.data;
+        ent->caller[caller.len] = '\0';
+        ent->fileid = *fileid;
+        ent->addr = sockid->addr;
+        ent->exclusive = args->exclusive;
+        ent->fhlen = args->alock.fh.len;
+        memcpy(ent->fh, args->alock.fh.val, ent->fhlen);
+        ent->svid = args->alock.svid;
+        ent->l_offset = args->alock.l_offset;
+        ent->l_len = args->alock.l_len;
+        memcpy(&ent->lock, lock, SDFS_LOCK_SIZE(lock));
+
+        *_ent = ent;
 
-        sy_spin_lock(&nlm4_async->lock);
-        
         return 0;
+err_oh:
+        yfree((void **)&ent->oh.data);
+err_cookies:
+        yfree((void **)&ent->cookies.data);
+err_free:
+        yfree((void **)&ent);
 err_ret:
         return ret;
 }
 
-int nlm4_async_unreg(const fileid_t *fileid, const sdfs_lock_t *lock, int *cancel)
+/* a waiter before ent, or any waiter if ent is NULL, conflicts with lock */
+static int __nlm4_async_blocked(const nlm4_async_file_t *file,
+                                const nlm4_async_entry_t *ent,
+                                const sdfs_lock_t *lock)
 {
-        int ret, found = 0;
+        struct list_head *pos;
+        nlm4_async_entry_t *tmp;
+
+        list_for_each(pos, &file->list) {
+                tmp = list_entry(pos, nlm4_async_entry_t, hook);
+                if (tmp == ent)
+                        break;
+
+                if (!tmp->cancel && !__nlm4_lock_same(&tmp->lock, lock)
+                    && __nlm4_lock_conflict(&tmp->lock, lock))
+                        return 1;
+        }
+
+        return 0;
+}
+
+/**
+ * a lock to be queued behind the waiters of its file rather than taken
+ */
+int nlm4_async_busy(const fileid_t *fileid, const sdfs_lock_t *lock)
+{
+        int busy = 0;
         nlm4_async_t *nlm4_async = __nlm4_async__;
-        struct list_head *pos, *n;
-        nlm4_async_entry_t *ent;
-        
-        ret = sy_spin_lock(&nlm4_async->lock);
+        nlm4_async_file_t *file;
+
+        pthread_mutex_lock(&nlm4_async->lock);
+
+        file = __nlm4_async_file(nlm4_async, fileid);
+        if (file)
+                busy = __nlm4_async_blocked(file, NULL, lock);
+
+        pthread_mutex_unlock(&nlm4_async->lock);
+
+        return busy;
+}
+
+int nlm4_async_reg(const sockid_t *sockid, const fileid_t *fileid,
+                   const sdfs_lock_t *lock, const nlm_lockargs *args)
+{
+        int ret;
+        nlm4_async_t *nlm4_async = __nlm4_async__;
+        nlm4_async_file_t *file;
+        nlm4_async_entry_t *ent, *tmp;
+        struct list_head *pos;
+
+        ret = __nlm4_async_new(sockid, fileid, lock, args, &ent);
         if (ret)
                 GOTO(err_ret, ret);
 
-        list_for_each_safe(pos, n, &nlm4_async->list) {
-                ent = (void *)pos;
+        pthread_mutex_lock(&nlm4_async->lock);
+
+        file = __nlm4_async_file(nlm4_async, fileid);
+        if (file == NULL) {
+                ret = ymalloc((void **)&file, sizeof(*file));
+                if (ret)
+                        GOTO(err_lock, ret);
+
+                file->fileid = *fileid;
+                INIT_LIST_HEAD(&file->list);
+                list_add_tail(&file->hook, &nlm4_async->list);
+        }
+
+        list_for_each(pos, &file->list) {
+                tmp = list_entry(pos, nlm4_async_entry_t, hook);
+                if (!tmp->cancel && sdfs_lock_equal(NULL, &tmp->lock, NULL, lock)) {
+                        /* retransmitted, keep its place */
+                        DBUG("lock "FID_FORMAT" queued already\n", FID_ARG(fileid));
+                        pthread_mutex_unlock(&nlm4_async->lock);
+                        __nlm4_async_free(ent);
+                        return 0;
+                }
+        }
+
+        list_add_tail(&ent->hook, &file->list);
+
+        pthread_mutex_unlock(&nlm4_async->lock);
+
+        DINFO("lock "FID_FORMAT" queued, caller %s\n", FID_ARG(fileid), ent->caller);
+
+        return 0;
+err_lock:
+        pthread_mutex_unlock(&nlm4_async->lock);
+        __nlm4_async_free(ent);
+err_ret:
+        return ret;
+}
+
+/* drop the waiter of lock, the type is not compared so UNLOCK matches too */
+int nlm4_async_cancel(const fileid_t *fileid, const sdfs_lock_t *lock)
+{
+        nlm4_async_t *nlm4_async = __nlm4_async__;
+        nlm4_async_file_t *file;
+        nlm4_async_entry_t *ent;
+        struct list_head *pos, *n;
+
+        pthread_mutex_lock(&nlm4_async->lock);
+
+        file = __nlm4_async_file(nlm4_async, fileid);
+        if (file == NULL) {
+                pthread_mutex_unlock(&nlm4_async->lock);
+                return 0;
+        }
+
+        list_for_each_safe(pos, n, &file->list) {
+                ent = list_entry(pos, nlm4_async_entry_t, hook);
+                if (!__nlm4_lock_same(&ent->lock, lock))
+                        continue;
+
+                DINFO("lock "FID_FORMAT" canceled\n", FID_ARG(fileid));
 
-                if (ent->fileid == fileid) {
-                        YASSERT(ent->lock == lock);
-                        YASSERT(ent->cancel = cancel);
+                if (ent->busy) {
+                        ent->cancel = 1;
+                } else {
                         list_del(&ent->hook);
-                        yfree((void **)&ent);
-                        found = 1;
-                        break;
+                        __nlm4_async_free(ent);
                 }
         }
-        
-        sy_spin_lock(&nlm4_async->lock);
 
-        YASSERT(found == 1);
-        
+        /* the waiters after it may go now */
+        file->kick = 1;
+        nlm4_async->kick = 1;
+        pthread_cond_signal(&nlm4_async->cond);
+
+        pthread_mutex_unlock(&nlm4_async->lock);
+
+        return 0;
+}
+
+/* a lock of fileid was released */
+void nlm4_async_wakeup(const fileid_t *fileid)
+{
+        nlm4_async_t *nlm4_async = __nlm4_async__;
+        nlm4_async_file_t *file;
+
+        pthread_mutex_lock(&nlm4_async->lock);
+
+        file = __nlm4_async_file(nlm4_async, fileid);
+        if (file) {
+                file->kick = 1;
+                nlm4_async->kick = 1;
+                pthread_cond_signal(&nlm4_async->cond);
+        }
+
+        pthread_mutex_unlock(&nlm4_async->lock);
+}
+
+static bool_t __xdr_netobj(XDR *xdrs, ynetobj *obj)
+{
+        return xdr_bytes(xdrs, (char **)&obj->data, &obj->len, XDR_MAX_NETOBJ);
+}
+
+/* nlm4_testargs */
+static bool_t __xdr_granted_args(XDR *xdrs, nlm4_async_entry_t *ent)
+{
+        char *fh = ent->fh;
+
+        return __xdr_netobj(xdrs, &ent->cookies)
+                && xdr_bool(xdrs, &ent->exclusive)
+                && xdr_string(xdrs, &ent->caller, XDR_MAX_NETOBJ)
+                && xdr_bytes(xdrs, &fh, &ent->fhlen, NLM4_ASYNC_FH)
+                && __xdr_netobj(xdrs, &ent->oh)
+                && xdr_uint32_t(xdrs, &ent->svid)
+                && xdr_uint64_t(xdrs, &ent->l_offset)
+                && xdr_uint64_t(xdrs, &ent->l_len);
+}
+
+/* nlm4_res */
+static bool_t __xdr_granted_res(XDR *xdrs, nlm_res *res)
+{
+        return __xdr_netobj(xdrs, &res->cookies)
+                && xdr_enum(xdrs, (enum_t *)&res->stat);
+}
+
+/* the nlm port of the client, asked from its portmap over udp */
+static int __nlm4_async_getport(struct sockaddr_in *sin)
+{
+        int ret, sd = RPC_ANYSOCK;
+        CLIENT *client;
+        enum clnt_stat stat;
+        struct sockaddr_in pmap;
+        struct pmap parms;
+        u_short port = 0;
+        struct timeval wait = {1, 0}, timeout = {NLM4_ASYNC_TIMEOUT, 0};
+
+        pmap = *sin;
+        pmap.sin_port = htons(PMAPPORT);
+
+        client = clntudp_create(&pmap, PMAPPROG, PMAPVERS, wait, &sd);
+        if (client == NULL) {
+                ret = ECONNREFUSED;
+                GOTO(err_ret, ret);
+        }
+
+        parms.pm_prog = NLM_PROGRAM;
+        parms.pm_vers = NLM_VERSION;
+        parms.pm_prot = IPPROTO_TCP;
+        parms.pm_port = 0;
+        stat = clnt_call(client, PMAPPROC_GETPORT,
+                         (xdrproc_t)xdr_pmap, (char *)&parms,
+                         (xdrproc_t)xdr_u_short, (char *)&port, timeout);
+        clnt_destroy(client);
+        if (stat != RPC_SUCCESS) {
+                ret = stat == RPC_TIMEDOUT ? ETIMEDOUT : EIO;
+                goto err_ret;
+        }
+
+        if (port == 0) {
+                ret = ENOENT;
+                goto err_ret;
+        }
+
+        sin->sin_port = htons(port);
+
         return 0;
 err_ret:
         return ret;
 }
 
+static int __nlm4_async_granted(nlm4_async_entry_t *ent)
+{
+        int ret;
+        char host[INET_ADDRSTRLEN];
+        struct sockaddr_in sin;
+        net_handle_t nh;
+        CLIENT *client;
+        enum clnt_stat stat;
+        nlm_res res;
+        unsigned char cookie[XDR_MAX_NETOBJ];
+        struct timeval timeout = {NLM4_ASYNC_TIMEOUT, 0};
+
+        memset(&sin, 0x0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = ent->addr;
+        inet_ntop(AF_INET, &sin.sin_addr, host, sizeof(host));
+
+        ret = __nlm4_async_getport(&sin);
+        if (ret) {
+                DWARN("nlm port of %s (%s) not found, ret %d\n", host,
+                      ent->caller, ret);
+                goto err_ret;
+        }
+
+        ret = tcp_sock_connect(&nh, &sin, 0, NLM4_ASYNC_TIMEOUT, 0);
+        if (ret) {
+                DWARN("connect nlm of %s (%s) fail, ret %d\n", host,
+                      ent->caller, ret);
+                goto err_ret;
+        }
+
+        client = clnttcp_create(&sin, NLM_PROGRAM, NLM_VERSION, &nh.u.sd.sd, 0, 0);
+        if (client == NULL) {
+                ret = ECONNREFUSED;
+                DWARN("connect nlm of %s (%s) fail\n", host, ent->caller);
+                GOTO(err_sd, ret);
+        }
+
+        clnt_control(client, CLSET_FD_CLOSE, NULL);
+
+        res.cookies.data = cookie;
+        res.cookies.len = 0;
+        stat = clnt_call(client, PNLM4_GRANTED,
+                         (xdrproc_t)__xdr_granted_args, (char *)ent,
+                         (xdrproc_t)__xdr_granted_res, (char *)&res, timeout);
+        clnt_destroy(client);
+        if (stat != RPC_SUCCESS) {
+                ret = EIO;
+                DWARN("granted to %s (%s) fail, %s\n", host, ent->caller,
+                      clnt_sperrno(stat));
+                GOTO(err_ret, ret);
+        }
+
+        if (res.stat != NLM4_GRANTED) {
+                /* the client gave up waiting */
+                ret = ECANCELED;
+                DINFO("granted to %s (%s) refused, stat %d\n", host, ent->caller,
+                      res.stat);
+                goto err_ret;
+        }
+
+        return 0;
+err_sd:
+        close(nh.u.sd.sd);
+err_ret:
+        return ret;
+}
+
+/* next waiter of file to try in this round */
+static nlm4_async_entry_t *__nlm4_async_next(nlm4_async_file_t *file, int round)
+{
+        struct list_head *pos;
+        nlm4_async_entry_t *ent;
+
+        list_for_each(pos, &file->list) {
+                ent = list_entry(pos, nlm4_async_entry_t, hook);
+                if (ent->round == round || ent->cancel)
+                        continue;
+
+                if (__nlm4_async_blocked(file, ent, &ent->lock)) {
+                        ent->round = round;
+                        continue;
+                }
+
+                return ent;
+        }
+
+        return NULL;
+}
+
+/* called and returns with the lock held */
+static void __nlm4_async_try(nlm4_async_t *nlm4_async, nlm4_async_file_t *file,
+                             struct list_head *granted)
+{
+        int ret;
+        nlm4_async_entry_t *ent;
+        sdfs_lock_t *unlock;
+        char _unlock[sizeof(*unlock)];
+
+        while (srv_running) {
+                ent = __nlm4_async_next(file, nlm4_async->round);
+                if (ent == NULL)
+                        break;
+
+                ent->busy = 1;
+                ent->round = nlm4_async->round;
+                pthread_mutex_unlock(&nlm4_async->lock);
+
+                ret = sdfs_setlock(&file->fileid, &ent->lock);
+
+                pthread_mutex_lock(&nlm4_async->lock);
+                ent->busy = 0;
+
+                if (ret) {
+                        if (ret != EWOULDBLOCK) {
+                                DWARN("lock "FID_FORMAT" fail, ret %d\n",
+                                      FID_ARG(&file->fileid), ret);
+                        }
+
+                        if (!ent->cancel)
+                                continue;
+                } else if (ent->cancel) {
+                        unlock = (void *)_unlock;
+                        memcpy(unlock, &ent->lock, sizeof(*unlock));
+                        unlock->type = SDFS_UNLOCK;
+                        unlock->len = 0;
+
+                        pthread_mutex_unlock(&nlm4_async->lock);
+                        sdfs_setlock(&file->fileid, unlock);
+                        pthread_mutex_lock(&nlm4_async->lock);
+                }
+
+                list_del(&ent->hook);
+                if (ent->cancel) {
+                        __nlm4_async_free(ent);
+                } else {
+                        list_add_tail(&ent->hook, granted);
+                }
+        }
+}
+
+static void *__nlm4_async_grant(void *arg)
+{
+        int ret;
+        nlm4_async_entry_t *ent = arg;
+        const fileid_t *fileid = &ent->fileid;
+        sdfs_lock_t *unlock;
+        char _unlock[sizeof(*unlock)];
+
+        DINFO("lock "FID_FORMAT" granted, caller %s\n", FID_ARG(fileid), ent->caller);
+
+        ret = __nlm4_async_granted(ent);
+        if (ret) {
+                unlock = (void *)_unlock;
+                memcpy(unlock, &ent->lock, sizeof(*unlock));
+                unlock->type = SDFS_UNLOCK;
+                unlock->len = 0;
+
+                ret = sdfs_setlock(fileid, unlock);
+                if (ret) {
+                        DWARN("unlock "FID_FORMAT" fail, ret %d\n", FID_ARG(fileid), ret);
+                }
+
+                nlm4_async_wakeup(fileid);
+        }
+
+        __nlm4_async_free(ent);
+
+        return NULL;
+}
+
+static void *__nlm4_async_worker(void *arg)
+{
+        int ret, all;
+        struct timespec ts;
+        time_t last = 0;
+        nlm4_async_t *nlm4_async = arg;
+        nlm4_async_file_t *file;
+        nlm4_async_entry_t *ent;
+        struct list_head *pos, *n, granted;
+
+        pthread_mutex_lock(&nlm4_async->lock);
+
+        while (1) {
+                if (!nlm4_async->kick) {
+                        clock_gettime(CLOCK_REALTIME, &ts);
+                        ts.tv_sec += NLM4_ASYNC_RETRY;
+                        pthread_cond_timedwait(&nlm4_async->cond, &nlm4_async->lock, &ts);
+                }
+
+                nlm4_async->kick = 0;
+                all = (time(NULL) - last >= NLM4_ASYNC_RETRY);
+                if (all)
+                        last = time(NULL);
+
+                list_for_each_safe(pos, n, &nlm4_async->list) {
+                        file = list_entry(pos, nlm4_async_file_t, hook);
+                        if (!file->kick && !all)
+                                continue;
+
+                        file->kick = 0;
+                        nlm4_async->round++;
+                        INIT_LIST_HEAD(&granted);
+
+                        __nlm4_async_try(nlm4_async, file, &granted);
+
+                        if (list_empty(&file->list)) {
+                                list_del(&file->hook);
+                                yfree((void **)&file);
+                        }
+
+                        if (list_empty(&granted))
+                                continue;
+
+                        while (!list_empty(&granted)) {
+                                ent = list_entry(granted.next, nlm4_async_entry_t, hook);
+                                list_del(&ent->hook);
+
+                                ret = sy_thread_create2(__nlm4_async_grant, ent,
+                                                        "__nlm4_async_grant");
+                                if (ret) {
+                                        /* only this thread frees files, n stays */
+                                        pthread_mutex_unlock(&nlm4_async->lock);
+                                        __nlm4_async_grant(ent);
+                                        pthread_mutex_lock(&nlm4_async->lock);
+                                }
+                        }
+                }
+        }
+
+        pthread_mutex_unlock(&nlm4_async->lock);
+
+        return NULL;
+}
+
 int nlm4_async_init()
 {
         int ret;
@@ -159,16 +669,24 @@ int nlm4_async_init()
 
         INIT_LIST_HEAD(&nlm4_async->list);
 
-        ret = sy_spin_init(&nlm4_async->lock);
+        ret = pthread_mutex_init(&nlm4_async->lock, NULL);
         if (ret)
-                GOTO(err_ret, ret);
-        
+                GOTO(err_free, ret);
+
+        ret = pthread_cond_init(&nlm4_async->cond, NULL);
+        if (ret)
+                GOTO(err_free, ret);
+
         __nlm4_async__ = nlm4_async;
 
+        ret = sy_thread_create2(__nlm4_async_worker, nlm4_async, "__nlm4_async_worker");
+        if (ret)
+                GOTO(err_free, ret);
 
         return 0;
+err_free:
+        __nlm4_async__ = NULL;
+        yfree((void **)&nlm4_async);
 err_ret:
         return ret;
 }
-
-
@@ -21,10 +21,14 @@
 #include "yfs_conf.h"
 #include "ylib.h"
 #include "sdfs_lib.h"
+#include "sunrpc_proto.h"
+#include "nlm_state_machine.h"
 
 int nlm4_async_init();
-int nlm4_async_unreg(const fileid_t *fileid, const sdfs_lock_t *lock, int *cancel);
-int nlm4_async_reg(const fileid_t *fileid, const sdfs_lock_t *lock, int *cancel);
+int nlm4_async_busy(const fileid_t *fileid, const sdfs_lock_t *lock);
+int nlm4_async_reg(const sockid_t *sockid, const fileid_t *fileid,
+                   const sdfs_lock_t *lock, const nlm_lockargs *args);
 int nlm4_async_cancel(const fileid_t *fileid, const sdfs_lock_t *lock);
+void nlm4_async_wakeup(const fileid_t *fileid);
 
 #endif
@@ -14,6 +14,7 @@
 #include "sdfs_lib.h"
 #include "network.h"
 #include "yfs_md.h"
+#include "nfs_attrcache.h"
 #include "dbg.h"
 
 /*
@@ -233,7 +234,8 @@ err_ret:
 }
 
 static int __readirplus_entry(entryplus *entryplus, char *name, fileid_t *fileid,
-                              const __dirlist_t *node, const cookie_t *cookie)
+                              const fileid_t *parent, const __dirlist_t *node,
+                              const cookie_t *cookie)
 {
         int ret;
         struct stat stbuf;
@@ -241,6 +243,10 @@ static int __readirplus_entry(entryplus *entryplus, char *name, fileid_t *fileid
         ret = sdfs_getattr(&node->fileid, &stbuf);
         if (ret)
                 GOTO(err_ret, ret);
+
+        /* the client is likely to lookup and stat it next */
+        nfs_attrcache_put(&node->fileid, &stbuf);
+        nfs_attrcache_link(parent, node->name, &node->fileid);
         
         _strcpy(name, node->name);
         *fileid = node->fileid;
@@ -339,7 +345,7 @@ int readdirplus(const fileid_t *fileid, uint64_t _cookie, char *verf,
 
                 cookie.cur = dirlist->cursor;
                 ret = __readirplus_entry(&_entryplus[i], &obj[i * MAX_NAME_LEN],
-                                         &fharray[i], node, &cookie);
+                                         &fharray[i], fileid, node, &cookie);
                 if (ret)
                         GOTO(err_free, ret);
 
@@ -18,6 +18,9 @@
 #include "xdr.h"
 #include "nfs_job_context.h"
 #include "nfs_events.h"
+#include "nfs_drc.h"
+#include "nfs_attrcache.h"
+#include "nfs_wgather.h"
 #include "nfs_state_machine.h"
 #include "xdr_nfs.h"
 
@@ -32,25 +35,9 @@ jobtracker_t *sunrpc_jobtracker;
 
 #define NFS3_WRITE 7
 
-typedef struct {
-        struct list_head hook;
-        buffer_t buf;
-        sockid_t sockid;
-} rpcreq_t;
-
-typedef struct {
-        struct list_head rpcreq_list;
-        int rpcreq_count;
-        sy_spinlock_t lock;
-        sem_t sem;
-} rpcreq_queue_t;
-
 static int __sunrpc_request_handler(const sockid_t *sockid,
                                     buffer_t *buf);
 
-static rpcreq_queue_t __rpcreq_queue__;
-rpcreq_queue_t *rpcreq_queue = &__rpcreq_queue__;
-
 int sunrpc_pack_len(void *buf, uint32_t len, int *msg_len, int *io_len)
 {
         uint32_t *length, _len, credlen, verilen, headlen;
@@ -180,218 +167,28 @@ err_ret:
 }
 #endif
 
-int __sunrpc_exec(rpcreq_t *rpcreq)
-{
-        int ret;
-        sunrpc_request_t *req;
-        buffer_t *buf;
-        job_t *job;
-        auth_head_t cred, veri;
-        auth_unix_t auth_unix;
-        char credbuf[MAX_AUTH_BYTES];
-        char veribuf[MAX_AUTH_BYTES];
-        uint32_t is_last;
-        //net_handle_t *nh;
-
-        buf = &rpcreq->buf;
-
-        ret = job_create(&job, sunrpc_jobtracker, job_sunrpc_request);
-        if (unlikely(ret))
-                GOTO(err_ret, ret); //GOTO???
-
-        req = (void *)job->buf;
-
-        ret = mbuffer_popmsg(buf, req, sizeof(sunrpc_request_t));
-        if (unlikely(ret))
-                GOTO(err_ret, ret); //GOTO???
-
-        is_last = ntohl(req->length) & (1 << 31);
-
-        if (is_last)
-                req->length = ntohl(req->length) ^ (1 << 31);
-        else
-                req->length = ntohl(req->length);
-
-        req->xid = req->xid;
-        req->msgtype = ntohl(req->msgtype);
-        req->rpcversion = ntohl(req->rpcversion);
-        req->program = ntohl(req->program);
-        req->progversion = ntohl(req->progversion);
-        req->procedure = ntohl(req->procedure);
-
-        if (unlikely(is_last != (uint32_t)(1 << 31))) {
-                DERROR("%u:%u\n", is_last, (uint32_t)(1 << 31));
-
-                DERROR("rpc request len %u xid %u version %u prog %u version"
-                                " %u procedure %u\n", req->length, req->xid,
-                                req->rpcversion, req->program, req->progversion,
-                                req->procedure);
-
-                UNIMPLEMENTED(__DUMP__);
-        }
-
-        DBUG("rpc request len %u xid %u version %u prog %u version"
-                        " %u procedure %u\n", req->length, req->xid,
-                        req->rpcversion, req->program, req->progversion,
-                        req->procedure);
-
-        mbuffer_get(buf, &cred, sizeof(auth_head_t));
-        cred.flavor = ntohl(cred.flavor);
-        cred.length = ntohl(cred.length);
-
-        ret = mbuffer_popmsg(buf, credbuf, cred.length + sizeof(auth_head_t));
-        if (unlikely(ret))
-                GOTO(err_ret, ret); //GOTO???
-
-        if (cred.length) {
-                ret = __auth_unix(&auth_unix, credbuf+sizeof(auth_head_t), cred.length);
-                if (unlikely(ret))
-                        GOTO(err_ret, ret); //GOTO???
-
-                job->uid = auth_unix.uid;
-                job->gid = auth_unix.gid;
-                yfree((void**)&auth_unix.machinename);
-        }
-
-        mbuffer_get(buf, &veri, sizeof(auth_head_t));
-        veri.flavor = ntohl(veri.flavor);
-        veri.length = ntohl(veri.length);
-
-        DBUG("cred %u len %u veri %u len %u\n", cred.flavor, cred.length,
-                        veri.flavor, veri.length);
-
-        ret = mbuffer_popmsg(buf, veribuf, veri.length + sizeof(auth_head_t));
-        if (unlikely(ret))
-                GOTO(err_ret, ret); //GOTO???
-
-        mbuffer_init(&job->request, 0);
-
-        mbuffer_merge(&job->request, buf);
-
-        DBUG("request len %u\n", job->request.len);
-
-        memset(&job->net, 0x0, sizeof(job->net));
-        job->sock = rpcreq->sockid;
-
-        job->msgid.idx = req->xid;
-        job->msgid.tabid = 0;
-
-        sunrpc_request_handler(job, NULL, NULL);
-
-        return 0;
-err_ret:
-        return ret;
-}
-
-int __sunrpc_needwait(int *used, int *total)
-{
-        int ret, qos;
-
-        ret = job_used(used, total);
-        if (unlikely(ret))
-                YASSERT(0);
-
-        qos = nfsconf.job_qos;
-        if (unlikely(nfsconf.job_qos > gloconf.jobdock_size/4)) {
-                qos = gloconf.jobdock_size/4;
-                DBUG("job_qos need under 1/4 * job_dock_size, qos was set to %d\n", qos);
-        }
-
-        if (*used > qos) {
-                return 1;
-        }
-
-        return 0;
-}
-
-static int __sunrpc_count()
-{
-        int count;
-
-        sy_spin_lock(&rpcreq_queue->lock);
-        count = rpcreq_queue->rpcreq_count;
-        sy_spin_unlock(&rpcreq_queue->lock);
-
-        return count;
-}
-
-void *__sunrpc_worker(void *arg)
-{
-        int ret, used, total, count;
-        rpcreq_t *rpcreq;
-        struct list_head rpcreq_list;
-        struct list_head *pos, *n;
-
-        (void)arg;
-        INIT_LIST_HEAD(&rpcreq_list);
-
-        while (1) {
-                ret = _sem_wait(&rpcreq_queue->sem);
-                if (ret)
-                        UNIMPLEMENTED(__DUMP__);
-
-                sy_spin_lock(&rpcreq_queue->lock);
-                if (list_empty(&rpcreq_queue->rpcreq_list)) {
-                        sy_spin_unlock(&rpcreq_queue->lock);
-                        DBUG("queue empty wait\n");
-                        /*usleep(100000);*/
-                        continue;
-                }
-
-                count = rpcreq_queue->rpcreq_count;
-                list_splice_tail_init(&rpcreq_queue->rpcreq_list, &rpcreq_list);
-                rpcreq_queue->rpcreq_count = 0;
-
-                sy_spin_unlock(&rpcreq_queue->lock);
-
-                list_for_each_safe(pos, n, &rpcreq_list) {
-retry:
-                        if (__sunrpc_needwait(&used, &total)) {
-                                DWARN("job busy queue %d job %d/%d\n",
-                                                count + __sunrpc_count(), used, total);
-                                usleep(1000);
-                                goto retry;
-                        }
-
-                        rpcreq = (rpcreq_t *)pos;
-                        list_del(pos);
-                        ret = __sunrpc_exec(rpcreq);
-                        if (ret)
-                                YASSERT(0);
-                        yfree((void **)&rpcreq);
-                }
-        }
-}
-
-void __sunrpc_add(rpcreq_t *rpcreq)
-{
-                sy_spin_lock(&rpcreq_queue->lock);
-
-                list_add(&rpcreq->hook, &rpcreq_queue->rpcreq_list);
-                rpcreq_queue->rpcreq_count++;
-
-                sy_spin_unlock(&rpcreq_queue->lock);
-                sem_post(&rpcreq_queue->sem);
-}
-
+/*
+ * requests are decoded by the main loop worker that owns the socket
+ * (__sunrpc_pack_handler) and run in its schedule, nfs_events.c limits
+ * what one connection may have in flight.
+ */
 int sunrpc_init()
 {
         int ret;
-        pthread_attr_t ta;
-        pthread_t th;
 
-        INIT_LIST_HEAD(&rpcreq_queue->rpcreq_list);
-        rpcreq_queue->rpcreq_count = 0;
-        sy_spin_init(&rpcreq_queue->lock);
+        ret = nfs_events_init();
+        if (ret)
+                GOTO(err_ret, ret);
 
-        ret = sem_init(&rpcreq_queue->sem, 0, 0);
+        ret = nfs_drc_init();
         if (ret)
                 GOTO(err_ret, ret);
 
-        pthread_attr_init(&ta);
-        pthread_attr_setdetachstate(&ta, PTHREAD_CREATE_DETACHED);
+        ret = nfs_attrcache_init();
+        if (ret)
+                GOTO(err_ret, ret);
 
-        ret = pthread_create(&th, &ta, __sunrpc_worker, NULL);
+        ret = nfs_wgather_init();
         if (ret)
                 GOTO(err_ret, ret);
 
@@ -400,16 +197,12 @@ err_ret:
         return ret;
 }
 
-
-
 static int __sunrpc_pack_handler(const nid_t *nid, const sockid_t *sockid, buffer_t *buf)
 {
         sunrpc_proto_t type;
-        rpcreq_t *rpcreq;
 
         (void) nid;
-        (void) rpcreq;
-        
+
         mbuffer_get(buf, &type, sizeof(sunrpc_proto_t));
 
         type.msgtype = ntohl(type.msgtype);
@@ -419,21 +212,7 @@ static int __sunrpc_pack_handler(const nid_t *nid, const sockid_t *sockid, buffe
 
         switch (type.msgtype) {
         case SUNRPC_REQ_MSG:
-#if 1
                 __sunrpc_request_handler(sockid, buf);
-#else
-                //在__sunrpc_exec中释放
-                ret = ymalloc((void **)&rpcreq, sizeof(rpcreq_t ));
-                if (ret)
-                        YASSERT(0);
-
-                mbuffer_init(&rpcreq->buf, 0);
-                mbuffer_merge(&rpcreq->buf, buf);
-                rpcreq->sockid = *sockid;
-                INIT_LIST_HEAD(&rpcreq->hook);
-                __sunrpc_add(rpcreq);
-#endif
-
                 break;
         case SUNRPC_REP_MSG:
                 DERROR("bad msgtype\n");
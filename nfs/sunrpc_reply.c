@@ -13,6 +13,7 @@
 #include "job_tracker.h"
 #include "ylib.h"
 #include "ynet_net.h"
+#include "nfs_drc.h"
 #include "dbg.h"
 
 #pragma pack(1)
@@ -144,6 +145,8 @@ int sunrpc_reply(const sockid_t *sockid, const sunrpc_request_t *req,
 
         DBUG("buf len %llu\n", (LLU)(buf.len - sizeof(uint32_t)));
 
+        nfs_drc_save(sockid, req, &buf);
+
         net_handle_t nh;
         sock2nh(&nh, sockid);
         ret = sdevent_queue(&nh, &buf, 0);
@@ -155,3 +158,21 @@ int sunrpc_reply(const sockid_t *sockid, const sunrpc_request_t *req,
 err_ret:
         return ret;
 }
+
+/* send a reply built before, see nfs_drc.c */
+int sunrpc_reply_buf(const sockid_t *sockid, buffer_t *buf)
+{
+        int ret;
+        net_handle_t nh;
+
+        sock2nh(&nh, sockid);
+        ret = sdevent_queue(&nh, buf, 0);
+        if (ret) {
+                GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        mbuffer_free(buf);
+        return ret;
+}
@@ -132,7 +132,10 @@ int conf_init(const char *conf_path)
         mdsconf.disk_keep = (100 * 1024 * 1024 * 1024LL); /*100G*/
         nfsconf.rsize = 1048576;
         nfsconf.wsize = 1048576;
-        nfsconf.job_qos = 4096;
+        nfsconf.job_qos = 512;
+        nfsconf.drc_size = 8192;
+        nfsconf.attr_cache_ttl = 0;
+        nfsconf.write_gather = 32;
         memset(sanconf.iqn, 0x0, MAXSIZE);
         sanconf.lun_blk_shift = 9;
         gloconf.write_back = 1;
@@ -183,6 +186,20 @@ int conf_init(const char *conf_path)
         gloconf.performance_analysis = 0;
         gloconf.io_mode = 1; /*0 is sequence, 1 is random*/
         gloconf.cache_size = (128 * 1024 * 1024LL);
+        gloconf.wbcache = 0;
+        gloconf.wbcache_size = (256 * 1024 * 1024LL);
+        gloconf.wbcache_flush_size = (4 * 1024 * 1024);
+        gloconf.wbcache_flush_interval = 1; //秒
+        gloconf.redis_replica_read = 0;
+        gloconf.redis_replica_lag = 1000; //毫秒
+        gloconf.quota_cache = 0;
+        gloconf.quota_cache_interval = 3; //秒
+        gloconf.quota_space_lease = (64 * 1024 * 1024LL);
+        gloconf.quota_inode_lease = 1024;
+        gloconf.md_atomic = 0;
+        gloconf.dir_split_threshold = 1000000;
+        gloconf.dir_split_buckets = 16;
+        gloconf.inline_size = 0;
         gloconf.net_crc = 0;
         gloconf.check_mountpoint = 1;
         gloconf.check_license = 1;
@@ -220,6 +237,8 @@ int conf_init(const char *conf_path)
         gloconf.hb = 2; //默认2秒
         gloconf.main_loop_threads = 4;
         gloconf.schedule_physical_package_id = -1;
+        gloconf.core_task_max = 0; //0 is TASK_MAX, up to TASK_LIMIT
+        gloconf.main_loop_task_max = 0;
         gloconf.max_lvm = 1024*8; //默认8K，最大64K
 
         yyin = fopen(conf_path, "r");
@@ -509,6 +528,12 @@ int set_value(const char* key, const char* value, int type)
                 nfsconf.wsize = _value;
         else if (keyis("job_qos", key))
                 nfsconf.job_qos = _value;
+        else if (keyis("drc_size", key))
+                nfsconf.drc_size = _value;
+        else if (keyis("attr_cache_ttl", key))
+                nfsconf.attr_cache_ttl = _value;
+        else if (keyis("write_gather", key))
+                nfsconf.write_gather = _value;
 
         /**
          * yiscsi configure
@@ -553,7 +578,13 @@ int set_value(const char* key, const char* value, int type)
                 mdsconf.schedule_physical_package_id = _value;
         else if (keyis("main_loop_threads ", key)) {
                 mdsconf.main_loop_threads = _value;
-        }
+        } else if (keyis("db", key)) {
+                if (strcmp(value, "redis") && strcmp(value, "leveldb")) {
+                        printf("db must be redis or leveldb\n");
+                } else
+                        strncpy(mdsconf.db, value, MAX_NAME_LEN - 1);
+        } else if (keyis("leveldb", key))
+                strncpy(mdsconf.leveldb, value, MAX_PATH_LEN - 1);
 
         /**
          * cds configure
@@ -581,6 +612,43 @@ int set_value(const char* key, const char* value, int type)
                 gloconf.write_back = _value;
         else if (keyis("performance_analysis", key))
                 gloconf.performance_analysis = _value;
+        else if (keyis("wbcache", key))
+                gloconf.wbcache = _value;
+        else if (keyis("wbcache_size", key))
+                gloconf.wbcache_size = _value;
+        else if (keyis("wbcache_flush_size", key))
+                gloconf.wbcache_flush_size = _value;
+        else if (keyis("wbcache_flush_interval", key))
+                gloconf.wbcache_flush_interval = _value;
+        else if (keyis("redis_replica_read", key))
+                gloconf.redis_replica_read = _value;
+        else if (keyis("redis_replica_lag", key))
+                gloconf.redis_replica_lag = _value;
+        else if (keyis("quota_cache", key))
+                gloconf.quota_cache = _value;
+        else if (keyis("quota_cache_interval", key))
+                gloconf.quota_cache_interval = _value;
+        else if (keyis("quota_space_lease", key))
+                gloconf.quota_space_lease = _value;
+        else if (keyis("quota_inode_lease", key))
+                gloconf.quota_inode_lease = _value;
+        else if (keyis("md_atomic", key))
+                gloconf.md_atomic = _value;
+        else if (keyis("dir_split_threshold", key)) {
+                gloconf.dir_split_threshold = _value;
+        } else if (keyis("dir_split_buckets", key)) {
+                gloconf.dir_split_buckets = _value;
+
+                if (gloconf.dir_split_buckets < 1)
+                        gloconf.dir_split_buckets = 1;
+                if (gloconf.dir_split_buckets > 255)
+                        gloconf.dir_split_buckets = 255;
+        } else if (keyis("inline_size", key)) {
+                gloconf.inline_size = _value;
+
+                if (gloconf.inline_size > 65536)
+                        gloconf.inline_size = 65536;
+        }
         else if (keyis("io_mode", key)) {
                 if (strcmp(value, "sequence")  == 0)
                         gloconf.io_mode = 0;
@@ -721,6 +789,10 @@ int set_value(const char* key, const char* value, int type)
                 gloconf.main_loop_threads = _value;
         else if (keyis("schedule_physical_package_id", key))
                 gloconf.schedule_physical_package_id = _value;
+        else if (keyis("core_task_max", key))
+                gloconf.core_task_max = _value;
+        else if (keyis("main_loop_task_max", key))
+                gloconf.main_loop_task_max = _value;
         /**
          * error.
          */
@@ -8,6 +8,7 @@
 #include <setjmp.h>
 #include <sys/eventfd.h>
 #include <sys/syscall.h>   /* For SYS_xxx definitions */
+#include <sys/mman.h>
 #include <stdint.h>
 
 #define DBG_SUBSYS S_LIBSCHEDULE
@@ -105,11 +106,17 @@ static __thread job_t *__running_job__ = NULL;
 static schedule_t **__schedule_array__ = NULL;
 static sy_spinlock_t __schedule_array_lock__;
 
+/* migratable requests not yet started, of all schedules */
+#define STEAL_BATCH 16
+static int __schedule_steal_pending__ = 0;
+
 static int __schedule_isfree(taskctx_t *taskctx);
 static void __schedule_fingerprint_new(schedule_t *schedule, taskctx_t *taskctx);
 static taskctx_t *__schedule_task_new(const char *name, func_t func, void *arg, int timeout, task_t *_parent, int priority);
 static void __schedule_backtrace__(const char *name, int id, int idx, uint32_t seq);
 static void __schedule_backtrace_set(taskctx_t *taskctx);
+static void __schedule_steal_queue_run(schedule_t *schedule);
+static int __schedule_steal(schedule_t *_schedule);
 
 
 #ifdef NEW_SCHED
@@ -255,7 +262,8 @@ int schedule_suspend()
 #if SCHEDULE_RUNNING_TASK_LIST
 static int __schedule_task_hasfree(schedule_t *schedule)
 {
-        return !list_empty(&schedule->free_task_list);
+        return !list_empty(&schedule->free_task_list)
+                || schedule->size < schedule->task_max;
 }
 #else
 static int __schedule_task_hasfree(schedule_t *schedule)
@@ -276,7 +284,7 @@ static int __schedule_task_hasfree(schedule_t *schedule)
                                 break;
                 }
 
-                if (i == TASK_MAX) {
+                if (i == schedule->task_max) {
                         return 0;
                 }
         }
@@ -371,6 +379,57 @@ static void __schedule_trampoline(taskctx_t *taskctx)
 #endif
 }
 
+#if ENABLE_SCHEDULE_STACK_GUARD
+/**
+ * stack is mmapped lazily, only touched pages are committed, an overflow
+ * hits the PROT_NONE page below the stack instead of the neighbour's memory.
+ */
+static int __schedule_stack_alloc(taskctx_t *taskctx)
+{
+        int ret;
+        char *addr;
+        size_t guard = getpagesize();
+
+        addr = mmap(NULL, DEFAULT_STACK_SIZE + guard, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (unlikely(addr == MAP_FAILED)) {
+                ret = errno;
+                GOTO(err_ret, ret);
+        }
+
+        ret = mprotect(addr, guard, PROT_NONE);
+        if (unlikely(ret < 0)) {
+                ret = errno;
+                munmap(addr, DEFAULT_STACK_SIZE + guard);
+                GOTO(err_ret, ret);
+        }
+
+        taskctx->stack = addr + guard;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static void __schedule_stack_free(taskctx_t *taskctx)
+{
+        size_t guard = getpagesize();
+
+        munmap((char *)taskctx->stack - guard, DEFAULT_STACK_SIZE + guard);
+        taskctx->stack = NULL;
+}
+#else
+static int __schedule_stack_alloc(taskctx_t *taskctx)
+{
+        return ymalloc((void **)&taskctx->stack, DEFAULT_STACK_SIZE);
+}
+
+static void __schedule_stack_free(taskctx_t *taskctx)
+{
+        yfree((void **)&taskctx->stack);
+}
+#endif
+
 #ifdef NEW_SCHED
 static void __schedule_makecontext(schedule_t *schedule, taskctx_t *taskctx)
 {
@@ -673,7 +732,7 @@ static int __schedule_exec(schedule_t *schedule, const task_t  *task, int retval
         int ret;
         taskctx_t *taskctx;
 
-        YASSERT(task->taskid >= 0 && task->taskid < TASK_MAX);
+        YASSERT(task->taskid >= 0 && task->taskid < schedule->size);
         taskctx = &schedule->tasks[task->taskid];
 
         DBUG("run task %s, id [%u][%u]\n", taskctx->name, schedule->id, taskctx->id);
@@ -983,24 +1042,31 @@ static taskctx_t *__schedule_task_new(const char *name, func_t func, void *arg,
 
 #if SCHEDULE_RUNNING_TASK_LIST
         (void) i;
-        (void) tasks;
-        if (list_empty(&schedule->free_task_list)) {
+        if (likely(!list_empty(&schedule->free_task_list))) {
+                /* freed tasks are pushed to the head, reuse the hottest stack */
+                taskctx = list_entry(schedule->free_task_list.next, taskctx_t, running_hook);
+
+                list_del(&taskctx->running_hook);
+        } else if (schedule->size < schedule->task_max) {
+                idx = schedule->size;
+                taskctx = &tasks[idx];
+                taskctx->id = idx;
+                taskctx->stack = NULL;
+                taskctx->state = TASK_STAT_FREE;
+                schedule->size++;
+        } else {
                 ret = __schedule_wait_task(name, func, arg, &parent);
                 if (unlikely(ret))
                         UNIMPLEMENTED(__DUMP__);
 
                 return NULL;
-        } else {
-                taskctx = list_entry(schedule->free_task_list.next, taskctx_t, running_hook);
-
-                list_del(&taskctx->running_hook);
         }
 
         if (taskctx->stack == NULL) {
                 if (likely(schedule->private_mem)) {
                         taskctx->stack = schedule->stack_addr + taskctx->id * DEFAULT_STACK_SIZE;
                 } else {
-                        ret = ymalloc((void **)&taskctx->stack, DEFAULT_STACK_SIZE);
+                        ret = __schedule_stack_alloc(taskctx);
                         if (unlikely(ret))
                                 UNIMPLEMENTED(__DUMP__);
                 }
@@ -1017,7 +1083,7 @@ static taskctx_t *__schedule_task_new(const char *name, func_t func, void *arg,
 
                 DBUG("id %u size %u\n", idx, schedule->size);
 
-                if (unlikely(i == TASK_MAX)) {
+                if (unlikely(i == schedule->task_max)) {
                         ret = __schedule_wait_task(name, func, arg, &parent);
                         if (unlikely(ret))
                                 UNIMPLEMENTED(__DUMP__);
@@ -1151,6 +1217,55 @@ void schedule_task_new(const char *name, func_t func, void *arg, int priority)
 #else
 #endif
 
+static int __schedule_task_max(const char *name)
+{
+        int max;
+
+        if (strcmp(name, "core") == 0)
+                max = gloconf.core_task_max;
+        else if (strcmp(name, "default") == 0)
+                max = gloconf.main_loop_task_max;
+        else
+                max = TASK_MAX;
+
+        if (max == 0) {
+                max = TASK_MAX;
+        } else if (max < 0 || max > TASK_LIMIT) {
+                DWARN("%s task max %d, reset to %u\n", name, max, TASK_LIMIT);
+                max = TASK_LIMIT;
+        }
+
+        return max;
+}
+
+/**
+ * address space for max tasks is reserved, pages are committed when
+ * a task slot is first used, so taskctx never move.
+ */
+static int __schedule_tasks_alloc(taskctx_t **_tasks, int max)
+{
+        int ret;
+        void *addr;
+
+        addr = mmap(NULL, sizeof(taskctx_t) * max, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (unlikely(addr == MAP_FAILED)) {
+                ret = errno;
+                GOTO(err_ret, ret);
+        }
+
+        *_tasks = addr;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static void __schedule_tasks_free(taskctx_t *tasks, int max)
+{
+        munmap(tasks, sizeof(taskctx_t) * max);
+}
+
 static int __schedule_create__(schedule_t **_schedule, const char *name, int idx, void *private_mem, int *_eventfd)
 {
         int ret, fd, i;
@@ -1208,6 +1323,10 @@ static int __schedule_create__(schedule_t **_schedule, const char *name, int idx
         if (unlikely(ret))
                 GOTO(err_ret, ret);
 
+        ret = sy_spin_init(&schedule->steal_queue.lock);
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
         ret = sy_spin_init(&schedule->reply_remote.lock);
         if (unlikely(ret))
                 GOTO(err_ret, ret);
@@ -1219,8 +1338,14 @@ static int __schedule_create__(schedule_t **_schedule, const char *name, int idx
         schedule->suspendable = 0;
         strcpy(schedule->name, name);
 
+        schedule->task_max = __schedule_task_max(name);
+        schedule->request_queue.limit = REQUEST_QUEUE_MAX(schedule->task_max);
+        schedule->steal_queue.limit = REQUEST_QUEUE_MAX(schedule->task_max);
+        schedule->reply_local.limit = REPLY_QUEUE_MAX(schedule->task_max);
+        schedule->reply_remote.limit = REPLY_QUEUE_MAX(schedule->task_max);
+
 #if 1
-        ret = ymalloc((void **)&taskctx, sizeof(*taskctx) * TASK_MAX);
+        ret = __schedule_tasks_alloc(&taskctx, schedule->task_max);
         if (unlikely(ret))
                 GOTO(err_ret, ret);
 #else
@@ -1241,18 +1366,10 @@ static int __schedule_create__(schedule_t **_schedule, const char *name, int idx
 #endif
 
         YASSERT(taskctx);
-        memset(taskctx, 0x0, sizeof(*taskctx) * TASK_MAX);
 
         INIT_LIST_HEAD(&schedule->running_task_list);
         INIT_LIST_HEAD(&schedule->free_task_list);
 
-        for (i = 0; i < TASK_MAX; ++i) {
-                taskctx[i].id = i;
-                taskctx[i].stack = NULL;
-                taskctx[i].state = TASK_STAT_FREE;
-                list_add_tail(&taskctx[i].running_hook, &schedule->free_task_list);
-        }
-
         count_list_init(&schedule->wait_task);
         for (i = 0; i < SCHEDULE_PRIORITY_MAX; i++) {
                 count_list_init(&schedule->runable[i]);
@@ -1260,7 +1377,8 @@ static int __schedule_create__(schedule_t **_schedule, const char *name, int idx
 
         schedule->tasks = taskctx;
         schedule->running = 1;
-        schedule->size = TASK_MAX;
+        /* task slots are initialized on demand, see __schedule_task_new */
+        schedule->size = 0;
 
         variable_set(VARIABLE_SCHEDULE, schedule);
         if (_schedule)
@@ -1284,6 +1402,8 @@ static void __schedule_destroy(schedule_t *schedule)
                 yfree((void **)&reply_local->replys);
         if (request_queue->requests)
                 yfree((void **)&request_queue->requests);
+        if (schedule->steal_queue.requests)
+                yfree((void **)&schedule->steal_queue.requests);
 
         YASSERT(list_empty(&schedule->wait_task.list));
 #if SCHEDULE_RUNNING_TASK_LIST
@@ -1292,7 +1412,7 @@ static void __schedule_destroy(schedule_t *schedule)
                 YASSERT(taskctx->state == TASK_STAT_FREE);
                 if (taskctx->stack) {
                         if (schedule->private_mem == NULL)
-                                yfree((void **)&taskctx->stack);
+                                __schedule_stack_free(taskctx);
                         else
                                 taskctx->stack = NULL;
                 }
@@ -1314,7 +1434,7 @@ static void __schedule_destroy(schedule_t *schedule)
         close(schedule->eventfd);
 
         if (schedule->private_mem == NULL) {
-                yfree((void **)&schedule->tasks);
+                __schedule_tasks_free(schedule->tasks, schedule->task_max);
                 yfree((void **)&schedule);
         }
 }
@@ -1430,6 +1550,8 @@ int schedule_finished(schedule_t *schedule)
 {
         if (__schedule_request_queue_finished(schedule) == 0)
                 return 0;
+        else if (__schedule_self(schedule)->steal_queue.count)
+                return 0;
         else if (__schedule_reply_local_finished(schedule) == 0)
                 return 0;
         else if (__schedule_reply_remote_finished(schedule) == 0)
@@ -1488,29 +1610,79 @@ void IO_FUNC schedule_task_run(schedule_t *_schedule)
         __schedule_task_run(_schedule);
 }
 
+/*
+ * a few entries are copied to the stack, a burst takes the whole array and
+ * the queue grows a new one, so the run may nest and the stack stays small
+ */
+static request_t *__schedule_request_take(request_queue_t *request_queue,
+                                          request_t *_request, int *_count)
+{
+        int count;
+        request_t *array;
+
+        count = request_queue->count;
+        if (likely(count <= SCHEDULE_QUEUE_COPY)) {
+                memcpy(_request, request_queue->requests, sizeof(request_t) * count);
+                array = _request;
+        } else {
+                array = request_queue->requests;
+                request_queue->requests = NULL;
+                request_queue->max = 0;
+        }
+
+        request_queue->count = 0;
+        *_count = count;
+
+        return array;
+}
+
+static reply_t *__schedule_reply_take(reply_queue_t *reply_queue,
+                                      reply_t *_reply, int *_count)
+{
+        int count;
+        reply_t *array;
+
+        count = reply_queue->count;
+        YASSERT(count <= reply_queue->limit);
+        if (likely(count <= SCHEDULE_QUEUE_COPY)) {
+                memcpy(_reply, reply_queue->replys, sizeof(reply_t) * count);
+                array = _reply;
+        } else {
+                array = reply_queue->replys;
+                reply_queue->replys = NULL;
+                reply_queue->max = 0;
+        }
+
+        reply_queue->count = 0;
+        *_count = count;
+
+        return array;
+}
+
 static void __schedule_request_queue_run(schedule_t *_schedule)
 {
         int ret, count, i;
         schedule_t *schedule = __schedule_self(_schedule);
         request_queue_t *request_queue = &schedule->request_queue;
-        request_t _request[REQUEST_QUEUE_MAX], *request;
+        request_t _request[SCHEDULE_QUEUE_COPY], *array, *request;
 
         if (request_queue->count) {
                 ret = sy_spin_lock(&request_queue->lock);
                 if (unlikely(ret))
                         UNIMPLEMENTED(__DUMP__);
 
-                memcpy(_request, request_queue->requests, sizeof(request_t) * request_queue->count);
-                count = request_queue->count;
-                request_queue->count = 0;
+                array = __schedule_request_take(request_queue, _request, &count);
                 sy_spin_unlock(&request_queue->lock);
 
                 for (i = 0; i < count; ++i) {
-                        request = &_request[i];
+                        request = &array[i];
                         __schedule_task_new(request->name, request->exec,
                                             request->buf, -1, &request->parent,
                                             request->priority);
                 }
+
+                if (array != _request)
+                        yfree((void **)&array);
         }
 }
 
@@ -1519,7 +1691,7 @@ static int __schedule_reply_remote_run(schedule_t *_schedule)
         int ret, count, i;
         schedule_t *schedule = __schedule_self(_schedule);
         reply_queue_t *reply_remote = &schedule->reply_remote;
-        reply_t _reply[REPLY_QUEUE_MAX], *reply;
+        reply_t _reply[SCHEDULE_QUEUE_COPY], *array, *reply;
         //core_t *core = core_self();
 
         if (schedule->running == 0) {
@@ -1536,14 +1708,11 @@ static int __schedule_reply_remote_run(schedule_t *_schedule)
                 if (unlikely(ret))
                         UNIMPLEMENTED(__DUMP__);
 
-                YASSERT(reply_remote->count <= REPLY_QUEUE_MAX);
-                memcpy(_reply, reply_remote->replys, sizeof(reply_t) * reply_remote->count);
-                count = reply_remote->count;
-                reply_remote->count = 0;
+                array = __schedule_reply_take(reply_remote, _reply, &count);
                 sy_spin_unlock(&reply_remote->lock);
 
                 for (i = 0; i < count; ++i) {
-                        reply = &_reply[i];
+                        reply = &array[i];
                         DBUG("**** rep %u\n", reply->task.taskid);
 
                         ret = __schedule_exec(schedule, &reply->task, reply->retval, reply->buf, 0);
@@ -1553,6 +1722,9 @@ static int __schedule_reply_remote_run(schedule_t *_schedule)
 
                         mem_cache_free(MEM_CACHE_4K, reply->buf);
                 }
+
+                if (array != _reply)
+                        yfree((void **)&array);
         }
 
         if (schedule->running == 0) {
@@ -1568,7 +1740,7 @@ static int __schedule_reply_local_run(schedule_t *_schedule)
         int ret, count, i;
         schedule_t *schedule = __schedule_self(_schedule);
         reply_queue_t *reply_local = &schedule->reply_local;
-        reply_t _reply[REPLY_QUEUE_MAX], *reply;
+        reply_t _reply[SCHEDULE_QUEUE_COPY], *array, *reply;
 
         if (schedule->running == 0) {
                 DINFO("reply queue %u\n", reply_local->count);
@@ -1577,13 +1749,10 @@ static int __schedule_reply_local_run(schedule_t *_schedule)
         if (reply_local->count == 0) {
                 return 0;
         } else {
-                YASSERT(reply_local->count <= REPLY_QUEUE_MAX);
-                memcpy(_reply, reply_local->replys, sizeof(reply_t) * reply_local->count);
-                count = reply_local->count;
-                reply_local->count = 0;
+                array = __schedule_reply_take(reply_local, _reply, &count);
 
                 for (i = 0; i < count; ++i) {
-                        reply = &_reply[i];
+                        reply = &array[i];
                         DBUG("**** rep %u\n", reply->task.taskid);
                         ret = __schedule_exec(schedule, &reply->task, reply->retval, reply->buf, 0);
                         if (unlikely(ret)) {
@@ -1592,6 +1761,9 @@ static int __schedule_reply_local_run(schedule_t *_schedule)
 
                         mem_cache_free(MEM_CACHE_4K, reply->buf);
                 }
+
+                if (array != _reply)
+                        yfree((void **)&array);
         }
 
         if (schedule->running == 0) {
@@ -1643,6 +1815,7 @@ static void __schedule_run(schedule_t *_schedule)
         }
 
         __schedule_request_queue_run(_schedule);
+        __schedule_steal_queue_run(__schedule_self(_schedule));
 }
 
 void schedule_run(schedule_t *_schedule)
@@ -1653,14 +1826,16 @@ void schedule_run(schedule_t *_schedule)
         _gettimeofday(&t1, NULL);
 #endif
 
-        while (!schedule_finished(_schedule)) {
-                //ANALYSIS_BEGIN(0);
+        do {
+                while (!schedule_finished(_schedule)) {
+                        //ANALYSIS_BEGIN(0);
 
-                DBUG("running\n");
-                __schedule_run(_schedule);
+                        DBUG("running\n");
+                        __schedule_run(_schedule);
 
-                //ANALYSIS_QUEUE(0, IO_WARN, "schedule_run");
-        }
+                        //ANALYSIS_QUEUE(0, IO_WARN, "schedule_run");
+                }
+        } while (__schedule_steal(_schedule));
 
 #if SCHEDULE_CHECK_RUNTIME
         _gettimeofday(&t2, NULL);
@@ -1700,10 +1875,10 @@ void schedule_task_given(task_t *task)
         }
 }
 
-int schedule_request(schedule_t *schedule, int priority, void (*exec)(void *buf), void *buf, const char *name)
+static int __schedule_request_push(request_queue_t *request_queue, int priority,
+                                   void (*exec)(void *buf), void *buf, const char *name)
 {
         int ret;
-        request_queue_t *request_queue = &schedule->request_queue;
         request_t *request;
 
         ret = sy_spin_lock(&request_queue->lock);
@@ -1711,7 +1886,7 @@ int schedule_request(schedule_t *schedule, int priority, void (*exec)(void *buf)
                 UNIMPLEMENTED(__DUMP__);
 
         if (request_queue->count == request_queue->max) {
-                if (request_queue->count + REQUEST_QUEUE_STEP == REQUEST_QUEUE_MAX) {
+                if (request_queue->count + REQUEST_QUEUE_STEP > request_queue->limit) {
                         ret = ENOSPC;
                         UNIMPLEMENTED(__DUMP__);
                         GOTO(err_lock, ret);
@@ -1740,15 +1915,200 @@ int schedule_request(schedule_t *schedule, int priority, void (*exec)(void *buf)
 
         sy_spin_unlock(&request_queue->lock);
 
-        schedule_post(schedule);
-
         return 0;
 err_lock:
         sy_spin_unlock(&request_queue->lock);
-//err_ret:
         return ret;
 }
 
+int schedule_request(schedule_t *schedule, int priority, void (*exec)(void *buf), void *buf, const char *name)
+{
+        int ret;
+
+        ret = __schedule_request_push(&schedule->request_queue, priority, exec, buf, name);
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
+        schedule_post(schedule);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/*
+ * pop at most max requests, the owner from the head so its tasks start in
+ * the order they were queued, a thief from the tail
+ */
+static int __schedule_steal_queue_pop(request_queue_t *steal_queue, request_t *array,
+                                      int max, int head)
+{
+        int ret, count;
+
+        ret = sy_spin_lock(&steal_queue->lock);
+        if (unlikely(ret))
+                UNIMPLEMENTED(__DUMP__);
+
+        count = steal_queue->count < max ? steal_queue->count : max;
+        if (head) {
+                memcpy(array, steal_queue->requests, sizeof(request_t) * count);
+                memmove(steal_queue->requests, &steal_queue->requests[count],
+                        sizeof(request_t) * (steal_queue->count - count));
+        } else {
+                memcpy(array, &steal_queue->requests[steal_queue->count - count],
+                       sizeof(request_t) * count);
+        }
+        steal_queue->count -= count;
+
+        sy_spin_unlock(&steal_queue->lock);
+
+        if (count)
+                __sync_fetch_and_sub(&__schedule_steal_pending__, count);
+
+        return count;
+}
+
+static int __schedule_steal_idle(const schedule_t *schedule)
+{
+        return schedule->running_task == -1 && __schedule_runable(schedule) == 0;
+}
+
+static void __schedule_steal_wakeup(schedule_t *schedule)
+{
+        int i;
+        schedule_t *peer;
+
+        for (i = 1; i < SCHEDULE_MAX; i++) {
+                peer = __schedule_array__[(schedule->id + i) % SCHEDULE_MAX];
+                if (peer == NULL || strcmp(peer->name, schedule->name))
+                        continue;
+
+                if (__schedule_steal_idle(peer)) {
+                        schedule_post(peer);
+                        break;
+                }
+        }
+}
+
+/**
+ * func must not depend on core local state, it may be started by any
+ * schedule with the same name (role) as the creator.
+ */
+void schedule_task_new_migratable(const char *name, func_t func, void *arg, int priority)
+{
+        int ret;
+        schedule_t *schedule = schedule_self();
+        request_queue_t *steal_queue;
+
+        if (unlikely(schedule == NULL)) {
+                schedule_task_new(name, func, arg, priority);
+                return;
+        }
+
+        steal_queue = &schedule->steal_queue;
+        ret = __schedule_request_push(steal_queue, priority, func, arg, name);
+        if (unlikely(ret))
+                UNIMPLEMENTED(__DUMP__);
+
+        __sync_fetch_and_add(&__schedule_steal_pending__, 1);
+
+        if (steal_queue->count % STEAL_BATCH == 0) {
+                __schedule_steal_wakeup(schedule);
+        }
+}
+
+typedef struct {
+        task_t task;
+        func0_t func;
+        void *arg;
+} schedule_migrate_ctx_t;
+
+static void __schedule_task_migrate(void *_ctx)
+{
+        schedule_migrate_ctx_t *ctx = _ctx;
+
+        schedule_resume(&ctx->task, ctx->func(ctx->arg), NULL);
+}
+
+/**
+ * run a cpu bound func (ec, checksum, ...) as a migratable task and wait
+ * for its return value, an idle peer may take it meanwhile.
+ */
+int schedule_task_migrate(const char *name, func0_t func, void *arg)
+{
+        schedule_migrate_ctx_t ctx;
+
+        if (unlikely(schedule_self() == NULL))
+                return func(arg);
+
+        ctx.task = schedule_task_get();
+        ctx.func = func;
+        ctx.arg = arg;
+
+        schedule_task_new_migratable(name, __schedule_task_migrate, &ctx, -1);
+
+        return schedule_yield(name, NULL, NULL);
+}
+
+static void __schedule_steal_queue_run(schedule_t *schedule)
+{
+        int count, i;
+        request_t _request[STEAL_BATCH], *request;
+
+        if (schedule->steal_queue.count == 0)
+                return;
+
+        count = __schedule_steal_queue_pop(&schedule->steal_queue, _request,
+                                           STEAL_BATCH, 1);
+        for (i = 0; i < count; ++i) {
+                request = &_request[i];
+                __schedule_task_new(request->name, request->exec,
+                                    request->buf, -1, &request->parent,
+                                    request->priority);
+        }
+}
+
+/* idle schedule takes half of a busy peer's migratable requests */
+static int __schedule_steal(schedule_t *_schedule)
+{
+        int i, j, max, count;
+        schedule_t *schedule = __schedule_self(_schedule), *peer;
+        request_t _request[STEAL_BATCH], *request;
+
+        if (likely(__schedule_steal_pending__ == 0))
+                return 0;
+
+        for (i = 1; i < SCHEDULE_MAX; i++) {
+                peer = __schedule_array__[(schedule->id + i) % SCHEDULE_MAX];
+                if (peer == NULL || peer->steal_queue.count < 2
+                    || strcmp(peer->name, schedule->name))
+                        continue;
+
+                max = peer->steal_queue.count / 2;
+                max = max < STEAL_BATCH ? max : STEAL_BATCH;
+                count = __schedule_steal_queue_pop(&peer->steal_queue, _request, max, 0);
+                if (count == 0)
+                        continue;
+
+                for (j = 0; j < count; ++j) {
+                        request = &_request[j];
+                        __schedule_task_new(request->name, request->exec,
+                                            request->buf, -1, &request->parent,
+                                            request->priority);
+                }
+
+                schedule->steal_count += count;
+                __sync_fetch_and_add(&peer->stolen_count, count);
+
+                DBUG("%s[%u] steal %u from [%u]\n", schedule->name,
+                     schedule->id, count, peer->id);
+
+                return count;
+        }
+
+        return 0;
+}
+
 static void __schedule_resume(schedule_t *schedule, reply_queue_t *reply_queue,
                               const task_t *task, int retval, buffer_t *buf)
 {
@@ -1757,7 +2117,7 @@ static void __schedule_resume(schedule_t *schedule, reply_queue_t *reply_queue,
         reply_t *reply;
 
         YASSERT(task->scheduleid >= 0 && task->scheduleid <= SCHEDULE_MAX);
-        YASSERT(task->taskid >= 0 && task->taskid < TASK_MAX);
+        YASSERT(task->taskid >= 0 && task->taskid < TASK_LIMIT);
         YASSERT(task->fingerprint);
 
         (void) schedule;
@@ -1773,7 +2133,7 @@ static void __schedule_resume(schedule_t *schedule, reply_queue_t *reply_queue,
 #endif
 
         if (unlikely(reply_queue->count == reply_queue->max)) {
-                if (unlikely(reply_queue->count + REPLY_QUEUE_STEP > REPLY_QUEUE_MAX)) {
+                if (unlikely(reply_queue->count + REPLY_QUEUE_STEP > reply_queue->limit)) {
                         ret = ENOSPC;
                         GOTO(err_ret, ret);
                 }
@@ -1989,8 +2349,9 @@ void IO_FUNC schedule_scan(schedule_t *_schedule)
                 }
         }
 
-        DINFO("%s[%u] %u/%u/%u\n", schedule->name, schedule->id,
-              TASK_MAX, schedule->size, used);
+        DINFO("%s[%u] %u/%u/%u steal %llu stolen %llu\n", schedule->name, schedule->id,
+              schedule->task_max, schedule->size, used,
+              (LLU)schedule->steal_count, (LLU)schedule->stolen_count);
 }
 
 void schedule_backtrace()
@@ -28,13 +28,19 @@
 
 #define SCHEDULE_CHECK_RUNTIME ENABLE_SCHEDULE_CHECK_RUNTIME
 
+/* default task slots per scheduler, see schedule_t->task_max */
 #define TASK_MAX (8192)
+/* task_t.taskid is an int16_t */
+#define TASK_LIMIT (INT16_MAX)
 
 #define REQUEST_QUEUE_STEP 128
-#define REQUEST_QUEUE_MAX TASK_MAX * 4
+#define REQUEST_QUEUE_MAX(__task_max__) ((__task_max__) * 4)
 
 #define REPLY_QUEUE_STEP 128
-#define REPLY_QUEUE_MAX TASK_MAX
+#define REPLY_QUEUE_MAX(__task_max__) (__task_max__)
+
+/* queued requests/replies up to this are copied to the stack to run */
+#define SCHEDULE_QUEUE_COPY 256
 
 #define NEW_SCHED
 
@@ -141,6 +147,7 @@ typedef struct {
         sy_spinlock_t lock;
         int count;
         int max;
+        int limit;
         request_t *requests;
 } request_queue_t;
 
@@ -154,6 +161,7 @@ typedef struct {
         sy_spinlock_t lock;
         int count;
         int max;
+        int limit;
         reply_t *replys;
 } reply_queue_t;
 
@@ -185,7 +193,8 @@ typedef struct schedule_t {
         void *private_mem;
         taskctx_t *tasks;
         void *stack_addr;
-        int size;
+        int size;               /* task slots in use, grow up to task_max */
+        int task_max;
 
         // no free task count
         int task_count;
@@ -204,6 +213,11 @@ typedef struct schedule_t {
         // core_request的请求，先放入队列，而后才生成task
         request_queue_t request_queue;
 
+        // schedule_task_new_migratable的请求，空闲的同名调度器可以窃取
+        request_queue_t steal_queue;
+        uint64_t steal_count;
+        uint64_t stolen_count;
+
         // 当前可调度的任务队列
         count_list_t runable[SCHEDULE_PRIORITY_MAX];
 
@@ -245,6 +259,8 @@ int schedule_request(schedule_t *schedule, int priority, void (*exec)(void *buf)
 
 void schedule_task_new(const char *name, func_t func, void *arg, int priority);
 void schedule_task_new1(const char *name, func_t func, void *arg, int priority);
+void schedule_task_new_migratable(const char *name, func_t func, void *arg, int priority);
+int schedule_task_migrate(const char *name, func0_t func, void *arg);
 
 /** 有副作用，两次schedule_task_get调用之间，必须有schedule_yield
  *
@@ -30,6 +30,7 @@
 #include "io_analysis.h"
 #include "flock.h"
 #include "xattr.h"
+#include "sdfs_wbcache.h"
 #include "dbg.h"
 
 
@@ -99,6 +100,10 @@ int sdfs_read(const fileid_t *fileid, buffer_t *_buf, uint32_t size, uint64_t of
         DBUG("fileid "FID_FORMAT" size %llu off %llu size %u\n", FID_ARG(&md->fileid),
               (LLU)md->at_size, (LLU)offset, size);
 
+        ret = wbcache_flush(fileid);
+        if (ret)
+                GOTO(err_ret, ret);
+
 retry:
         ret = md_getattr((void *)md, fileid);
         if (ret) {
@@ -109,6 +114,19 @@ retry:
                         GOTO(err_ret, ret);
         }
 
+        if (md->data_inline) {
+                ret = md_inline_read((void *)md, _buf, size, offset);
+                if (ret == 0) {
+                        goto out;
+                } else if (ret != ENODATA) {
+                        ret = _errno(ret);
+                        if (ret == EAGAIN) {
+                                USLEEP_RETRY(err_ret, ret, retry, retry, 100, (1000 * 1000));
+                        } else
+                                GOTO(err_ret, ret);
+                }
+        }
+
         if (offset > md->at_size) {
                 DWARN("fileid "FID_FORMAT" size %llu off %llu size %u\n", FID_ARG(&md->fileid),
                                 (LLU)md->at_size, (LLU)offset, size);
@@ -148,6 +166,7 @@ retry:
                 }
 
                 size -= chk_size;
+                offset += chk_size;
                 YASSERT(buf.len == chk_size);
                 mbuffer_merge(_buf, &buf);
         }
@@ -155,7 +174,7 @@ retry:
 out:
         ANALYSIS_QUEUE(0, IO_WARN, NULL);
 
-        ret = io_analysis(ANALYSIS_READ, size);
+        ret = io_analysis(ANALYSIS_READ, _buf->len);
         if (ret)
                 GOTO(err_ret, ret);
         
@@ -208,7 +227,7 @@ int sdfs_read_async(const fileid_t *fileid, buffer_t *buf, uint32_t size,
         ctx->callback = callback;
         ctx->arg = obj;
 
-        ret = main_loop_request(__sdfs_read_async, ctx, "sdfs_read_async");
+        ret = main_loop_request1(fileid->id, __sdfs_read_async, ctx, "sdfs_read_async");
         if (ret)
                 GOTO(err_free, ret);
 
@@ -261,7 +280,8 @@ err_ret:
         return -ret;
 }
 
-static int __sdfs_write_split(wseg_t *segs, int *count, buffer_t *buf, uint32_t _size,
+/* split the head of buf in at most YFS_WRITE_SEG_MAX segs, the rest stays in buf */
+static int __sdfs_write_split(wseg_t *segs, int *count, buffer_t *buf,
                    uint64_t _offset, uint32_t chk_max, const fileid_t *fileid)
 {
         int ret, i;
@@ -270,12 +290,9 @@ static int __sdfs_write_split(wseg_t *segs, int *count, buffer_t *buf, uint32_t
         wseg_t *seg;
 
         offset = _offset;
-        size = _size;
-        YASSERT(buf->len == _size);
-
-        for (i = 0; size > 0; i++) {
-                YASSERT(i < YFS_WRITE_SEG_MAX);
+        size = buf->len;
 
+        for (i = 0; size > 0 && i < YFS_WRITE_SEG_MAX; i++) {
                 seg = &segs[i];
                 fid2cid(&seg->head.chkid, fileid, offset / chk_max);
                 seg->head.op = CHKOP_WRITE;
@@ -294,13 +311,15 @@ static int __sdfs_write_split(wseg_t *segs, int *count, buffer_t *buf, uint32_t
                 mbuffer_init(&seg->buf, 0);
 
                 ret = mbuffer_pop(buf, &seg->buf, seg->head.size);
-                if (ret)
+                if (ret) {
+                        *count = i + 1;
                         GOTO(err_ret, ret);
+                }
 
                 YASSERT(seg->buf.len == seg->head.size);
         }
 
-        YASSERT(buf->len == 0);
+        YASSERT(buf->len == size);
 
         *count = i;
 
@@ -311,25 +330,153 @@ err_ret:
         return ret;
 }
 
-int sdfs_write(const fileid_t *fileid, const buffer_t *_buf, uint32_t size, uint64_t offset)
+static void __sdfs_write_free(wseg_t *segs, int count)
 {
-        int ret, retry = 0;
-        fileinfo_t _md;
-        fileinfo_t *md = &_md;
+        int i;
+
+        for (i = 0; i < count; i++) {
+                mbuffer_free(&segs[i].buf);
+        }
+}
+
+/* large writes, gathered ones included, go out YFS_WRITE_SEG_MAX segs a round */
+static int __sdfs_write1(const fileinfo_t *md, const buffer_t *_buf,
+                         uint32_t size, uint64_t offset)
+{
+        int ret;
         ec_t ec;
         wseg_t seg_array[YFS_WRITE_SEG_MAX], *seg;
         int i, seg_count;
         buffer_t newbuf;
 
-        ANALYSIS_BEGIN(0);
-        
         YASSERT(_buf->len == size);
-
-        DBUG("write "CHKID_FORMAT"\n", CHKID_ARG(fileid));
+        YASSERT(md->split);
+        YASSERT(md->fileid.id);
+        YASSERT(md->fileid.volid);
 
         mbuffer_init(&newbuf, 0);
         mbuffer_reference(&newbuf, _buf);
-        
+
+        ec.plugin = md->plugin;
+        ec.tech = md->tech;
+        ec.m = md->m;
+        ec.k = md->k;
+
+        while (newbuf.len) {
+                seg_count = 0;
+                ret = __sdfs_write_split(seg_array, &seg_count, &newbuf,
+                                         offset, md->split, &md->fileid);
+                if (ret)
+                        GOTO(err_free, ret);
+
+                for (i = 0; i < seg_count; i++) {
+                        seg = &seg_array[i];
+                        ret = sdfs_chunk_write(md, &seg->head.chkid, &seg->buf,
+                                               seg->head.size, seg->head.offset, &ec);
+                        if (ret) {
+                                GOTO(err_free, ret);
+                        }
+
+                        offset += seg->head.size;
+                }
+
+                __sdfs_write_free(seg_array, seg_count);
+        }
+
+        mbuffer_free(&newbuf);
+
+        return 0;
+err_free:
+        __sdfs_write_free(seg_array, seg_count);
+        mbuffer_free(&newbuf);
+        return ret;
+}
+
+/*
+ * move the data of an inline file to its chunks, it is growing past
+ * inline_size
+ */
+static int __sdfs_inline_promote(const fileid_t *fileid)
+{
+        int ret, retry = 0;
+        fileinfo_t _md;
+        fileinfo_t *md = &_md;
+        buffer_t buf, chkbuf;
+
+retry:
+        mbuffer_init(&buf, 0);
+        ret = md_inline_get(fileid, (void *)md, &buf);
+        if (ret) {
+                if (ret == ENODATA) {
+                        goto out;
+                } else
+                        GOTO(err_free, ret);
+        }
+
+        DBUG("promote "FID_FORMAT" size %llu\n", FID_ARG(fileid), (LLU)md->at_size);
+
+        if (md->at_size) {
+                mbuffer_init(&chkbuf, 0);
+                mbuffer_reference(&chkbuf, &buf);
+                ret = mbuffer_appendzero(&chkbuf, md->at_size - buf.len);
+                if (ret) {
+                        mbuffer_free(&chkbuf);
+                        GOTO(err_free, ret);
+                }
+
+                ret = __sdfs_write1(md, &chkbuf, md->at_size, 0);
+                mbuffer_free(&chkbuf);
+                if (ret)
+                        GOTO(err_free, ret);
+        }
+
+        ret = md_inline_drop((void *)md, &buf);
+        if (ret) {
+                if (ret == EAGAIN) {
+                        mbuffer_free(&buf);
+                        USLEEP_RETRY(err_ret, ret, retry, retry, 10, (10 * 1000));
+                } else
+                        GOTO(err_free, ret);
+        }
+
+out:
+        mbuffer_free(&buf);
+        return 0;
+err_free:
+        mbuffer_free(&buf);
+err_ret:
+        return ret;
+}
+
+int sdfs_write1(const fileinfo_t *md, const buffer_t *_buf, uint32_t size, uint64_t offset)
+{
+        int ret;
+
+        if (md->data_inline) {
+                ret = md_inline_write((void *)md, _buf, size, offset);
+                if (ret == 0) {
+                        return 0;
+                } else if (ret == EFBIG) {
+                        ret = __sdfs_inline_promote(&md->fileid);
+                        if (ret)
+                                GOTO(err_ret, ret);
+                } else if (ret != ENODATA)
+                        GOTO(err_ret, ret);
+        }
+
+        ret = __sdfs_write1(md, _buf, size, offset);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int __sdfs_write_getattr(const fileid_t *fileid, fileinfo_t *md)
+{
+        int ret, retry = 0;
+
 retry:
         ret = md_getattr((void *)md, fileid);
         if (ret) {
@@ -340,6 +487,64 @@ retry:
                         GOTO(err_ret, ret);
         }
 
+        return 0;
+err_ret:
+        return ret;
+}
+
+int sdfs_write(const fileid_t *fileid, const buffer_t *_buf, uint32_t size, uint64_t offset)
+{
+        return sdfs_write_wcc(fileid, _buf, size, offset, NULL, NULL);
+}
+
+/**
+ * pre and post, both set or both NULL, get the attr before and after the
+ * write. post comes from the md read for pre and the size written, so it
+ * costs no round trip.
+ */
+int sdfs_write_wcc(const fileid_t *fileid, const buffer_t *_buf, uint32_t size,
+                   uint64_t offset, struct stat *pre, struct stat *post)
+{
+        int ret, retry = 0, got = 0;
+        fileinfo_t _md;
+        fileinfo_t *md = &_md;
+
+        ANALYSIS_BEGIN(0);
+        
+        YASSERT(_buf->len == size);
+        YASSERT((pre == NULL) == (post == NULL));
+
+        DBUG("write "CHKID_FORMAT"\n", CHKID_ARG(fileid));
+
+        if (pre) {
+                ret = __sdfs_write_getattr(fileid, md);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                MD2STAT(md, pre);
+                if (S_ISREG(md->at_mode))
+                        wbcache_stat(fileid, pre);
+                got = 1;
+        }
+
+        ret = wbcache_write(fileid, _buf, size, offset);
+        if (ret == 0) {
+                if (post) {
+                        *post = *pre;
+                        wbcache_stat(fileid, post);
+                }
+
+                goto out;
+        } else if (ret != ENOBUFS) {
+                GOTO(err_ret, ret);
+        }
+
+        if (!got) {
+                ret = __sdfs_write_getattr(fileid, md);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
         if (!S_ISREG(md->at_mode)) {
                 if (S_ISDIR(md->at_mode))
                         ret = EISDIR;
@@ -348,34 +553,10 @@ retry:
                 GOTO(err_ret, ret);
         }
 
-        YASSERT(md->split);
-        YASSERT(md->fileid.id);
-        YASSERT(md->fileid.volid);
-
-        ret = __sdfs_write_split(seg_array, &seg_count, &newbuf, size,
-                                 offset, md->split, &md->fileid);
+        ret = sdfs_write1(md, _buf, size, offset);
         if (ret)
                 GOTO(err_ret, ret);
 
-        ec.plugin = md->plugin;
-        ec.tech = md->tech;
-        ec.m = md->m;
-        ec.k = md->k;
-
-        for (i = 0; i < seg_count; i++) {
-                seg = &seg_array[i];
-                ret = sdfs_chunk_write(md, &seg->head.chkid, &seg->buf,
-                                       seg->head.size, seg->head.offset, &ec);
-                if (ret) {
-                        GOTO(err_free, ret);
-                }
-        }
-
-        for (i = 0; i < seg_count; i++) {
-                seg = &seg_array[i];
-                mbuffer_free(&seg->buf);
-        }
-        
 retry1:
         ret = md_extend(fileid, size + offset);
         if (ret) {
@@ -386,8 +567,15 @@ retry1:
                         GOTO(err_ret, ret);
         }
 
-        mbuffer_free(&newbuf);
+        if (post) {
+                *post = *pre;
+                if ((uint64_t)post->st_size < size + offset) {
+                        post->st_size = size + offset;
+                        post->st_blocks = post->st_size / FAKE_BLOCK;
+                }
+        }
 
+out:
         ANALYSIS_QUEUE(0, IO_WARN, NULL);
 
         ret = io_analysis(ANALYSIS_WRITE, size);
@@ -395,16 +583,15 @@ retry1:
                 GOTO(err_ret, ret);
         
         return 0;
-err_free:
-        for (i = 0; i < seg_count; i++) {
-                seg = &seg_array[i];
-                mbuffer_free(&seg->buf);
-        }
 err_ret:
-        mbuffer_free(&newbuf);
         return ret;
 }
 
+int sdfs_fsync(const fileid_t *fileid)
+{
+        return wbcache_fsync(fileid);
+}
+
 static void __sdfs_write_async(void *_arg)
 {
         int ret;
@@ -448,7 +635,7 @@ int sdfs_write_async(const fileid_t *fileid, const buffer_t *buf, uint32_t size,
         ctx->callback = callback;
         ctx->arg = obj;
 
-        ret = main_loop_request(__sdfs_write_async, ctx, "sdfs_write_async");
+        ret = main_loop_request1(fileid->id, __sdfs_write_async, ctx, "sdfs_write_async");
         if (ret)
                 GOTO(err_free, ret);
 
@@ -504,6 +691,16 @@ int sdfs_truncate(const fileid_t *fileid, uint64_t length)
         }
 #endif
 
+        ret = wbcache_flush(fileid);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (length > (uint64_t)gloconf.inline_size) {
+                ret = __sdfs_inline_promote(fileid);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
 retry:
         ret = md_truncate(fileid, length);
         if (ret) {
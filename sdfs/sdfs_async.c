@@ -0,0 +1,402 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YFSLIB
+
+#include "sdfs_id.h"
+#include "sdfs_lib.h"
+#include "schedule.h"
+#include "main_loop.h"
+#include "ylib.h"
+#include "dbg.h"
+
+/*
+ * batched async client api. the ops of a batch are split by the
+ * main_loop worker owning their file, each worker gets its share in one
+ * crossing. there the ops of a file are cut into stages in submission
+ * order: an op joins the last stage of its file unless it conflicts with
+ * an op in it (overlapping read/write, fsync, truncate, a create against
+ * the same name or a listing of its parent), then it opens the next
+ * stage. the ops of a stage run as concurrent tasks, a stage starts when
+ * the one before it is done, so a WRITE then FSYNC of a file complete in
+ * that order while unrelated ops and files run side by side.
+ */
+
+#define SDFS_STAGE_MAX 64       /* ops per stage, bounds the conflict scan */
+
+struct __sdfs_stage;
+struct __sdfs_batch;
+
+typedef struct __sdfs_node {
+        struct __sdfs_node *next;       /* next op of the stage */
+        struct __sdfs_stage *stage;
+        sdfs_op_t *op;
+} sdfs_node_t;
+
+typedef struct __sdfs_stage {
+        struct __sdfs_stage *next;      /* next stage of the same file */
+        struct __sdfs_batch *batch;
+        sdfs_node_t *head;
+        sdfs_node_t *tail;
+        int count;
+        int left;                       /* ops not done */
+        int wait;                       /* has a stage before it */
+} sdfs_stage_t;
+
+/* the ops of one worker, one allocation */
+typedef struct __sdfs_batch {
+        int count;
+        int left;                       /* ops not done */
+        uint32_t mask;                  /* slots - 1 */
+        sdfs_node_t *node;              /* count */
+        sdfs_stage_t *stage;            /* up to count */
+        sdfs_stage_t **slot;            /* last stage of a file, by fileid */
+} sdfs_batch_t;
+
+static int __sdfs_op_exec__(sdfs_op_t *op)
+{
+        int ret;
+
+        switch (op->type) {
+        case SDFS_OP_READ:
+                ret = sdfs_read(&op->fileid, op->buf, op->size, op->offset);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                ret = op->buf->len;
+                break;
+        case SDFS_OP_WRITE:
+                ret = sdfs_write(&op->fileid, op->buf, op->size, op->offset);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                ret = op->size;
+                break;
+        case SDFS_OP_GETATTR:
+                ret = sdfs_getattr(&op->fileid, op->stbuf);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                break;
+        case SDFS_OP_LOOKUP:
+                ret = sdfs_lookup(&op->fileid, op->name, op->out);
+                if (ret)
+                        goto err_ret;
+
+                break;
+        case SDFS_OP_CREATE:
+                ret = sdfs_create(&op->fileid, op->name, op->out,
+                                  op->mode, op->uid, op->gid);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                break;
+        case SDFS_OP_READDIR:
+                op->de = NULL;
+                op->delen = 0;
+                ret = sdfs_readdirplus(&op->fileid, op->offset, &op->de, &op->delen);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                ret = op->delen;
+                break;
+        case SDFS_OP_TRUNCATE:
+                ret = sdfs_truncate(&op->fileid, op->offset);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                break;
+        case SDFS_OP_FSYNC:
+                ret = sdfs_fsync(&op->fileid);
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                break;
+        default:
+                ret = EINVAL;
+                GOTO(err_ret, ret);
+        }
+
+        return ret;
+err_ret:
+        return -ret;
+}
+
+static int __sdfs_op_overlap(const sdfs_op_t *a, const sdfs_op_t *b)
+{
+        return a->offset < b->offset + b->size && b->offset < a->offset + a->size;
+}
+
+/* two ops of one file that must complete in submission order */
+static int __sdfs_op_conflict(const sdfs_op_t *a, const sdfs_op_t *b)
+{
+        const sdfs_op_t *t;
+
+        if (a->type == SDFS_OP_FSYNC || a->type == SDFS_OP_TRUNCATE
+            || b->type == SDFS_OP_FSYNC || b->type == SDFS_OP_TRUNCATE)
+                return 1;
+
+        if (a->type > b->type) {
+                t = a;
+                a = b;
+                b = t;
+        }
+
+        switch (a->type) {
+        case SDFS_OP_READ:
+                return b->type == SDFS_OP_WRITE && __sdfs_op_overlap(a, b);
+        case SDFS_OP_WRITE:
+                if (b->type == SDFS_OP_WRITE)
+                        return __sdfs_op_overlap(a, b);
+
+                return b->type == SDFS_OP_GETATTR;
+        case SDFS_OP_GETATTR:
+                return b->type == SDFS_OP_CREATE;
+        case SDFS_OP_LOOKUP:
+                return b->type == SDFS_OP_CREATE && !strcmp(a->name, b->name);
+        case SDFS_OP_CREATE:
+                if (b->type == SDFS_OP_CREATE)
+                        return !strcmp(a->name, b->name);
+
+                return b->type == SDFS_OP_READDIR;
+        default:
+                return 0;
+        }
+}
+
+static int __sdfs_stage_conflict(const sdfs_stage_t *stage, const sdfs_op_t *op)
+{
+        const sdfs_node_t *node;
+
+        if (stage->count == SDFS_STAGE_MAX)
+                return 1;
+
+        for (node = stage->head; node; node = node->next) {
+                if (__sdfs_op_conflict(node->op, op))
+                        return 1;
+        }
+
+        return 0;
+}
+
+static void __sdfs_stage_run(sdfs_stage_t *stage);
+
+static void __sdfs_node_exec(void *arg)
+{
+        int ret;
+        sdfs_node_t *node = arg;
+        sdfs_stage_t *stage = node->stage;
+        sdfs_batch_t *batch = stage->batch;
+
+        ret = __sdfs_op_exec__(node->op);
+        node->op->callback(node->op->arg, ret);
+
+        stage->left--;
+        if (stage->left == 0 && stage->next)
+                __sdfs_stage_run(stage->next);
+
+        batch->left--;
+        if (batch->left == 0)
+                yfree((void **)&batch);
+}
+
+static void __sdfs_stage_run(sdfs_stage_t *stage)
+{
+        sdfs_node_t *node;
+
+        for (node = stage->head; node; node = node->next) {
+                schedule_task_new("sdfs_op", __sdfs_node_exec, node, -1);
+        }
+}
+
+/* slot of fileid, empty or holding the last stage of that file */
+static sdfs_stage_t **__sdfs_batch_slot(sdfs_batch_t *batch, const fileid_t *fileid)
+{
+        uint32_t i;
+        sdfs_stage_t *stage;
+
+        i = (fileid->id ^ fileid->volid) & batch->mask;
+        while (1) {
+                stage = batch->slot[i];
+                if (stage == NULL || !chkid_cmp(&stage->head->op->fileid, fileid))
+                        return &batch->slot[i];
+
+                i = (i + 1) & batch->mask;
+        }
+}
+
+static void __sdfs_batch_exec(void *arg)
+{
+        int i, n = 0;
+        sdfs_batch_t *batch = arg;
+        sdfs_node_t *node;
+        sdfs_stage_t **slot, *stage, *last;
+
+        for (i = 0; i < batch->count; i++) {
+                node = &batch->node[i];
+                slot = __sdfs_batch_slot(batch, &node->op->fileid);
+                last = *slot;
+
+                if (last == NULL || __sdfs_stage_conflict(last, node->op)) {
+                        stage = &batch->stage[n++];
+                        memset(stage, 0x0, sizeof(*stage));
+                        stage->batch = batch;
+                        if (last) {
+                                last->next = stage;
+                                stage->wait = 1;
+                        }
+
+                        *slot = stage;
+                } else {
+                        stage = last;
+                }
+
+                node->next = NULL;
+                node->stage = stage;
+                if (stage->tail)
+                        stage->tail->next = node;
+                else
+                        stage->head = node;
+                stage->tail = node;
+                stage->count++;
+                stage->left++;
+        }
+
+        /* a task started here runs after this one yields, batch stays */
+        for (i = 0; i < n; i++) {
+                if (!batch->stage[i].wait)
+                        __sdfs_stage_run(&batch->stage[i]);
+        }
+}
+
+static int __sdfs_batch_new(int count, sdfs_batch_t **_batch)
+{
+        int ret;
+        uint32_t slots;
+        sdfs_batch_t *batch;
+
+        for (slots = 1; slots < (uint32_t)count * 2; slots <<= 1)
+                ;
+
+        ret = ymalloc((void **)&batch, sizeof(*batch)
+                      + sizeof(sdfs_node_t) * count
+                      + sizeof(sdfs_stage_t) * count
+                      + sizeof(sdfs_stage_t *) * slots);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        batch->count = 0;
+        batch->left = count;
+        batch->mask = slots - 1;
+        batch->node = (void *)(batch + 1);
+        batch->stage = (void *)(batch->node + count);
+        batch->slot = (void *)(batch->stage + count);
+        memset(batch->slot, 0x0, sizeof(sdfs_stage_t *) * slots);
+
+        *_batch = batch;
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * ops must stay valid until every callback has been called, the
+ * callback gets the op result (bytes for read/write/readdir, 0 for
+ * others) or -errno. each op runs in the worker owning its fileid, ops
+ * of the same file that conflict in submission order, see above. an
+ * error return means no op was started, otherwise every op gets its
+ * callback.
+ */
+int sdfs_submit(sdfs_op_t *ops, int count)
+{
+        int ret, i, j, w, workers, started = 0;
+        int *share;
+        sdfs_batch_t **batch;
+        sdfs_op_t *op;
+
+        if (count <= 0) {
+                ret = EINVAL;
+                GOTO(err_ret, ret);
+        }
+
+        for (i = 0; i < count; i++) {
+                if (ops[i].callback == NULL) {
+                        ret = EINVAL;
+                        GOTO(err_ret, ret);
+                }
+        }
+
+        workers = main_loop_worker_count();
+        if (workers == 0) {
+                ret = EAGAIN;
+                GOTO(err_ret, ret);
+        }
+
+        ret = ymalloc((void **)&share, (sizeof(*share) + sizeof(*batch)) * workers);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        batch = (void *)(share + workers);
+        memset(share, 0x0, sizeof(*share) * workers);
+        memset(batch, 0x0, sizeof(*batch) * workers);
+
+        for (i = 0; i < count; i++) {
+                share[ops[i].fileid.id % workers]++;
+        }
+
+        for (w = 0; w < workers; w++) {
+                if (share[w] == 0)
+                        continue;
+
+                ret = __sdfs_batch_new(share[w], &batch[w]);
+                if (ret)
+                        GOTO(err_free, ret);
+        }
+
+        for (i = 0; i < count; i++) {
+                w = ops[i].fileid.id % workers;
+                batch[w]->node[batch[w]->count++].op = &ops[i];
+        }
+
+        /* same hash as main_loop_request1 of the fileid, same worker */
+        for (w = 0; w < workers; w++) {
+                if (batch[w] == NULL)
+                        continue;
+
+                ret = main_loop_request1(w, __sdfs_batch_exec, batch[w], "sdfs_submit");
+                if (ret) {
+                        if (started == 0)
+                                GOTO(err_free, ret);
+
+                        /* some workers are running already, fail the rest */
+                        DWARN("submit worker %d fail, ret %d\n", w, ret);
+                        for (j = 0; j < batch[w]->count; j++) {
+                                op = batch[w]->node[j].op;
+                                op->callback(op->arg, -ret);
+                        }
+
+                        yfree((void **)&batch[w]);
+                        continue;
+                }
+
+                batch[w] = NULL;
+                started++;
+        }
+
+        yfree((void **)&share);
+
+        return 0;
+err_free:
+        for (w = 0; w < workers; w++) {
+                if (batch[w])
+                        yfree((void **)&batch[w]);
+        }
+        yfree((void **)&share);
+err_ret:
+        return ret;
+}
@@ -373,6 +373,7 @@ static int __chunk_write(const fileinfo_t *md, const chkid_t *chkid,
                          const buffer_t *buf, int count, int offset)
 {
         int ret, intect;
+        uint64_t token;
         char _chkinfo[CHK_SIZE(YFS_CHK_REP_MAX)];
         chkinfo_t *chkinfo;
 
@@ -385,7 +386,7 @@ static int __chunk_write(const fileinfo_t *md, const chkid_t *chkid,
                 GOTO(err_ret, ret);
         
         if (unlikely(!intect)) {
-                ret = klock(chkid, 10, 1);
+                ret = klock(chkid, 10, 1, &token);
                 if (unlikely(ret))
                         GOTO(err_ret, ret);
         }
@@ -395,7 +396,7 @@ static int __chunk_write(const fileinfo_t *md, const chkid_t *chkid,
                 GOTO(err_lock, ret);
 
         if (unlikely(!intect)) {
-                ret = kunlock(chkid);
+                ret = kunlock(chkid, token);
                 if (unlikely(ret))
                         GOTO(err_ret, ret);
         }
@@ -405,7 +406,7 @@ static int __chunk_write(const fileinfo_t *md, const chkid_t *chkid,
         return 0;
 err_lock:
         if (unlikely(!intect)) {
-                kunlock(chkid);
+                kunlock(chkid, token);
         }
 err_ret:
         DWARN("write "CHKID_FORMAT" fail\n", CHKID_ARG(chkid));
@@ -500,6 +501,35 @@ err_ret:
         return ret;
 }
 
+typedef struct {
+        char *base;                     /* rows * m strips, row major */
+        int rows;
+        int m;
+        int k;
+} chunk_ec_encode_t;
+
+/* parity of every row, cpu only, any core may run it */
+static int __chunk_ec_encode(void *arg)
+{
+        int ret, row, i;
+        chunk_ec_encode_t *ctx = arg;
+        char *buffs[EC_MMAX];
+
+        for (row = 0; row < ctx->rows; row++) {
+                for (i = 0; i < ctx->m; i++) {
+                        buffs[i] = ctx->base + (size_t)(row * ctx->m + i) * STRIP_BLOCK;
+                }
+
+                ret = ec_encode(&buffs[0], &buffs[ctx->k], STRIP_BLOCK, ctx->m, ctx->k);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
 static int __chunk_ec_write_strip(ec_arg_t *ec_arg, int count, int offset, const ec_t *ec,
                                  const chkinfo_t *chkinfo, buffer_t *data)
 {
@@ -508,8 +538,9 @@ static int __chunk_ec_write_strip(ec_arg_t *ec_arg, int count, int offset, const
         int row, row1, row2;
         int new, len;
         uint32_t off, begin, end;
-        char *buffs[EC_MMAX];
+        char *strip;
         void *buf;
+        chunk_ec_encode_t ctx;
 
         k = ec->k;
         m = ec->m;
@@ -518,22 +549,23 @@ static int __chunk_ec_write_strip(ec_arg_t *ec_arg, int count, int offset, const
         /*YASSERT(context->offset % STRIP_BLOCK == 0);*/
         /*YASSERT(context->count % STRIP_BLOCK == 0);*/
 
-        for (i = 0; i < EC_MMAX; i++) {
-                ret = posix_memalign(&buf, STRIP_ALIGN, STRIP_BLOCK);
-                if (ret) {
-                        DERROR("alloc error: Fail");
-                        GOTO(err_free, ret);
-                }
-
-                buffs[i] = buf;
-        }
-
         //row number start from 0, when size % STRIP_BLOCK * k == 0, row1 is ok,
         //but row2 need row2--, so row2 = (size - 1) / STRIP_BLOCK * k
         off = offset;
         row1 = off / (STRIP_BLOCK * k);
         row2 = (off + count - 1) / (STRIP_BLOCK * k);
 
+        ctx.rows = row2 - row1 + 1;
+        ctx.m = m;
+        ctx.k = k;
+        ret = posix_memalign(&buf, STRIP_ALIGN, (size_t)ctx.rows * m * STRIP_BLOCK);
+        if (ret) {
+                DERROR("alloc error: Fail");
+                GOTO(err_ret, ret);
+        }
+
+        ctx.base = buf;
+
         for (i = 0; i < k + r; i++) {
                 ec_arg->strips[i].idx = i; //第几个副本
                 ec_arg->strips[i].offset = STRIP_BLOCK * row1;
@@ -546,23 +578,27 @@ static int __chunk_ec_write_strip(ec_arg_t *ec_arg, int count, int offset, const
                 for (i = 0; i < k; i++) {
                         begin = (STRIP_BLOCK*k)*row + (STRIP_BLOCK*i);
                         end = begin + STRIP_BLOCK;
+                        strip = ctx.base + (size_t)((row - row1) * m + i) * STRIP_BLOCK;
 
                         ret = __chunk_write_ec_strip__(data, begin, end, row,
                                                        count, offset,
-                                                       buffs[i], &chkinfo->diskid[i],
+                                                       strip, &chkinfo->diskid[i],
                                                        &chkinfo->chkid);
                         if (ret)
                                 GOTO(err_free, ret);
                                 
                 }
+        }
 
-                //计算后面r个纠删码
-                ret = ec_encode(&buffs[0], &buffs[k], STRIP_BLOCK, m, k);
-                if (ret)
-                        GOTO(err_free, ret);
+        //计算后面r个纠删码, 可以被空闲的核取走
+        ret = schedule_task_migrate("ec_encode", __chunk_ec_encode, &ctx);
+        if (ret)
+                GOTO(err_free, ret);
 
+        for (row = 0; row < ctx.rows; row++) {
                 for (i = 0; i < k + r; i++) {
-                        ret = mbuffer_copy(&ec_arg->strips[i].buf, buffs[i], STRIP_BLOCK);
+                        strip = ctx.base + (size_t)(row * m + i) * STRIP_BLOCK;
+                        ret = mbuffer_copy(&ec_arg->strips[i].buf, strip, STRIP_BLOCK);
                         if (ret)
                                 GOTO(err_free, ret);
                 }
@@ -570,10 +606,7 @@ static int __chunk_ec_write_strip(ec_arg_t *ec_arg, int count, int offset, const
 
         ec_arg->strip_count = k+r;
 
-        for (i = 0; i < EC_MMAX; i++) {
-                if (buffs[i])
-                        free(buffs[i]);
-        }
+        free(ctx.base);
 
         //把每个strip的count切分成小于Y_BLOCK_MAX, 1+1模式会走到下面代码
         new = k+r;
@@ -597,10 +630,8 @@ static int __chunk_ec_write_strip(ec_arg_t *ec_arg, int count, int offset, const
 
         return 0;
 err_free:
-        for (i = 0; i < EC_MMAX; i++) {
-                if (buffs[i])
-                        free(buffs[i]);
-        }
+        free(ctx.base);
+err_ret:
         return ret;
 }
 
@@ -688,6 +719,7 @@ static int __chunk_write_ec(const fileinfo_t *md, const chkid_t *chkid,
                             const buffer_t *buf, int count, int offset, const ec_t *ec)
 {
         int ret, intect;
+        uint64_t token;
         ec_arg_t ec_arg;
         chkinfo_t *chkinfo;
         char _chkinfo[CHK_SIZE(YFS_CHK_REP_MAX)];
@@ -705,7 +737,7 @@ static int __chunk_write_ec(const fileinfo_t *md, const chkid_t *chkid,
                 GOTO(err_ret, ret);
 
         if (unlikely(!intect)) {
-                ret = klock(chkid, 10, 1);
+                ret = klock(chkid, 10, 1, &token);
                 if (unlikely(ret))
                         GOTO(err_ret, ret);
         }
@@ -722,7 +754,7 @@ static int __chunk_write_ec(const fileinfo_t *md, const chkid_t *chkid,
         __chunk_write_ec_free(&ec_arg);
         
         if (unlikely(!intect)) {
-                ret = kunlock(chkid);
+                ret = kunlock(chkid, token);
                 if (unlikely(ret))
                         GOTO(err_ret, ret);
         }
@@ -737,7 +769,7 @@ err_free:
         __chunk_write_ec_free(&ec_arg);
 err_lock:
         if (unlikely(!intect)) {
-                kunlock(chkid);
+                kunlock(chkid, token);
         }
 err_ret:
         DWARN("write "CHKID_FORMAT" fail\n", CHKID_ARG(chkid));
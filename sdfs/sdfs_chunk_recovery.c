@@ -27,6 +27,7 @@
 #include "dbg.h"
 #include "worm_cli_lib.h"
 #include "main_loop.h"
+#include "schedule.h"
 #include "posix_acl.h"
 #include "flock.h"
 #include "xattr.h"
@@ -247,61 +248,97 @@ err_ret:
         return ret;
 }
 
+typedef struct {
+        char *base;                     /* rows * m strips, row major */
+        unsigned char *src_in_err;
+        int rows;
+        int m;
+        int k;
+} chunk_ec_decode_t;
+
+/* lost strips of every row, cpu only, any core may run it */
+static int __sdfs_chunk_ec_decode(void *arg)
+{
+        int ret, row, i;
+        chunk_ec_decode_t *ctx = arg;
+        char *buffs[YFS_CHK_REP_MAX];
+
+        for (row = 0; row < ctx->rows; row++) {
+                for (i = 0; i < ctx->m; i++) {
+                        buffs[i] = ctx->base + (size_t)(row * ctx->m + i) * STRIP_BLOCK;
+                }
+
+                ret = ec_decode(ctx->src_in_err, &buffs[0], &buffs[ctx->k],
+                                STRIP_BLOCK, ctx->m, ctx->k);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
+        return 0;
+err_ret:
+        return ret;
+}
+
 static int __sdfs_chunk_ec_recode_off(buffer_t *recover, unsigned char *src_in_err,
                                       const chkinfo_t *chkinfo, size_t size, const ec_t *ec)
 {
         int ret;
         uint32_t i, j, m, k;
-        char *buffs[YFS_CHK_REP_MAX];
-        char *buf;
+        char *strip;
+        void *buf;
         buffer_t tmpbuf;
+        chunk_ec_decode_t ctx;
 
         mbuffer_init(&tmpbuf, 0);
         m = ec->m;
         k = ec->k;
 
         YASSERT(m >= k);
+        YASSERT(chkinfo->repnum <= m);
         YASSERT((size % STRIP_BLOCK) == 0);
 
-        for (i = 0; i < YFS_CHK_REP_MAX; i++) {
-                ret = posix_memalign((void **)&buf, STRIP_ALIGN, STRIP_BLOCK);
-                if (ret)
-                        GOTO(err_free, ret);
+        ctx.rows = size / STRIP_BLOCK;
+        ctx.m = m;
+        ctx.k = k;
+        ctx.src_in_err = src_in_err;
+        ret = posix_memalign(&buf, STRIP_ALIGN, (size_t)ctx.rows * m * STRIP_BLOCK);
+        if (ret)
+                GOTO(err_ret, ret);
 
-                buffs[i] = buf;
-        }
+        ctx.base = buf;
 
         for (i = 0; i < size / STRIP_BLOCK; i++) {
                 for(j = 0; j < chkinfo->repnum; j++) {
                         if (!src_in_err[j]) {
-                                mbuffer_get(&recover[j], buffs[j], STRIP_BLOCK);
+                                strip = ctx.base + (size_t)(i * m + j) * STRIP_BLOCK;
+                                mbuffer_get(&recover[j], strip, STRIP_BLOCK);
                                 mbuffer_pop(&recover[j], &tmpbuf, STRIP_BLOCK);
                                 mbuffer_free(&tmpbuf);
                         }
                 }
+        }
 
-                ret = ec_decode(src_in_err, &buffs[0], &buffs[k], STRIP_BLOCK, m, k);
-                if (ret)
-                        GOTO(err_free, ret);
+        /* an idle core may take the decode */
+        ret = schedule_task_migrate("ec_decode", __sdfs_chunk_ec_decode, &ctx);
+        if (ret)
+                GOTO(err_free, ret);
 
+        for (i = 0; i < size / STRIP_BLOCK; i++) {
                 for(j = 0; j < chkinfo->repnum; j++) {
-                        if (src_in_err[j])
-                                mbuffer_copy(&recover[j], buffs[j], STRIP_BLOCK);
+                        if (src_in_err[j]) {
+                                strip = ctx.base + (size_t)(i * m + j) * STRIP_BLOCK;
+                                mbuffer_copy(&recover[j], strip, STRIP_BLOCK);
+                        }
                 }
         }
 
-        for (i = 0; i < YFS_CHK_REP_MAX; i++) {
-                if (buffs[i])
-                        free(buffs[i]);
-        }
+        free(ctx.base);
 
         return 0;
 err_free:
+        free(ctx.base);
+err_ret:
         mbuffer_free(&tmpbuf);
-        for (i = 0; i < YFS_CHK_REP_MAX; i++) {
-                if (buffs[i])
-                        free(buffs[i]);
-        }
         return ret;
 }
 
@@ -486,6 +523,7 @@ err_ret:
 int sdfs_chunk_recovery(const chkid_t *chkid)
 {
         int ret, repmin, i;
+        uint64_t token;
         fileid_t fileid;
         fileinfo_t md;
         chkinfo_t *chkinfo;
@@ -504,7 +542,7 @@ int sdfs_chunk_recovery(const chkid_t *chkid)
         repmin = (md.plugin != PLUGIN_NULL) ? md.k : 1;
 
         begin = time(NULL);
-        ret = klock(chkid, 20, 0);
+        ret = klock(chkid, 20, 0, &token);
         if (unlikely(ret))
                 GOTO(err_ret, ret);
         
@@ -541,7 +579,7 @@ int sdfs_chunk_recovery(const chkid_t *chkid)
         if (ret)
                 GOTO(err_lock, ret);
         
-        ret = kunlock(chkid);
+        ret = kunlock(chkid, token);
         if (unlikely(ret))
                 GOTO(err_ret, ret);
 
@@ -549,7 +587,7 @@ int sdfs_chunk_recovery(const chkid_t *chkid)
         
         return 0;
 err_lock:
-        kunlock(chkid);
+        kunlock(chkid, token);
 err_ret:
         DWARN("recovery "CHKID_FORMAT" fail\n", CHKID_ARG(chkid));
         return ret;
@@ -30,6 +30,7 @@
 #include "posix_acl.h"
 #include "flock.h"
 #include "xattr.h"
+#include "sdfs_wbcache.h"
 
 
 int sdfs_getattr(const fileid_t *fileid, struct stat *stbuf)
@@ -59,6 +60,9 @@ retry:
 
         MD2STAT(md, stbuf);
 
+        if (S_ISREG(md->at_mode))
+                wbcache_stat(fileid, stbuf);
+
         return 0;
 err_ret:
         return ret;
@@ -218,8 +222,17 @@ err_ret:
 }
 
 int sdfs_setattr(const fileid_t *fileid, const setattr_t *setattr, int force)
+{
+        return sdfs_setattr_wcc(fileid, setattr, force, NULL, NULL);
+}
+
+/* pre and post, if set, get the attr before and after the update */
+int sdfs_setattr_wcc(const fileid_t *fileid, const setattr_t *setattr, int force,
+                     struct stat *pre, struct stat *post)
 {
         int ret, retry = 0;
+        char buf1[MAX_BUF_LEN], buf2[MAX_BUF_LEN];
+        md_proto_t *md1, *md2;
 
 #if ENABLE_WORM
         worm_status_t worm_status;
@@ -232,8 +245,16 @@ int sdfs_setattr(const fileid_t *fileid, const setattr_t *setattr, int force)
         }
 #endif
 
+        if (setattr->size.set_it) {
+                ret = wbcache_flush(fileid);
+                if (ret)
+                        GOTO(err_ret, ret);
+        }
+
+        md1 = pre ? (void *)buf1 : NULL;
+        md2 = post ? (void *)buf2 : NULL;
 retry:
-        ret = md_setattr(fileid, setattr, force);
+        ret = md_setattr_wcc(fileid, setattr, force, md1, md2);
         if (ret) {
                 ret = _errno(ret);
                 if (ret == EAGAIN) {
@@ -242,6 +263,18 @@ retry:
                         GOTO(err_ret, ret);
         }
 
+        if (pre) {
+                MD2STAT(md1, pre);
+                if (S_ISREG(md1->at_mode))
+                        wbcache_stat(fileid, pre);
+        }
+
+        if (post) {
+                MD2STAT(md2, post);
+                if (S_ISREG(md2->at_mode))
+                        wbcache_stat(fileid, post);
+        }
+
         return 0;
 err_ret:
         return ret;
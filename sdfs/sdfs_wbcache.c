@@ -0,0 +1,748 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YFSLIB
+
+#include "configure.h"
+#include "md_lib.h"
+#include "schedule.h"
+#include "main_loop.h"
+#include "sdfs_wbcache.h"
+#include "ylib.h"
+#include "dbg.h"
+
+/*
+ * small sequential writes are absorbed per file and flushed as large
+ * Y_BLOCK_MAX aligned chunk writes, followed by a single md_extend.
+ *
+ * a failed flush drops the dirty data and leaves a sticky err on the file
+ * for wbcache_fsync. an err nobody asked for in WBCACHE_ERR_KEEP seconds
+ * is dropped by the worker, so the file can be freed. every failed flush
+ * bumps wbcache_errgen, nfs changes its write verifier on it, so clients
+ * resend unstable writes even if the err itself is gone by COMMIT.
+ */
+
+#define WBCACHE_HASH 1024
+#define WBCACHE_EXT_MAX 64
+#define WBCACHE_ERR_KEEP 60
+
+typedef struct {
+        struct list_head hook;
+        uint64_t offset;
+        buffer_t buf;
+} wbext_t;
+
+typedef struct {
+        struct list_head hook;
+        fileid_t fileid;
+        sy_rwlock_t rwlock;
+        struct list_head list;  /* wbext_t, sorted by offset, never overlapped */
+        fileinfo_t md;
+        int count;
+        int ref;
+        int err;                /* sticky, reported by wbcache_fsync */
+        time_t etime;           /* when err was set */
+        uint64_t dirty;
+        uint64_t end;
+        time_t ctime;
+} wbfile_t;
+
+typedef struct {
+        sy_spinlock_t lock;
+        struct list_head list;
+} wbhead_t;
+
+typedef struct {
+        sy_spinlock_t lock;
+        uint64_t dirty;
+        sem_t sem;
+        wbhead_t array[WBCACHE_HASH];
+} wbcache_t;
+
+typedef struct {
+        sem_t sem;
+        wbfile_t *wbfile;
+        int fsync;
+        int ret;
+} wbflush_ctx_t;
+
+static wbcache_t *__wbcache__ = NULL;
+static uint32_t __wbcache_errgen__ = 0;
+
+static wbhead_t *__wbcache_head(const fileid_t *fileid)
+{
+        return &__wbcache__->array[fileid->id % WBCACHE_HASH];
+}
+
+static wbfile_t *__wbcache_find(wbhead_t *head, const fileid_t *fileid)
+{
+        struct list_head *pos;
+        wbfile_t *wbfile;
+
+        list_for_each(pos, &head->list) {
+                wbfile = (void *)pos;
+                if (fileid_cmp(&wbfile->fileid, fileid) == 0)
+                        return wbfile;
+        }
+
+        return NULL;
+}
+
+static int __wbcache_get(const fileid_t *fileid, wbfile_t **_wbfile, int create)
+{
+        int ret;
+        wbhead_t *head;
+        wbfile_t *wbfile, *newfile = NULL;
+
+        head = __wbcache_head(fileid);
+
+retry:
+        ret = sy_spin_lock(&head->lock);
+        if (ret)
+                GOTO(err_free, ret);
+
+        wbfile = __wbcache_find(head, fileid);
+        if (wbfile == NULL) {
+                if (newfile == NULL) {
+                        sy_spin_unlock(&head->lock);
+
+                        if (!create) {
+                                ret = ENOENT;
+                                goto err_ret;
+                        }
+
+                        ret = ymalloc((void **)&newfile, sizeof(*newfile));
+                        if (ret)
+                                GOTO(err_ret, ret);
+
+                        memset(newfile, 0x0, sizeof(*newfile));
+                        newfile->fileid = *fileid;
+                        INIT_LIST_HEAD(&newfile->list);
+                        ret = sy_rwlock_init(&newfile->rwlock, "wbcache");
+                        if (ret)
+                                GOTO(err_free, ret);
+
+                        goto retry;
+                }
+
+                wbfile = newfile;
+                newfile = NULL;
+                list_add_tail(&wbfile->hook, &head->list);
+        }
+
+        wbfile->ref++;
+        sy_spin_unlock(&head->lock);
+
+        if (newfile)
+                yfree((void **)&newfile);
+
+        *_wbfile = wbfile;
+
+        return 0;
+err_free:
+        if (newfile)
+                yfree((void **)&newfile);
+err_ret:
+        return ret;
+}
+
+static void __wbcache_put(wbfile_t *wbfile)
+{
+        int ret;
+        wbhead_t *head;
+
+        head = __wbcache_head(&wbfile->fileid);
+
+        ret = sy_spin_lock(&head->lock);
+        if (ret)
+                UNIMPLEMENTED(__DUMP__);
+
+        YASSERT(wbfile->ref > 0);
+        wbfile->ref--;
+        if (wbfile->ref == 0 && list_empty(&wbfile->list) && wbfile->err == 0) {
+                list_del(&wbfile->hook);
+        } else {
+                wbfile = NULL;
+        }
+
+        sy_spin_unlock(&head->lock);
+
+        if (wbfile)
+                yfree((void **)&wbfile);
+}
+
+static int __wbcache_reserve(uint32_t size)
+{
+        int ret, succ;
+
+        ret = sy_spin_lock(&__wbcache__->lock);
+        if (ret)
+                UNIMPLEMENTED(__DUMP__);
+
+        succ = (__wbcache__->dirty + size <= gloconf.wbcache_size);
+        if (succ)
+                __wbcache__->dirty += size;
+
+        sy_spin_unlock(&__wbcache__->lock);
+
+        return succ;
+}
+
+static void __wbcache_release(uint64_t size)
+{
+        int ret;
+
+        ret = sy_spin_lock(&__wbcache__->lock);
+        if (ret)
+                UNIMPLEMENTED(__DUMP__);
+
+        YASSERT(__wbcache__->dirty >= size);
+        __wbcache__->dirty -= size;
+
+        sy_spin_unlock(&__wbcache__->lock);
+}
+
+static void __wbcache_clean(wbfile_t *wbfile)
+{
+        wbext_t *ext;
+
+        while (!list_empty(&wbfile->list)) {
+                ext = (void *)wbfile->list.next;
+                list_del(&ext->hook);
+                mbuffer_free(&ext->buf);
+                yfree((void **)&ext);
+        }
+
+        __wbcache_release(wbfile->dirty);
+
+        wbfile->count = 0;
+        wbfile->dirty = 0;
+        wbfile->end = 0;
+        wbfile->ctime = 0;
+}
+
+static int __wbcache_overlap(const wbfile_t *wbfile, uint32_t size, uint64_t offset)
+{
+        struct list_head *pos;
+        wbext_t *ext;
+
+        list_for_each(pos, &wbfile->list) {
+                ext = (void *)pos;
+                if (ext->offset >= offset + size)
+                        break;
+
+                if (ext->offset + ext->buf.len > offset)
+                        return 1;
+        }
+
+        return 0;
+}
+
+static int __wbcache_load(wbfile_t *wbfile)
+{
+        int ret, retry = 0;
+        fileinfo_t *md = &wbfile->md;
+
+retry:
+        ret = md_getattr((void *)md, &wbfile->fileid);
+        if (ret) {
+                ret = _errno(ret);
+                if (ret == EAGAIN) {
+                        USLEEP_RETRY(err_ret, ret, retry, retry, 100, (1000 * 1000));
+                } else
+                        GOTO(err_ret, ret);
+        }
+
+        if (!S_ISREG(md->at_mode)) {
+                if (S_ISDIR(md->at_mode))
+                        ret = EISDIR;
+                else
+                        ret = EINVAL;
+                GOTO(err_ret, ret);
+        }
+
+        YASSERT(md->split);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static int __wbcache_insert(wbfile_t *wbfile, const buffer_t *buf,
+                            uint32_t size, uint64_t offset)
+{
+        int ret;
+        struct list_head *pos;
+        wbext_t *ext, *prev = NULL, *next = NULL;
+        buffer_t tmp;
+
+        list_for_each(pos, &wbfile->list) {
+                ext = (void *)pos;
+                if (ext->offset > offset) {
+                        next = ext;
+                        break;
+                }
+
+                prev = ext;
+        }
+
+        if (prev && prev->offset + prev->buf.len == offset) {
+                mbuffer_reference(&prev->buf, buf);
+
+                if (next && offset + size == next->offset) {
+                        mbuffer_merge(&prev->buf, &next->buf);
+                        list_del(&next->hook);
+                        yfree((void **)&next);
+                        wbfile->count--;
+                }
+        } else if (next && offset + size == next->offset) {
+                mbuffer_init(&tmp, 0);
+                mbuffer_reference(&tmp, buf);
+                mbuffer_merge(&tmp, &next->buf);
+                mbuffer_merge(&next->buf, &tmp);
+                next->offset = offset;
+        } else {
+                ret = ymalloc((void **)&ext, sizeof(*ext));
+                if (ret)
+                        GOTO(err_ret, ret);
+
+                ext->offset = offset;
+                mbuffer_init(&ext->buf, 0);
+                mbuffer_reference(&ext->buf, buf);
+
+                list_add_tail(&ext->hook, next ? &next->hook : &wbfile->list);
+                wbfile->count++;
+        }
+
+        wbfile->dirty += size;
+        if (offset + size > wbfile->end)
+                wbfile->end = offset + size;
+
+        if (wbfile->ctime == 0)
+                wbfile->ctime = gettime();
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/* wbfile->rwlock held */
+static int __wbcache_flush__(wbfile_t *wbfile)
+{
+        int ret, retry = 0;
+        wbext_t *ext;
+        buffer_t piece;
+        uint32_t len;
+
+        if (list_empty(&wbfile->list))
+                goto out;
+
+        DBUG("flush "FID_FORMAT" count %u dirty %llu end %llu\n",
+             FID_ARG(&wbfile->fileid), wbfile->count,
+             (LLU)wbfile->dirty, (LLU)wbfile->end);
+
+        list_for_each_entry(ext, &wbfile->list, hook) {
+                while (ext->buf.len) {
+                        len = Y_BLOCK_MAX - ext->offset % Y_BLOCK_MAX;
+                        len = len < ext->buf.len ? len : ext->buf.len;
+
+                        mbuffer_init(&piece, 0);
+                        ret = mbuffer_pop(&ext->buf, &piece, len);
+                        if (ret) {
+                                mbuffer_free(&piece);
+                                GOTO(err_clean, ret);
+                        }
+
+                        ret = sdfs_write1(&wbfile->md, &piece, len, ext->offset);
+                        mbuffer_free(&piece);
+                        if (ret)
+                                GOTO(err_clean, ret);
+
+                        ext->offset += len;
+                }
+        }
+
+retry:
+        ret = md_extend(&wbfile->fileid, wbfile->end);
+        if (ret) {
+                ret = _errno(ret);
+                if (ret == EAGAIN) {
+                        USLEEP_RETRY(err_clean, ret, retry, retry, 100, (1000 * 1000));
+                } else
+                        GOTO(err_clean, ret);
+        }
+
+        __wbcache_clean(wbfile);
+
+out:
+        return 0;
+err_clean:
+        if (ret == ENOENT) {
+                DINFO("file "FID_FORMAT" removed, drop %llu\n",
+                      FID_ARG(&wbfile->fileid), (LLU)wbfile->dirty);
+                __wbcache_clean(wbfile);
+                return 0;
+        }
+
+        wbfile->err = ret;
+        wbfile->etime = gettime();
+        __sync_fetch_and_add(&__wbcache_errgen__, 1);
+        __wbcache_clean(wbfile);
+        return ret;
+}
+
+static int __wbcache_flush(wbfile_t *wbfile, int fsync)
+{
+        int ret;
+
+        ret = sy_rwlock_wrlock(&wbfile->rwlock);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = __wbcache_flush__(wbfile);
+        if (fsync) {
+                if (ret == 0)
+                        ret = wbfile->err;
+
+                wbfile->err = 0;
+        } else if (ret == 0 && wbfile->err && list_empty(&wbfile->list)
+                   && gettime() - wbfile->etime >= WBCACHE_ERR_KEEP) {
+                DWARN("file "FID_FORMAT" drop unreported error %u\n",
+                      FID_ARG(&wbfile->fileid), wbfile->err);
+                wbfile->err = 0;
+        }
+
+        sy_rwlock_unlock(&wbfile->rwlock);
+
+        if (ret)
+                GOTO(err_ret, ret);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+static void __wbcache_flush_task(void *arg)
+{
+        wbflush_ctx_t *ctx = arg;
+
+        ctx->ret = __wbcache_flush(ctx->wbfile, ctx->fsync);
+        sem_post(&ctx->sem);
+}
+
+static int __wbcache_flush_sync(wbfile_t *wbfile, int fsync)
+{
+        int ret;
+        wbflush_ctx_t ctx;
+
+        if (schedule_running()) {
+                return __wbcache_flush(wbfile, fsync);
+        }
+
+        sem_init(&ctx.sem, 0, 0);
+        ctx.wbfile = wbfile;
+        ctx.fsync = fsync;
+        ctx.ret = 0;
+
+        ret = main_loop_request1(wbfile->fileid.id, __wbcache_flush_task,
+                                &ctx, "wbcache_flush");
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = _sem_wait(&ctx.sem);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = ctx.ret;
+        if (ret)
+                GOTO(err_ret, ret);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+int wbcache_write(const fileid_t *fileid, const buffer_t *buf, uint32_t size, uint64_t offset)
+{
+        int ret, big;
+        wbfile_t *wbfile;
+
+        if (__wbcache__ == NULL) {
+                ret = ENOBUFS;
+                goto err_ret;
+        }
+
+        /* big write goes through, but overlapped dirty data must be flushed first */
+        big = (size > (uint32_t)gloconf.wbcache_flush_size);
+
+        ret = __wbcache_get(fileid, &wbfile, !big);
+        if (ret) {
+                if (ret == ENOENT) {
+                        ret = ENOBUFS;
+                        goto err_ret;
+                }
+
+                GOTO(err_ret, ret);
+        }
+
+        ret = sy_rwlock_wrlock(&wbfile->rwlock);
+        if (ret)
+                GOTO(err_put, ret);
+
+        if (__wbcache_overlap(wbfile, size, offset)) {
+                ret = __wbcache_flush__(wbfile);
+                if (ret)
+                        GOTO(err_lock, ret);
+        }
+
+        if (big) {
+                ret = ENOBUFS;
+                goto err_lock;
+        }
+
+        if (list_empty(&wbfile->list)) {
+                ret = __wbcache_load(wbfile);
+                if (ret)
+                        GOTO(err_lock, ret);
+        }
+
+        if (!__wbcache_reserve(size)) {
+                sem_post(&__wbcache__->sem);
+                ret = ENOBUFS;
+                goto err_lock;
+        }
+
+        ret = __wbcache_insert(wbfile, buf, size, offset);
+        if (ret) {
+                __wbcache_release(size);
+                GOTO(err_lock, ret);
+        }
+
+        if (wbfile->dirty >= (uint64_t)gloconf.wbcache_flush_size
+            || wbfile->count > WBCACHE_EXT_MAX) {
+                ret = __wbcache_flush__(wbfile);
+                if (ret)
+                        GOTO(err_lock, ret);
+        }
+
+        sy_rwlock_unlock(&wbfile->rwlock);
+        __wbcache_put(wbfile);
+
+        return 0;
+err_lock:
+        sy_rwlock_unlock(&wbfile->rwlock);
+err_put:
+        __wbcache_put(wbfile);
+err_ret:
+        return ret;
+}
+
+static int __wbcache_flush_file(const fileid_t *fileid, int fsync)
+{
+        int ret;
+        wbfile_t *wbfile;
+
+        if (__wbcache__ == NULL)
+                return 0;
+
+        ret = __wbcache_get(fileid, &wbfile, 0);
+        if (ret) {
+                if (ret == ENOENT)
+                        return 0;
+
+                GOTO(err_ret, ret);
+        }
+
+        ret = __wbcache_flush_sync(wbfile, fsync);
+        if (ret)
+                GOTO(err_put, ret);
+
+        __wbcache_put(wbfile);
+
+        return 0;
+err_put:
+        __wbcache_put(wbfile);
+err_ret:
+        return ret;
+}
+
+int wbcache_flush(const fileid_t *fileid)
+{
+        return __wbcache_flush_file(fileid, 0);
+}
+
+int wbcache_fsync(const fileid_t *fileid)
+{
+        return __wbcache_flush_file(fileid, 1);
+}
+
+/* count of failed flushes, dirty data was dropped when it moves */
+uint32_t wbcache_errgen()
+{
+        return __wbcache_errgen__;
+}
+
+void wbcache_stat(const fileid_t *fileid, struct stat *stbuf)
+{
+        int ret;
+        wbhead_t *head;
+        wbfile_t *wbfile;
+
+        if (__wbcache__ == NULL)
+                return;
+
+        head = __wbcache_head(fileid);
+
+        ret = sy_spin_lock(&head->lock);
+        if (ret)
+                UNIMPLEMENTED(__DUMP__);
+
+        wbfile = __wbcache_find(head, fileid);
+        if (wbfile && wbfile->end > (uint64_t)stbuf->st_size) {
+                stbuf->st_size = wbfile->end;
+                stbuf->st_blocks = (wbfile->end + 511) / 512;
+        }
+
+        sy_spin_unlock(&head->lock);
+}
+
+static int __wbcache_scan(fileid_t *array, int max, int all)
+{
+        int ret, i, count = 0;
+        time_t now;
+        wbhead_t *head;
+        wbfile_t *wbfile;
+        struct list_head *pos;
+
+        now = gettime();
+        for (i = 0; i < WBCACHE_HASH && count < max; i++) {
+                head = &__wbcache__->array[i];
+
+                ret = sy_spin_lock(&head->lock);
+                if (ret)
+                        UNIMPLEMENTED(__DUMP__);
+
+                list_for_each(pos, &head->list) {
+                        wbfile = (void *)pos;
+                        if (wbfile->ctime == 0) {
+                                /* only an error left, expire it */
+                                if (wbfile->err
+                                    && now - wbfile->etime >= WBCACHE_ERR_KEEP) {
+                                        array[count++] = wbfile->fileid;
+                                        if (count == max)
+                                                break;
+                                }
+
+                                continue;
+                        }
+
+                        if (all || now - wbfile->ctime >= gloconf.wbcache_flush_interval) {
+                                array[count++] = wbfile->fileid;
+                                if (count == max)
+                                        break;
+                        }
+                }
+
+                sy_spin_unlock(&head->lock);
+        }
+
+        return count;
+}
+
+static void *__wbcache_worker(void *arg)
+{
+        int ret, i, count, all;
+        fileid_t array[WBCACHE_HASH];
+        wbfile_t *wbfile;
+
+        (void) arg;
+
+        while (1) {
+                ret = _sem_timedwait1(&__wbcache__->sem, gloconf.wbcache_flush_interval);
+                if (ret && ret != ETIMEDOUT) {
+                        DWARN("ret %u %s\n", ret, strerror(ret));
+                        sleep(1);
+                        continue;
+                }
+
+                all = (ret == 0);
+                count = __wbcache_scan(array, WBCACHE_HASH, all);
+
+                for (i = 0; i < count; i++) {
+                        ret = __wbcache_get(&array[i], &wbfile, 0);
+                        if (ret)
+                                continue;
+
+                        ret = __wbcache_flush_sync(wbfile, 0);
+                        if (ret) {
+                                DWARN("flush "FID_FORMAT" ret %u %s\n",
+                                      FID_ARG(&array[i]), ret, strerror(ret));
+                        }
+
+                        __wbcache_put(wbfile);
+                }
+        }
+
+        return NULL;
+}
+
+int wbcache_init()
+{
+        int ret, i;
+        wbcache_t *wbcache;
+
+        if (!gloconf.wbcache) {
+                DINFO("wbcache disabled\n");
+                return 0;
+        }
+
+        YASSERT(__wbcache__ == NULL);
+
+        ret = ymalloc((void **)&wbcache, sizeof(*wbcache));
+        if (ret)
+                GOTO(err_ret, ret);
+
+        memset(wbcache, 0x0, sizeof(*wbcache));
+
+        ret = sy_spin_init(&wbcache->lock);
+        if (ret)
+                GOTO(err_free, ret);
+
+        ret = sem_init(&wbcache->sem, 0, 0);
+        if (ret) {
+                ret = errno;
+                GOTO(err_free, ret);
+        }
+
+        for (i = 0; i < WBCACHE_HASH; i++) {
+                ret = sy_spin_init(&wbcache->array[i].lock);
+                if (ret)
+                        GOTO(err_free, ret);
+
+                INIT_LIST_HEAD(&wbcache->array[i].list);
+        }
+
+        __wbcache__ = wbcache;
+
+        ret = sy_thread_create2(__wbcache_worker, NULL, "wbcache_worker");
+        if (ret)
+                GOTO(err_reset, ret);
+
+        DINFO("wbcache size %llu flush_size %u interval %u\n",
+              (LLU)gloconf.wbcache_size, gloconf.wbcache_flush_size,
+              gloconf.wbcache_flush_interval);
+
+        return 0;
+err_reset:
+        __wbcache__ = NULL;
+err_free:
+        yfree((void **)&wbcache);
+err_ret:
+        return ret;
+}
@@ -0,0 +1,30 @@
+#ifndef __SDFS_WBCACHE_H__
+#define __SDFS_WBCACHE_H__
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "sdfs_buffer.h"
+#include "sdfs_id.h"
+#include "yfs_md.h"
+
+/**
+ * client side write-back cache
+ *
+ * wbcache_write return ENOBUFS if the write is not absorbed (cache disabled,
+ * overlapped or memory budget exhausted), the caller must write through.
+ * a failed background flush is kept and reported once by wbcache_fsync,
+ * for WBCACHE_ERR_KEEP seconds at most, wbcache_errgen moves on each.
+ */
+
+int wbcache_init();
+int wbcache_write(const fileid_t *fileid, const buffer_t *buf, uint32_t size, uint64_t offset);
+int wbcache_flush(const fileid_t *fileid);
+int wbcache_fsync(const fileid_t *fileid);
+void wbcache_stat(const fileid_t *fileid, struct stat *stbuf);
+uint32_t wbcache_errgen();
+
+/* sdfs.c, write data only, file size not changed */
+int sdfs_write1(const fileinfo_t *md, const buffer_t *_buf, uint32_t size, uint64_t offset);
+
+#endif
@@ -57,6 +57,7 @@
         uint8_t plugin:3;                       \
         uint8_t k:5;                            \
         uint8_t tech:3;                         \
+        uint8_t data_inline;                    \
         uint64_t __pad__[10];                     
 
 typedef struct {
@@ -277,6 +277,24 @@ int ly_release(int fd)
         return 0;
 }
 
+int ly_fsync(const char *path)
+{
+        int ret;
+        fileid_t fileid;
+
+        ret = sdfs_lookup_recurive(path, &fileid);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = sdfs_fsync(&fileid);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
 int ly_truncate(const char *path, off_t length)
 {
         int ret;
@@ -205,14 +205,13 @@ static int __increase_inode_for_directory_quota(const fileid_t *start_quotaid)
                         if((tmp_quota.inode_hard > 0) &&
                                         (tmp_quota.inode_used > tmp_quota.inode_hard)) {
                                 if(level > 1) {
-                                        last_quota.inode_used--;
-                                        md_update_quota(&last_quota);
+                                        md_quota_add(&last_quota, 0, -1);
                                 }
                                 ret = EDQUOT;
                                 goto err_ret;
                         }
 
-                        ret = md_update_quota(&tmp_quota);
+                        ret = md_quota_add(&tmp_quota, 0, 1);
                         if(ret)
                                 GOTO(err_ret, ret);
 
@@ -254,13 +253,11 @@ static int __increase_inode_for_group_or_user_quota(
         }
 
         if(tmp_quota.inode_used < tmp_quota.inode_hard) {
-                tmp_quota.inode_used++;
+                ret = md_quota_add(&tmp_quota, 0, 1);
+                if(ret)
+                        GOTO(err_ret, ret);
         }
 
-        ret = md_update_quota(&tmp_quota);
-        if(ret)
-                GOTO(err_ret, ret);
-
 out:
         return 0;
 err_ret:
@@ -547,8 +544,7 @@ static int __increase_space_for_directory_quota(const fileid_t *start_quotaid,
                         if((tmp_quota.space_hard > 0) &&
                                         (space_used_tmp > tmp_quota.space_hard)) {
                                 if(level > 1) {
-                                        last_quota.space_used -= space;
-                                        ret = md_update_quota(&last_quota);
+                                        ret = md_quota_add(&last_quota, -(int64_t)space, 0);
                                         if (ret)
                                                 GOTO(err_ret, ret);
                                 }
@@ -556,12 +552,12 @@ static int __increase_space_for_directory_quota(const fileid_t *start_quotaid,
                                 goto err_ret;
                         }
 
-                        tmp_quota.space_used = space_used_tmp;
-
-                        ret = md_update_quota(&tmp_quota);
+                        ret = md_quota_add(&tmp_quota, space, 0);
                         if(ret)
                                 GOTO(err_ret, ret);
 
+                        tmp_quota.space_used = space_used_tmp;
+
                         level++;
                         memcpy(&last_quota, &tmp_quota, sizeof(quota_t));
 
@@ -586,7 +582,6 @@ static int __increase_space_for_group_or_user_quota(const uid_t uid,
 {
         int ret;
         quota_t tmp_quota;
-        uint64_t space_used_tmp = 0;
 
         memset(&tmp_quota, 0, sizeof(quota_t));
         tmp_quota.uid = uid;
@@ -602,17 +597,7 @@ static int __increase_space_for_group_or_user_quota(const uid_t uid,
                 goto out;
         }
 
-        space_used_tmp = tmp_quota.space_used;
-        if(space_used_tmp < (UINT64_MAX - space)) {
-                space_used_tmp += space;
-        } else {
-                space_used_tmp = UINT64_MAX;
-        }
-
-        tmp_quota.space_used = space_used_tmp;
-
-
-        ret = md_update_quota(&tmp_quota);
+        ret = md_quota_add(&tmp_quota, space, 0);
         if(ret)
                 GOTO(err_ret, ret);
 
@@ -795,12 +780,11 @@ static int __decrease_inode_for_directory_qutoa(const fileid_t *start_quotaid)
                                 continue;
                         }
 
-                        if(tmp_quota.inode_used > 0)
-                                tmp_quota.inode_used--;
-
-                        ret = md_update_quota(&tmp_quota);
-                        if(ret)
-                                GOTO(err_ret, ret);
+                        if(tmp_quota.inode_used > 0) {
+                                ret = md_quota_add(&tmp_quota, 0, -1);
+                                if(ret)
+                                        GOTO(err_ret, ret);
+                        }
 
                         init_quotaid = tmp_quota.pquotaid;
                 } else {
@@ -836,9 +820,7 @@ static int __decrease_inode_for_user_or_group_quota(const uid_t uid,
         }
 
         if(tmp_quota.inode_used > 0) {
-
-                tmp_quota.inode_used--;
-                ret = md_update_quota(&tmp_quota);
+                ret = md_quota_add(&tmp_quota, 0, -1);
                 if(ret)
                         GOTO(err_ret, ret);
         }
@@ -898,16 +880,13 @@ static int __decrease_space_for_directory_quota(const fileid_t *start_quotaid,
                                 continue;
                         }
 
+                        /* never below zero */
                         space_used_tmp = tmp_quota.space_used;
-                        if(space_used_tmp < space) {
-                                space_used_tmp = 0;
-                        } else {
-                                space_used_tmp -= space;
+                        if(space_used_tmp > space) {
+                                space_used_tmp = space;
                         }
 
-                        tmp_quota.space_used = space_used_tmp;
-
-                        ret = md_update_quota(&tmp_quota);
+                        ret = md_quota_add(&tmp_quota, -(int64_t)space_used_tmp, 0);
                         if(ret)
                                 GOTO(err_ret, ret);
 
@@ -946,13 +925,8 @@ static int __decrease_space_for_user_or_group_quota(const uid_t uid,
                 goto out;
         }
 
-        if(tmp_quota.space_used < space) {
-                tmp_quota.space_used = 0;
-        } else {
-                tmp_quota.space_used -= space;
-        }
-
-        ret = md_update_quota(&tmp_quota);
+        ret = md_quota_add(&tmp_quota, -(int64_t)(tmp_quota.space_used < space
+                                                  ? tmp_quota.space_used : space), 0);
         if(ret)
                 GOTO(err_ret, ret);
 
@@ -1005,6 +979,8 @@ int quota_chown(const fileid_t *fileid, IN uid_t new_uid, IN gid_t new_gid)
 
         md = (md_proto_t *)buf;
 
+        quota_cache_flush();
+
         ret = md_getattr(md, fileid);
         if (ret)
                 GOTO(err_ret, ret);
@@ -1145,6 +1121,27 @@ err_ret:
         return ret;
 }
 
+/**
+ * same as quota_check_dec, md as left by the unlink
+ */
+int quota_unlink_dec(const md_proto_t *md)
+{
+        if (md->md_size == 0 || md->quotaid.id == QUOTA_NULL) {
+                return 0;
+        }
+
+        if (S_ISREG(md->at_mode) && md->at_nlink == 0) {
+                quota_space_dec(&md->quotaid, md->at_uid, md->at_gid,
+                                &md->fileid, md->at_size);
+
+                quota_inode_dec(&md->quotaid, md->at_uid, md->at_gid, &md->fileid);
+        } else if (S_ISDIR(md->at_mode)) {
+                quota_inode_dec(&md->quotaid, md->at_uid, md->at_gid, &md->fileid);
+        }
+
+        return 0;
+}
+
 int quota_inode_increase(const fileid_t *fileid, const setattr_t *setattr)
 {
         int ret;
@@ -1152,6 +1149,10 @@ int quota_inode_increase(const fileid_t *fileid, const setattr_t *setattr)
         md_proto_t *md;
         char buf[MAX_BUF_LEN];
 
+        ret = quota_cache_inode(fileid, setattr->uid.val, setattr->gid.val, 1);
+        if (ret != ENOBUFS)
+                return ret;
+
         md = (void *)buf;
         ret = md_getattr(md, fileid);
         if (ret) {
@@ -1180,6 +1181,10 @@ int quota_inode_decrease(const fileid_t *fileid, const setattr_t *setattr)
         md_proto_t *md;
         char buf[MAX_BUF_LEN];
 
+        ret = quota_cache_inode(fileid, setattr->uid.val, setattr->gid.val, -1);
+        if (ret != ENOBUFS)
+                return ret;
+
         md = (void *)buf;
         ret = md_getattr(md, fileid);
         if (ret) {
@@ -1208,6 +1213,10 @@ int quota_space_increase(const fileid_t *fileid, uid_t uid, gid_t gid, uint64_t
         md_proto_t *md;
         char buf[MAX_BUF_LEN];
 
+        ret = quota_cache_space(fileid, uid, gid, space);
+        if (ret != ENOBUFS)
+                return ret;
+
         md = (void *)buf;
         ret = md_getattr(md, fileid);
         if (ret) {
@@ -1236,6 +1245,10 @@ int quota_space_decrease(const fileid_t *fileid, uid_t uid, gid_t gid, uint64_t
         md_proto_t *md;
         char buf[MAX_BUF_LEN];
 
+        ret = quota_cache_space(fileid, uid, gid, -(int64_t)space);
+        if (ret != ENOBUFS)
+                return ret;
+
         md = (void *)buf;
         ret = md_getattr(md, fileid);
         if (ret) {
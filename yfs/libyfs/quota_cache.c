@@ -0,0 +1,569 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#define DBG_SUBSYS S_YFSLIB
+
+#include "sdfs_list.h"
+#include "sdfs_id.h"
+#include "sdfs_lib.h"
+#include "sdfs_conf.h"
+#include "configure.h"
+#include "md_lib.h"
+#include "quota.h"
+#include "sdfs_quota.h"
+#include "ylib.h"
+#include "dbg.h"
+
+/*
+ * client side quota cache
+ *
+ * quota records met by this client are cached for quota_cache_interval
+ * seconds, usage deltas are accumulated locally and added to the shared
+ * counters in one batch per interval. a record is checked exactly (pending
+ * deltas flushed, then the uncached path) only if the op brings it within
+ * quota_space_lease/quota_inode_lease of its hard limit, so each client
+ * may overrun a limit by at most one lease.
+ */
+
+#define QCACHE_HASH 256
+#define QCACHE_RETRY 16
+
+typedef struct {
+        struct list_head hook;
+        int type;
+        fileid_t quotaid;       /* QUOTA_DIR */
+        uint64_t volid;         /* QUOTA_USER, QUOTA_GROUP */
+        uint32_t id;            /* uid or gid */
+        int exist;
+        quota_t quota;
+        int64_t space;          /* not flushed */
+        int64_t inode;
+} qcache_ent_t;
+
+typedef struct {
+        struct list_head hook;
+        fileid_t dirid;
+        fileid_t quotaid;
+} qcache_dir_t;
+
+typedef struct {
+        pthread_mutex_t lock;
+        int count;
+        struct list_head ent[QCACHE_HASH];
+        struct list_head dir[QCACHE_HASH];
+} qcache_t;
+
+static qcache_t *__qcache__ = NULL;
+
+static int __qcache_hash(int type, const fileid_t *quotaid, uint64_t volid, uint32_t id)
+{
+        if (type == QUOTA_DIR)
+                return quotaid->id % QCACHE_HASH;
+        else
+                return (volid + id + type) % QCACHE_HASH;
+}
+
+static qcache_ent_t *__qcache_find(int type, const fileid_t *quotaid, uint64_t volid, uint32_t id)
+{
+        struct list_head *head, *pos;
+        qcache_ent_t *ent;
+
+        head = &__qcache__->ent[__qcache_hash(type, quotaid, volid, id)];
+        list_for_each(pos, head) {
+                ent = (void *)pos;
+                if (ent->type != type)
+                        continue;
+
+                if (type == QUOTA_DIR) {
+                        if (fileid_cmp(&ent->quotaid, quotaid) == 0)
+                                return ent;
+                } else if (ent->volid == volid && ent->id == id) {
+                        return ent;
+                }
+        }
+
+        return NULL;
+}
+
+static int __qcache_load(int type, const fileid_t *quotaid, uint64_t volid, uint32_t id)
+{
+        int ret, exist;
+        quota_t quota;
+        qcache_ent_t *ent;
+
+        memset(&quota, 0, sizeof(quota));
+        if (type == QUOTA_DIR) {
+                ret = md_get_quota(quotaid, &quota, QUOTA_DIR);
+        } else {
+                if (type == QUOTA_GROUP)
+                        quota.gid = id;
+                else
+                        quota.uid = id;
+
+                volid2lvmid(volid, &quota.dirid);
+                ret = md_get_quota(NULL, &quota, type);
+        }
+
+        if (ret) {
+                if (ret == ENOENT) {
+                        exist = 0;
+                } else
+                        GOTO(err_ret, ret);
+        } else {
+                exist = 1;
+        }
+
+        ret = pthread_mutex_lock(&__qcache__->lock);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (__qcache_find(type, quotaid, volid, id)) {
+                goto out;
+        }
+
+        if (__qcache__->count >= QUOTA_MAX_COUNT) {
+                ret = ENOBUFS;
+                GOTO(err_lock, ret);
+        }
+
+        ret = ymalloc((void **)&ent, sizeof(*ent));
+        if (ret)
+                GOTO(err_lock, ret);
+
+        ent->type = type;
+        if (type == QUOTA_DIR)
+                ent->quotaid = *quotaid;
+        ent->volid = volid;
+        ent->id = id;
+        ent->exist = exist;
+        ent->quota = quota;
+        ent->space = 0;
+        ent->inode = 0;
+
+        list_add_tail(&ent->hook, &__qcache__->ent[__qcache_hash(type, quotaid, volid, id)]);
+        __qcache__->count++;
+
+out:
+        pthread_mutex_unlock(&__qcache__->lock);
+
+        return 0;
+err_lock:
+        pthread_mutex_unlock(&__qcache__->lock);
+err_ret:
+        return ret;
+}
+
+static int __qcache_quotaid(const fileid_t *dirid, fileid_t *quotaid)
+{
+        int ret;
+        struct list_head *head, *pos;
+        qcache_dir_t *dir;
+        md_proto_t *md;
+        char buf[MAX_BUF_LEN];
+
+        head = &__qcache__->dir[dirid->id % QCACHE_HASH];
+
+        ret = pthread_mutex_lock(&__qcache__->lock);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        list_for_each(pos, head) {
+                dir = (void *)pos;
+                if (fileid_cmp(&dir->dirid, dirid) == 0) {
+                        *quotaid = dir->quotaid;
+                        pthread_mutex_unlock(&__qcache__->lock);
+                        return 0;
+                }
+        }
+
+        pthread_mutex_unlock(&__qcache__->lock);
+
+        md = (void *)buf;
+        ret = md_getattr(md, dirid);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        *quotaid = md->quotaid;
+
+        ret = ymalloc((void **)&dir, sizeof(*dir));
+        if (ret)
+                GOTO(err_ret, ret);
+
+        dir->dirid = *dirid;
+        dir->quotaid = md->quotaid;
+
+        ret = pthread_mutex_lock(&__qcache__->lock);
+        if (ret)
+                GOTO(err_free, ret);
+
+        list_add_tail(&dir->hook, head);
+
+        pthread_mutex_unlock(&__qcache__->lock);
+
+        return 0;
+err_free:
+        yfree((void **)&dir);
+err_ret:
+        return ret;
+}
+
+static int __qcache_near(const qcache_ent_t *ent, int64_t space, int64_t inode)
+{
+        const quota_t *quota = &ent->quota;
+
+        if (space > 0 && quota->space_hard > 0
+            && quota->space_used + ent->space + space
+            + gloconf.quota_space_lease > quota->space_hard)
+                return 1;
+
+        if (inode > 0 && quota->inode_hard > 0
+            && quota->inode_used + ent->inode + inode
+            + gloconf.quota_inode_lease > quota->inode_hard)
+                return 1;
+
+        return 0;
+}
+
+/*
+ * collect the quotas charged by an op under the parent quotaid, the dir
+ * chain up to the first unset level then the group and user quota of
+ * the volume. return the record to load if one is not cached.
+ */
+static int __qcache_collect(const fileid_t *quotaid, uid_t uid, gid_t gid,
+                            qcache_ent_t **array, int *_count,
+                            int *type, fileid_t *missid, uint32_t *id)
+{
+        int i, count = 0;
+        fileid_t cur = *quotaid;
+        qcache_ent_t *ent;
+
+        for (i = 0; i < QUOTA_MAX_LEVEL && cur.id != QUOTA_NULL; i++) {
+                ent = __qcache_find(QUOTA_DIR, &cur, 0, 0);
+                if (ent == NULL) {
+                        *type = QUOTA_DIR;
+                        *missid = cur;
+                        return ENOENT;
+                }
+
+                if (!ent->exist || !(ent->quota.inode_used || ent->quota.inode_hard
+                                     || ent->quota.space_used || ent->quota.space_hard))
+                        break;
+
+                array[count++] = ent;
+                cur = ent->quota.pquotaid;
+        }
+
+        ent = __qcache_find(QUOTA_GROUP, NULL, quotaid->volid, gid);
+        if (ent == NULL) {
+                *type = QUOTA_GROUP;
+                *id = gid;
+                return ENOENT;
+        }
+
+        if (ent->exist)
+                array[count++] = ent;
+
+        ent = __qcache_find(QUOTA_USER, NULL, quotaid->volid, uid);
+        if (ent == NULL) {
+                *type = QUOTA_USER;
+                *id = uid;
+                return ENOENT;
+        }
+
+        if (ent->exist)
+                array[count++] = ent;
+
+        *_count = count;
+
+        return 0;
+}
+
+static int __qcache_apply(const fileid_t *dirid, uid_t uid, gid_t gid,
+                          int64_t space, int64_t inode)
+{
+        int ret, i, count, type, retry = 0;
+        uint32_t id = 0;
+        fileid_t quotaid, missid;
+        qcache_ent_t *array[QUOTA_MAX_LEVEL + 2];
+
+        if (__qcache__ == NULL) {
+                ret = ENOBUFS;
+                goto err_ret;
+        }
+
+        ret = __qcache_quotaid(dirid, &quotaid);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (quotaid.id == QUOTA_NULL)
+                return 0;
+
+retry:
+        ret = pthread_mutex_lock(&__qcache__->lock);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = __qcache_collect(&quotaid, uid, gid, array, &count, &type, &missid, &id);
+        if (ret) {
+                YASSERT(ret == ENOENT);
+                pthread_mutex_unlock(&__qcache__->lock);
+
+                if (retry++ > QCACHE_RETRY) {
+                        ret = ENOBUFS;
+                        goto err_ret;
+                }
+
+                ret = __qcache_load(type, &missid, quotaid.volid, id);
+                if (ret)
+                        goto err_ret;
+
+                goto retry;
+        }
+
+        for (i = 0; i < count; i++) {
+                if (__qcache_near(array[i], space, inode)) {
+                        pthread_mutex_unlock(&__qcache__->lock);
+
+                        DBUG("quota "CHKID_FORMAT" near limit\n",
+                             CHKID_ARG(&array[i]->quota.quotaid));
+                        quota_cache_flush();
+                        ret = ENOBUFS;
+                        goto err_ret;
+                }
+        }
+
+        for (i = 0; i < count; i++) {
+                array[i]->space += space;
+                array[i]->inode += inode;
+        }
+
+        pthread_mutex_unlock(&__qcache__->lock);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * ENOBUFS if not absorbed, the caller must charge the quota itself
+ */
+int quota_cache_space(const fileid_t *dirid, uid_t uid, gid_t gid, int64_t space)
+{
+        return __qcache_apply(dirid, uid, gid, space, 0);
+}
+
+int quota_cache_inode(const fileid_t *dirid, uid_t uid, gid_t gid, int64_t inode)
+{
+        return __qcache_apply(dirid, uid, gid, 0, inode);
+}
+
+typedef struct {
+        int type;
+        fileid_t quotaid;
+        uint64_t volid;
+        uint32_t id;
+        quota_t quota;
+        int64_t space;
+        int64_t inode;
+} qcache_delta_t;
+
+/* a delta that did not reach redis goes back to its entry, for the next flush */
+static void __qcache_restore(const qcache_delta_t *delta)
+{
+        int ret;
+        qcache_ent_t *ent;
+
+        ret = pthread_mutex_lock(&__qcache__->lock);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ent = __qcache_find(delta->type, &delta->quotaid, delta->volid, delta->id);
+        if (ent) {
+                ent->quota.space_used -= delta->space;
+                ent->quota.inode_used -= delta->inode;
+        } else {
+                /* dropped meanwhile, keep the delta in an entry of its own */
+                ret = ymalloc((void **)&ent, sizeof(*ent));
+                if (ret)
+                        GOTO(err_lock, ret);
+
+                ent->type = delta->type;
+                ent->quotaid = delta->quotaid;
+                ent->volid = delta->volid;
+                ent->id = delta->id;
+                ent->exist = 1;
+                ent->quota = delta->quota;
+                ent->space = 0;
+                ent->inode = 0;
+
+                list_add_tail(&ent->hook, &__qcache__->ent[__qcache_hash(delta->type,
+                                  &delta->quotaid, delta->volid, delta->id)]);
+                __qcache__->count++;
+        }
+
+        ent->space += delta->space;
+        ent->inode += delta->inode;
+
+        pthread_mutex_unlock(&__qcache__->lock);
+
+        return;
+err_lock:
+        pthread_mutex_unlock(&__qcache__->lock);
+err_ret:
+        DERROR("quota "CHKID_FORMAT" space %jd inode %jd lost, ret (%u) %s\n",
+               CHKID_ARG(&delta->quota.quotaid), delta->space, delta->inode,
+               ret, strerror(ret));
+}
+
+int quota_cache_flush()
+{
+        int ret, i, j, count;
+        struct list_head *pos;
+        qcache_ent_t *ent;
+        qcache_delta_t *array;
+
+        if (__qcache__ == NULL)
+                return 0;
+
+        ret = pthread_mutex_lock(&__qcache__->lock);
+        if (ret)
+                GOTO(err_ret, ret);
+
+        if (__qcache__->count == 0) {
+                pthread_mutex_unlock(&__qcache__->lock);
+                return 0;
+        }
+
+        ret = ymalloc((void **)&array, sizeof(*array) * __qcache__->count);
+        if (ret)
+                GOTO(err_lock, ret);
+
+        count = 0;
+        for (i = 0; i < QCACHE_HASH; i++) {
+                list_for_each(pos, &__qcache__->ent[i]) {
+                        ent = (void *)pos;
+                        if (ent->space == 0 && ent->inode == 0)
+                                continue;
+
+                        array[count].type = ent->type;
+                        array[count].quotaid = ent->quotaid;
+                        array[count].volid = ent->volid;
+                        array[count].id = ent->id;
+                        array[count].quota = ent->quota;
+                        array[count].space = ent->space;
+                        array[count].inode = ent->inode;
+                        count++;
+
+                        /* counted as used until the entry is dropped */
+                        ent->quota.space_used += ent->space;
+                        ent->quota.inode_used += ent->inode;
+                        ent->space = 0;
+                        ent->inode = 0;
+                }
+        }
+
+        pthread_mutex_unlock(&__qcache__->lock);
+
+        for (j = 0; j < count; j++) {
+                ret = md_quota_add(&array[j].quota, array[j].space, array[j].inode);
+                if (ret) {
+                        DWARN("quota "CHKID_FORMAT" add space %jd inode %jd fail, ret (%u) %s\n",
+                              CHKID_ARG(&array[j].quota.quotaid), array[j].space,
+                              array[j].inode, ret, strerror(ret));
+                        __qcache_restore(&array[j]);
+                }
+        }
+
+        yfree((void **)&array);
+
+        return 0;
+err_lock:
+        pthread_mutex_unlock(&__qcache__->lock);
+err_ret:
+        return ret;
+}
+
+static void __qcache_drop()
+{
+        int i;
+        struct list_head *pos, *n;
+        qcache_ent_t *ent;
+
+        for (i = 0; i < QCACHE_HASH; i++) {
+                list_for_each_safe(pos, n, &__qcache__->ent[i]) {
+                        ent = (void *)pos;
+                        if (ent->space || ent->inode)
+                                continue;
+
+                        list_del(pos);
+                        yfree((void **)&ent);
+                        __qcache__->count--;
+                }
+
+                list_for_each_safe(pos, n, &__qcache__->dir[i]) {
+                        list_del(pos);
+                        yfree((void **)&pos);
+                }
+        }
+}
+
+static void *__quota_cache_worker(void *arg)
+{
+        (void) arg;
+
+        while (1) {
+                sleep(gloconf.quota_cache_interval);
+
+                quota_cache_flush();
+
+                /* reload limits and usage of other clients */
+                pthread_mutex_lock(&__qcache__->lock);
+                __qcache_drop();
+                pthread_mutex_unlock(&__qcache__->lock);
+        }
+
+        return NULL;
+}
+
+int quota_cache_init()
+{
+        int ret, i;
+        qcache_t *qcache;
+
+        if (!gloconf.quota_cache)
+                return 0;
+
+        ret = ymalloc((void **)&qcache, sizeof(*qcache));
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = pthread_mutex_init(&qcache->lock, NULL);
+        if (ret)
+                GOTO(err_free, ret);
+
+        for (i = 0; i < QCACHE_HASH; i++) {
+                INIT_LIST_HEAD(&qcache->ent[i]);
+                INIT_LIST_HEAD(&qcache->dir[i]);
+        }
+
+        qcache->count = 0;
+        __qcache__ = qcache;
+
+        ret = sy_thread_create2(__quota_cache_worker, NULL, "quota_cache");
+        if (ret)
+                GOTO(err_reset, ret);
+
+        DINFO("quota cache interval %u space lease %ju inode lease %u\n",
+              gloconf.quota_cache_interval, gloconf.quota_space_lease,
+              gloconf.quota_inode_lease);
+
+        return 0;
+err_reset:
+        __qcache__ = NULL;
+err_free:
+        yfree((void **)&qcache);
+err_ret:
+        return ret;
+}
@@ -7,6 +7,7 @@
 #define DBG_SUBSYS S_YFSLIB
 
 #include "md_lib.h"
+#include "quota.h"
 #include "../../ynet/rpc/rpc_proto.h"
 #include "fnotify.h"
 #include "net_global.h"
@@ -25,6 +26,7 @@
 #include "bh.h"
 #include "io_analysis.h"
 #include "../../sdfs/replica_rpc.h"
+#include "../../sdfs/sdfs_wbcache.h"
 #include "net_global.h"
 #include "dbg.h"
 #include "license_helper.h"
@@ -691,6 +693,14 @@ int ly_init(int daemon, const char *name, int64_t maxopenfile)
         ret = replica_rpc_init();
         if (ret)
                 GOTO(err_ret, ret);
+
+        ret = wbcache_init();
+        if (ret)
+                GOTO(err_ret, ret);
+
+        ret = quota_cache_init();
+        if (ret)
+                GOTO(err_ret, ret);
         
         main_loop_start();
 
@@ -853,7 +863,7 @@ err_ret:
 
 int ly_destroy(void)
 {
-        return 0;
+        return md_destroy();
 }
 
 int ly_init_simple2(const char *name)
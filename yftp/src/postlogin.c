@@ -1097,6 +1097,19 @@ middle_out1:
         }
 
         DINFO("upload: totol %llu\n", (unsigned long long)offset);
+
+        ret = sdfs_fsync(&fileid);
+        if (ret) {
+                DERROR("sdfs_fsync() (%d) %s\n", ret, strerror(ret));
+
+                ret = cmdio_write(ys, FTP_UPLOADFAIL,
+                                "Could not create file.");
+                if (ret)
+                        GOTO(err_epoll, ret);
+
+                goto out_epoll;
+        }
+
         ret = cmdio_write(ys, FTP_TRANSFEROK, "Transfer complete\r\n");
         if (ret)
                 GOTO(err_epoll, ret);
@@ -503,30 +503,44 @@ err_ret:
         return -ret;
 }
 
-static int yfs_release(const char *path, struct fuse_file_info *fi)
+static int yfs_release(const char *_path, struct fuse_file_info *fi)
 {
-        /* Just a stub.	 This method is optional and can safely be left
-           unimplemented */
+        int ret;
+        char path[MAX_PATH_LEN];
 
-        (void) path;
         (void) fi;
 
+        yfs_fusepath(_path, path);
         DBUG("release %s\n", path);
+
+        ret = ly_fsync(path);
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
         return 0;
+err_ret:
+        return -ret;
 }
 
-static int yfs_fsync(const char *path, int isdatasync,
+static int yfs_fsync(const char *_path, int isdatasync,
                 struct fuse_file_info *fi)
 {
-        /* Just a stub.	 This method is optional and can safely be left
-           unimplemented */
+        int ret;
+        char path[MAX_PATH_LEN];
 
-        (void) path;
         (void) isdatasync;
         (void) fi;
 
+        yfs_fusepath(_path, path);
         DBUG("fsync %s\n", path);
+
+        ret = ly_fsync(path);
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
         return 0;
+err_ret:
+        return -ret;
 }
 
 #ifdef HAVE_POSIX_FALLOCATE
@@ -6,6 +6,9 @@
 
 typedef  redisContext redis_ctx_t;
 
+#define REDIS_SHA_LEN 41
+#define REDIS_EVAL_ARG_MAX 32
+
 typedef struct {
         struct list_head hook;
         char *key;
@@ -49,6 +52,11 @@ int redis_sdel(redis_conn_t *conn, const char *set, const char *key);
 int redis_scount(redis_conn_t *conn, const char *set, uint64_t *count);
 int redis_siterator(redis_conn_t *conn, const char *set, func1_t func, void *arg);
 int redis_hlen(redis_conn_t *conn, const char *key, uint64_t *count);
+int redis_incrby(redis_conn_t *conn, const char *key, int64_t incr, int64_t *result);
+int redis_blpop(redis_conn_t *conn, const char *key, int timeout);
+int redis_repl_offset(redis_conn_t *conn, uint64_t *offset, int *master);
+int redis_eval(redis_conn_t *conn, const char *script, char *sha, int argc,
+               const char **argv, const size_t *argvlen, redisReply **reply);
 int redis_iterator(redis_conn_t *conn, const char *match, func1_t func, void *arg);
 
 #if 0
@@ -71,6 +79,7 @@ void redis_multi_append(mctx_t *ctx, char *key,  void *value, uint32_t len);
 int redis_multi_exec(redis_conn_t *conn, const char *op, const char *tab , mctx_t *ctx, func1_t func, void *arg);
 int redis_multi_destory(mctx_t *ctx);
 redisReply *redis_hscan(redis_conn_t *conn, const char *key, const char *match, uint64_t cursor, uint64_t _count);
+redisReply *redis_hmget(redis_conn_t *conn, const char *hash, int count, const char **keys);
 int redis_kdel(redis_conn_t *conn, const char *key);
 int redis_del(redis_conn_t *conn, const char *key);
 int redis_disconnect(redis_conn_t *conn);
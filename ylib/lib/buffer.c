@@ -81,6 +81,7 @@ static int __buffer_pool_alloc(struct list_head *list, int count)
                         GOTO(err_ret, ret);
 
                 seg->ptr = ptr;
+                seg->base = ptr;
                 seg->type = BUFFER_POOL;
                 seg->len = PAGE_SIZE;
                 list_add_tail(&seg->hook, list);
@@ -241,19 +242,38 @@ static inline seg_t *__memseg_alloc(uint32_t size)
                 return NULL;
         }
 
+        seg->base = seg->ptr;
         seg->len = size;
         seg->type = BUFFER_RW;
 
         return seg;
 }
 
+/*
+ * drop cp bytes from the front of seg. memory of our own is not moved,
+ * ptr goes on and base is freed at last, so popping a message header or a
+ * partly sent page costs no copy.
+ */
+static inline void __memseg_trim(seg_t *seg, uint32_t cp)
+{
+        YASSERT(cp < seg->len);
+
+        if (seg->type == BUFFER_RW) {
+                seg->ptr += cp;
+        } else {
+                memmove(seg->ptr, seg->ptr + cp, seg->len - cp);
+        }
+
+        seg->len -= cp;
+}
+
 static inline void __memseg_free(seg_t *seg)
 {
         int ret;
         struct list_head list;
 
         if (seg->type == BUFFER_RW) {
-                __buffer_free(seg->ptr, seg->len);
+                __buffer_free(seg->base, seg->len);
                 mpool_put(&head_pool, seg);
         } else if (seg->type == BUFFER_POOL) {
                 DBUG("free big mem %u\n", seg->len);
@@ -352,8 +372,7 @@ int mbuffer_popmsg(buffer_t *buf, void *dist, uint32_t len)
                 case BUFFER_RW:
                 case BUFFER_POOL:
                         if (cp < seg->len) {
-                                memmove(seg->ptr, seg->ptr + cp, seg->len - cp);
-                                seg->len -= cp;
+                                __memseg_trim(seg, cp);
                         } else {
                                 list_del(pos);
                                 __memseg_free(seg);
@@ -520,8 +539,7 @@ static int __buffer_sendrw(buffer_t *buf, int sd)
                         list_del(&seg->hook);
                         __memseg_free(seg);
                 } else {
-                        memmove(seg->ptr, seg->ptr + sent, seg->len - sent);
-                        seg->len -= sent;
+                        __memseg_trim(seg, sent);
                         sent = 0;
                 }
 
@@ -599,8 +617,7 @@ int mbuffer_send(buffer_t *buf, int sd, int *eagain)
                         YASSERT(cp <= (int)seg->len);
 
                         if (cp != (int)seg->len) {
-                                memmove(seg->ptr, seg->ptr + cp, seg->len - cp);
-                                seg->len -= cp;
+                                __memseg_trim(seg, cp);
                                 done = 1;
                                 *eagain = 1;
                         } else {
@@ -1040,7 +1057,7 @@ int mbuffer_pop(buffer_t *buf, buffer_t *newbuf, uint32_t len)
 {
         int ret;
         struct list_head *pos, *n;
-        seg_t *seg;
+        seg_t *seg, *rest;
         uint32_t left, cp;
 
         BUFFER_CHECK(buf);
@@ -1060,27 +1077,42 @@ int mbuffer_pop(buffer_t *buf, buffer_t *newbuf, uint32_t len)
                         if (cp < seg->len) {
                                 DBUG("pop %u from %u\n", cp, seg->len);
 
+                                if (newbuf && seg->type == BUFFER_RW
+                                    && seg->len - cp < cp) {
+                                        /* hand the page over, copy out the shorter rest */
+                                        rest = __memseg_alloc(seg->len - cp);
+                                        if (rest == NULL) {
+                                                ret = ENOMEM;
+                                                GOTO(err_ret, ret);
+                                        }
+
+                                        _memcpy(rest->ptr, seg->ptr + cp, rest->len);
+                                        list_add(&rest->hook, &seg->hook);
+                                        list_del(pos);
+                                        seg->len = cp;
+                                        list_add_tail(&seg->hook, &newbuf->list);
+                                        newbuf->len += cp;
+                                        break;
+                                }
+
                                 if (newbuf) {
                                         ret = mbuffer_appendmem(newbuf, seg->ptr, cp);
                                         if (ret)
                                                 GOTO(err_ret, ret);
                                 }
 
-                                memmove(seg->ptr, seg->ptr + cp, seg->len - cp);
-                                seg->len -= cp;
+                                __memseg_trim(seg, cp);
                         } else {
                                 list_del(pos);
 
                                 YASSERT(cp == seg->len);
                                 if (newbuf) {
-                                        ret = mbuffer_apply(newbuf, seg->ptr, cp);
-                                        if (ret)
-                                                GOTO(err_ret, ret);
+                                        /* hand the page over */
+                                        list_add_tail(&seg->hook, &newbuf->list);
+                                        newbuf->len += cp;
                                 } else {
-                                        __buffer_free(seg->ptr, seg->len);
+                                        __memseg_free(seg);
                                 }
-
-                                mpool_put(&head_pool, seg);
                         }
 
                         break;
@@ -1389,6 +1421,7 @@ int mbuffer_apply(buffer_t *buf, void *mem, int size)
                 GOTO(err_ret, ret);
 
         seg->ptr = mem;
+        seg->base = mem;
         seg->len = size;
         seg->type = BUFFER_RW;
 
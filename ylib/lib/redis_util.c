@@ -633,6 +633,43 @@ err_ret:
         return NULL;
 }
 
+redisReply *redis_hmget(redis_conn_t *conn, const char *hash, int count,
+                        const char **keys)
+{
+        int ret, i;
+        redisReply *reply;
+        const char *argv[REDIS_EVAL_ARG_MAX];
+        size_t argvlen[REDIS_EVAL_ARG_MAX];
+
+        YASSERT(count + 2 <= REDIS_EVAL_ARG_MAX);
+
+        argv[0] = "HMGET";
+        argvlen[0] = strlen("HMGET");
+        argv[1] = hash;
+        argvlen[1] = strlen(hash);
+        for (i = 0; i < count; i++) {
+                argv[i + 2] = keys[i];
+                argvlen[i + 2] = strlen(keys[i]);
+        }
+
+        ret = sy_rwlock_wrlock(&conn->rwlock);
+        if ((unlikely(ret)))
+                GOTO(err_ret, ret);
+
+        reply = redisCommandArgv(conn->ctx, count + 2, argv, argvlen);
+
+        sy_rwlock_unlock(&conn->rwlock);
+
+        if (reply == NULL) {
+                DWARN("redis reset, hash %s\n", hash);
+                return NULL;
+        }
+
+        return reply;
+err_ret:
+        return NULL;
+}
+
 int redis_keys(redis_conn_t *conn, func1_t func, void *arg)
 {
         int ret;
@@ -877,6 +914,261 @@ err_ret:
         return ret;
 }
 
+int redis_incrby(redis_conn_t *conn, const char *key, int64_t incr, int64_t *result)
+{
+        int ret;
+        redisReply *reply;
+
+        ret = sy_rwlock_wrlock(&conn->rwlock);
+        if ((unlikely(ret)))
+                GOTO(err_ret, ret);
+
+        reply = redisCommand(conn->ctx, "INCRBY %s %lld", key, (long long)incr);
+
+        sy_rwlock_unlock(&conn->rwlock);
+
+        if (reply == NULL) {
+                ret = ECONNRESET;
+                DWARN("redis reset, key %s\n", key);
+                GOTO(err_ret, ret);
+        }
+
+        if (reply->type != REDIS_REPLY_INTEGER) {
+                DWARN("redis reply->type: %d\n", reply->type);
+                ret = __redis_error(__FUNCTION__, reply);
+                GOTO(err_free, ret);
+        }
+
+        if (result)
+                *result = reply->integer;
+
+        freeReplyObject(reply);
+
+        return 0;
+err_free:
+        freeReplyObject(reply);
+err_ret:
+        return ret;
+}
+
+/**
+ * pop the head of list key, waiting up to timeout seconds for a push.
+ * ETIMEDOUT if nothing came. timeout must stay below the socket timeout
+ * of the connection.
+ */
+int redis_blpop(redis_conn_t *conn, const char *key, int timeout)
+{
+        int ret;
+        redisReply *reply;
+
+        ret = sy_rwlock_wrlock(&conn->rwlock);
+        if ((unlikely(ret)))
+                GOTO(err_ret, ret);
+
+        reply = redisCommand(conn->ctx, "BLPOP %s %d", key, timeout);
+
+        sy_rwlock_unlock(&conn->rwlock);
+
+        if (reply == NULL) {
+                ret = ECONNRESET;
+                DWARN("redis reset, key %s\n", key);
+                GOTO(err_ret, ret);
+        }
+
+        if (reply->type == REDIS_REPLY_NIL) {
+                ret = ETIMEDOUT;
+                goto err_free;
+        }
+
+        if (reply->type != REDIS_REPLY_ARRAY) {
+                DWARN("redis reply->type: %d\n", reply->type);
+                ret = __redis_error(__FUNCTION__, reply);
+                GOTO(err_free, ret);
+        }
+
+        freeReplyObject(reply);
+
+        return 0;
+err_free:
+        freeReplyObject(reply);
+err_ret:
+        return ret;
+}
+
+static int __redis_script_load(redis_conn_t *conn, const char *script, char *sha)
+{
+        int ret;
+        redisReply *reply;
+
+        reply = redisCommand(conn->ctx, "SCRIPT LOAD %s", script);
+        if (reply == NULL) {
+                ret = ECONNRESET;
+                DWARN("redis reset\n");
+                GOTO(err_ret, ret);
+        }
+
+        if (reply->type != REDIS_REPLY_STRING
+            || reply->len != REDIS_SHA_LEN - 1) {
+                ret = __redis_error(__FUNCTION__, reply);
+                GOTO(err_free, ret);
+        }
+
+        memcpy(sha, reply->str, REDIS_SHA_LEN - 1);
+        sha[REDIS_SHA_LEN - 1] = '\0';
+
+        freeReplyObject(reply);
+
+        return 0;
+err_free:
+        freeReplyObject(reply);
+err_ret:
+        return ret;
+}
+
+/**
+ * run a lua script by EVALSHA, loading it on first use or when the server
+ * lost it (restart, failover). argv starts with numkeys, the reply is
+ * returned to the caller. sha is shared by all connections, a load always
+ * writes the same digest so racing loaders are harmless.
+ */
+int redis_eval(redis_conn_t *conn, const char *script, char *sha, int argc,
+               const char **argv, const size_t *argvlen, redisReply **_reply)
+{
+        int ret, i, loaded = 0;
+        redisReply *reply;
+        const char *_argv[REDIS_EVAL_ARG_MAX];
+        size_t _argvlen[REDIS_EVAL_ARG_MAX];
+
+        YASSERT(argc + 2 <= REDIS_EVAL_ARG_MAX);
+
+        _argv[0] = "EVALSHA";
+        _argvlen[0] = strlen("EVALSHA");
+        for (i = 0; i < argc; i++) {
+                _argv[i + 2] = argv[i];
+                _argvlen[i + 2] = argvlen[i];
+        }
+
+        ret = sy_rwlock_wrlock(&conn->rwlock);
+        if ((unlikely(ret)))
+                GOTO(err_ret, ret);
+
+retry:
+        if (sha[0] == '\0') {
+                ret = __redis_script_load(conn, script, sha);
+                if (ret)
+                        GOTO(err_lock, ret);
+
+                loaded = 1;
+        }
+
+        _argv[1] = sha;
+        _argvlen[1] = REDIS_SHA_LEN - 1;
+        reply = redisCommandArgv(conn->ctx, argc + 2, _argv, _argvlen);
+        if (reply == NULL) {
+                ret = ECONNRESET;
+                DWARN("redis reset\n");
+                GOTO(err_lock, ret);
+        }
+
+        if (reply->type == REDIS_REPLY_ERROR) {
+                if (strncmp(reply->str, "NOSCRIPT", strlen("NOSCRIPT")) == 0
+                    && loaded == 0) {
+                        freeReplyObject(reply);
+                        sha[0] = '\0';
+                        goto retry;
+                }
+
+                if (strncmp(reply->str, "LOADING", strlen("LOADING")) == 0
+                    || strncmp(reply->str, "READONLY", strlen("READONLY")) == 0) {
+                        ret = __redis_error(__FUNCTION__, reply);
+                } else {
+                        DERROR("script %s fail, %s\n", sha, reply->str);
+                        ret = EIO;
+                }
+
+                GOTO(err_free, ret);
+        }
+
+        sy_rwlock_unlock(&conn->rwlock);
+
+        *_reply = reply;
+
+        return 0;
+err_free:
+        freeReplyObject(reply);
+err_lock:
+        sy_rwlock_unlock(&conn->rwlock);
+err_ret:
+        return ret;
+}
+
+static int __redis_info_u64(const char *info, const char *name, uint64_t *value)
+{
+        const char *p;
+
+        p = strstr(info, name);
+        if (p == NULL)
+                return ENOENT;
+
+        *value = strtoull(p + strlen(name), NULL, 10);
+
+        return 0;
+}
+
+/**
+ * replication offset of the server, master_repl_offset on a master,
+ * slave_repl_offset on a replica. ENOLINK if the replica lost its master.
+ */
+int redis_repl_offset(redis_conn_t *conn, uint64_t *offset, int *master)
+{
+        int ret;
+        redisReply *reply;
+
+        ret = sy_rwlock_wrlock(&conn->rwlock);
+        if ((unlikely(ret)))
+                GOTO(err_ret, ret);
+
+        reply = redisCommand(conn->ctx, "INFO replication");
+
+        sy_rwlock_unlock(&conn->rwlock);
+
+        if (reply == NULL) {
+                ret = ECONNRESET;
+                DWARN("redis reset\n");
+                GOTO(err_ret, ret);
+        }
+
+        if (reply->type != REDIS_REPLY_STRING) {
+                ret = EIO;
+                GOTO(err_free, ret);
+        }
+
+        if (strstr(reply->str, "role:master")) {
+                *master = 1;
+                ret = __redis_info_u64(reply->str, "master_repl_offset:", offset);
+                if (ret)
+                        GOTO(err_free, ret);
+        } else {
+                *master = 0;
+                if (strstr(reply->str, "master_link_status:up") == NULL) {
+                        ret = ENOLINK;
+                        goto err_free;
+                }
+
+                ret = __redis_info_u64(reply->str, "slave_repl_offset:", offset);
+                if (ret)
+                        GOTO(err_free, ret);
+        }
+
+        freeReplyObject(reply);
+
+        return 0;
+err_free:
+        freeReplyObject(reply);
+err_ret:
+        return ret;
+}
+
 
 #if 0
 int redis_exec(redis_conn_t *conn, const char *buf)
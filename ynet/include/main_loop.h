@@ -17,6 +17,8 @@ void main_loop_hold();
 int main_loop_check();
 
 int main_loop_request(void (*exec)(void *buf), void *buf, const char *name);
+int main_loop_request1(uint64_t hash, void (*exec)(void *buf), void *buf, const char *name);
+int main_loop_worker_count();
 int main_loop_event(int sd, int event, int op);
 
 #if 1
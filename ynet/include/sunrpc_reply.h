@@ -9,5 +9,6 @@ extern int sunrpc1_reply_prep(job_t *job, xdr_ret_t xdr_ret, void *buf
 extern int sunrpc1_reply_send(job_t *job, buffer_t *buf,  mbuffer_op_t op);
 int sunrpc_reply(const sockid_t *sockid, const sunrpc_request_t *req,
                  int state, void *res, xdr_ret_t xdr_ret);
+int sunrpc_reply_buf(const sockid_t *sockid, buffer_t *buf);
 
 #endif
@@ -210,10 +210,29 @@ err_ret:
         return ret;
 }
 
+static int __main_loop_request(int idx, void (*exec)(void *buf), void *buf, const char *name)
+{
+        int ret;
+        schedule_t *schedule;
+
+        schedule = __worker__[idx].schedule;
+        if (schedule == NULL) {
+                ret = EAGAIN;
+                GOTO(err_ret, ret);
+        }
+
+        ret = schedule_request(schedule, -1, exec, buf, name);
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
 int main_loop_request(void (*exec)(void *buf), void *buf, const char *name)
 {
         int ret, rand;
-        schedule_t *schedule;
 
         if (__worker__ == NULL || __worker_count__ == 0) {
                 ret = EAGAIN;
@@ -222,13 +241,29 @@ int main_loop_request(void (*exec)(void *buf), void *buf, const char *name)
 
         rand = ++__main_loop_request__ % (__worker_count__);
 
-        schedule = __worker__[rand].schedule;
-        if (schedule == NULL) {
+        ret = __main_loop_request(rand, exec, buf, name);
+        if (unlikely(ret))
+                GOTO(err_ret, ret);
+
+        return 0;
+err_ret:
+        return ret;
+}
+
+/**
+ * requests with the same hash always run in the same worker, so
+ * operations on one file keep their order and stay core local.
+ */
+int main_loop_request1(uint64_t hash, void (*exec)(void *buf), void *buf, const char *name)
+{
+        int ret;
+
+        if (__worker__ == NULL || __worker_count__ == 0) {
                 ret = EAGAIN;
                 GOTO(err_ret, ret);
         }
 
-        ret = schedule_request(schedule, -1, exec, buf, name);
+        ret = __main_loop_request(hash % __worker_count__, exec, buf, name);
         if (unlikely(ret))
                 GOTO(err_ret, ret);
 
@@ -237,6 +272,15 @@ err_ret:
         return ret;
 }
 
+/**
+ * workers behind main_loop_request1, hash % count picks one, 0 before
+ * main_loop_create
+ */
+int main_loop_worker_count()
+{
+        return __worker__ ? __worker_count__ : 0;
+}
+
 #if 0
 inline static int __main_loop_gettime(worker_t *worker)
 {